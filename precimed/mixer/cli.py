@@ -17,6 +17,7 @@ import scipy.stats
 import random
 from scipy.interpolate import interp1d
 import time
+import hashlib
 
 from .libbgmg import LibBgmg
 from .utils import UnivariateParams
@@ -109,6 +110,13 @@ def fix_and_validate_args(args):
         check_input_file(args, 'bim-file', chri)
         check_input_file(args, 'ld-file', chri)
 
+    if arg_dict.get("context_snapshot") and arg_dict.get("ld_shm_dir"):
+        raise ValueError('--context-snapshot can not be combined with --ld-shm-dir')
+    if arg_dict.get("compact_ld") and arg_dict.get("ld_shm_dir"):
+        raise ValueError('--compact-ld can not be combined with --ld-shm-dir')
+    if (arg_dict.get("r2min_exploratory") or 0) > 0 and arg_dict.get("ld_shm_dir"):
+        raise ValueError('--r2min-exploratory can not be combined with --ld-shm-dir')
+
 def convert_args_to_libbgmg_options(args, num_snp):
     libbgmg_options = {
         'r2min': args.r2min if ('r2min' in args) else None,
@@ -119,6 +127,11 @@ def convert_args_to_libbgmg_options(args, num_snp):
         'cubature_max_evals': args.cubature_max_evals if ('cubature_max_evals' in args) else None,
         'z1max': args.z1max if ('z1max' in args) else None,
         'z2max': args.z2max if ('z2max' in args) else None, 
+        'ld_row_cache_mb': args.ld_row_cache_mb if ('ld_row_cache_mb' in args) else None,
+        'ld_load_jobs': args.ld_load_jobs if ('ld_load_jobs' in args) else None,
+        'ld_r_bits': args.ld_r_bits if ('ld_r_bits' in args) else None,
+        'huge_pages': args.huge_pages if ('huge_pages' in args) else None,
+        'ld_numa_placement': 1 if (('ld_numa_placement' in args) and args.ld_numa_placement) else None,
     }
     return [(k, v) for k, v in libbgmg_options.items() if v is not None ]
 
@@ -139,7 +152,7 @@ def parser_add_common_arguments(parser, num_traits):
         "Marker names must not have duplicated entries. "
         "May contain simbol '@', which will be replaced with the actual chromosome label. ")
     parser.add_argument("--ld-file", type=str, default=None, help="File with linkage disequilibrium information, "
-        "generated via 'mixer.py ld' command. "
+        "generated via 'mixer.py ld' command, or a single file for all chromosomes generated via 'mixer.py merge-ld' command. "
         "May contain simbol '@', similarly to --bim-file argument. ")
     parser.add_argument("--chr2use", type=str, default="1-22", help="Chromosome ids to use "
          "(e.g. 1,2,3 or 1-4,12,16-20). Chromosome must be labeled by integer, i.e. X and Y are not acceptable. ")
@@ -149,11 +162,36 @@ def parser_add_common_arguments(parser, num_traits):
     if num_traits==2: parser.add_argument('--z2max', type=float, default=None, help="right-censoring threshold for the second trait. ")
     parser.add_argument('--extract', type=str, default="", help="File with variants to include in the analysis")
     parser.add_argument('--exclude', type=str, default="", help="File with variants to exclude from the analysis")
+    parser.add_argument('--restrict-ld-reference', default=False, action="store_true", help="remove variants excluded by --extract and --exclude "
+        "from the LD reference, not only from the tag variants; their LD r2 with other variants is counted below --r2min. "
+        "Reduces memory usage and run time in proportion to the number of excluded variants. ")
     parser.add_argument('--randprune-n', type=int, default=64, help="Number of random pruning iterations")
     parser.add_argument('--randprune-r2', type=float, default=0.1, help="Threshold for random pruning")
     parser.add_argument('--seed', type=int, default=123, help="Random seed")
     parser.add_argument('--r2min', type=float, default=0.0, help="r2 values below this threshold will contribute via infinitesimal model")
     parser.add_argument('--threads', type=int, default=[None], nargs='+', help="specify how many threads to use (concurrency). None will default to the total number of CPU cores. ")
+    parser.add_argument('--ld-row-cache-mb', type=float, default=0, help="memory budget (in megabytes) for keeping decoded LD rows between cost function evaluations; "
+        "0 disables the cache. Longest rows are cached first. ")
+    parser.add_argument('--ld-load-jobs', type=int, default=0, help="how many chromosomes to load concurrently from --ld-file; "
+        "0 loads one chromosome per thread. Lower values reduce peak memory usage while loading LD matrix. Ignored with --ld-stream-dir, which loads one chromosome at a time. ")
+    parser.add_argument('--ld-r-bits', type=int, default=16, choices=[8, 16], help="how many bits to use for each LD r value kept in memory; "
+        "8 halves memory usage of LD r values at the cost of quantization error below 0.5%% of (1 - r2min) in r2. "
+        "Each chromosome is quantized after it is loaded with 16 bits, i.e. the peak memory usage while loading is higher than with 8 bits alone. ")
+    parser.add_argument('--huge-pages', type=int, default=1, choices=[0, 1, 2], help="memory pages for large arrays (LD matrix, LD scores, heterozygosity); "
+        "0 - regular 4 KB pages, 1 - transparent huge pages (madvise), 2 - explicit huge pages reserved in /proc/sys/vm/nr_hugepages, with fallback to 1. ")
+    parser.add_argument('--ld-shm-dir', type=str, default=None, help="directory for LD matrix shared between mixer.py processes running on the same node, "
+        "e.g. /dev/shm or a hugetlbfs mount; the first process stores its LD matrix there, other processes map it instead of loading --ld-file. "
+        "The last process to finish removes the shared LD matrix. Can not be combined with --compact-ld or --r2min-exploratory. ")
+    parser.add_argument('--ld-stream-dir', type=str, default=None, help="directory on a local disk for scratch files of out-of-core LD matrix; "
+        "LD matrix of each chromosome moves there as soon as it is loaded, and is read back chromosome by chromosome during the fit, "
+        "so that only a few chromosomes are kept in memory at a time (chromosomes are loaded one by one, see --ld-load-jobs). Use on nodes that can't hold the whole LD matrix in memory. ")
+    parser.add_argument('--ld-numa-placement', default=False, action="store_true", help="on multi-socket nodes, keep LD rows of the variants processed "
+        "by each thread in memory of its NUMA node. Works best with pinned threads, e.g. OMP_PROC_BIND=close OMP_PLACES=cores. ")
+    parser.add_argument('--context-snapshot', type=str, default=None, help="snapshot file of initialized data (reference, summary statistics, LD matrix and weights). "
+        "If the file exists and was saved for the same input files and options, it is memory-mapped instead of loading the inputs; "
+        "otherwise the inputs are loaded as usual, and saved to the snapshot. Can not be combined with --ld-shm-dir. ")
+    parser.add_argument('--compact-ld', default=False, action="store_true", help="after random pruning, release LD rows of variants with zero weight, "
+        "and keep the remaining rows in contiguous memory. ")
     parser.add_argument('--cubature-rel-error', type=float, default=1e-5, help="relative error for cubature stop criteria (applies to 'convolve' cost calculator). ")
     parser.add_argument('--cubature-max-evals', type=float, default=1000, help="max evaluations for cubature stop criteria (applies to 'convolve' cost calculator). "
         "Bivariate cubature require in the order of 10^4 evaluations and thus is much slower than sampling, therefore it is not exposed via mixer.py command-line interface. ")
@@ -184,6 +222,11 @@ def parser_fit_or_test_add_arguments(args, func, parser, do_fit, num_traits):
         parser.add_argument('--kmax', type=int, default=[100], nargs='+', help="Number of sampling iterations")
         parser.add_argument('--load-params-file', type=str, default=None, help="params of the fitted model (for 'mixer.py test1' and 'mixer.py test2' runs). ")
 
+    if do_fit:
+        parser.add_argument('--r2min-exploratory', type=float, default=0.0, help="during exploratory stages of the fit ('diffevo' and 'brute1'), "
+            "ignore LD r2 values below this threshold (their contribution is moved to the infinitesimal model); 0 disables this. "
+            "LD matrix is restored to --r2min before the final stages of the fit. ")
+
     # all arguments below marked with argparse.SUPRESS option are internal and not recommended for a general use.
     # Valid options for --fit-sequence (remember to combine them in a sequence that makes sence):
     #       'load' reads previosly fitted parameters from a file (--load-params-file);
@@ -219,6 +262,21 @@ def parser_ld_add_arguments(args, func, parser):
     parser.add_argument('--ldscore-r2min', type=float, default=0.001, help="r2 values above this threshold (and below --r2min) will be stored as LD scores that contribute to the cost function via an infinitesimal model")
     parser.add_argument('--ld-window-kb', type=float, default=0, help="limit window similar to --ld-window-kb in 'plink r2'; 0 will disable this constraint")
     parser.add_argument('--ld-window', type=int, default=0, help="limit window similar to --ld-window in 'plink r2'; 0 will disable this constraint")
+    parser.add_argument('--ld-engine', type=str, default='tiled', choices=['tiled', 'pairwise'], help="'tiled' computes correlations for 64x64 tiles of SNP pairs at once from bit-sliced genotypes; "
+        "'pairwise' computes each SNP pair separately (slower, gives the same results)")
+    parser.set_defaults(func=func)
+
+def parser_merge_ld_add_arguments(args, func, parser):
+    parser.add_argument("--bim-file", type=str, default=None, help="Plink bim file, used to compute --ld-file. "
+        "May contain simbol '@', which will be replaced with the actual chromosome label. ")
+    parser.add_argument("--ld-file", type=str, default=None, help="Files with linkage disequilibrium information, "
+        "generated via 'mixer.py ld' command. Must contain simbol '@', similarly to --bim-file argument. ")
+    parser.add_argument("--chr2use", type=str, default="1-22", help="Chromosome ids to include into the output file "
+         "(e.g. 1,2,3 or 1-4,12,16-20). Chromosome must be labeled by integer, i.e. X and Y are not acceptable. ")
+    parser.add_argument('--r2min', type=float, default=0.05, help="--r2min used in 'mixer.py ld' command (recorded in the output file)")
+    parser.add_argument('--ldscore-r2min', type=float, default=0.001, help="--ldscore-r2min used in 'mixer.py ld' command (recorded in the output file)")
+    parser.add_argument('--compress-r', default=False, action="store_true", help="compress LD r values in the output file; "
+        "this gives smaller files (faster to load from network storage), but r values are decompressed into memory on load instead of being memory-mapped")
     parser.set_defaults(func=func)
 
 def parser_snps_add_arguments(args, func, parser):
@@ -227,7 +285,7 @@ def parser_snps_add_arguments(args, func, parser):
         "Marker names must not have duplicated entries. "
         "May contain simbol '@', which will be replaced with the actual chromosome label. ")
     parser.add_argument("--ld-file", type=str, default=None, help="File with linkage disequilibrium information, "
-        "generated via 'mixer.py ld' command. "
+        "generated via 'mixer.py ld' command, or a single file for all chromosomes generated via 'mixer.py merge-ld' command. "
         "May contain simbol '@', similarly to --bim-file argument. ")
     parser.add_argument("--chr2use", type=str, default="1-22", help="Chromosome ids to use "
          "(e.g. 1,2,3 or 1-4,12,16-20). Chromosome must be labeled by integer, i.e. X and Y are not acceptable. ")
@@ -259,6 +317,7 @@ def parse_args(args):
     parser_fit_or_test_add_arguments(args=args, func=execute_fit2_or_test2_parser, parser=subparsers.add_parser("test2", parents=[parent_parser], help='test bivariate MiXeR model'), do_fit=False, num_traits=2)
 
     parser_ld_add_arguments(args=args, func=execute_ld_parser, parser=subparsers.add_parser("ld", parents=[parent_parser], help='prepare files with linkage disequilibrium information'))
+    parser_merge_ld_add_arguments(args=args, func=execute_merge_ld_parser, parser=subparsers.add_parser("merge-ld", parents=[parent_parser], help='merge per-chromosome files with linkage disequilibrium information into a single file'))
     parser_perf_add_arguments(args=args, func=execute_perf_parser, parser=subparsers.add_parser("perf", parents=[parent_parser], help='run performance evaluation of the MiXeR'))
     parser_snps_add_arguments(args=args, func=execute_snps_parser, parser=subparsers.add_parser("snps", parents=[parent_parser], help='generate random sets of SNPs'))
 
@@ -288,10 +347,18 @@ def load_bivariate_params_file(fname):
     p = data['params']
     return BivariateParams(pi=p['pi'], sig2_beta=p['sig2_beta'], sig2_zero=p['sig2_zero'], rho_beta=p['rho_beta'], rho_zero=p['rho_zero'])
 
+def set_r2min_exploratory(args, libbgmg, fit_type, enable):
+    # returns True if LD matrix was (or still is) filtered with --r2min-exploratory for this fit_type
+    if ('r2min_exploratory' not in args) or (args.r2min_exploratory <= 0): return False
+    if fit_type not in ['diffevo', 'diffevo-fast', 'brute1', 'brute1-fast']: return False
+    libbgmg.set_option('r2min_runtime', args.r2min_exploratory if enable else 0)
+    return True
+
 def apply_univariate_fit_sequence(args, libbgmg, fit_sequence, init_params=None, trait=1):
     params=init_params; optimize_result_sequence=[]
     for fit_type in fit_sequence:
         libbgmg.log_message("fit_type=={}...".format(fit_type))
+        set_r2min_exploratory(args, libbgmg, fit_type, enable=True)
 
         if fit_type == 'load':
             params = load_univariate_params_file(args.load_params_file)
@@ -341,6 +408,7 @@ def apply_univariate_fit_sequence(args, libbgmg, fit_sequence, init_params=None,
         else:
             libbgmg.log_message("Unable to apply {} in univariate fit".format(fit_type))
 
+        set_r2min_exploratory(args, libbgmg, fit_type, enable=False)
         libbgmg.set_option('cost_calculator', _cost_calculator_gaussian)
         if optimize_result:
             enhance_optimize_result(optimize_result, cost_n=np.sum(libbgmg.weights), cost_fast=params.cost(libbgmg, trait))
@@ -362,6 +430,7 @@ def apply_bivariate_fit_sequence(args, libbgmg):
     params = None; optimize_result_sequence = []
     for fit_type in args.fit_sequence:
         libbgmg.log_message("fit_type=={}...".format(fit_type))
+        set_r2min_exploratory(args, libbgmg, fit_type, enable=True)
 
         if fit_type == 'load':
             params = load_bivariate_params_file(args.load_params_file)
@@ -463,6 +532,7 @@ def apply_bivariate_fit_sequence(args, libbgmg):
         else:
             libbgmg.log_message("Unable to apply {} in bivariate fit".format(fit_type))
 
+        set_r2min_exploratory(args, libbgmg, fit_type, enable=False)
         libbgmg.set_option('cost_calculator', _cost_calculator_gaussian)
         # cost_df=9 --- nine free parameters (incl. univariate)
         enhance_optimize_result(optimize_result, cost_df=9, cost_n=np.sum(libbgmg.weights), cost_fast=params.cost(libbgmg))
@@ -544,11 +614,36 @@ def print_types(results, libbgmg):
 
 def execute_ld_parser(args):
     libbgmg = LibBgmg(args.lib)
-    libbgmg.calc_ld_matrix(args.bfile, args.out, args.r2min, args.ldscore_r2min, args.ld_window, args.ld_window_kb)
+    libbgmg.calc_ld_matrix(args.bfile, args.out, args.r2min, args.ldscore_r2min, args.ld_window, args.ld_window_kb, args.ld_engine)
+    libbgmg.log_message('Done')
+
+def execute_merge_ld_parser(args):
+    fix_and_validate_args(args)
+    libbgmg = LibBgmg(args.lib)
+    libbgmg.merge_ld_matrix(args.bim_file, args.chr2use, args.ld_file, args.r2min, args.ldscore_r2min, args.out, compress_r=args.compress_r)
     libbgmg.log_message('Done')
 
+def context_snapshot_key(args):
+    # inputs of initialize_mixer_plugin, with size and modification time of each input file
+    files = [args.bim_file.replace('@', str(chri)) for chri in args.chr2use] + [args.ld_file.replace('@', str(chri)) for chri in args.chr2use]
+    files += [vars(args)[arg] for arg in ['trait1_file', 'trait2_file', 'exclude', 'extract'] if (arg in args) and vars(args)[arg]]
+    inputs = [(os.path.abspath(f), os.path.getsize(f), os.path.getmtime(f)) for f in files]
+    inputs += [(arg, vars(args)[arg]) for arg in ['chr2use', 'r2min', 'ld_r_bits', 'randprune_n', 'randprune_r2', 'seed', 'restrict_ld_reference'] if arg in args]
+    return hashlib.sha256(str(inputs).encode('utf-8')).hexdigest()
+
 def initialize_mixer_plugin(args):
     libbgmg = LibBgmg(args.lib)
+    snapshot_key = context_snapshot_key(args) if (('context_snapshot' in args) and args.context_snapshot) else None
+    if snapshot_key and libbgmg.load_context(args.context_snapshot, snapshot_key):
+        for opt, val in convert_args_to_libbgmg_options(args, libbgmg.num_snp):
+            libbgmg.set_option(opt, val)
+        if ('randprune_n' in args) and ('randprune_r2' in args) and ('compact_ld' in args) and args.compact_ld:
+            libbgmg.compact_ld_to_deftags(free_rest=True)
+        libbgmg.set_option('diag', 0)
+        return libbgmg
+
+    if ('restrict_ld_reference' in args) and args.restrict_ld_reference:
+        libbgmg.set_option('restrict_ld_reference', 1)  # must be set before init
     libbgmg.init(args.bim_file, "", args.chr2use,
                  args.trait1_file if ('trait1_file' in args) else "",
                  args.trait2_file if ('trait2_file' in args) else "",
@@ -558,12 +653,18 @@ def initialize_mixer_plugin(args):
     for opt, val in convert_args_to_libbgmg_options(args, libbgmg.num_snp):
         libbgmg.set_option(opt, val)
 
-    for chr_label in args.chr2use: 
-        libbgmg.set_ld_r2_coo_from_file(chr_label, args.ld_file.replace('@', str(chr_label)))
-        libbgmg.set_ld_r2_csr(chr_label)
+    if ('ld_shm_dir' in args) and args.ld_shm_dir:
+        libbgmg.set_ld_shm_dir(args.ld_shm_dir)
+    if ('ld_stream_dir' in args) and args.ld_stream_dir:
+        libbgmg.set_ld_stream_dir(args.ld_stream_dir)
+    libbgmg.set_ld_r2_from_files(args.chr2use, args.ld_file)
 
     if ('randprune_n' in args) and ('randprune_r2' in args):
         libbgmg.set_weights_randprune(args.randprune_n, args.randprune_r2, exclude="", extract="")
+    if snapshot_key:
+        libbgmg.save_context(args.context_snapshot, snapshot_key)
+    if ('randprune_n' in args) and ('randprune_r2' in args) and ('compact_ld' in args) and args.compact_ld:
+        libbgmg.compact_ld_to_deftags(free_rest=True)
     
     libbgmg.set_option('diag', 0)
     return libbgmg
@@ -53,7 +53,13 @@ class LibBgmg(object):
         self.cdll.bgmg_set_option.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_double]
         self.cdll.bgmg_set_ld_r2_coo_from_file.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_char_p]
         self.cdll.bgmg_set_ld_r2_csr.argtypes = [ctypes.c_int, ctypes.c_int]
+        self.cdll.bgmg_set_ld_r2_from_files.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p]
+        self.cdll.bgmg_set_ld_shm_dir.argtypes = [ctypes.c_int, ctypes.c_char_p]
+        self.cdll.bgmg_set_ld_stream_dir.argtypes = [ctypes.c_int, ctypes.c_char_p]
+        self.cdll.bgmg_save_context.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p]
+        self.cdll.bgmg_load_context.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p]
         self.cdll.bgmg_set_weights_randprune.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_float, ctypes.c_char_p, ctypes.c_char_p]
+        self.cdll.bgmg_compact_ld_to_deftags.argtypes = [ctypes.c_int, ctypes.c_int]
         self.cdll.bgmg_perform_ld_clump.argtypes = [ctypes.c_int, ctypes.c_float, ctypes.c_int, float32_pointer_type]
         self.cdll.bgmg_retrieve_ld_sum_r2.argtypes = [ctypes.c_int, ctypes.c_int, float32_pointer_type]
         self.cdll.bgmg_retrieve_ld_sum_r4.argtypes = [ctypes.c_int, ctypes.c_int, float32_pointer_type]
@@ -84,13 +90,18 @@ class LibBgmg(object):
         self.cdll.bgmg_calc_unified_bivariate_pdf.argtypes = [ctypes.c_int, ctypes.c_int, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, ctypes.c_float, ctypes.c_float, ctypes.c_int, float32_pointer_type, float32_pointer_type, float32_pointer_type]
         self.cdll.bgmg_calc_unified_bivariate_delta_posterior.argtypes = [ctypes.c_int, ctypes.c_int, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, ctypes.c_float, ctypes.c_float, ctypes.c_int, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type, float32_pointer_type]
 
-        self.cdll.bgmg_calc_ld_matrix.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_double, ctypes.c_double, ctypes.c_int, ctypes.c_float]
+        self.cdll.bgmg_calc_ld_matrix.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_double, ctypes.c_double, ctypes.c_int, ctypes.c_float, ctypes.c_int]
+        self.cdll.bgmg_merge_ld_matrix.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_double, ctypes.c_double, ctypes.c_int, ctypes.c_char_p]
 
         if init_log: self.init_log(init_log)
         if dispose: self.dispose()
 
-    def calc_ld_matrix(self, bfile, outfile, r2min, ldscore_r2min, ld_window, ld_window_kb):
-        self.cdll.bgmg_calc_ld_matrix(_p2n(bfile), _p2n(outfile), r2min, ldscore_r2min, ld_window, np.float32(ld_window_kb))
+    def calc_ld_matrix(self, bfile, outfile, r2min, ldscore_r2min, ld_window, ld_window_kb, ld_engine='tiled'):  # ld_engine: 'tiled' or 'pairwise'
+        self.cdll.bgmg_calc_ld_matrix(_p2n(bfile), _p2n(outfile), r2min, ldscore_r2min, ld_window, np.float32(ld_window_kb), {'pairwise': 0, 'tiled': 1}[ld_engine])
+
+    def merge_ld_matrix(self, bim_file, chr_labels, ld_file_template, r2min, ldscore_r2min, outfile, compress_r=False):  # '@' in bim_file and ld_file_template is replaced with chromosome label
+        chr_labels_val = chr_labels if isinstance(chr_labels, str) else ' '.join([str(x) for x in chr_labels])
+        return self._check_error(self.cdll.bgmg_merge_ld_matrix(_p2n(bim_file), _p2n(chr_labels_val), _p2n(ld_file_template), r2min, ldscore_r2min, int(compress_r), _p2n(outfile)))
 
     def get_last_error(self):
         return _n2p(self.cdll.bgmg_get_last_error())
@@ -128,9 +139,28 @@ class LibBgmg(object):
     def set_ld_r2_csr(self, chr_label=-1):  # -1 means to finalize all chromosomes
         return self._check_error(self.cdll.bgmg_set_ld_r2_csr(self._context_id, chr_label))
 
+    def set_ld_r2_from_files(self, chr_labels, filename_template):  # '@' in filename_template is replaced with chromosome label
+        chr_labels_val = chr_labels if isinstance(chr_labels, str) else ' '.join([str(x) for x in chr_labels])
+        return self._check_error(self.cdll.bgmg_set_ld_r2_from_files(self._context_id, _p2n(chr_labels_val), _p2n(filename_template)))
+
+    def set_ld_shm_dir(self, directory):  # call before set_ld_r2_from_files to share LD matrix with other processes, e.g. via /dev/shm
+        return self._check_error(self.cdll.bgmg_set_ld_shm_dir(self._context_id, _p2n(directory)))
+
+    def set_ld_stream_dir(self, directory):  # call before set_ld_r2_from_files to keep LD matrix in scratch files instead of memory
+        return self._check_error(self.cdll.bgmg_set_ld_stream_dir(self._context_id, _p2n(directory)))
+
+    def save_context(self, filename, key):  # snapshot of initialized context, see load_context
+        return self._check_error(self.cdll.bgmg_save_context(self._context_id, _p2n(filename), _p2n(key)))
+
+    def load_context(self, filename, key):  # call instead of init; returns True if context was restored from the snapshot saved with the same key
+        return self._check_error(self.cdll.bgmg_load_context(self._context_id, _p2n(filename), _p2n(key))) == 1
+
     def set_weights_randprune(self, n, r2, exclude="", extract=""):
         return self._check_error(self.cdll.bgmg_set_weights_randprune(self._context_id, n, r2, _p2n(exclude), _p2n(extract)))
 
+    def compact_ld_to_deftags(self, free_rest=False):  # call after weights are set
+        return self._check_error(self.cdll.bgmg_compact_ld_to_deftags(self._context_id, int(free_rest)))
+
     def perform_ld_clump(self, r2, buffer): # buffer must have a length equal to 'num_tag'
         buffer_data = (buffer if isinstance(buffer, np.ndarray) else np.array(buffer)).astype(np.float32)
         self._check_error(self.cdll.bgmg_perform_ld_clump(self._context_id, r2, np.size(buffer), buffer_data))
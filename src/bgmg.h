@@ -83,6 +83,32 @@ extern "C" {
   DLL_PUBLIC int64_t bgmg_set_ld_r2_coo_from_file(int context_id, int chr_label, const char* filename);
   DLL_PUBLIC int64_t bgmg_set_ld_r2_csr(int context_id, int chr_label);
 
+  // Load and finalize LD structure for several chromosomes at once, from files produced by bgmg_calc_ld_matrix.
+  // Equivalent to calling bgmg_set_ld_r2_coo_from_file and bgmg_set_ld_r2_csr for each chromosome, but chromosomes are processed concurrently.
+  // - chr_labels - list of chromosome labels (can be empty, default to 1:22)
+  // - filename_template - filename with '@' symbol, to be replaced with chromosome label (or a genome LD file produced by bgmg_merge_ld_matrix)
+  // Use "ld_load_jobs" option to limit how many chromosomes are loaded at the same time (and hence the peak memory usage).
+  // With bgmg_set_ld_stream_dir chromosomes are always loaded one at a time, and "ld_load_jobs" is ignored.
+  DLL_PUBLIC int64_t bgmg_set_ld_r2_from_files(int context_id, const char* chr_labels, const char* filename_template);
+
+  // share LD matrix loaded by bgmg_set_ld_r2_from_files with other processes on the same node.
+  // The first process saves LD matrix as a segment file in the directory (e.g. /dev/shm, or a hugetlbfs mount),
+  // other processes with the same reference and LD files map that segment instead of loading their own copy.
+  // The last process to release the segment removes it. Empty directory disables sharing.
+  DLL_PUBLIC int64_t bgmg_set_ld_shm_dir(int context_id, const char* directory);
+
+  // keep LD matrix out of core: as each chromosome is loaded, its LD matrix moves to a scratch file in the directory (on a local disk),
+  // and is read back chromosome by chromosome while cost functions loop over tag variants. Results are the same as with in-memory LD matrix.
+  // Call before bgmg_set_ld_r2_from_files (or bgmg_set_ld_r2_csr). Empty directory keeps LD matrix in memory.
+  DLL_PUBLIC int64_t bgmg_set_ld_stream_dir(int context_id, const char* directory);
+
+  // save a fully initialized context (after bgmg_init, bgmg_set_ld_r2_from_files and bgmg_set_weights_randprune) to a snapshot file,
+  // and restore it in another process; the key identifies the inputs (e.g. a hash of input files and options).
+  // bgmg_load_context must be called instead of bgmg_init; it returns 1 if the context was restored,
+  // and 0 if the file doesn't exist or was saved for a different key. LD matrix is memory-mapped from the snapshot.
+  DLL_PUBLIC int64_t bgmg_save_context(int context_id, const char* filename, const char* key);
+  DLL_PUBLIC int64_t bgmg_load_context(int context_id, const char* filename, const char* key);
+
   // query LD structure of a given SNP or for a given chromosome
   DLL_PUBLIC int64_t bgmg_num_ld_r2_snp(int context_id, int snp_index);
   DLL_PUBLIC int64_t bgmg_retrieve_ld_r2_snp(int context_id, int snp_index, int length, int* tag_index, float* r2);
@@ -94,6 +120,7 @@ extern "C" {
   // Set weights, either explicitly or based on random pruning
   DLL_PUBLIC int64_t bgmg_set_weights(int context_id, int length, float* values);
   DLL_PUBLIC int64_t bgmg_set_weights_randprune(int context_id, int n, float r2, const char* exclude, const char* extract);
+  DLL_PUBLIC int64_t bgmg_compact_ld_to_deftags(int context_id, int free_rest);  // keep a contiguous copy of LD rows for tags with non-zero weight; free_rest releases all other rows
   DLL_PUBLIC int64_t bgmg_retrieve_weights(int context_id, int length, float* buffer);
   
   // Perform informed clumping - i.e. pick the largest value in the buffer, remove everything in LD with it, and continue until no work is left
@@ -117,6 +144,14 @@ extern "C" {
                                                                  int length, float* c00, float* c10, float* c01, float* c20, float* c11, float* c02);
 
   // estimate LD structure
-  DLL_PUBLIC int64_t bgmg_calc_ld_matrix(const char* bfile, const char* outfile, double r2min, double ldscore_r2min, int ld_window, float ld_window_kb);
+  // - ld_engine - 0 computes the correlation of each SNP pair separately, 1 computes tiles of SNP pairs at once (faster, same results)
+  DLL_PUBLIC int64_t bgmg_calc_ld_matrix(const char* bfile, const char* outfile, double r2min, double ldscore_r2min, int ld_window, float ld_window_kb, int ld_engine);
+
+  // Merge per-chromosome files produced by bgmg_calc_ld_matrix into a single genome LD file,
+  // which then can be passed to bgmg_set_ld_r2_coo_from_file (or bgmg_set_ld_r2_from_files) for any of its chromosomes.
+  // - bim_file, ld_file_template - filenames with '@' symbol, to be replaced with chromosome label
+  // - r2min, ldscore_r2min - recorded in the header, should match those used in bgmg_calc_ld_matrix
+  // - compress_r - compress LD r values; gives smaller files, but r values are decompressed into memory on load instead of being memory-mapped
+  DLL_PUBLIC int64_t bgmg_merge_ld_matrix(const char* bim_file, const char* chr_labels, const char* ld_file_template, double r2min, double ldscore_r2min, int compress_r, const char* outfile);
 }
 
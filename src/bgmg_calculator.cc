@@ -36,7 +36,7 @@ std::vector<float>* BgmgCalculator::get_causalbetavec(int trait_index) {
 }
 
 BgmgCalculator::BgmgCalculator() : num_snp_(-1), num_tag_(-1), k_max_(100), seed_(0), aux_option_(AuxOption_Ezvec2),
-    use_complete_tag_indices_(false), disable_snp_to_tag_map_(false), r2_min_(0.0), z1max_(1e10), z2max_(1e10), ld_format_version_(-1), retrieve_ld_sum_type_(0), num_components_(1), 
+    use_complete_tag_indices_(false), restrict_ld_reference_(false), disable_snp_to_tag_map_(false), r2_min_(0.0), z1max_(1e10), z2max_(1e10), ld_format_version_(-1), ld_load_jobs_(0), ld_load_peak_chunks_(0), share_ld_(false), ld_numa_placement_(false), retrieve_ld_sum_type_(0), num_components_(1), 
     max_causals_(100000), cost_calculator_(CostCalculator_Sampling), cache_tag_r2sum_(false), ld_matrix_csr_(*this),
     cubature_abs_error_(0), cubature_rel_error_(1e-4), cubature_max_evals_(0), calc_k_pdf_(false) {
   boost::posix_time::ptime const time_epoch(boost::gregorian::date(1970, 1, 1));
@@ -160,8 +160,32 @@ int64_t BgmgCalculator::set_option(char* option, double value) {
     retrieve_ld_sum_type_ = int(value); return 0;
   } else if (!strcmp(option, "use_complete_tag_indices")) {
     use_complete_tag_indices_ = (value != 0); return 0;
+  } else if (!strcmp(option, "ld_numa_placement")) {
+    ld_numa_placement_ = (value != 0); return 0;
+  } else if (!strcmp(option, "restrict_ld_reference")) {
+    restrict_ld_reference_ = (value != 0); return 0;
+  } else if (!strcmp(option, "ld_row_cache_mb")) {
+    if (value < 0) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_row_cache_mb must be non-negative"));
+    ld_matrix_csr_.set_row_cache_budget(static_cast<size_t>(value * 1024.0 * 1024.0)); return 0;
+  } else if (!strcmp(option, "ld_r_bits")) {
+    ld_matrix_csr_.set_r_bits(static_cast<int>(value)); return 0;
+  } else if (!strcmp(option, "r2min_runtime") || !strcmp(option, "r2min_runtime_in_place")) {
+    if (value > 1) BGMG_THROW_EXCEPTION(::std::runtime_error("r2min_runtime must not exceed 1"));
+    const float r2_min_runtime = ld_matrix_csr_.r2_min_runtime();
+    ld_matrix_csr_.set_r2_min_runtime((value > r2_min_) ? static_cast<float>(value) : 0.0f, !strcmp(option, "r2min_runtime"));
+    if (ld_matrix_csr_.r2_min_runtime() != r2_min_runtime) clear_state();  // tag_r2sum_ depends on LD matrix
+    return 0;
+  } else if (!strcmp(option, "share_ld")) {
+    share_ld_ = (value != 0); return 0;
+  } else if (!strcmp(option, "ld_load_jobs")) {
+    if (value < 0) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_load_jobs must be non-negative"));
+    ld_load_jobs_ = static_cast<int>(value); return 0;
   } else if (!strcmp(option, "disable_snp_to_tag_map")) {
     disable_snp_to_tag_map_ = (value != 0); return 0;
+  } else if (!strcmp(option, "huge_pages")) {
+    const int mode = static_cast<int>(value);
+    if ((mode < kHugePagesOff) || (mode > kHugePagesExplicit)) BGMG_THROW_EXCEPTION(::std::runtime_error("huge_pages must be 0 (off), 1 (transparent huge pages) or 2 (explicit huge pages)"));
+    set_huge_pages_mode(static_cast<HugePagesMode>(mode)); return 0;
   } else if (!strcmp(option, "threads")) {
     if (value > 0) {
       LOG << " omp_set_num_threads(" << static_cast<int>(value) << ")";
@@ -218,14 +242,282 @@ int64_t BgmgCalculator::set_ld_r2_coo(int chr_label, const std::string& filename
     mafvec_.assign(num_snp_, NAN);
   }
 
-  return ld_matrix_csr_.set_ld_r2_coo_version1plus(chr_label, filename, r2_min_);
+  return load_ld_r2_file(&ld_matrix_csr_, chr_label, filename);
+}
+
+int64_t BgmgCalculator::load_ld_r2_file(LdMatrixCsr* ld_matrix_csr, int chr_label, const std::string& filename) {
+  LdMatrixGenomeHeader header;
+  std::vector<LdMatrixGenomeChunk> chunks;
+  if (load_ld_matrix_genome_header(filename, &header, &chunks)) {
+    for (auto& chunk : chunks) {
+      if ((chunk.chr_label == chr_label) && (chunk.reference_hash != bim_file_.reference_hash(chr_label))) {
+        std::stringstream ss; ss << filename << " was computed for a different reference on chromosome " << chr_label;
+        BGMG_THROW_EXCEPTION(std::runtime_error(ss.str()));
+      }
+    }
+  }
+
+  return ld_matrix_csr->set_ld_r2_coo_version1plus(chr_label, filename, r2_min_);
 }
 
 int64_t BgmgCalculator::set_ld_r2_csr(int chr_label) {
   int64_t retval = ld_matrix_csr_.set_ld_r2_csr(r2_min_, chr_label);
+  if (!ld_stream_dir_.empty()) ld_matrix_csr_.spill_chunk(chr_label, ld_stream_dir_);
   return retval;
 }
 
+// Chromosomes are independent of each other (each has its own chunk in ld_matrix_csr_, and its own range of snps and tags), 
+// therefore they are loaded as separate tasks, largest file first. At most ld_load_jobs_ tasks run at the same time,
+// and the OpenMP threads are split between them, so that parallel sections within each task (e.g. set_ld_r2_csr) still use all cores.
+int64_t BgmgCalculator::set_ld_r2_from_files(std::string chr_labels, std::string filename_template) {
+  LOG << ">set_ld_r2_from_files(chr_labels=" << chr_labels << ", filename_template=" << filename_template << "); ";
+  SimpleTimer timer(-1);
+
+  std::vector<std::string> chr_labels_vector;
+  split_chr_labels(chr_labels, &chr_labels_vector);
+
+  std::vector<int> chr_label_values;
+  std::vector<std::string> filenames;
+  std::vector<uintmax_t> file_sizes;
+  for (auto chrlabel : chr_labels_vector) {
+    const int chr_label = boost::lexical_cast<int>(chrlabel);
+    if (std::find(chr_label_values.begin(), chr_label_values.end(), chr_label) != chr_label_values.end())
+      BGMG_THROW_EXCEPTION(std::runtime_error("chr_labels must not contain duplicates"));
+    chr_label_values.push_back(chr_label);
+    filenames.push_back(filename_template);
+    boost::replace_all(filenames.back(), "@", chrlabel);
+    if (!boost::filesystem::exists(filenames.back())) {
+      std::stringstream ss; ss << "ERROR: input file " << filenames.back() << " does not exist";
+      BGMG_THROW_EXCEPTION(std::runtime_error(ss.str()));
+    }
+    file_sizes.push_back(boost::filesystem::file_size(filenames.back()));
+  }
+
+  if ((ld_format_version_ != 0) && mafvec_.empty()) {
+    LOG << " initialize mafvec";
+    mafvec_.assign(num_snp_, NAN);
+  }
+
+  if ((share_ld_ || !ld_shm_dir_.empty()) && (ld_format_version_ != 0)) attach_shared_ld_r2(chr_label_values, filenames, file_sizes);
+  else load_ld_r2_files(&ld_matrix_csr_, chr_label_values, filenames, file_sizes);
+
+  LOG << "<set_ld_r2_from_files(chr_labels=" << chr_labels << ", filename_template=" << filename_template << "); elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
+
+void BgmgCalculator::load_ld_r2_files(LdMatrixCsr* ld_matrix_csr, const std::vector<int>& chr_label_values, const std::vector<std::string>& filenames, const std::vector<uintmax_t>& file_sizes) {
+  const int num_tasks = chr_label_values.size();
+  std::vector<int> task_order(num_tasks);
+  std::iota(task_order.begin(), task_order.end(), 0);
+  std::stable_sort(task_order.begin(), task_order.end(), [&file_sizes](int lhs, int rhs) { return file_sizes[lhs] > file_sizes[rhs]; });
+
+  // With ld_stream_dir_ a chromosome stays in memory until it is spilled, after its load is complete;
+  // therefore chromosomes are loaded one at a time, each using all threads.
+  const int num_threads = omp_get_max_threads();
+  const int max_jobs = ld_stream_dir_.empty() ? ((ld_load_jobs_ > 0) ? ld_load_jobs_ : num_threads) : 1;
+  const int num_jobs = std::max(1, std::min(num_tasks, max_jobs));
+  const int threads_per_job = std::max(1, num_threads / num_jobs);
+  LOG << " set_ld_r2_from_files loads " << num_tasks << " files, " << num_jobs << " at a time, " << threads_per_job << " threads each";
+
+  std::vector<std::string> errors(num_tasks);
+  int num_resident = 0;
+  ld_load_peak_chunks_ = 0;
+  const int max_active_levels = omp_get_max_active_levels();
+  omp_set_max_active_levels(2);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_jobs)
+  for (int i = 0; i < num_tasks; i++) {
+    const int task_index = task_order[i];
+    omp_set_num_threads(threads_per_job);
+#pragma omp critical(ld_load_resident)
+    ld_load_peak_chunks_ = std::max(ld_load_peak_chunks_, ++num_resident);
+    try {
+      if (ld_format_version_ == 0) ld_matrix_csr->set_ld_r2_coo_version0(chr_label_values[task_index], filenames[task_index], r2_min_);
+      else load_ld_r2_file(ld_matrix_csr, chr_label_values[task_index], filenames[task_index]);
+      ld_matrix_csr->set_ld_r2_csr(r2_min_, chr_label_values[task_index]);
+      if (!ld_stream_dir_.empty()) ld_matrix_csr->spill_chunk(chr_label_values[task_index], ld_stream_dir_);  // before the next chromosome is loaded
+    } catch (const std::exception& e) {
+      errors[task_index] = filenames[task_index] + ": " + e.what();
+    }
+    if (!ld_stream_dir_.empty()) {
+#pragma omp critical(ld_load_resident)
+      num_resident--;
+    }
+  }
+  omp_set_max_active_levels(max_active_levels);
+  LOG << " set_ld_r2_from_files kept at most " << ld_load_peak_chunks_ << " chromosomes in memory while loading";
+
+  for (auto& error : errors)
+    if (!error.empty()) BGMG_THROW_EXCEPTION(std::runtime_error(error));
+
+  if (ld_numa_placement_) ld_matrix_csr->place_rows_per_thread();
+}
+
+// LD matrices shared between contexts (see "share_ld" option). Each store is loaded once for a given reference, set of LD files, r2min and r_bits,
+// with the tags of the context that loaded it; other contexts attach to it if their tags are a subset of the store's tags (see LdMatrixCsr::attach_shared).
+// Stores are held by the contexts attached to them, and released together with the last of them; the registry only keeps weak references.
+// A store can also be backed by LD segment shared with other processes (see set_ld_shm_dir); then it holds all snps as tags,
+// so that processes analyzing different traits can use the same segment, and the last process to release the segment removes it.
+struct LdMatrixStore {
+  LdMatrixStore(TagToSnpMapping& mapping, bool all_snps_as_tags) : mapping(mapping, all_snps_as_tags), ld_matrix_csr(this->mapping) {}
+  ~LdMatrixStore() {
+    if ((segment_lock == nullptr) || !segment_lock->try_exclusive()) return;
+    LOG << " remove LD segment " << segment_path << ", no other process uses it";
+    boost::system::error_code ec;
+    boost::filesystem::remove(segment_path, ec);
+  }
+  std::string key;
+  TagToSnpMappingCopy mapping;
+  LdMatrixCsr ld_matrix_csr;
+  std::string segment_path;
+  std::shared_ptr<LdSegmentLock> segment_lock;
+};
+
+static std::mutex ld_matrix_store_mutex;
+static std::vector<std::weak_ptr<LdMatrixStore>> ld_matrix_store;
+
+void BgmgCalculator::attach_shared_ld_r2(const std::vector<int>& chr_label_values, const std::vector<std::string>& filenames, const std::vector<uintmax_t>& file_sizes) {
+  std::stringstream key;
+  if (!ld_shm_dir_.empty()) key << "segment;";
+  key << "num_snp=" << num_snp_ << ";r2_min=" << r2_min_ << ";r_bits=" << ld_matrix_csr_.r_bits();
+  const std::vector<char>& excluded_snp = ld_matrix_csr_.excluded_snps();
+  if (!excluded_snp.empty()) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : excluded_snp) { hash ^= static_cast<unsigned char>(c); hash *= 1099511628211ULL; }
+    key << ";excluded=" << std::hex << hash << std::dec;
+  }
+  for (int i = 0; i < chr_label_values.size(); i++) {
+    key << ";" << chr_label_values[i] << ":" << ((bim_file_.size() > 0) ? bim_file_.reference_hash(chr_label_values[i]) : 0)
+        << ":" << boost::filesystem::canonical(filenames[i]).string() << ":" << file_sizes[i] << ":" << boost::filesystem::last_write_time(filenames[i]);
+  }
+
+  // the lock is held while a new store is loaded, so that contexts loading the same files at the same time wait for the first of them
+  std::shared_ptr<LdMatrixStore> store;
+  std::lock_guard<std::mutex> guard(ld_matrix_store_mutex);
+  ld_matrix_store.erase(std::remove_if(ld_matrix_store.begin(), ld_matrix_store.end(), [](const std::weak_ptr<LdMatrixStore>& entry) { return entry.expired(); }), ld_matrix_store.end());
+  for (auto& entry : ld_matrix_store) {
+    std::shared_ptr<LdMatrixStore> candidate = entry.lock();
+    if ((candidate == nullptr) || (candidate->key != key.str()) || !ld_matrix_csr_.can_attach_shared(candidate->ld_matrix_csr)) continue;
+    if ((store == nullptr) || (candidate->mapping.tag_to_snp() == tag_to_snp_)) store = candidate;  // prefer the same tags, to avoid translation of tag indices
+  }
+
+  if ((store == nullptr) && !ld_shm_dir_.empty()) {
+    store = std::make_shared<LdMatrixStore>(*this, true);
+    store->key = key.str();
+    store->ld_matrix_csr.set_r_bits(ld_matrix_csr_.r_bits());
+    store->ld_matrix_csr.set_row_cache_budget(ld_matrix_csr_.row_cache_budget());
+    store->ld_matrix_csr.init_chunks();
+    store->ld_matrix_csr.set_excluded_snps(ld_matrix_csr_.excluded_snps());
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : store->key) { hash ^= static_cast<unsigned char>(c); hash *= 1099511628211ULL; }
+    std::stringstream name; name << ld_shm_dir_ << "/bgmg_ld_" << std::hex << hash;
+    store->segment_path = name.str() + ".bin";
+    store->segment_lock = std::make_shared<LdSegmentLock>(name.str() + ".lock");
+
+    auto load_segment = [&store]() { return boost::filesystem::exists(store->segment_path) && store->ld_matrix_csr.load_segment(store->segment_path, store->key); };
+    bool loaded = load_segment();
+    if (!loaded) {
+      store->segment_lock->lock_build();  // waits while another process builds the segment
+      loaded = load_segment();
+    }
+    if (!loaded) {
+      LOG << " build LD segment " << store->segment_path << " to share it with other processes";
+      load_ld_r2_files(&store->ld_matrix_csr, chr_label_values, filenames, file_sizes);
+      const std::string tmp_path = store->segment_path + boost::filesystem::unique_path(".%%%%-%%%%-%%%%").string();
+      store->ld_matrix_csr.save_segment(tmp_path, store->key);
+      boost::filesystem::rename(tmp_path, store->segment_path);  // other processes never see partially written segment
+
+      // replace private copy of LD matrix with the mapped segment
+      store->ld_matrix_csr.clear();
+      store->ld_matrix_csr.init_chunks();
+      if (!store->ld_matrix_csr.load_segment(store->segment_path, store->key)) BGMG_THROW_EXCEPTION(std::runtime_error("unable to load LD segment " + store->segment_path));
+    }
+    store->segment_lock->unlock_build();
+    ld_matrix_store.push_back(store);
+  }
+
+  if (store == nullptr) {
+    LOG << " load LD matrix to share it with other contexts";
+    store = std::make_shared<LdMatrixStore>(*this, false);
+    store->key = key.str();
+    store->ld_matrix_csr.set_r_bits(ld_matrix_csr_.r_bits());
+    store->ld_matrix_csr.set_row_cache_budget(ld_matrix_csr_.row_cache_budget());
+    store->ld_matrix_csr.init_chunks();
+    store->ld_matrix_csr.set_excluded_snps(ld_matrix_csr_.excluded_snps());
+    load_ld_r2_files(&store->ld_matrix_csr, chr_label_values, filenames, file_sizes);
+    ld_matrix_store.push_back(store);
+  }
+
+  ld_matrix_csr_.attach_shared(std::shared_ptr<LdMatrixCsr>(store, &store->ld_matrix_csr));
+  mafvec_ = store->mapping.mafvec();
+}
+
+int64_t BgmgCalculator::set_ld_shm_dir(std::string directory) {
+  if (!directory.empty() && !boost::filesystem::is_directory(directory)) BGMG_THROW_EXCEPTION(std::runtime_error(directory + " is not a directory"));
+  LOG << " set_ld_shm_dir(directory=" << directory << ")";
+  ld_shm_dir_ = directory;
+  return 0;
+}
+
+int64_t BgmgCalculator::set_ld_stream_dir(std::string directory) {
+  if (!directory.empty() && !boost::filesystem::is_directory(directory)) BGMG_THROW_EXCEPTION(std::runtime_error(directory + " is not a directory"));
+  LOG << " set_ld_stream_dir(directory=" << directory << ")";
+  ld_stream_dir_ = directory;
+  return 0;
+}
+
+int64_t BgmgCalculator::save_context(std::string filename, std::string key) {
+  if (num_snp_ == -1 || chrnumvec_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("save_context: context is not initialized"));
+  if (ld_matrix_csr_.is_shared()) BGMG_THROW_EXCEPTION(::std::runtime_error("save_context: LD matrix shared with other contexts (share_ld, or ld_shm_dir) can not be saved"));
+  LOG << ">save_context(filename=" << filename << "); ";
+  SimpleTimer timer(-1);
+
+  ContextSnapshot snapshot;
+  snapshot.num_snp = num_snp_;
+  snapshot.tag_to_snp = tag_to_snp_;
+  snapshot.chrnumvec = chrnumvec_;
+  snapshot.zvec1 = zvec1_; snapshot.nvec1 = nvec1_;
+  snapshot.zvec2 = zvec2_; snapshot.nvec2 = nvec2_;
+  snapshot.weights = weights_;
+  snapshot.causalbetavec1 = causalbetavec1_; snapshot.causalbetavec2 = causalbetavec2_;
+
+  const std::string tmp_filename = filename + boost::filesystem::unique_path(".%%%%-%%%%-%%%%").string();
+  save_context_snapshot(tmp_filename, key, snapshot, &ld_matrix_csr_);
+  boost::filesystem::rename(tmp_filename, filename);  // concurrent load_context never sees partially written snapshot
+
+  LOG << "<save_context(filename=" << filename << "); elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
+
+int64_t BgmgCalculator::load_context(std::string filename, std::string key) {
+  if (num_snp_ != -1 || num_tag_ != -1) BGMG_THROW_EXCEPTION(::std::runtime_error("load_context: context is already initialized"));
+  LOG << ">load_context(filename=" << filename << "); ";
+  SimpleTimer timer(-1);
+
+  ContextSnapshot snapshot;
+  if (!boost::filesystem::exists(filename) || !load_context_snapshot(filename, key, &snapshot)) {
+    LOG << "<load_context(filename=" << filename << "): no snapshot for these inputs";
+    return 0;
+  }
+
+  for (auto vec : { &snapshot.zvec1, &snapshot.nvec1, &snapshot.zvec2, &snapshot.nvec2, &snapshot.weights })
+    if (!vec->empty() && (vec->size() != snapshot.tag_to_snp.size())) BGMG_THROW_EXCEPTION(::std::runtime_error("context snapshot is corrupted: " + filename));
+  for (auto vec : { &snapshot.causalbetavec1, &snapshot.causalbetavec2 })
+    if (!vec->empty() && (vec->size() != snapshot.num_snp)) BGMG_THROW_EXCEPTION(::std::runtime_error("context snapshot is corrupted: " + filename));
+
+  set_tag_indices(snapshot.num_snp, snapshot.tag_to_snp.size(), &snapshot.tag_to_snp[0]);
+  set_chrnumvec(snapshot.num_snp, &snapshot.chrnumvec[0]);
+  zvec1_.swap(snapshot.zvec1); nvec1_.swap(snapshot.nvec1);
+  zvec2_.swap(snapshot.zvec2); nvec2_.swap(snapshot.nvec2);
+  weights_.swap(snapshot.weights);
+  causalbetavec1_.swap(snapshot.causalbetavec1); causalbetavec2_.swap(snapshot.causalbetavec2);
+  if (!ld_matrix_csr_.load_segment(filename, key, snapshot.segment_offset))  // also restores mafvec_
+    BGMG_THROW_EXCEPTION(::std::runtime_error("context snapshot is corrupted: " + filename));
+
+  LOG << "<load_context(filename=" << filename << "); num_snp=" << num_snp_ << ", num_tag=" << num_tag_ << "; elapsed time " << timer.elapsed_ms() << " ms";
+  return 1;
+}
+
 int64_t BgmgCalculator::set_mafvec(int length, float* values) {
   for (int i = 0; i < length; i++) {
     if (!std::isfinite(values[i])) BGMG_THROW_EXCEPTION(::std::runtime_error("encounter undefined values"));
@@ -318,6 +610,7 @@ void BgmgCalculator::log_diagnostics() {
     LOG << " diag: last_num_causals_[" << i << "]=" << last_num_causals_[i];
   LOG << " diag: options.k_max_=" << k_max_;
   LOG << " diag: options.use_complete_tag_indices_=" << use_complete_tag_indices_;
+  LOG << " diag: options.restrict_ld_reference_=" << restrict_ld_reference_;
   LOG << " diag: options.disable_snp_to_tag_map_=" << disable_snp_to_tag_map_;
   LOG << " diag: options.max_causals_=" << max_causals_;
   LOG << " diag: options.num_components_=" << num_components_;
@@ -340,6 +633,14 @@ void BgmgCalculator::log_diagnostics() {
   LOG << " diag: options.cubature_max_evals_=" << (cubature_max_evals_);
   LOG << " diag: options.calc_k_pdf_=" << (calc_k_pdf_);
   LOG << " diag: options.ld_format_version_=" << (ld_format_version_);
+  LOG << " diag: options.ld_load_jobs_=" << (ld_load_jobs_);
+  LOG << " diag: options.share_ld_=" << (share_ld_);
+  LOG << " diag: options.ld_numa_placement_=" << (ld_numa_placement_);
+  LOG << " diag: options.ld_shm_dir_=" << (ld_shm_dir_);
+  LOG << " diag: options.ld_stream_dir_=" << (ld_stream_dir_);
+  LOG << " diag: options.ld_r_bits=" << (ld_matrix_csr_.r_bits());
+  LOG << " diag: options.huge_pages=" << huge_pages_status();
+  LOG << " diag: options.r2min_runtime=" << (ld_matrix_csr_.r2_min_runtime());
   LOG << " diag: options.retrieve_ld_sum_type_=" << (retrieve_ld_sum_type_);
   LOG << " diag: Estimated memory usage (total): " << mem_bytes_total << " bytes";
 }
@@ -366,6 +667,15 @@ void apply_exclude(std::string exclude, const BimFile& bim_file, std::vector<int
   LOG << " constrain analysis to " << std::accumulate(defvec->begin(), defvec->end(), 0) << " tag variants (due to exclude='" << exclude << "')";
 }
 
+int64_t BgmgCalculator::compact_ld_to_deftags(int free_rest) {
+  std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
+  LOG << " compact_ld_to_deftags(free_rest=" << free_rest << "), num_deftag=" << num_deftag;
+  std::vector<char> keep_tag(num_tag_, 0);
+  for (int tag_index : deftag_indices) keep_tag[tag_index] = 1;
+  ld_matrix_csr_.compact_to_tags(keep_tag, free_rest != 0);
+  return 0;
+}
+
 int64_t BgmgCalculator::perform_ld_clump(float r2_threshold, int length, float* buffer) {
   check_num_tag(length);
   if (r2_threshold < r2_min_) BGMG_THROW_EXCEPTION(::std::runtime_error("perform_ld_clump: r2 < r2_min_"));
@@ -654,15 +964,7 @@ int64_t BgmgCalculator::init(std::string bim_file, std::string frq_file, std::st
   SimpleTimer timer(-1);
 
   std::vector<std::string> chr_labels_vector, bim_files, frq_files;
-
-  if (chr_labels.empty()) {
-    for (int i = 1; i <= 22; i++)
-      chr_labels_vector.push_back(boost::lexical_cast<std::string>(i));
-  } else {
-    const std::string separators = " ,;\t\n\r";
-    boost::trim_if(chr_labels, boost::is_any_of(separators));
-    boost::split(chr_labels_vector, chr_labels, boost::is_any_of(separators), boost::token_compress_on);
-  }
+  split_chr_labels(chr_labels, &chr_labels_vector);
 
   if (bim_file.find("@") != std::string::npos) {
     for (auto chrlabel : chr_labels_vector) {
@@ -737,8 +1039,21 @@ int64_t BgmgCalculator::init(std::string bim_file, std::string frq_file, std::st
     LOG << " constrain analysis to " << std::accumulate(defvec.begin(), defvec.end(), 0) << " tag variants (due to trait2_file='" << trait2_file << "')";
   }
 
+  // with restrict_ld_reference, variants removed by extract/exclude are also removed from LD matrix (see LdMatrixCsr::set_excluded_snps);
+  // variants without summary statistics stay in the reference, as they still may be causal
+  std::vector<char> excluded_snp(bim_file_.size(), 0);
   if (!extract.empty()) apply_extract(extract, bim_file_, &defvec);
   if (!exclude.empty()) apply_exclude(exclude, bim_file_, &defvec);
+  if (restrict_ld_reference_ && (!extract.empty() || !exclude.empty())) {
+    SnpList extract_object, exclude_object;
+    if (!extract.empty()) extract_object.read(extract);
+    if (!exclude.empty()) exclude_object.read(exclude);
+    for (int i = 0; i < bim_file_.size(); i++) {
+      if (!extract.empty() && !extract_object.contains(bim_file_.snp()[i])) excluded_snp[i] = 1;
+      if (!exclude.empty() && exclude_object.contains(bim_file_.snp()[i])) excluded_snp[i] = 1;
+    }
+    LOG << " restrict LD reference to " << std::count(excluded_snp.begin(), excluded_snp.end(), 0) << " variants (due to extract='" << extract << "', exclude='" << exclude << "')";
+  }
 
   // Find tag indices
   std::vector<int> tag_indices;
@@ -752,6 +1067,7 @@ int64_t BgmgCalculator::init(std::string bim_file, std::string frq_file, std::st
   // - set_zvec, set_nvec (for each trait, if they are available)
   set_tag_indices(defvec.size(), tag_indices.size(), &tag_indices[0]);
   set_chrnumvec(bim_file_.size(), &bim_file_.chr_label()[0]);
+  ld_matrix_csr_.set_excluded_snps(excluded_snp);
   if (!frq_file.empty())
     set_mafvec(bim_file_.size(), &frq_file_object.frq()[0]);
 
@@ -840,10 +1156,12 @@ void BgmgCalculator::calc_fixed_effect_delta_from_causalbetavec(int trait_index,
   LOG << ">calc_fixed_effect_delta_from_causalbetavec(trait_index=" << trait_index << ")";
   SimpleTimer timer(-1);
 
-  std::vector<float> sqrt_hvec;
+  HugePageVector<float> sqrt_hvec;
   find_hvec(*this, &sqrt_hvec);
   for (int i = 0; i < sqrt_hvec.size(); i++) sqrt_hvec[i] = sqrt(sqrt_hvec[i]);
 
+  ld_matrix_csr_.init_snp_to_tag_map();
+
 #pragma omp parallel
   {
     LdMatrixRow ld_matrix_row;
@@ -233,6 +233,17 @@ class BgmgCalculator : public TagToSnpMapping {
   int64_t set_ld_r2_coo(int chr_label, int64_t length, int* snp_index, int* tag_index, float* r);
   int64_t set_ld_r2_coo(int chr_label, const std::string& filename);
   int64_t set_ld_r2_csr(int chr_label = -1);  // finalize
+  int64_t set_ld_r2_from_files(std::string chr_labels, std::string filename_template);  // set_ld_r2_coo + set_ld_r2_csr for several chromosomes, concurrently
+  int64_t set_ld_stream_dir(std::string directory);  // keep LD matrix out of core, in scratch files in directory, streamed chromosome by chromosome; empty string disables
+  int64_t set_ld_shm_dir(std::string directory);  // share LD matrix with other processes via LD segment in directory (e.g. /dev/shm, or hugetlbfs mount); empty string disables
+
+  // Snapshot of a fully initialized context (tag indices, chrnumvec, mafvec, zvec/nvec, weights, causalbetavec, LD matrix and LD scores),
+  // so that repeated analyses of the same inputs skip init, set_ld_r2_from_files and set_weights_randprune. The key identifies the inputs
+  // (e.g. a hash of file names, their sizes and modification times, and the options); load_context returns 0 if there is no snapshot with the same key,
+  // and 1 if the context was restored. load_context must be called on a context that is not initialized yet; LD matrix is memory-mapped from the snapshot.
+  // The reference (bim file) is not part of the snapshot, therefore set_weights_randprune with exclude/extract and convert_plink_ld are not available after load_context.
+  int64_t save_context(std::string filename, std::string key);
+  int64_t load_context(std::string filename, std::string key);
 
   int64_t num_ld_r2_snp(int snp_index);
   int64_t retrieve_ld_r2_snp(int snp_index, int length, int* tag_index, float* r2);
@@ -253,6 +264,7 @@ class BgmgCalculator : public TagToSnpMapping {
   int64_t set_weights(int length, float* values);
   int64_t set_weights_randprune(int n, float r2);   // alternative to set_weights; calculates weights based on random pruning from LD matrix
   int64_t set_weights_randprune(int n, float r2, std::string exclude, std::string extract);   // alternative to set_weights; calculates weights based on random pruning from LD matrix
+  int64_t compact_ld_to_deftags(int free_rest);   // keep a contiguous copy of LD rows for tags with non-zero weight (free_rest!=0 releases all other rows), see LdMatrixCsr::compact_to_tags
   int64_t perform_ld_clump(float r2, int length, float* buffer);
 
   int64_t retrieve_zvec(int trait, int length, float* buffer);
@@ -269,7 +281,7 @@ class BgmgCalculator : public TagToSnpMapping {
   
   void log_diagnostics();
 
-  // a note about 'smplfast': this is a special implementation of sampling, valid when 'pi' is constant across SNPs, and it use chunks_forward_ (while all other functions in unified implementation use chunks_reverse_).
+  // a note about 'smplfast': this is a special implementation of sampling, valid when 'pi' is constant across SNPs, and it use chunks_forward_ (while all other functions in unified implementation use chunks_reverse_). chunks_forward_ is built on the first call.
   double calc_unified_univariate_cost(int trait_index, int num_components, int num_snp, float* pi_vec, float* sig2_vec, float sig2_zeroA, float sig2_zeroC, float sig2_zeroL, float* aux);
   double calc_unified_univariate_cost_gaussian(int trait_index, int num_components, int num_snp, float* pi_vec, float* sig2_vec, float sig2_zeroA, float sig2_zeroC, float sig2_zeroL, float* aux);
   double calc_unified_univariate_cost_convolve(int trait_index, int num_components, int num_snp, float* pi_vec, float* sig2_vec, float sig2_zeroA, float sig2_zeroC, float sig2_zeroL, float* aux);
@@ -296,11 +308,11 @@ class BgmgCalculator : public TagToSnpMapping {
 
   int64_t seed() { return seed_; }
   void set_seed(int64_t seed) { seed_ = seed; }
+  int ld_load_peak_chunks() { return ld_load_peak_chunks_; }
 
   virtual int num_snp() { return num_snp_; }
   virtual int num_tag() { return num_tag_; }
   virtual bool has_complete_tag_indices() { return num_snp_ == num_tag_; }
-  virtual bool disable_snp_to_tag_map() { return disable_snp_to_tag_map_ || (num_snp_ == num_tag_); }
   virtual const std::vector<int>& tag_to_snp() { return  tag_to_snp_; }
   virtual const std::vector<int>& snp_to_tag() { return snp_to_tag_; }
   virtual const std::vector<char>& is_tag() { return is_tag_; }
@@ -337,7 +349,8 @@ class BgmgCalculator : public TagToSnpMapping {
   int k_max_;
   int64_t seed_;
   bool use_complete_tag_indices_;  // an option that indicates that all SNPs are TAG (i.e. num_snp_ == num_tag_).
-  bool disable_snp_to_tag_map_;    // save memory by disabling ld_matrix_csr_.chunks_forward_ (not needed in unified implementation)
+  bool restrict_ld_reference_;     // init() removes variants excluded by extract/exclude from LD matrix, not only from the tag variants
+  bool disable_snp_to_tag_map_;    // no longer has any effect: ld_matrix_csr_.chunks_forward_ is built on demand as a transpose of chunks_reverse_
 
   float r2_min_;
   float z1max_;
@@ -348,6 +361,12 @@ class BgmgCalculator : public TagToSnpMapping {
   int cubature_max_evals_;
   AuxOption aux_option_;       // controls auxilary data stored in "aux" array of calc_unified_univariate_cost_*** calls
   int ld_format_version_;      // overwrite format version for LD matrix files. Default -1. Set this to 0 to read from MiXeR v1.0 LD files.
+  int ld_load_jobs_;           // how many chromosomes set_ld_r2_from_files loads at the same time. Default 0 means one chromosome per thread. Ignored with ld_stream_dir_, which loads one chromosome at a time.
+  int ld_load_peak_chunks_;    // how many chromosomes were in memory at the same time during the last load_ld_r2_files (spilled chromosomes do not count)
+  bool share_ld_;              // set_ld_r2_from_files attaches to LD matrix shared with other contexts that load the same LD files (see LdMatrixStore)
+  bool ld_numa_placement_;     // set_ld_r2_from_files places tag rows in memory of the NUMA node of the threads that process them (see LdMatrixCsr::place_rows_per_thread)
+  std::string ld_shm_dir_;     // directory for LD segments shared with other processes, e.g. /dev/shm; empty if LD matrix is not shared between processes
+  std::string ld_stream_dir_;  // directory for scratch files of out-of-core LD matrix (see LdMatrixCsr::spill_chunk); empty to keep LD matrix in memory
   int retrieve_ld_sum_type_;   // control behaviour of retrieve_ld_sum_r2() and retrieve_ld_sum_r4()
                                // 0 = above r2min; 1 = below r2min; 2 = above r2min adjusted for hvec; 3 = below r2min adjusted for hvec; 
                                // For retrieve_ld_sum_r4() the "below r2min" option is not available, therefore 1 will work the same as 0, and 3 will work same as 2.
@@ -364,6 +383,9 @@ class BgmgCalculator : public TagToSnpMapping {
   void find_z_minus_fixed_effect_delta(int trait_index, std::vector<float>* z_minus_fixed_effect_delta);
 
   int find_deftag_indices(const float* weights, std::vector<int>* deftag_indices);
+  int64_t load_ld_r2_file(LdMatrixCsr* ld_matrix_csr, int chr_label, const std::string& filename);
+  void load_ld_r2_files(LdMatrixCsr* ld_matrix_csr, const std::vector<int>& chr_label_values, const std::vector<std::string>& filenames, const std::vector<uintmax_t>& file_sizes);
+  void attach_shared_ld_r2(const std::vector<int>& chr_label_values, const std::vector<std::string>& filenames, const std::vector<uintmax_t>& file_sizes);
 
   BimFile bim_file_;
 
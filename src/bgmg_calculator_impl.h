@@ -99,6 +99,7 @@
 #include "bgmg_log.h"
 #include "bgmg_parse.h"
 #include "bgmg_math.h"
+#include "ld_matrix.h"
 #include "bgmg_rand.h"
 #include "fmath.hpp"
 
@@ -182,10 +182,10 @@ int64_t BgmgCalculator::find_tag_r2sum(int component_id, float num_causals) {
   }
 
   // apply infinitesimal model to adjust tag_r2sum for all r2 that are below r2min (and thus do not contribute via resampling)
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
   const float pival_delta = (num_causals_original - last_num_causals_original) / static_cast<float>(num_snp_);
 
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
 
   // it is OK to parallelize the following loop on k_index, because:
   // - all structures here are readonly, except tag_r2sum_ that we are accumulating
@@ -1311,7 +1311,7 @@ void BgmgCalculator::find_tag_r2sum_no_cache(int component_id, float num_causal,
 
   for (int i = 0; i < num_tag_; i++) buffer->at(i) = 0;
 
-  std::vector<float> hvec;
+  HugePageVector<float> hvec;
   find_hvec(*this, &hvec);
 
   LdMatrixRow ld_matrix_row;
@@ -1330,7 +1330,7 @@ void BgmgCalculator::find_tag_r2sum_no_cache(int component_id, float num_causal,
     }
   }
 
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
 
   const float pival = num_causal / static_cast<float>(num_snp_);
   for (int i = 0; i < num_tag_; i++) {
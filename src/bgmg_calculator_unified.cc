@@ -42,10 +42,10 @@ class UnivariateCharacteristicFunctionData {
   float sig2_zeroL;
   int tag_index;  // for which SNP to calculate the characteristic function
   LdMatrixRow* ld_matrix_row;
-  const std::vector<float>* hvec;
+  const HugePageVector<float>* hvec;
   const std::vector<float>* nvec;
   const std::vector<float>* z_minus_fixed_effect_delta;
-  const std::vector<float>* ld_tag_sum_r2_below_r2min_adjust_for_hvec;
+  const HugePageVector<float>* ld_tag_sum_r2_below_r2min_adjust_for_hvec;
   int func_evals;
 };
 
@@ -113,8 +113,8 @@ double BgmgCalculator::calc_unified_univariate_cost_convolve(int trait_index, in
   // standard variables
   std::vector<float> z_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(trait_index, &z_minus_fixed_effect_delta);
   std::vector<float>& nvec(*get_nvec(trait_index));
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   const double zmax = (trait_index==1) ? z1max_ : z2max_;
 
   std::vector<float> weights_convolve(weights_.begin(), weights_.end());
@@ -136,7 +136,8 @@ double BgmgCalculator::calc_unified_univariate_cost_convolve(int trait_index, in
 
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(&weights_convolve[0], &deftag_indices);
 
-#pragma omp parallel
+  LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
+#pragma omp parallel reduction(+: log_pdf_total, num_snp_failed, num_infinite, func_evals, total_weight)
   {
     LdMatrixRow ld_matrix_row;
     UnivariateCharacteristicFunctionData data;
@@ -153,8 +154,8 @@ double BgmgCalculator::calc_unified_univariate_cost_convolve(int trait_index, in
     data.nvec = &nvec;
     data.ld_tag_sum_r2_below_r2min_adjust_for_hvec = &ld_tag_sum_r2_below_r2min_adjust_for_hvec;
 
-#pragma omp for schedule(dynamic, kOmpDynamicChunk) reduction(+: log_pdf_total, num_snp_failed, num_infinite, func_evals, total_weight)
-    for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
+    for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+    for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
       int tag_index = deftag_indices[deftag_index];
       double tag_weight = static_cast<double>(weights_convolve[tag_index]);
 
@@ -206,14 +207,14 @@ double BgmgCalculator::calc_unified_univariate_cost_gaussian(int trait_index, in
   // standard variables
   std::vector<float> z_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(trait_index, &z_minus_fixed_effect_delta);
   std::vector<float>& nvec(*get_nvec(trait_index));
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
   const double zmax = (trait_index==1) ? z1max_ : z2max_;
 
   // Step 1. Calculate Ebeta2 and Ebeta4
-  std::valarray<float> Ebeta2(0.0, num_snp_);
-  std::valarray<float> Ebeta4(0.0, num_snp_);// Ebeta4 is a simplified name - in fact, this variable contains E(\beta^4) - 3 (E \beta^2)^2.
+  HugePageVector<float> Ebeta2(num_snp_, 0.0f);
+  HugePageVector<float> Ebeta4(num_snp_, 0.0f);// Ebeta4 is a simplified name - in fact, this variable contains E(\beta^4) - 3 (E \beta^2)^2.
   for (int comp_index = 0; comp_index < num_components; comp_index++) {
     for (int snp_index = 0; snp_index < num_snp_; snp_index++) {
       const float p = pi_vec[comp_index*num_snp_ + snp_index];
@@ -231,14 +232,15 @@ double BgmgCalculator::calc_unified_univariate_cost_gaussian(int trait_index, in
   std::valarray<float> Edelta2(0.0, num_tag_);
   std::valarray<float> Edelta4(0.0, num_tag_);  // Edelta4 is a simplified name - see comment for Ebeta4
 
+  LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
 #pragma omp parallel
   {
     LdMatrixRow ld_matrix_row;
     std::valarray<float> Edelta2_local(0.0, num_tag_);
     std::valarray<float> Edelta4_local(0.0, num_tag_);
 
-#pragma omp for schedule(dynamic, kOmpDynamicChunk)    
-    for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
+    for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+    for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
       int tag_index = deftag_indices[deftag_index];
 
       ld_matrix_csr_.extract_tag_row(TagIndex(tag_index), &ld_matrix_row);
@@ -329,8 +331,8 @@ double BgmgCalculator::calc_unified_univariate_cost_sampling(int trait_index, in
   // standard variables
   std::vector<float> z_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(trait_index, &z_minus_fixed_effect_delta);
   std::vector<float>& nvec(*get_nvec(trait_index));
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(weights, &deftag_indices);
 
   const double z_max = (trait_index==1) ? z1max_ : z2max_;
@@ -338,14 +340,15 @@ double BgmgCalculator::calc_unified_univariate_cost_sampling(int trait_index, in
   double log_pdf_total = 0.0;
   int num_infinite = 0;
 
-#pragma omp parallel
+  LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
+#pragma omp parallel reduction(+: log_pdf_total, num_infinite)
   {
     LdMatrixRow ld_matrix_row;
     std::vector<float> tag_delta2(k_max_, 0.0f);
     std::valarray<double> tag_kpdf(0.0f, k_max_);
 
-#pragma omp for schedule(dynamic, kOmpDynamicChunk) reduction(+: log_pdf_total, num_infinite)
-    for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
+    for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+    for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
       const int tag_index = deftag_indices[deftag_index];
       
       // for those who are woundering what's the point of tag_to_snp_[tag_index]...
@@ -416,9 +419,10 @@ double BgmgCalculator::calc_unified_univariate_cost_smplfast(int trait_index, in
   // standard variables
   std::vector<float> z_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(trait_index, &z_minus_fixed_effect_delta);
   std::vector<float>& nvec(*get_nvec(trait_index));
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(weights, &deftag_indices);
+  ld_matrix_csr_.init_snp_to_tag_map();  // smplfast uses snp->tag map
 
   const double z_max = (trait_index==1) ? z1max_ : z2max_;
   const double pi_k = 1.0 / static_cast<double>(k_max_);
@@ -709,8 +713,8 @@ int64_t BgmgCalculator::calc_unified_univariate_pdf(int trait_index, int num_com
 
   const double pi_k = 1.0 / static_cast<double>(k_max_);
   std::vector<float>& nvec(*get_nvec(trait_index));
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
 
   std::valarray<double> pdf_double(0.0, length);
@@ -756,8 +760,8 @@ int64_t BgmgCalculator::calc_unified_univariate_power(int trait_index, int num_c
   SimpleTimer timer(-1);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
   const double pi_k = 1.0 / static_cast<double>(k_max_);
-  std::vector<float> hvec; find_hvec(*this, &hvec);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
   std::vector<float> nvec_dummy(num_tag_, 1.0f);
 
   std::valarray<double> s_numerator_global(0.0, length);
@@ -820,8 +824,8 @@ int64_t BgmgCalculator::calc_unified_univariate_delta_posterior(int trait_index,
   std::vector<float> z_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(trait_index, &z_minus_fixed_effect_delta);
   std::vector<float>& nvec(*get_nvec(trait_index));
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
-  std::vector<float> hvec; find_hvec(*this, &hvec);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
 
   std::valarray<double> c0_global(0.0f, num_tag_);
   std::valarray<double> c1_global(0.0f, num_tag_);
@@ -915,14 +919,14 @@ double BgmgCalculator::calc_unified_bivariate_cost_gaussian(int num_snp, float*
   // standard variables
   std::vector<float> z1_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(1, &z1_minus_fixed_effect_delta);
   std::vector<float> z2_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(2, &z2_minus_fixed_effect_delta);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
 
   // Step 1. Calculate Ebeta20, Ebeta02, Ebeta11
-  std::valarray<float> Ebeta20(0.0, num_snp_);
-  std::valarray<float> Ebeta02(0.0, num_snp_);
-  std::valarray<float> Ebeta11(0.0, num_snp_);
+  HugePageVector<float> Ebeta20(num_snp_, 0.0f);
+  HugePageVector<float> Ebeta02(num_snp_, 0.0f);
+  HugePageVector<float> Ebeta11(num_snp_, 0.0f);
   for (int snp_index = 0; snp_index < num_snp_; snp_index++) {
     const float p1 = pi_vec[0*num_snp_ + snp_index];
     const float p2 = pi_vec[1*num_snp_ + snp_index];
@@ -943,6 +947,7 @@ double BgmgCalculator::calc_unified_bivariate_cost_gaussian(int num_snp, float*
   std::valarray<float> Edelta02(0.0, num_snp_);
   std::valarray<float> Edelta11(0.0, num_snp_);
   
+  LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
 #pragma omp parallel
   {
     LdMatrixRow ld_matrix_row;
@@ -950,8 +955,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_gaussian(int num_snp, float*
     std::valarray<float> Edelta02_local(0.0, num_snp_);
     std::valarray<float> Edelta11_local(0.0, num_snp_);
 
-#pragma omp for schedule(dynamic, kOmpDynamicChunk)    
-    for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
+    for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+    for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
       int tag_index = deftag_indices[deftag_index];
 
       ld_matrix_csr_.extract_tag_row(TagIndex(tag_index), &ld_matrix_row);
@@ -1053,12 +1058,12 @@ class BivariateCharacteristicFunctionData {
   int tag_index;  // for which SNP to calculate the characteristic function
   LdMatrixRow* ld_matrix_row;
 
-  const std::vector<float>* hvec;
+  const HugePageVector<float>* hvec;
   const std::vector<float>* z1_minus_fixed_effect_delta;
   const std::vector<float>* nvec1;
   const std::vector<float>* z2_minus_fixed_effect_delta;
   const std::vector<float>* nvec2;
-  const std::vector<float>* ld_tag_sum_r2_below_r2min_adjust_for_hvec;
+  const HugePageVector<float>* ld_tag_sum_r2_below_r2min_adjust_for_hvec;
   int func_evals;
 };
 
@@ -1150,8 +1155,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_convolve(int num_snp, float*
   // standard variables
   std::vector<float> z1_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(1, &z1_minus_fixed_effect_delta);
   std::vector<float> z2_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(2, &z2_minus_fixed_effect_delta);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
 
   std::vector<float> weights_convolve(weights_.begin(), weights_.end());
   std::vector<float> weights_sampling(weights_.begin(), weights_.end()); int num_deftag_sampling = 0;
@@ -1173,7 +1178,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_convolve(int num_snp, float*
 
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(&weights_convolve[0], &deftag_indices);
 
-#pragma omp parallel
+  LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
+#pragma omp parallel reduction(+: log_pdf_total, num_snp_failed, num_infinite, func_evals, total_weight)
   {
     LdMatrixRow ld_matrix_row;
     BivariateCharacteristicFunctionData data;
@@ -1194,8 +1200,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_convolve(int num_snp, float*
     data.nvec2 = &nvec2_;
     data.ld_tag_sum_r2_below_r2min_adjust_for_hvec = &ld_tag_sum_r2_below_r2min_adjust_for_hvec;
 
-#pragma omp for schedule(dynamic, kOmpDynamicChunk) reduction(+: log_pdf_total, num_snp_failed, num_infinite, func_evals, total_weight)
-    for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
+    for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+    for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
       int tag_index = deftag_indices[deftag_index];
       double tag_weight = static_cast<double>(weights_convolve[tag_index]);
 
@@ -1246,8 +1252,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_sampling(int num_snp, float*
   // standard variables
   std::vector<float> z1_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(1, &z1_minus_fixed_effect_delta);
   std::vector<float> z2_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(2, &z2_minus_fixed_effect_delta);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(weights, &deftag_indices);
 
   const double pi_k = 1.0 / static_cast<double>(k_max_);
@@ -1255,7 +1261,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_sampling(int num_snp, float*
   int num_infinite = 0;
   const int num_components = 3;
 
-#pragma omp parallel
+  LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
+#pragma omp parallel reduction(+: log_pdf_total, num_infinite)
   {
     LdMatrixRow ld_matrix_row;
     std::vector<float> tag_delta20(k_max_, 0.0f);
@@ -1263,8 +1270,8 @@ double BgmgCalculator::calc_unified_bivariate_cost_sampling(int num_snp, float*
     std::vector<float> tag_delta11(k_max_, 0.0f);
     std::valarray<double> tag_kpdf(0.0f, k_max_);
 
-#pragma omp for schedule(dynamic, kOmpDynamicChunk) reduction(+: log_pdf_total, num_infinite)
-    for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
+    for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+    for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
       const int tag_index = deftag_indices[deftag_index];
       MultinomialSampler subset_sampler((seed_ > 0) ? seed_ : (seed_ - 1), 1 + tag_to_snp_[tag_index], k_max_, num_components);
       const float adj_hval = ld_tag_sum_r2_below_r2min_adjust_for_hvec[tag_index];
@@ -1347,9 +1354,10 @@ double BgmgCalculator::calc_unified_bivariate_cost_smplfast(int num_snp, float*
   // standard variables
   std::vector<float> z1_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(1, &z1_minus_fixed_effect_delta);
   std::vector<float> z2_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(2, &z2_minus_fixed_effect_delta);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(weights, &deftag_indices);
+  ld_matrix_csr_.init_snp_to_tag_map();  // smplfast uses snp->tag map
 
   const double pi_k = 1.0 / static_cast<double>(k_max_);
   std::valarray<double> pdf_double(0.0, num_tag_);
@@ -1515,8 +1523,8 @@ int64_t BgmgCalculator::calc_unified_bivariate_pdf(int num_snp, float* pi_vec, f
   // standard variables
   std::vector<float> z1_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(1, &z1_minus_fixed_effect_delta);
   std::vector<float> z2_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(2, &z2_minus_fixed_effect_delta);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
   const double pi_k = 1.0 / static_cast<double>(k_max_);
   const int num_components = 3;
@@ -1586,8 +1594,8 @@ int64_t BgmgCalculator::calc_unified_bivariate_delta_posterior(int num_snp, floa
   // standard variables
   std::vector<float> z1_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(1, &z1_minus_fixed_effect_delta);
   std::vector<float> z2_minus_fixed_effect_delta; find_z_minus_fixed_effect_delta(2, &z2_minus_fixed_effect_delta);
-  const std::vector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
-  std::vector<float> hvec; find_hvec(*this, &hvec);
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min_adjust_for_hvec = ld_matrix_csr_.ld_sum_adjust_for_hvec()->ld_tag_sum_r2_below_r2min();
+  HugePageVector<float> hvec; find_hvec(*this, &hvec);
   std::vector<int> deftag_indices; const int num_deftag = find_deftag_indices(nullptr, &deftag_indices);
 
   const double pi_k = 1.0 / static_cast<double>(k_max_);
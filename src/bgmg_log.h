@@ -6,6 +6,7 @@
 #include <fstream>
 #include <vector>
 #include <chrono>
+#include <mutex>
 
 #define LOG Logger::singleton()
 #define MAX_LOG_LINES 10000000
@@ -83,6 +84,7 @@ public:
   template <typename T>
   LoggerImpl& operator<< (const T& rhs) {
     // std::cout << rhs;
+    std::lock_guard<std::mutex> guard(mutex_);  // LOG may be called from several threads (e.g. set_ld_r2_from_files); lines may interleave, but the stream stays consistent
     if (log_file_.is_open()) {
       log_file_ << rhs;
       log_file_.flush();
@@ -99,6 +101,7 @@ public:
 
 private:
   std::ofstream log_file_;
+  std::mutex mutex_;
 };
 
 class Logger : boost::noncopyable {
@@ -184,6 +184,36 @@ void BimFile::read(std::vector<std::string> filenames) {
   LOG << " Found " << chr_label_.size() << " variants in total.";
 }
 
+void split_chr_labels(std::string chr_labels, std::vector<std::string>* chr_labels_vector) {
+  chr_labels_vector->clear();
+  if (chr_labels.empty()) {
+    for (int i = 1; i <= 22; i++)
+      chr_labels_vector->push_back(std::to_string(i));
+  } else {
+    const std::string separators = " ,;\t\n\r";
+    boost::trim_if(chr_labels, boost::is_any_of(separators));
+    boost::split(*chr_labels_vector, chr_labels, boost::is_any_of(separators), boost::token_compress_on);
+  }
+}
+
+uint64_t BimFile::reference_hash(int chr_label) const {
+  uint64_t hash = 14695981039346656037ULL;
+  auto update = [&hash](const std::string& value) {
+    for (char c : value) { hash ^= static_cast<unsigned char>(c); hash *= 1099511628211ULL; }
+    hash ^= static_cast<unsigned char>('\t'); hash *= 1099511628211ULL;
+  };
+
+  for (int i = 0; i < chr_label_.size(); i++) {
+    if (chr_label_[i] != chr_label) continue;
+    update(std::to_string(chr_label_[i]));
+    update(snp_[i]);
+    update(std::to_string(bp_[i]));
+    update(a1_[i]);
+    update(a2_[i]);
+  }
+  return hash;
+}
+
 PlinkLdFile::PlinkLdFile(const BimFile& bim, std::string filename) {
   const std::string separators = " \t\n\r";
   std::vector<std::string> tokens;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <map>
@@ -7,6 +8,9 @@
 
 #define BED_HEADER_SIZE 3
 
+// Split a list of chromosome labels (separated by spaces, commas or semicolons); empty list defaults to 1..22
+void split_chr_labels(std::string chr_labels, std::vector<std::string>* chr_labels_vector);
+
 class BedFileInMemory {
 public:
   BedFileInMemory() : num_subjects_(0), num_snps_(0), row_byte_size_(0) {}
@@ -49,6 +53,10 @@ public:
   const std::vector<std::string>& a1() const { return a1_; }
   const std::vector<std::string>& a2() const { return a2_; }
 
+  // 64-bit FNV-1a hash of CHR, SNP, BP, A1 and A2 columns of all variants on a given chromosome;
+  // used to check that LD files match the reference.
+  uint64_t reference_hash(int chr_label) const;
+
 private:
   std::vector<int> chr_label_;
   std::vector<std::string> snp_;
@@ -0,0 +1,158 @@
+/*
+  bgmg - tool to calculate log likelihood of BGMG and UGMG mixture models
+  Copyright (C) 2018 Oleksandr Frei
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "huge_page_allocator.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+std::atomic<int> g_huge_pages_mode(kHugePagesAdvise);
+std::atomic<size_t> g_huge_pages_bytes[4];
+
+// kind of each large allocation; there are only a few of them (one per array of at least kHugePageSize bytes)
+std::mutex g_huge_pages_mutex;
+std::unordered_map<const void*, HugePagesKind>& huge_pages_registry() {
+  static std::unordered_map<const void*, HugePagesKind> registry;
+  return registry;
+}
+
+size_t round_up(size_t bytes, size_t alignment) {
+  return (bytes + alignment - 1) / alignment * alignment;
+}
+
+void* aligned_heap_allocate(size_t bytes) {
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, kHugePageAlignment, (bytes == 0) ? kHugePageAlignment : bytes) != 0) throw std::bad_alloc();
+  return ptr;
+}
+
+#ifndef _WIN32
+// anonymous mapping of "bytes" (a multiple of kHugePageSize) aligned to kHugePageSize, so that khugepaged can back it with 2 MB pages
+void* mmap_aligned(size_t bytes) {
+  const size_t padded = bytes + kHugePageSize;
+  void* raw = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) throw std::bad_alloc();
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(raw);
+  const uintptr_t aligned = round_up(begin, kHugePageSize);
+  if (aligned > begin) munmap(raw, aligned - begin);
+  if (begin + padded > aligned + bytes) munmap(reinterpret_cast<void*>(aligned + bytes), begin + padded - aligned - bytes);
+  return reinterpret_cast<void*>(aligned);
+}
+#endif
+
+}  // namespace
+
+void set_huge_pages_mode(HugePagesMode mode) { g_huge_pages_mode = mode; }
+HugePagesMode huge_pages_mode() { return static_cast<HugePagesMode>(g_huge_pages_mode.load()); }
+
+void* huge_pages_allocate(size_t bytes) {
+#ifndef _WIN32
+  if (bytes >= kHugePageSize) {
+    const size_t mapped_bytes = round_up(bytes, kHugePageSize);
+    const HugePagesMode mode = huge_pages_mode();
+    void* ptr = nullptr;
+    HugePagesKind kind = kHugePagesKindFallback;
+#ifdef MAP_HUGETLB
+    if (mode == kHugePagesExplicit) {
+      ptr = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (ptr == MAP_FAILED) ptr = nullptr;
+      else kind = kHugePagesKindExplicit;
+    }
+#endif
+    if (ptr == nullptr) {
+      ptr = mmap_aligned(mapped_bytes);
+#ifdef MADV_HUGEPAGE
+      if ((mode != kHugePagesOff) && (madvise(ptr, mapped_bytes, MADV_HUGEPAGE) == 0)) kind = kHugePagesKindAdvised;
+#endif
+    }
+
+    g_huge_pages_bytes[kind] += mapped_bytes;
+    std::lock_guard<std::mutex> guard(g_huge_pages_mutex);
+    huge_pages_registry()[ptr] = kind;
+    return ptr;
+  }
+#endif
+  return aligned_heap_allocate(bytes);
+}
+
+void huge_pages_deallocate(void* ptr, size_t bytes) {
+  if (ptr == nullptr) return;
+#ifndef _WIN32
+  if (bytes >= kHugePageSize) {
+    const size_t mapped_bytes = round_up(bytes, kHugePageSize);
+    HugePagesKind kind = kHugePagesKindNone;
+    {
+      std::lock_guard<std::mutex> guard(g_huge_pages_mutex);
+      auto iter = huge_pages_registry().find(ptr);
+      if (iter != huge_pages_registry().end()) { kind = iter->second; huge_pages_registry().erase(iter); }
+    }
+    g_huge_pages_bytes[kind] -= mapped_bytes;
+    munmap(ptr, mapped_bytes);
+    return;
+  }
+#endif
+  free(ptr);
+}
+
+HugePagesKind huge_pages_kind(const void* ptr) {
+  std::lock_guard<std::mutex> guard(g_huge_pages_mutex);
+  auto iter = huge_pages_registry().find(ptr);
+  return (iter != huge_pages_registry().end()) ? iter->second : kHugePagesKindNone;
+}
+
+const char* huge_pages_kind_str(HugePagesKind kind) {
+  switch (kind) {
+    case kHugePagesKindFallback: return "4k pages";
+    case kHugePagesKindAdvised: return "transparent huge pages";
+    case kHugePagesKindExplicit: return "explicit huge pages";
+    default: return "n/a";
+  }
+}
+
+void huge_pages_usage(size_t* bytes_fallback, size_t* bytes_advised, size_t* bytes_explicit) {
+  *bytes_fallback = g_huge_pages_bytes[kHugePagesKindFallback];
+  *bytes_advised = g_huge_pages_bytes[kHugePagesKindAdvised];
+  *bytes_explicit = g_huge_pages_bytes[kHugePagesKindExplicit];
+}
+
+std::string huge_pages_status() {
+  std::string thp_enabled;
+  std::ifstream is("/sys/kernel/mm/transparent_hugepage/enabled");
+  if (!is || !std::getline(is, thp_enabled)) thp_enabled = "n/a";
+
+  size_t bytes_fallback, bytes_advised, bytes_explicit;
+  huge_pages_usage(&bytes_fallback, &bytes_advised, &bytes_explicit);
+  std::stringstream ss;
+  ss << "mode=" << static_cast<int>(huge_pages_mode()) << ", transparent_hugepage/enabled=" << thp_enabled
+     << ", bytes with explicit huge pages=" << bytes_explicit
+     << ", bytes with transparent huge pages=" << bytes_advised
+     << ", bytes with 4k pages=" << bytes_fallback;
+  return ss.str();
+}
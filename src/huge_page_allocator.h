@@ -0,0 +1,84 @@
+/*
+  bgmg - tool to calculate log likelihood of BGMG and UGMG mixture models
+  Copyright (C) 2018 Oleksandr Frei
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+// Memory for large arrays with random access (LD r values and packed indices, LdSum, hvec).
+// Allocations of at least kHugePageSize bytes are placed on 2 MB pages, which saves TLB misses on hvec[snp_index]-style access:
+//   kHugePagesOff      - no huge pages; the memory is still aligned to kHugePageAlignment (for SIMD loads)
+//   kHugePagesAdvise   - 2 MB aligned anonymous memory with madvise(MADV_HUGEPAGE), i.e. transparent huge pages (default)
+//   kHugePagesExplicit - explicit huge pages (MAP_HUGETLB) from the pool reserved in /proc/sys/vm/nr_hugepages;
+//                        falls back to kHugePagesAdvise when the pool is exhausted
+// Smaller allocations get kHugePageAlignment-aligned memory from the heap. The mode applies to new allocations only.
+enum HugePagesMode {
+  kHugePagesOff = 0,
+  kHugePagesAdvise = 1,
+  kHugePagesExplicit = 2,
+};
+
+// How the memory of an array was obtained (see huge_pages_kind)
+enum HugePagesKind {
+  kHugePagesKindNone,      // not allocated by HugePageAllocator (e.g. memory-mapped from a file), or smaller than kHugePageSize
+  kHugePagesKindFallback,  // regular 4 KB pages, because huge pages were disabled or unavailable
+  kHugePagesKindAdvised,   // transparent huge pages (whether the kernel actually backs the range with 2 MB pages is up to khugepaged)
+  kHugePagesKindExplicit,  // explicit huge pages
+};
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+static const size_t kHugePageAlignment = 64;
+
+void set_huge_pages_mode(HugePagesMode mode);
+HugePagesMode huge_pages_mode();
+
+void* huge_pages_allocate(size_t bytes);
+void huge_pages_deallocate(void* ptr, size_t bytes);
+HugePagesKind huge_pages_kind(const void* ptr);  // for the start of an array allocated with huge_pages_allocate
+const char* huge_pages_kind_str(HugePagesKind kind);
+
+// total number of bytes currently allocated by huge_pages_allocate, by HugePagesKind
+void huge_pages_usage(size_t* bytes_fallback, size_t* bytes_advised, size_t* bytes_explicit);
+std::string huge_pages_status();  // contents of /sys/kernel/mm/transparent_hugepage/enabled, and the usage
+
+template<typename T>
+class HugePageAllocator {
+ public:
+  typedef T value_type;
+
+  HugePageAllocator() = default;
+  template<typename U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+  T* allocate(size_t numel) { return static_cast<T*>(huge_pages_allocate(numel * sizeof(T))); }
+  void deallocate(T* ptr, size_t numel) { huge_pages_deallocate(ptr, numel * sizeof(T)); }
+
+  template<typename U> bool operator==(const HugePageAllocator<U>&) const { return true; }
+  template<typename U> bool operator!=(const HugePageAllocator<U>&) const { return false; }
+};
+
+template<typename T>
+using HugePageVector = std::vector<T, HugePageAllocator<T>>;
+
+template<typename T>
+const char* huge_pages_kind_str(const HugePageVector<T>& vec) {
+  return huge_pages_kind_str(vec.empty() ? kHugePagesKindNone : huge_pages_kind(vec.data()));
+}
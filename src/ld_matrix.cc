@@ -3,13 +3,45 @@
 #include <string>
 #include <valarray>
 #include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include <zlib.h>
+#include <boost/algorithm/string.hpp>
 
 #include "bgmg_log.h"
 #include "bgmg_parse.h"
 #include "plink_ld.h"
 #include "ld_matrix_csr.h"
 
-#define LD_MATRIX_FORMAT_VERSION 1
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#define omp_get_num_threads() 1
+#endif
+
+// Format history:
+// version 1 - sequence of (numel, data) vectors, loaded via std::ifstream
+// version 2 - the same vectors, but placed at 64-byte aligned offsets listed in a section table,
+//             so that CSR arrays can be memory-mapped without copying (see load_ld_matrix)
+// version 3 - genome LD file, i.e. several chromosomes in one file, each with its own section table (see save_ld_matrix_genome)
+// version 4 - the same as version 2, with extra sections for per-row index codecs and (optionally) compressed r values;
+//             genome LD files may have these sections as well
+#define LD_MATRIX_FORMAT_VERSION 4
+#define LD_MATRIX_GENOME_FORMAT_VERSION 3
+#define LD_MATRIX_SEGMENT_FORMAT_VERSION 100  // LD segment (see LdMatrixCsr::save_segment); not an LD file, hence rejected by load_ld_matrix
+#define LD_MATRIX_CONTEXT_FORMAT_VERSION 101  // context snapshot (see save_context_snapshot), with an LD segment embedded at the end
+#define LD_MATRIX_SECTION_ALIGNMENT 64
 
 class PosixFile {
 public:
@@ -24,10 +56,55 @@ private:
   FILE* file;
 };
 
-void generate_ld_matrix_from_bed_file(std::string bfile, float r2_min, float ldscore_r2min, int ld_window, float ld_window_kb, std::string outfile) {
+// Read-only memory mapping of an entire file. The mapping is released in destructor,
+// therefore instances are held via shared_ptr by all MappableVector objects that point into the file.
+class MemoryMappedFile {
+public:
+  MemoryMappedFile(std::string filename) : data_(nullptr), size_(0) {
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to open ") + filename));
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to stat ") + filename)); }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void* ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr == MAP_FAILED) { close(fd); BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to mmap ") + filename)); }
+      data_ = static_cast<const char*>(ptr);
+    }
+    close(fd);  // the mapping stays valid after the descriptor is closed
+#else
+    BGMG_THROW_EXCEPTION(::std::runtime_error("memory-mapped LD files are not supported on this platform"));
+#endif
+  }
+  ~MemoryMappedFile() {
+#ifndef _WIN32
+    if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+#endif
+  }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  MemoryMappedFile(const MemoryMappedFile&);
+  MemoryMappedFile& operator=(const MemoryMappedFile&);
+  const char* data_;
+  size_t size_;
+};
+
+// An entry in the section table of format version 2 and 3
+struct LdMatrixSection {
+  uint64_t offset;     // from the beginning of the file, multiple of LD_MATRIX_SECTION_ALIGNMENT
+  uint64_t numel;
+  uint64_t elem_size;  // sizeof(T), validated on load
+};
+
+void generate_ld_matrix_from_bed_file(std::string bfile, float r2_min, float ldscore_r2min, int ld_window, float ld_window_kb, std::string outfile, LdEngine ld_engine, int block_size) {
   std::stringstream ss;
-  ss << "generate_ld_matrix_from_bed_file(bfile=" << bfile << ", r2_min=" << r2_min << ", ldscore_r2min=" << ldscore_r2min << ", ld_window=" << ld_window << ", ld_window_kb=" << ld_window_kb << ")";
+  ss << "generate_ld_matrix_from_bed_file(bfile=" << bfile << ", r2_min=" << r2_min << ", ldscore_r2min=" << ldscore_r2min << ", ld_window=" << ld_window << ", ld_window_kb=" << ld_window_kb << ", ld_engine=" << ((ld_engine == kLdEngineTiled) ? "tiled" : "pairwise") << ", block_size=" << block_size << ")";
   LOG << ">" << ss.str() << ";";
+  LOG << " LD kernel: " << ld_kernel_str(ld_kernel());
+  if (block_size <= 0) BGMG_THROW_EXCEPTION(::std::runtime_error("block_size must be positive"));
   SimpleTimer timer(-1);
 
   FamFile fam_file(bfile + ".fam");
@@ -49,21 +126,27 @@ void generate_ld_matrix_from_bed_file(std::string bfile, float r2_min, float lds
     if ((ld_window > 0) && (i > 0) && (snp_dist[i] < snp_dist[i-1])) BGMG_THROW_EXCEPTION(::std::runtime_error("bfile must be sorted on CHR:BP"));
   }
 
-  const int block_size = std::min(8*1024, num_snps);  // handle blocks of up to 8K SNPs
-  const int block_elems = block_size * block_size;
+  block_size = std::min(block_size, num_snps);
   const int num_blocks = (num_snps + (block_size-1)) / block_size;
+  const int tile_size = 64;  // tiled engine: tile_size x tile_size SNP pairs per task, so that the bit planes of both tiles stay in cache
+  const int64_t pairs_per_task = 8*1024;  // pairwise engine: number of SNP pairs per task
 
   PosixFile bedfile(bfile + ".bed", "rb");
 
-  LdMatrixCsrChunk ld_matrix_csr_chunk;
-  ld_matrix_csr_chunk.key_index_from_inclusive_ = 0;
-  ld_matrix_csr_chunk.key_index_to_exclusive_ = num_snps;
-  ld_matrix_csr_chunk.chr_label_ = 0;
+  // The LD file keeps each pair (i, j) only once, in the row of i < j; therefore the rows of a fixed block are final as soon as
+  // the block is processed against all var blocks, and they are written out right away. Memory is bounded by the LD of one block, not of the whole panel.
+  LdMatrixFileWriter writer(outfile, 0, num_snps);
 
   std::valarray<float> ld_r2_sum(0.0, num_snps);
   std::valarray<float> ld_r2_sum_adjust_for_hvec(0.0, num_snps);
   std::vector<float> freqvec(num_snps, 0.0);
 
+  // per-thread accumulators of tail LD scores for the two blocks being processed (fixed block, then var block);
+  // after each block pair they are summed across threads into ld_r2_sum, each element by one thread, without a lock
+  const int thread_acc_size = 2 * block_size;
+  std::vector<float> thread_ld_r2_sum(omp_get_max_threads() * thread_acc_size);
+  std::vector<float> thread_ld_r2_sum_adjust_for_hvec(omp_get_max_threads() * thread_acc_size);
+
   PlinkLdBedFileChunk chunk_fixed, chunk_var, *chunk_var_ptr;
   for (int block_idx = 0; block_idx < num_blocks; block_idx++) {
     const int block_istart = block_idx * block_size;
@@ -73,6 +156,12 @@ void generate_ld_matrix_from_bed_file(std::string bfile, float r2_min, float lds
 
     if (0 != chunk_fixed.init(num_subj, block_istart, block_isize, bedfile.handle()))
       BGMG_THROW_EXCEPTION(::std::runtime_error("error while reading .bed file"));
+    if (ld_engine == kLdEngineTiled) chunk_fixed.init_bit_planes();
+
+    LdMatrixCsrChunk ld_matrix_csr_chunk;  // rows of the fixed block
+    ld_matrix_csr_chunk.key_index_from_inclusive_ = block_istart;
+    ld_matrix_csr_chunk.key_index_to_exclusive_ = block_iend;
+    ld_matrix_csr_chunk.chr_label_ = 0;
 
     // save allele frequencies
     for (int block_snp_index = 0; block_snp_index < block_isize; block_snp_index++)
@@ -113,12 +202,44 @@ void generate_ld_matrix_from_bed_file(std::string bfile, float r2_min, float lds
       } else {
         if (0 != chunk_var.init(num_subj, block_jstart, block_jsize, bedfile.handle()))
           BGMG_THROW_EXCEPTION(::std::runtime_error("error while reading .bed file"));
+        if (ld_engine == kLdEngineTiled) chunk_var.init_bit_planes();
         chunk_var_ptr = &chunk_var;
       }
 
+      // Pairs to compute: for each SNP of the fixed block, a range [pair_jbegin, pair_jend) of SNPs in the var block,
+      // found by a binary search on bp_dist and snp_dist. Only these ranges are dispatched to threads,
+      // split into tasks of equal number of pairs (pairwise engine) or covered by tiles (tiled engine).
+      std::vector<int> pair_jbegin(block_isize), pair_jend(block_isize);
+      std::vector<int64_t> pair_offset(block_isize + 1, 0);
+      for (int block_snp_index = 0; block_snp_index < block_isize; block_snp_index++) {
+        const int global_snp_index = block_snp_index + block_istart;
+        const int global_jbegin = std::max(global_snp_index + 1, block_jstart);
+        int global_jend = block_jend;
+        if (ld_window_bp > 0) global_jend = std::min(global_jend, (int)(std::upper_bound(bp_dist.begin() + block_jstart, bp_dist.begin() + block_jend, bp_dist[global_snp_index] + ld_window_bp) - bp_dist.begin()));
+        if (ld_window > 0) global_jend = std::min(global_jend, (int)(std::upper_bound(snp_dist.begin() + block_jstart, snp_dist.begin() + block_jend, snp_dist[global_snp_index] + ld_window) - snp_dist.begin()));
+        pair_jbegin[block_snp_index] = global_jbegin - block_jstart;
+        pair_jend[block_snp_index] = std::max(global_jbegin, global_jend) - block_jstart;
+        pair_offset[block_snp_index + 1] = pair_offset[block_snp_index] + (pair_jend[block_snp_index] - pair_jbegin[block_snp_index]);
+      }
+      const int64_t num_pairs = pair_offset[block_isize];
+
+      // tiled engine: for each tile of fixed SNPs, cover the union of their ranges (pair_jbegin and pair_jend are non-decreasing)
+      std::vector<std::pair<int, int>> tiles;  // tile_istart, tile_jstart
+      if (ld_engine == kLdEngineTiled) {
+        for (int tile_istart = 0; tile_istart < block_isize; tile_istart += tile_size) {
+          const int tile_ilast = std::min(tile_istart + tile_size, block_isize) - 1;
+          for (int tile_jstart = pair_jbegin[tile_istart]; tile_jstart < pair_jend[tile_ilast]; tile_jstart += tile_size)
+            tiles.push_back(std::make_pair(tile_istart, tile_jstart));
+        }
+      }
+
       const size_t size_before = ld_matrix_csr_chunk.coo_ld_.size();
       size_t count_below_r2min = 0;
 
+      // position of the j-th SNP of the var block in the accumulators; a diagonal block pair has a single block
+      const int acc_jstart = (block_jdx == block_idx) ? 0 : block_isize;
+      const int acc_size = acc_jstart + block_jsize;
+
       // There are many alternatives of collecting tail LD scores:
       // - collecting raw r2, versus r2 adjusted for heterozygosity
       // - collecting withing a range r2min < r2 < r2max;
@@ -129,70 +250,109 @@ void generate_ld_matrix_from_bed_file(std::string bfile, float r2_min, float lds
       // without correcting for the bias or filtering based on p-value.
 #pragma omp parallel
       {
-        std::vector<std::tuple<int, int, packed_r_value>> local_coo_ld; // snp, tag, r2
-        std::valarray<float> local_ld_r2_sum(0.0, num_snps);
-        std::valarray<float> local_ld_r2_sum_adjust_for_hvec(0.0, num_snps);
+        LdMatrixCoo local_coo_ld; // snp, tag, r
+        float* local_ld_r2_sum = &thread_ld_r2_sum[omp_get_thread_num() * thread_acc_size];
+        float* local_ld_r2_sum_adjust_for_hvec = &thread_ld_r2_sum_adjust_for_hvec[omp_get_thread_num() * thread_acc_size];
+        std::fill(local_ld_r2_sum, local_ld_r2_sum + acc_size, 0.0f);
+        std::fill(local_ld_r2_sum_adjust_for_hvec, local_ld_r2_sum_adjust_for_hvec + acc_size, 0.0f);
         size_t local_count_below_r2min = 0;
 
-#pragma omp for schedule(dynamic, block_size)
-        for (int k = 0; k < block_elems; k++) {
-          int block_snp_index = k / block_size;
-          int block_snp_jndex = k % block_size;
-          int global_snp_index = block_snp_index + block_istart;
-          int global_snp_jndex = block_snp_jndex + block_jstart;
-          if (global_snp_jndex <= global_snp_index || global_snp_jndex >= num_snps) continue;
-
-          const int64_t bp_elem_dist = bp_dist[global_snp_jndex] - bp_dist[global_snp_index];
-          if ((ld_window_bp > 0) && (bp_elem_dist > ld_window_bp)) continue;
-          const int64_t snp_elem_dist = snp_dist[global_snp_jndex] - snp_dist[global_snp_index];
-          if ((ld_window > 0) && (snp_elem_dist > ld_window)) continue;
-
-          float ld_corr = (float)PlinkLdBedFileChunk::calculate_ld_corr(chunk_fixed, *chunk_var_ptr, block_snp_index, block_snp_jndex);
+        auto process_pair = [&](int global_snp_index, int global_snp_jndex, int block_snp_index, int block_snp_jndex, double corr) {
+          float ld_corr = (float)corr;
           float ld_r2 = ld_corr * ld_corr;
 
           if ((ldscore_r2min <= ld_r2) && (ld_r2 < r2_min)) {
             const float hval_at_index = chunk_fixed.hetval(block_snp_index);
             const float hval_at_jndex = chunk_var_ptr->hetval(block_snp_jndex);
-            local_ld_r2_sum[global_snp_index] += ld_r2;  // note that i-th SNP is adjusted for het of j-th SNP
-            local_ld_r2_sum[global_snp_jndex] += ld_r2;  // and vice versa.
-            local_ld_r2_sum_adjust_for_hvec[global_snp_index] += ld_r2 * hval_at_jndex;
-            local_ld_r2_sum_adjust_for_hvec[global_snp_jndex] += ld_r2 * hval_at_index;
+            local_ld_r2_sum[block_snp_index] += ld_r2;  // note that i-th SNP is adjusted for het of j-th SNP
+            local_ld_r2_sum[acc_jstart + block_snp_jndex] += ld_r2;  // and vice versa.
+            local_ld_r2_sum_adjust_for_hvec[block_snp_index] += ld_r2 * hval_at_jndex;
+            local_ld_r2_sum_adjust_for_hvec[acc_jstart + block_snp_jndex] += ld_r2 * hval_at_index;
             local_count_below_r2min++;
           }
           if (ld_r2 >= r2_min) {
             local_coo_ld.push_back(std::make_tuple(global_snp_index, global_snp_jndex, ld_corr));
           }
+        };
+
+        if (ld_engine == kLdEngineTiled) {
+          std::vector<double> tile_corr(tile_size * tile_size);
+#pragma omp for schedule(dynamic, 1)
+          for (int tile_index = 0; tile_index < (int)tiles.size(); tile_index++) {
+            const int tile_istart = tiles[tile_index].first;
+            const int tile_isize = std::min(tile_size, block_isize - tile_istart);
+            const int tile_jstart = tiles[tile_index].second;
+            const int tile_jsize = std::min(tile_size, pair_jend[tile_istart + tile_isize - 1] - tile_jstart);
+
+            PlinkLdBedFileChunk::calculate_ld_corr_tile(chunk_fixed, *chunk_var_ptr, tile_istart, tile_isize, tile_jstart, tile_jsize, &tile_corr[0]);
+            for (int i = 0; i < tile_isize; i++) {
+              const int block_snp_index = tile_istart + i;
+              const int jbegin = std::max(pair_jbegin[block_snp_index], tile_jstart);
+              const int jend = std::min(pair_jend[block_snp_index], tile_jstart + tile_jsize);
+              for (int block_snp_jndex = jbegin; block_snp_jndex < jend; block_snp_jndex++) {
+                process_pair(block_snp_index + block_istart, block_snp_jndex + block_jstart, block_snp_index, block_snp_jndex,
+                             tile_corr[i * tile_jsize + (block_snp_jndex - tile_jstart)]);
+              }
+            }
+          }
+        } else {
+          const int64_t num_tasks = (num_pairs + pairs_per_task - 1) / pairs_per_task;
+#pragma omp for schedule(dynamic, 1)
+          for (int64_t task = 0; task < num_tasks; task++) {
+            const int64_t pair_begin = task * pairs_per_task;
+            const int64_t pair_end = std::min(num_pairs, pair_begin + pairs_per_task);
+            int block_snp_index = (int)(std::upper_bound(pair_offset.begin(), pair_offset.end(), pair_begin) - pair_offset.begin()) - 1;
+            for (int64_t pair = pair_begin; pair < pair_end; pair++) {
+              while (pair >= pair_offset[block_snp_index + 1]) block_snp_index++;
+              const int block_snp_jndex = pair_jbegin[block_snp_index] + (int)(pair - pair_offset[block_snp_index]);
+              process_pair(block_snp_index + block_istart, block_snp_jndex + block_jstart, block_snp_index, block_snp_jndex,
+                           PlinkLdBedFileChunk::calculate_ld_corr(chunk_fixed, *chunk_var_ptr, block_snp_index, block_snp_jndex));
+            }
+          }
         }
 #pragma omp critical 
         {
-          ld_r2_sum += local_ld_r2_sum;
-          ld_r2_sum_adjust_for_hvec += local_ld_r2_sum_adjust_for_hvec;
-          ld_matrix_csr_chunk.coo_ld_.insert( ld_matrix_csr_chunk.coo_ld_.end(), local_coo_ld.begin(), local_coo_ld.end() );
+          ld_matrix_csr_chunk.coo_ld_.append(std::move(local_coo_ld));
           count_below_r2min += local_count_below_r2min;
         }
+
+        // the loops above end with a barrier, hence all accumulators are complete
+        const int num_threads = omp_get_num_threads();
+#pragma omp for schedule(static)
+        for (int acc_index = 0; acc_index < acc_size; acc_index++) {
+          float sum = 0.0f, sum_adjust_for_hvec = 0.0f;
+          for (int thread_num = 0; thread_num < num_threads; thread_num++) {
+            sum += thread_ld_r2_sum[thread_num * thread_acc_size + acc_index];
+            sum_adjust_for_hvec += thread_ld_r2_sum_adjust_for_hvec[thread_num * thread_acc_size + acc_index];
+          }
+          const int global_snp_index = (acc_index < acc_jstart) ? (block_istart + acc_index) : (block_jstart + acc_index - acc_jstart);
+          ld_r2_sum[global_snp_index] += sum;
+          ld_r2_sum_adjust_for_hvec[global_snp_index] += sum_adjust_for_hvec;
+        }
       }
 
       const size_t size_after = ld_matrix_csr_chunk.coo_ld_.size();
       LOG << " processed  block " << (block_idx+1) << "x" << (block_jdx+1) << " of " << num_blocks << "x" << num_blocks << ", " << (size_after - size_before) << " new r2 elements found, and further " << count_below_r2min << " r2 elements contribute to ld scores"  << ", elapsed time " << timer2.elapsed_ms() << "ms";;
     }
+
+    ld_matrix_csr_chunk.set_ld_r2_csr();
+    writer.append_rows(ld_matrix_csr_chunk);
   }
 
-  ld_matrix_csr_chunk.set_ld_r2_csr(); 
   std::vector<float> ld_r2_sum_adjust_for_hvec_vec, ld_r2_sum_vec;
   ld_r2_sum_vec.assign(std::begin(ld_r2_sum), std::end(ld_r2_sum));
   ld_r2_sum_adjust_for_hvec_vec.assign(std::begin(ld_r2_sum_adjust_for_hvec), std::end(ld_r2_sum_adjust_for_hvec));
 
-  save_ld_matrix(ld_matrix_csr_chunk, freqvec, ld_r2_sum_vec, ld_r2_sum_adjust_for_hvec_vec, outfile);
+  writer.finish(freqvec, ld_r2_sum_vec, ld_r2_sum_adjust_for_hvec_vec);
 
-  LOG << ">" << ss.str() << ", nnz=" << ld_matrix_csr_chunk.csr_ld_r_.size() << ", elapsed time " << timer.elapsed_ms() << "ms";
+  LOG << ">" << ss.str() << ", nnz=" << writer.num_ld_r() << ", elapsed time " << timer.elapsed_ms() << "ms";
 }
 
 // reader must know the type
 template<typename T>
-void save_vector(std::ofstream& os, const std::vector<T>& vec) {
-  size_t numel = vec.size();
+void save_vector(std::ofstream& os, const T* data, size_t numel) {
   os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
-  os.write(reinterpret_cast<const char*>(&vec[0]), numel * sizeof(T));
+  os.write(reinterpret_cast<const char*>(data), numel * sizeof(T));
 }
 
 template<typename T>
@@ -200,8 +360,8 @@ void save_value(std::ofstream& os, T value) {
   os.write(reinterpret_cast<const char*>(&value), sizeof(T));
 }
 
-template<typename T>
-void load_vector(std::ifstream& is, std::vector<T>* vec) {
+template<typename T, typename A>
+void load_vector(std::ifstream& is, std::vector<T, A>* vec) {
   size_t numel;
   is.read(reinterpret_cast<char*>(&numel), sizeof(size_t));
   vec->resize(numel);
@@ -213,11 +373,233 @@ void load_value(std::ifstream& is, T* value) {
   is.read(reinterpret_cast<char*>(value), sizeof(T));
 }
 
+template<typename T>
+LdMatrixSection make_section(uint64_t* offset, size_t numel) {
+  LdMatrixSection section;
+  section.offset = LD_MATRIX_SECTION_ALIGNMENT * ((*offset + LD_MATRIX_SECTION_ALIGNMENT - 1) / LD_MATRIX_SECTION_ALIGNMENT);
+  section.numel = numel;
+  section.elem_size = sizeof(T);
+  *offset = section.offset + numel * sizeof(T);
+  return section;
+}
+
+template<typename T>
+void save_section(std::ofstream& os, const LdMatrixSection& section, const T* data) {
+  const std::streamoff pos = os.tellp();
+  if (pos > section.offset) BGMG_THROW_EXCEPTION(::std::runtime_error("internal error, save_section: unexpected file position"));
+  if (section.numel == 0) return;  // no padding after the last non-empty section
+  const std::vector<char> padding(section.offset - pos, 0);
+  if (!padding.empty()) os.write(&padding[0], padding.size());
+  os.write(reinterpret_cast<const char*>(data), section.numel * sizeof(T));
+}
+
+template<typename T>
+const T* find_section(const MemoryMappedFile& file, const LdMatrixSection& section) {
+  if ((section.elem_size == sizeof(T)) && (section.numel == 0)) return reinterpret_cast<const T*>(file.data());  // empty sections at the end of the file may point past its end (see save_section)
+  if ((section.elem_size != sizeof(T)) ||
+      (section.offset % LD_MATRIX_SECTION_ALIGNMENT != 0) ||
+      (section.offset > file.size()) ||
+      (section.numel > (file.size() - section.offset) / sizeof(T)))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: invalid section table"));
+  return reinterpret_cast<const T*>(file.data() + section.offset);
+}
+
+template<typename T>
+void map_section(const std::shared_ptr<MemoryMappedFile>& file, const LdMatrixSection& section, MappableVector<T>* vec) {
+  vec->assign_mapped(find_section<T>(*file, section), section.numel, file);
+}
+
+template<typename T>
+void copy_section(const MemoryMappedFile& file, const LdMatrixSection& section, std::vector<T>* vec) {
+  const T* data = find_section<T>(file, section);
+  vec->assign(data, data + section.numel);
+}
+
+template<typename T>
+void copy_section(const MemoryMappedFile& file, const LdMatrixSection& section, LdBlockOffsets<T>* vec) {
+  vec->assign(find_section<T>(file, section), section.numel);
+}
+
+template<typename T>
+uLong update_checksum(uLong crc, const T* data, size_t numel) {
+  const Bytef* ptr = reinterpret_cast<const Bytef*>(data);
+  size_t bytes = numel * sizeof(T);
+  while (bytes > 0) {  // crc32 takes uInt length
+    const uInt len = static_cast<uInt>(std::min<size_t>(bytes, 1 << 30));
+    crc = crc32(crc, ptr, len);
+    ptr += len; bytes -= len;
+  }
+  return crc;
+}
+
+enum LdMatrixSectionId {
+  kSectionKeyIndex, kSectionValIndexOffset, kSectionValIndexPacked, kSectionR,
+  kSectionFreqvec, kSectionLdR2Sum, kSectionLdR2SumAdjustForHvec,
+  kSectionValIndexCodec,  // sections starting from this one are absent in files written before format version 4
+  kSectionRBlockOffset, kSectionRCompressed,
+  kNumSections
+};
+const uint64_t kNumSectionsVersion2 = kSectionValIndexCodec;
+
+// r values can be stored compressed, in blocks of LD_MATRIX_R_BLOCK_SIZE values. Within each block the bytes are shuffled
+// (low bytes of all values, then high bytes), because high bytes are much more predictable than low bytes, and then compressed with zlib.
+// Compressed r values must be decompressed on load, i.e. they can not be memory-mapped; this trades load time from local disk for smaller files.
+#define LD_MATRIX_R_BLOCK_SIZE (1 << 16)
+
+struct LdMatrixCompressedR {
+  std::vector<uint64_t> block_offset;  // num_blocks + 1 offsets into data; empty if r values are stored as is
+  std::vector<unsigned char> data;
+};
+
+void compress_ld_r(const MappableVector<packed_r_value>& r, LdMatrixCompressedR* compressed) {
+  const int64_t numel = r.size();
+  const int num_blocks = (numel + LD_MATRIX_R_BLOCK_SIZE - 1) / LD_MATRIX_R_BLOCK_SIZE;
+  std::vector<std::vector<unsigned char>> blocks(num_blocks);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int block_index = 0; block_index < num_blocks; block_index++) {
+    const int64_t from = (int64_t)block_index * LD_MATRIX_R_BLOCK_SIZE;
+    const int64_t size = std::min<int64_t>(LD_MATRIX_R_BLOCK_SIZE, numel - from);
+    std::vector<unsigned char> shuffled(2 * size);
+    for (int64_t i = 0; i < size; i++) {
+      const uint16_t value = r[from + i].raw_value();
+      shuffled[i] = static_cast<unsigned char>(value & 0xFF);
+      shuffled[size + i] = static_cast<unsigned char>(value >> 8);
+    }
+    uLongf compressed_size = compressBound(shuffled.size());
+    blocks[block_index].resize(compressed_size);
+    if (compress2(&blocks[block_index][0], &compressed_size, &shuffled[0], shuffled.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+      BGMG_THROW_EXCEPTION(::std::runtime_error("compress_ld_r: zlib compress2 failed"));
+    blocks[block_index].resize(compressed_size);
+  }
+
+  compressed->block_offset.assign(1, 0);
+  compressed->data.clear();
+  for (auto& block : blocks) {
+    compressed->data.insert(compressed->data.end(), block.begin(), block.end());
+    compressed->block_offset.push_back(compressed->data.size());
+  }
+}
+
+void decompress_ld_r(const uint64_t* block_offset, int64_t num_blocks, const unsigned char* data, uint64_t data_size, int64_t numel, HugePageVector<packed_r_value>* r) {
+  if ((num_blocks != (numel + LD_MATRIX_R_BLOCK_SIZE - 1) / LD_MATRIX_R_BLOCK_SIZE) || (block_offset[0] != 0))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: unexpected number of compressed r blocks"));
+  for (int64_t block_index = 0; block_index < num_blocks; block_index++)
+    if (block_offset[block_index] > block_offset[block_index + 1]) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: invalid compressed r blocks"));
+  if (block_offset[num_blocks] > data_size) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: compressed r blocks exceed their section"));
+
+  r->resize(numel);
+  bool failed = false;
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t block_index = 0; block_index < num_blocks; block_index++) {
+    const int64_t from = block_index * LD_MATRIX_R_BLOCK_SIZE;
+    const int64_t size = std::min<int64_t>(LD_MATRIX_R_BLOCK_SIZE, numel - from);
+    std::vector<unsigned char> shuffled(2 * size);
+    uLongf shuffled_size = shuffled.size();
+    if ((uncompress(&shuffled[0], &shuffled_size, data + block_offset[block_index], block_offset[block_index + 1] - block_offset[block_index]) != Z_OK) || (shuffled_size != shuffled.size())) {
+#pragma omp atomic write
+      failed = true;
+      continue;
+    }
+    uint16_t* values = reinterpret_cast<uint16_t*>(&r->at(from));
+    for (int64_t i = 0; i < size; i++) values[i] = static_cast<uint16_t>(shuffled[i]) | (static_cast<uint16_t>(shuffled[size + i]) << 8);
+  }
+  if (failed) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: can't decompress r values"));
+}
+
+// Allocates sections for one chunk, starting at *offset
+std::vector<LdMatrixSection> make_sections(uint64_t* offset,
+                                           const LdMatrixCsrChunk& chunk,
+                                           const LdMatrixCompressedR& compressed_r,
+                                           const std::vector<float>& freqvec,
+                                           const std::vector<float>& ld_r2_sum,
+                                           const std::vector<float>& ld_r2_sum_adjust_for_hvec) {
+  const bool is_compressed = !compressed_r.block_offset.empty();
+  std::vector<LdMatrixSection> sections(kNumSections);
+  sections[kSectionKeyIndex] = make_section<int64_t>(offset, chunk.csr_ld_key_index_.size());
+  sections[kSectionValIndexOffset] = make_section<uint64_t>(offset, chunk.csr_ld_val_index_offset_.size());
+  sections[kSectionValIndexPacked] = make_section<unsigned char>(offset, chunk.csr_ld_val_index_packed_.size());
+  sections[kSectionR] = make_section<packed_r_value>(offset, is_compressed ? 0 : chunk.csr_ld_r_.size());
+  sections[kSectionFreqvec] = make_section<float>(offset, freqvec.size());
+  sections[kSectionLdR2Sum] = make_section<float>(offset, ld_r2_sum.size());
+  sections[kSectionLdR2SumAdjustForHvec] = make_section<float>(offset, ld_r2_sum_adjust_for_hvec.size());
+  sections[kSectionValIndexCodec] = make_section<uint8_t>(offset, chunk.csr_ld_val_index_codec_.size());
+  sections[kSectionRBlockOffset] = make_section<uint64_t>(offset, compressed_r.block_offset.size());
+  sections[kSectionRCompressed] = make_section<unsigned char>(offset, compressed_r.data.size());
+  return sections;
+}
+
+void save_sections(std::ofstream& os,
+                   const std::vector<LdMatrixSection>& sections,
+                   const LdMatrixCsrChunk& chunk,
+                   const LdMatrixCompressedR& compressed_r,
+                   const std::vector<float>& freqvec,
+                   const std::vector<float>& ld_r2_sum,
+                   const std::vector<float>& ld_r2_sum_adjust_for_hvec) {
+  save_section(os, sections[kSectionKeyIndex], chunk.csr_ld_key_index_.to_vector().data());
+  save_section(os, sections[kSectionValIndexOffset], chunk.csr_ld_val_index_offset_.to_vector().data());
+  save_section(os, sections[kSectionValIndexPacked], chunk.csr_ld_val_index_packed_.data());
+  save_section(os, sections[kSectionR], chunk.csr_ld_r_.data());
+  save_section(os, sections[kSectionFreqvec], freqvec.data());
+  save_section(os, sections[kSectionLdR2Sum], ld_r2_sum.data());
+  save_section(os, sections[kSectionLdR2SumAdjustForHvec], ld_r2_sum_adjust_for_hvec.data());
+  save_section(os, sections[kSectionValIndexCodec], chunk.csr_ld_val_index_codec_.data());
+  save_section(os, sections[kSectionRBlockOffset], compressed_r.block_offset.data());
+  save_section(os, sections[kSectionRCompressed], compressed_r.data.data());
+}
+
+// CSR arrays are not copied; instead, the chunk refers to memory-mapped file, and pages are loaded by OS on first access.
+// The exceptions are the offset tables (converted to block-banded LdBlockOffsets), and compressed r values, which are decompressed into memory.
+void map_sections(const std::shared_ptr<MemoryMappedFile>& file,
+                  const std::vector<LdMatrixSection>& sections,
+                  LdMatrixCsrChunk* chunk,
+                  std::vector<float>* freqvec,
+                  std::vector<float>* ld_r2_sum,
+                  std::vector<float>* ld_r2_sum_adjust_for_hvec) {
+  copy_section(*file, sections[kSectionKeyIndex], &chunk->csr_ld_key_index_);
+  copy_section(*file, sections[kSectionValIndexOffset], &chunk->csr_ld_val_index_offset_);
+  map_section(file, sections[kSectionValIndexPacked], &chunk->csr_ld_val_index_packed_);
+  map_section(file, sections[kSectionR], &chunk->csr_ld_r_);
+  if (sections.size() > kSectionValIndexCodec) map_section(file, sections[kSectionValIndexCodec], &chunk->csr_ld_val_index_codec_);
+  else chunk->csr_ld_val_index_codec_.clear();
+  for (uint8_t codec : chunk->csr_ld_val_index_codec_)
+    if (codec >= kNumIndexCodecs) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file uses an index codec not supported by this version of bgmglib"));
+
+  if ((sections.size() > kSectionRCompressed) && (sections[kSectionRBlockOffset].numel > 0)) {
+    const int64_t numel = chunk->csr_ld_key_index_.empty() ? 0 : chunk->csr_ld_key_index_.back();
+    decompress_ld_r(find_section<uint64_t>(*file, sections[kSectionRBlockOffset]), sections[kSectionRBlockOffset].numel - 1,
+                    find_section<unsigned char>(*file, sections[kSectionRCompressed]), sections[kSectionRCompressed].numel, numel, &chunk->csr_ld_r_.mutable_vector());
+  }
+
+  copy_section(*file, sections[kSectionFreqvec], freqvec);
+  copy_section(*file, sections[kSectionLdR2Sum], ld_r2_sum);
+  copy_section(*file, sections[kSectionLdR2SumAdjustForHvec], ld_r2_sum_adjust_for_hvec);
+}
+
+// checksum is computed over the content of the chunk (i.e. uncompressed r values), not over the bytes stored in the file
+uint64_t checksum_sections(const LdMatrixCsrChunk& chunk,
+                           const std::vector<float>& freqvec,
+                           const std::vector<float>& ld_r2_sum,
+                           const std::vector<float>& ld_r2_sum_adjust_for_hvec) {
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = update_checksum(crc, chunk.csr_ld_key_index_.to_vector().data(), chunk.csr_ld_key_index_.size());
+  crc = update_checksum(crc, chunk.csr_ld_val_index_offset_.to_vector().data(), chunk.csr_ld_val_index_offset_.size());
+  crc = update_checksum(crc, chunk.csr_ld_val_index_packed_.data(), chunk.csr_ld_val_index_packed_.size());
+  crc = update_checksum(crc, chunk.csr_ld_r_.data(), chunk.csr_ld_r_.size());
+  crc = update_checksum(crc, freqvec.data(), freqvec.size());
+  crc = update_checksum(crc, ld_r2_sum.data(), ld_r2_sum.size());
+  crc = update_checksum(crc, ld_r2_sum_adjust_for_hvec.data(), ld_r2_sum_adjust_for_hvec.size());
+  crc = update_checksum(crc, chunk.csr_ld_val_index_codec_.data(), chunk.csr_ld_val_index_codec_.size());
+  return crc;
+}
+
 void save_ld_matrix(const LdMatrixCsrChunk& chunk,
                     const std::vector<float>& freqvec,
                     const std::vector<float>& ld_r2_sum,
                     const std::vector<float>& ld_r2_sum_adjust_for_hvec,
-                    std::string filename) {
+                    std::string filename,
+                    bool compress_r) {
+  if (chunk.is_quantized()) BGMG_THROW_EXCEPTION(std::runtime_error("can't save LD matrix with 8-bit r values"));
   std::ofstream os(filename, std::ofstream::binary);
   if (!os) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename)));
 
@@ -228,20 +610,246 @@ void save_ld_matrix(const LdMatrixCsrChunk& chunk,
 
   save_value(os, chunk.key_index_from_inclusive_);
   save_value(os, chunk.key_index_to_exclusive_);
-  save_vector(os, chunk.csr_ld_key_index_);
-  save_vector(os, chunk.csr_ld_val_index_offset_);
-  save_vector(os, chunk.csr_ld_val_index_packed_);
-  save_vector(os, chunk.csr_ld_r_);
 
-  save_vector(os, freqvec);
-  save_vector(os, ld_r2_sum);
-  save_vector(os, ld_r2_sum_adjust_for_hvec);
+  const uint64_t num_sections = kNumSections;
+  uint64_t offset = sizeof(size_t) + 2 * sizeof(int) + sizeof(uint64_t) + num_sections * sizeof(LdMatrixSection);
+  LdMatrixCompressedR compressed_r;
+  if (compress_r) compress_ld_r(chunk.csr_ld_r_, &compressed_r);
+  const std::vector<LdMatrixSection> sections = make_sections(&offset, chunk, compressed_r, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
 
+  save_value(os, num_sections);
+  os.write(reinterpret_cast<const char*>(&sections[0]), num_sections * sizeof(LdMatrixSection));
+  save_sections(os, sections, chunk, compressed_r, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename));
   os.close();
 
   LOG << "<save_ld_matrix(filename=" << filename << ")...";
 }
 
+// Layout of the file is the same as in save_ld_matrix, but the sections are stored in a different order (the loader only follows the section table):
+// r values first, then packed indices, then all other sections.
+LdMatrixFileWriter::LdMatrixFileWriter(std::string filename, int key_index_from_inclusive, int key_index_to_exclusive)
+    : filename_(filename), key_index_from_inclusive_(key_index_from_inclusive), key_index_to_exclusive_(key_index_to_exclusive),
+      key_index_(1, 0), val_index_offset_(1, 0), finished_(false) {
+  os_.open(filename, std::ofstream::binary);
+  if (!os_) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename)));
+  packed_os_.open(filename + ".tmp", std::ofstream::binary);
+  if (!packed_os_) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename + ".tmp")));
+
+  LOG << ">LdMatrixFileWriter(filename=" << filename << "), format version " << LD_MATRIX_FORMAT_VERSION;
+
+  // header and section table are written by finish(); until then the space is filled with zeros
+  uint64_t offset = sizeof(size_t) + 2 * sizeof(int) + sizeof(uint64_t) + kNumSections * sizeof(LdMatrixSection);
+  r_offset_ = make_section<packed_r_value>(&offset, 0).offset;
+  const std::vector<char> padding(r_offset_, 0);
+  os_.write(&padding[0], padding.size());
+}
+
+LdMatrixFileWriter::~LdMatrixFileWriter() {
+  if (packed_os_.is_open()) packed_os_.close();
+  remove((filename_ + ".tmp").c_str());
+  if (!finished_) {
+    if (os_.is_open()) os_.close();
+    remove(filename_.c_str());
+  }
+}
+
+void LdMatrixFileWriter::append_rows(const LdMatrixCsrChunk& chunk) {
+  if (finished_) BGMG_THROW_EXCEPTION(::std::runtime_error("LdMatrixFileWriter: can't append rows after finish()"));
+  if (chunk.is_quantized()) BGMG_THROW_EXCEPTION(std::runtime_error("can't save LD matrix with 8-bit r values"));
+  if ((chunk.key_index_from_inclusive_ != key_index_from_inclusive_ + (int)val_index_codec_.size()) || (chunk.key_index_to_exclusive_ > key_index_to_exclusive_))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LdMatrixFileWriter: rows must be appended in order"));
+  if (!chunk.is_finalized()) BGMG_THROW_EXCEPTION(::std::runtime_error("LdMatrixFileWriter: chunk must be finalized with set_ld_r2_csr"));
+
+  // csr_ld_val_index_offset_ is empty if the chunk has no r values (set_ld_r2_csr doesn't pack empty chunks)
+  const bool has_packed = !chunk.csr_ld_val_index_offset_.empty();
+  const int64_t ld_index_base = key_index_.back();
+  const uint64_t packed_base = val_index_offset_.back();
+  for (int key_index = chunk.key_index_from_inclusive_; key_index < chunk.key_index_to_exclusive_; key_index++) {
+    key_index_.push_back(ld_index_base + chunk.ld_index_end(key_index));
+    val_index_offset_.push_back(packed_base + (has_packed ? chunk.csr_ld_val_index_offset_[key_index - chunk.key_index_from_inclusive_ + 1] : 0));
+    val_index_codec_.push_back(chunk.csr_ld_val_index_codec(key_index));
+  }
+
+  const size_t packed_size = has_packed ? chunk.csr_ld_val_index_offset_.back() : 0;
+  if (!chunk.csr_ld_r_.empty()) os_.write(reinterpret_cast<const char*>(chunk.csr_ld_r_.data()), chunk.csr_ld_r_.size() * sizeof(packed_r_value));
+  if (packed_size > 0) packed_os_.write(reinterpret_cast<const char*>(chunk.csr_ld_val_index_packed_.data()), packed_size);
+  if (!os_ || !packed_os_) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename_));
+}
+
+void LdMatrixFileWriter::finish(const std::vector<float>& freqvec,
+                                const std::vector<float>& ld_r2_sum,
+                                const std::vector<float>& ld_r2_sum_adjust_for_hvec) {
+  if (finished_) BGMG_THROW_EXCEPTION(::std::runtime_error("LdMatrixFileWriter: can't call finish() twice"));
+  if (key_index_from_inclusive_ + (int)val_index_codec_.size() != key_index_to_exclusive_)
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LdMatrixFileWriter: not all rows were appended"));
+  packed_os_.close();
+  if (!packed_os_) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename_ + ".tmp"));
+
+  const bool all_vsimple = std::all_of(val_index_codec_.begin(), val_index_codec_.end(), [](uint8_t codec) { return codec == kIndexCodecVSimple; });
+  const LdMatrixCompressedR compressed_r;  // not supported, i.e. empty
+  std::vector<LdMatrixSection> sections(kNumSections);
+  uint64_t offset = r_offset_;
+  sections[kSectionR] = make_section<packed_r_value>(&offset, key_index_.back());
+  sections[kSectionValIndexPacked] = make_section<unsigned char>(&offset, val_index_offset_.back());
+  sections[kSectionKeyIndex] = make_section<int64_t>(&offset, key_index_.size());
+  sections[kSectionValIndexOffset] = make_section<uint64_t>(&offset, val_index_offset_.size());
+  sections[kSectionFreqvec] = make_section<float>(&offset, freqvec.size());
+  sections[kSectionLdR2Sum] = make_section<float>(&offset, ld_r2_sum.size());
+  sections[kSectionLdR2SumAdjustForHvec] = make_section<float>(&offset, ld_r2_sum_adjust_for_hvec.size());
+  sections[kSectionValIndexCodec] = make_section<uint8_t>(&offset, all_vsimple ? 0 : val_index_codec_.size());
+  sections[kSectionRBlockOffset] = make_section<uint64_t>(&offset, compressed_r.block_offset.size());
+  sections[kSectionRCompressed] = make_section<unsigned char>(&offset, compressed_r.data.size());
+
+  // copy packed indices from the temporary file
+  {
+    const std::vector<char> padding(sections[kSectionValIndexPacked].offset - (uint64_t)os_.tellp(), 0);
+    if (!padding.empty()) os_.write(&padding[0], padding.size());
+    std::ifstream is(filename_ + ".tmp", std::ifstream::binary);
+    std::vector<char> buffer(1 << 20);
+    uint64_t remaining = sections[kSectionValIndexPacked].numel;
+    while ((remaining > 0) && is) {
+      const std::streamsize count = std::min<uint64_t>(remaining, buffer.size());
+      is.read(&buffer[0], count);
+      os_.write(&buffer[0], is.gcount());
+      remaining -= is.gcount();
+    }
+    if (remaining > 0) BGMG_THROW_EXCEPTION(::std::runtime_error("can't read from " + filename_ + ".tmp"));
+  }
+
+  save_section(os_, sections[kSectionKeyIndex], key_index_.data());
+  save_section(os_, sections[kSectionValIndexOffset], val_index_offset_.data());
+  save_section(os_, sections[kSectionFreqvec], freqvec.data());
+  save_section(os_, sections[kSectionLdR2Sum], ld_r2_sum.data());
+  save_section(os_, sections[kSectionLdR2SumAdjustForHvec], ld_r2_sum_adjust_for_hvec.data());
+  save_section(os_, sections[kSectionValIndexCodec], val_index_codec_.data());
+
+  os_.seekp(0);
+  size_t format_version = LD_MATRIX_FORMAT_VERSION;
+  os_.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
+  save_value(os_, key_index_from_inclusive_);
+  save_value(os_, key_index_to_exclusive_);
+  const uint64_t num_sections = kNumSections;
+  save_value(os_, num_sections);
+  os_.write(reinterpret_cast<const char*>(&sections[0]), num_sections * sizeof(LdMatrixSection));
+
+  if (!os_) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename_));
+  os_.close();
+  finished_ = true;
+
+  LOG << "<LdMatrixFileWriter(filename=" << filename_ << "), nnz=" << key_index_.back();
+}
+
+// Layout of the genome LD file:
+//   size_t format_version (=3), LdMatrixGenomeHeader,
+//   for each chunk: LdMatrixGenomeChunk followed by num_sections LdMatrixSection entries,
+//   data of all sections (64-byte aligned, chunk by chunk).
+// Per-chromosome files are loaded one at a time, and kept mapped until the output is written.
+void save_ld_matrix_genome(const BimFile& reference,
+                           const std::vector<int>& chr_labels,
+                           const std::vector<std::string>& filenames,
+                           float r2min,
+                           float ldscore_r2min,
+                           std::string out_file,
+                           bool compress_r) {
+  LOG << ">save_ld_matrix_genome(out_file=" << out_file << ", " << chr_labels.size() << " chromosomes, compress_r=" << compress_r << "), format version " << LD_MATRIX_GENOME_FORMAT_VERSION;
+  SimpleTimer timer(-1);
+
+  if (chr_labels.size() != filenames.size()) BGMG_THROW_EXCEPTION(::std::runtime_error("chr_labels and filenames must have the same size"));
+  if (chr_labels.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("chr_labels must not be empty"));
+  const int num_chunks = chr_labels.size();
+
+  LdMatrixGenomeHeader header;
+  memset(&header, 0, sizeof(header));
+  header.r2min = r2min;
+  header.ldscore_r2min = ldscore_r2min;
+  header.num_chunks = num_chunks;
+  header.num_sections = kNumSections;
+
+  std::vector<LdMatrixCsrChunk> chunks(num_chunks);
+  std::vector<std::vector<float>> freqvec(num_chunks), ld_r2_sum(num_chunks), ld_r2_sum_adjust_for_hvec(num_chunks);
+  std::vector<LdMatrixCompressedR> compressed_r(num_chunks);
+  std::vector<LdMatrixGenomeChunk> entries(num_chunks);
+  std::vector<std::vector<LdMatrixSection>> sections(num_chunks);
+
+  uint64_t offset = sizeof(size_t) + sizeof(LdMatrixGenomeHeader) + num_chunks * (sizeof(LdMatrixGenomeChunk) + kNumSections * sizeof(LdMatrixSection));
+  uint64_t reference_hash = 14695981039346656037ULL;
+  for (int i = 0; i < num_chunks; i++) {
+    const int chr_label = chr_labels[i];
+    if (std::find(chr_labels.begin(), chr_labels.begin() + i, chr_label) != chr_labels.begin() + i)
+      BGMG_THROW_EXCEPTION(::std::runtime_error("chr_labels must not contain duplicates"));
+
+    load_ld_matrix(filenames[i], &chunks[i], &freqvec[i], &ld_r2_sum[i], &ld_r2_sum_adjust_for_hvec[i]);
+    const int num_snp_in_chr = std::count(reference.chr_label().begin(), reference.chr_label().end(), chr_label);
+    const int num_keys = chunks[i].key_index_to_exclusive_ - chunks[i].key_index_from_inclusive_;
+    if (num_keys != num_snp_in_chr) {
+      std::stringstream ss;
+      ss << filenames[i] << " has " << num_keys << " variants, while reference has " << num_snp_in_chr << " variants on chromosome " << chr_label;
+      BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+    }
+
+    LdMatrixGenomeChunk& entry = entries[i];
+    memset(&entry, 0, sizeof(entry));
+    entry.chr_label = chr_label;
+    entry.key_index_from_inclusive = chunks[i].key_index_from_inclusive_;
+    entry.key_index_to_exclusive = chunks[i].key_index_to_exclusive_;
+    entry.reference_hash = reference.reference_hash(chr_label);
+    entry.checksum = checksum_sections(chunks[i], freqvec[i], ld_r2_sum[i], ld_r2_sum_adjust_for_hvec[i]);
+    if (compress_r) compress_ld_r(chunks[i].csr_ld_r_, &compressed_r[i]);
+    sections[i] = make_sections(&offset, chunks[i], compressed_r[i], freqvec[i], ld_r2_sum[i], ld_r2_sum_adjust_for_hvec[i]);
+
+    header.num_snp += num_snp_in_chr;
+    for (int byte = 0; byte < sizeof(uint64_t); byte++) {
+      reference_hash ^= (entry.reference_hash >> (8 * byte)) & 0xFF;
+      reference_hash *= 1099511628211ULL;
+    }
+  }
+  header.reference_hash = reference_hash;
+
+  std::ofstream os(out_file, std::ofstream::binary);
+  if (!os) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + out_file)));
+
+  size_t format_version = LD_MATRIX_GENOME_FORMAT_VERSION;
+  os.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int i = 0; i < num_chunks; i++) {
+    os.write(reinterpret_cast<const char*>(&entries[i]), sizeof(LdMatrixGenomeChunk));
+    os.write(reinterpret_cast<const char*>(&sections[i][0]), kNumSections * sizeof(LdMatrixSection));
+  }
+  for (int i = 0; i < num_chunks; i++)
+    save_sections(os, sections[i], chunks[i], compressed_r[i], freqvec[i], ld_r2_sum[i], ld_r2_sum_adjust_for_hvec[i]);
+
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + out_file));
+  os.close();
+
+  LOG << "<save_ld_matrix_genome(out_file=" << out_file << "), num_snp=" << header.num_snp << ", reference_hash=" << std::hex << header.reference_hash << std::dec << ", elapsed time " << timer.elapsed_ms() << "ms";
+}
+
+void merge_ld_matrix_files(std::string bim_file,
+                           std::string chr_labels,
+                           std::string ld_file_template,
+                           float r2min,
+                           float ldscore_r2min,
+                           std::string out_file,
+                           bool compress_r) {
+  std::vector<std::string> chr_labels_vector, bim_files, ld_files;
+  std::vector<int> chr_label_values;
+  split_chr_labels(chr_labels, &chr_labels_vector);
+  for (auto chrlabel : chr_labels_vector) {
+    chr_label_values.push_back(std::stoi(chrlabel));
+    ld_files.push_back(ld_file_template);
+    boost::replace_all(ld_files.back(), "@", chrlabel);
+    if (bim_files.empty() || (bim_file.find("@") != std::string::npos)) {
+      bim_files.push_back(bim_file);
+      boost::replace_all(bim_files.back(), "@", chrlabel);
+    }
+  }
+
+  BimFile reference(bim_files);
+  save_ld_matrix_genome(reference, chr_label_values, ld_files, r2min, ldscore_r2min, out_file, compress_r);
+}
+
 // load LD matrix from an old format
 void load_ld_matrix_version0(std::string filename,
                              std::vector<int>* snp_index,
@@ -271,26 +879,24 @@ void load_ld_matrix_version0(std::string filename,
   LOG << "<load_ld_matrix_version0(filename=" << filename << ")";
 }
 
-void load_ld_matrix(std::string filename,
-                    LdMatrixCsrChunk* chunk,
-                    std::vector<float>* freqvec,
-                    std::vector<float>* ld_r2_sum,
-                    std::vector<float>* ld_r2_sum_adjust_for_hvec) {
-  LOG << ">load_ld_matrix(filename=" << filename << ")";
-
+// load LD matrix saved in format version 1 (all arrays are copied into memory)
+void load_ld_matrix_version1(std::string filename,
+                             LdMatrixCsrChunk* chunk,
+                             std::vector<float>* freqvec,
+                             std::vector<float>* ld_r2_sum,
+                             std::vector<float>* ld_r2_sum_adjust_for_hvec) {
   std::ifstream is(filename, std::ifstream::binary);
   if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open" + filename));
 
   size_t format_version;
   is.read(reinterpret_cast<char*>(&format_version), sizeof(size_t));
-  if (format_version <= 0 || format_version > LD_MATRIX_FORMAT_VERSION) throw("Unable to read an old format version");
 
   load_value(is, &chunk->key_index_from_inclusive_);
   load_value(is, &chunk->key_index_to_exclusive_);
-  load_vector(is, &chunk->csr_ld_key_index_);
-  load_vector(is, &chunk->csr_ld_val_index_offset_);
-  load_vector(is, &chunk->csr_ld_val_index_packed_);
-  load_vector(is, &chunk->csr_ld_r_);
+  std::vector<int64_t> csr_ld_key_index; load_vector(is, &csr_ld_key_index); chunk->csr_ld_key_index_.assign(csr_ld_key_index);
+  std::vector<uint64_t> csr_ld_val_index_offset; load_vector(is, &csr_ld_val_index_offset); chunk->csr_ld_val_index_offset_.assign(csr_ld_val_index_offset);
+  load_vector(is, &chunk->csr_ld_val_index_packed_.mutable_vector());
+  load_vector(is, &chunk->csr_ld_r_.mutable_vector());
 
   load_vector(is, freqvec);
   load_vector(is, ld_r2_sum);
@@ -298,6 +904,540 @@ void load_ld_matrix(std::string filename,
 
   if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't read from " + filename));
   is.close();
+}
+
+// load LD matrix saved in format version 2 or 4
+void load_ld_matrix_version2(std::string filename,
+                             LdMatrixCsrChunk* chunk,
+                             std::vector<float>* freqvec,
+                             std::vector<float>* ld_r2_sum,
+                             std::vector<float>* ld_r2_sum_adjust_for_hvec) {
+  std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>(filename);
+
+  const size_t header_size = sizeof(size_t) + 2 * sizeof(int) + sizeof(uint64_t);
+  if (file->size() < header_size) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: " + filename));
+  const char* ptr = file->data() + sizeof(size_t);
+  memcpy(&chunk->key_index_from_inclusive_, ptr, sizeof(int)); ptr += sizeof(int);
+  memcpy(&chunk->key_index_to_exclusive_, ptr, sizeof(int)); ptr += sizeof(int);
+  uint64_t num_sections;
+  memcpy(&num_sections, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+  if ((num_sections < kNumSectionsVersion2) || (num_sections > (file->size() - header_size) / sizeof(LdMatrixSection)))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: " + filename));
+  std::vector<LdMatrixSection> sections(num_sections);
+  memcpy(&sections[0], ptr, num_sections * sizeof(LdMatrixSection));
+
+  map_sections(file, sections, chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+}
+
+// parse header and per-chunk tables of a genome LD file (format version 3)
+void parse_ld_matrix_genome(const MemoryMappedFile& file, std::string filename,
+                            LdMatrixGenomeHeader* header,
+                            std::vector<LdMatrixGenomeChunk>* chunks,
+                            std::vector<std::vector<LdMatrixSection>>* sections) {
+  size_t available = file.size();
+  if (available < sizeof(size_t) + sizeof(LdMatrixGenomeHeader)) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: " + filename));
+  const char* ptr = file.data() + sizeof(size_t);
+  memcpy(header, ptr, sizeof(LdMatrixGenomeHeader)); ptr += sizeof(LdMatrixGenomeHeader);
+  available -= sizeof(size_t) + sizeof(LdMatrixGenomeHeader);
+
+  const uint64_t entry_size = sizeof(LdMatrixGenomeChunk) + header->num_sections * sizeof(LdMatrixSection);
+  if ((header->num_sections < kNumSectionsVersion2) || (header->num_sections > available / sizeof(LdMatrixSection)) || (header->num_chunks > available / entry_size))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LD file is corrupted: " + filename));
+
+  chunks->resize(header->num_chunks);
+  if (sections != nullptr) sections->resize(header->num_chunks);
+  for (int i = 0; i < header->num_chunks; i++) {
+    memcpy(&chunks->at(i), ptr, sizeof(LdMatrixGenomeChunk)); ptr += sizeof(LdMatrixGenomeChunk);
+    if (sections != nullptr) {
+      sections->at(i).resize(header->num_sections);
+      memcpy(&sections->at(i)[0], ptr, header->num_sections * sizeof(LdMatrixSection));
+    }
+    ptr += header->num_sections * sizeof(LdMatrixSection);
+  }
+}
+
+// load one chromosome from genome LD file; only the sections of this chromosome are touched
+void load_ld_matrix_version3(std::string filename,
+                             int chr_label,
+                             LdMatrixCsrChunk* chunk,
+                             std::vector<float>* freqvec,
+                             std::vector<float>* ld_r2_sum,
+                             std::vector<float>* ld_r2_sum_adjust_for_hvec) {
+  std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>(filename);
+  LdMatrixGenomeHeader header;
+  std::vector<LdMatrixGenomeChunk> chunks;
+  std::vector<std::vector<LdMatrixSection>> sections;
+  parse_ld_matrix_genome(*file, filename, &header, &chunks, &sections);
+
+  int chunk_index = -1;
+  if ((chr_label < 0) && (chunks.size() == 1)) chunk_index = 0;
+  for (int i = 0; i < chunks.size(); i++) if ((chr_label >= 0) && (chunks[i].chr_label == chr_label)) chunk_index = i;
+  if (chunk_index < 0) {
+    std::stringstream ss;
+    if (chr_label < 0) ss << "chr_label must be specified to load LD matrix from " << filename << " (it contains " << chunks.size() << " chromosomes)";
+    else ss << filename << " has no LD matrix for chromosome " << chr_label;
+    BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+  }
+
+  const LdMatrixGenomeChunk& entry = chunks[chunk_index];
+  chunk->key_index_from_inclusive_ = entry.key_index_from_inclusive;
+  chunk->key_index_to_exclusive_ = entry.key_index_to_exclusive;
+  map_sections(file, sections[chunk_index], chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+
+  if (checksum_sections(*chunk, *freqvec, *ld_r2_sum, *ld_r2_sum_adjust_for_hvec) != entry.checksum) {
+    std::stringstream ss; ss << "LD file is corrupted: " << filename << " (checksum mismatch for chromosome " << entry.chr_label << ")";
+    BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+  }
+}
+
+size_t read_ld_matrix_format_version(std::string filename) {
+  size_t format_version;
+  std::ifstream is(filename, std::ifstream::binary);
+  if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open" + filename));
+  is.read(reinterpret_cast<char*>(&format_version), sizeof(size_t));
+  if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't read from " + filename));
+  return format_version;
+}
+
+bool load_ld_matrix_genome_header(std::string filename,
+                                  LdMatrixGenomeHeader* header,
+                                  std::vector<LdMatrixGenomeChunk>* chunks) {
+  if (read_ld_matrix_format_version(filename) != LD_MATRIX_GENOME_FORMAT_VERSION) return false;
+  MemoryMappedFile file(filename);
+  parse_ld_matrix_genome(file, filename, header, chunks, nullptr);
+  return true;
+}
+
+void load_ld_matrix(std::string filename,
+                    LdMatrixCsrChunk* chunk,
+                    std::vector<float>* freqvec,
+                    std::vector<float>* ld_r2_sum,
+                    std::vector<float>* ld_r2_sum_adjust_for_hvec,
+                    int chr_label) {
+  LOG << ">load_ld_matrix(filename=" << filename << ")";
+
+  const size_t format_version = read_ld_matrix_format_version(filename);
+  if (format_version <= 0 || format_version > LD_MATRIX_FORMAT_VERSION) BGMG_THROW_EXCEPTION(::std::runtime_error("Unable to read LD file " + filename + ": unsupported format version"));
+  if (format_version == 1) load_ld_matrix_version1(filename, chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+  else if (format_version == LD_MATRIX_GENOME_FORMAT_VERSION) load_ld_matrix_version3(filename, chr_label, chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+  else load_ld_matrix_version2(filename, chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
 
   LOG << "<load_ld_matrix(filename=" << filename << "), format version " << format_version;
 }
+
+// Layout of LD segment:
+//   size_t format_version (=100), uint64_t key size, key, LdMatrixSegmentHeader,
+//   for each chunk: LdMatrixSegmentChunk followed by kNumSegmentSections LdMatrixSection entries,
+//   kNumSegmentGlobalSections LdMatrixSection entries, data of all sections (64-byte aligned).
+// Chunks hold tag rows of LdMatrixCsr (chunks_reverse_) exactly as they are in memory, including 8-bit r values;
+// global sections hold mafvec and snp sums of LdSum (tag sums are derived on load).
+// Segments are written by the process that built LD matrix, and only read on the same machine, hence there is no checksum.
+struct LdMatrixSegmentHeader {
+  uint64_t num_snp;
+  uint64_t num_tag;
+  uint64_t num_chunks;
+  int r_bits;
+  int reserved;
+};
+
+struct LdMatrixSegmentChunk {
+  int chr_label;
+  int key_index_from_inclusive;
+  int key_index_to_exclusive;
+  int reserved;
+};
+
+enum LdMatrixSegmentSectionId {
+  kSegmentKeyIndex, kSegmentValIndexOffset, kSegmentValIndexPacked, kSegmentValIndexCodec,
+  kSegmentR, kSegmentR8, kSegmentR8Codebook,
+  kNumSegmentSections
+};
+
+enum LdMatrixSegmentGlobalSectionId {
+  kSegmentMafvec,
+  kSegmentLdSumR2Below, kSegmentLdSumR2Above, kSegmentLdSumR4Above,
+  kSegmentLdSumAdjustForHvecR2Below, kSegmentLdSumAdjustForHvecR2Above, kSegmentLdSumAdjustForHvecR4Above,
+  kNumSegmentGlobalSections
+};
+
+void LdMatrixCsr::save_segment(const std::string& filename, const std::string& key) {
+  LOG << ">LdMatrixCsr::save_segment(filename=" << filename << "); ";
+  SimpleTimer timer(-1);
+
+  std::ofstream os(filename, std::ofstream::binary);
+  if (!os) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename)));
+  save_segment(os, key);
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename));
+  os.close();
+  LOG << "<LdMatrixCsr::save_segment(filename=" << filename << "), elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+void LdMatrixCsr::save_segment(std::ofstream& os, const std::string& key) {
+  check_not_shared("save_segment");
+  if (!chunks_full_.empty() || compact_freed_rest_)
+    BGMG_THROW_EXCEPTION(::std::runtime_error("save_segment: LD matrix must be saved as loaded from LD files, before r2min_runtime or compact_ld_to_deftags"));
+
+  std::vector<int> chr_labels;
+  for (int chr_label = 0; chr_label < chunks_reverse_.size(); chr_label++)
+    if (chunks_reverse_[chr_label].is_finalized()) chr_labels.push_back(chr_label);
+  const int num_chunks = chr_labels.size();
+
+  LdMatrixSegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  header.num_snp = mapping_.num_snp();
+  header.num_tag = mapping_.num_tag();
+  header.num_chunks = num_chunks;
+  header.r_bits = r_bits_;
+
+  // section offsets are from the beginning of the file, which may hold other data before the segment
+  uint64_t offset = static_cast<uint64_t>(os.tellp()) + sizeof(size_t) + sizeof(uint64_t) + key.size() + sizeof(LdMatrixSegmentHeader) +
+                    num_chunks * (sizeof(LdMatrixSegmentChunk) + kNumSegmentSections * sizeof(LdMatrixSection)) + kNumSegmentGlobalSections * sizeof(LdMatrixSection);
+  std::vector<LdMatrixSegmentChunk> entries(num_chunks);
+  std::vector<std::vector<LdMatrixSection>> sections(num_chunks, std::vector<LdMatrixSection>(kNumSegmentSections));
+  for (int i = 0; i < num_chunks; i++) {
+    const LdMatrixCsrChunk& chunk = chunks_reverse_[chr_labels[i]];
+    memset(&entries[i], 0, sizeof(LdMatrixSegmentChunk));
+    entries[i].chr_label = chr_labels[i];
+    entries[i].key_index_from_inclusive = chunk.key_index_from_inclusive_;
+    entries[i].key_index_to_exclusive = chunk.key_index_to_exclusive_;
+    sections[i][kSegmentKeyIndex] = make_section<int64_t>(&offset, chunk.csr_ld_key_index_.size());
+    sections[i][kSegmentValIndexOffset] = make_section<uint64_t>(&offset, chunk.csr_ld_val_index_offset_.size());
+    sections[i][kSegmentValIndexPacked] = make_section<unsigned char>(&offset, chunk.csr_ld_val_index_packed_.size());
+    sections[i][kSegmentValIndexCodec] = make_section<uint8_t>(&offset, chunk.csr_ld_val_index_codec_.size());
+    sections[i][kSegmentR] = make_section<packed_r_value>(&offset, chunk.csr_ld_r_.size());
+    sections[i][kSegmentR8] = make_section<uint8_t>(&offset, chunk.csr_ld_r8_.size());
+    sections[i][kSegmentR8Codebook] = make_section<float>(&offset, chunk.csr_ld_r8_codebook_.size());
+  }
+
+  const std::vector<float>& mafvec = mapping_.mafvec();
+  const std::vector<std::pair<const float*, size_t>> global_data = {
+    { mafvec.data(), mafvec.size() },
+    { ld_sum_->ld_sum_r2_below_r2min().data(), ld_sum_->ld_sum_r2_below_r2min().size() },
+    { ld_sum_->ld_sum_r2_above_r2min().data(), ld_sum_->ld_sum_r2_above_r2min().size() },
+    { ld_sum_->ld_sum_r4_above_r2min().data(), ld_sum_->ld_sum_r4_above_r2min().size() },
+    { ld_sum_adjust_for_hvec_->ld_sum_r2_below_r2min().data(), ld_sum_adjust_for_hvec_->ld_sum_r2_below_r2min().size() },
+    { ld_sum_adjust_for_hvec_->ld_sum_r2_above_r2min().data(), ld_sum_adjust_for_hvec_->ld_sum_r2_above_r2min().size() },
+    { ld_sum_adjust_for_hvec_->ld_sum_r4_above_r2min().data(), ld_sum_adjust_for_hvec_->ld_sum_r4_above_r2min().size() } };
+  std::vector<LdMatrixSection> global_sections(kNumSegmentGlobalSections);
+  for (int i = 0; i < kNumSegmentGlobalSections; i++) global_sections[i] = make_section<float>(&offset, global_data[i].second);
+
+  size_t format_version = LD_MATRIX_SEGMENT_FORMAT_VERSION;
+  os.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
+  save_value(os, static_cast<uint64_t>(key.size()));
+  os.write(key.data(), key.size());
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int i = 0; i < num_chunks; i++) {
+    os.write(reinterpret_cast<const char*>(&entries[i]), sizeof(LdMatrixSegmentChunk));
+    os.write(reinterpret_cast<const char*>(&sections[i][0]), kNumSegmentSections * sizeof(LdMatrixSection));
+  }
+  os.write(reinterpret_cast<const char*>(&global_sections[0]), kNumSegmentGlobalSections * sizeof(LdMatrixSection));
+
+  for (int i = 0; i < num_chunks; i++) {
+    const LdMatrixCsrChunk& chunk = chunks_reverse_[chr_labels[i]];
+    save_section(os, sections[i][kSegmentKeyIndex], chunk.csr_ld_key_index_.to_vector().data());
+    save_section(os, sections[i][kSegmentValIndexOffset], chunk.csr_ld_val_index_offset_.to_vector().data());
+    save_section(os, sections[i][kSegmentValIndexPacked], chunk.csr_ld_val_index_packed_.data());
+    save_section(os, sections[i][kSegmentValIndexCodec], chunk.csr_ld_val_index_codec_.data());
+    save_section(os, sections[i][kSegmentR], chunk.csr_ld_r_.data());
+    save_section(os, sections[i][kSegmentR8], chunk.csr_ld_r8_.data());
+    save_section(os, sections[i][kSegmentR8Codebook], chunk.csr_ld_r8_codebook_.data());
+  }
+  for (int i = 0; i < kNumSegmentGlobalSections; i++) save_section(os, global_sections[i], global_data[i].first);
+  LOG << " LdMatrixCsr::save_segment: " << num_chunks << " chunks, " << offset << " bytes";
+}
+
+bool LdMatrixCsr::load_segment(const std::string& filename, const std::string& key, uint64_t offset) {
+  check_not_shared("load_segment");
+  std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>(filename);
+  size_t format_version = 0;
+  if (file->size() >= offset + sizeof(size_t)) memcpy(&format_version, file->data() + offset, sizeof(size_t));
+  if (format_version != LD_MATRIX_SEGMENT_FORMAT_VERSION) {
+    LOG << " LdMatrixCsr::load_segment(filename=" << filename << "): not an LD segment, or written by another version of bgmglib";
+    return false;
+  }
+
+  size_t available = file->size() - offset - sizeof(size_t);
+  const char* ptr = file->data() + offset + sizeof(size_t);
+  auto read = [&ptr, &available, &filename](void* dst, size_t bytes) {
+    if (bytes > available) BGMG_THROW_EXCEPTION(::std::runtime_error("LD segment is corrupted: " + filename));
+    memcpy(dst, ptr, bytes); ptr += bytes; available -= bytes;
+  };
+
+  uint64_t key_size;
+  read(&key_size, sizeof(uint64_t));
+  if ((key_size != key.size()) || (key_size > available) || (memcmp(ptr, key.data(), key.size()) != 0)) {
+    LOG << " LdMatrixCsr::load_segment(filename=" << filename << "): the segment was built from another LD matrix";
+    return false;
+  }
+  ptr += key_size; available -= key_size;
+
+  LdMatrixSegmentHeader header;
+  read(&header, sizeof(LdMatrixSegmentHeader));
+  if ((header.num_snp != mapping_.num_snp()) || (header.num_tag != mapping_.num_tag()) || (header.num_chunks > chunks_reverse_.size()))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("LD segment " + filename + " doesn't match snps and tags of LD matrix"));
+
+  std::vector<LdMatrixSegmentChunk> entries(header.num_chunks);
+  std::vector<std::vector<LdMatrixSection>> sections(header.num_chunks, std::vector<LdMatrixSection>(kNumSegmentSections));
+  std::vector<LdMatrixSection> global_sections(kNumSegmentGlobalSections);
+  for (int i = 0; i < header.num_chunks; i++) {
+    read(&entries[i], sizeof(LdMatrixSegmentChunk));
+    read(&sections[i][0], kNumSegmentSections * sizeof(LdMatrixSection));
+    const int chr_label = entries[i].chr_label;
+    if ((chr_label < 0) || (chr_label >= chunks_reverse_.size()) ||
+        (entries[i].key_index_from_inclusive != chunks_reverse_[chr_label].key_index_from_inclusive_) ||
+        (entries[i].key_index_to_exclusive != chunks_reverse_[chr_label].key_index_to_exclusive_))
+      BGMG_THROW_EXCEPTION(::std::runtime_error("LD segment " + filename + " doesn't match snps and tags of LD matrix"));
+  }
+  read(&global_sections[0], kNumSegmentGlobalSections * sizeof(LdMatrixSection));
+
+  invalidate_row_cache();
+  invalidate_compact_view();
+  invalidate_snp_to_tag_map();
+  for (int i = 0; i < header.num_chunks; i++) {
+    LdMatrixCsrChunk& chunk = chunks_reverse_[entries[i].chr_label];
+    chunk.clear();
+    copy_section(*file, sections[i][kSegmentKeyIndex], &chunk.csr_ld_key_index_);
+    copy_section(*file, sections[i][kSegmentValIndexOffset], &chunk.csr_ld_val_index_offset_);
+    map_section(file, sections[i][kSegmentValIndexPacked], &chunk.csr_ld_val_index_packed_);
+    map_section(file, sections[i][kSegmentValIndexCodec], &chunk.csr_ld_val_index_codec_);
+    map_section(file, sections[i][kSegmentR], &chunk.csr_ld_r_);
+    map_section(file, sections[i][kSegmentR8], &chunk.csr_ld_r8_);
+    copy_section(*file, sections[i][kSegmentR8Codebook], &chunk.csr_ld_r8_codebook_);
+    for (uint8_t codec : chunk.csr_ld_val_index_codec_)
+      if (codec >= kNumIndexCodecs) BGMG_THROW_EXCEPTION(::std::runtime_error("LD segment is corrupted: " + filename));
+  }
+
+  std::vector<std::vector<float>> global_data(kNumSegmentGlobalSections);
+  for (int i = 0; i < kNumSegmentGlobalSections; i++) {
+    copy_section(*file, global_sections[i], &global_data[i]);
+    if (global_data[i].size() != mapping_.num_snp()) BGMG_THROW_EXCEPTION(::std::runtime_error("LD segment is corrupted: " + filename));
+  }
+  mapping_.mutable_mafvec()->swap(global_data[kSegmentMafvec]);
+  ld_sum_ = std::make_shared<LdSum>(mapping_, global_data[kSegmentLdSumR2Below], global_data[kSegmentLdSumR2Above], global_data[kSegmentLdSumR4Above]);
+  ld_sum_adjust_for_hvec_ = std::make_shared<LdSum>(mapping_, global_data[kSegmentLdSumAdjustForHvecR2Below], global_data[kSegmentLdSumAdjustForHvecR2Above], global_data[kSegmentLdSumAdjustForHvecR4Above]);
+  r_bits_ = header.r_bits;
+
+  LOG << " LdMatrixCsr::load_segment(filename=" << filename << "), " << header.num_chunks << " chunks mapped";
+  return true;
+}
+
+struct ContextSnapshotHeader {
+  uint64_t num_snp;
+  uint64_t num_tag;
+  uint64_t segment_offset;  // LD segment with LD matrix of the context, written by LdMatrixCsr::save_segment
+};
+
+enum ContextSnapshotSectionId {
+  kContextTagToSnp, kContextChrnumvec,
+  kContextZvec1, kContextNvec1, kContextZvec2, kContextNvec2, kContextWeights,
+  kContextCausalbetavec1, kContextCausalbetavec2,
+  kNumContextSections
+};
+
+void save_context_snapshot(std::string filename, std::string key, const ContextSnapshot& snapshot, LdMatrixCsr* ld_matrix_csr) {
+  LOG << ">save_context_snapshot(filename=" << filename << "); ";
+  SimpleTimer timer(-1);
+
+  const std::vector<const std::vector<float>*> float_data = {
+    &snapshot.zvec1, &snapshot.nvec1, &snapshot.zvec2, &snapshot.nvec2, &snapshot.weights, &snapshot.causalbetavec1, &snapshot.causalbetavec2 };
+  uint64_t offset = sizeof(size_t) + sizeof(uint64_t) + key.size() + sizeof(ContextSnapshotHeader) + kNumContextSections * sizeof(LdMatrixSection);
+  std::vector<LdMatrixSection> sections(kNumContextSections);
+  sections[kContextTagToSnp] = make_section<int>(&offset, snapshot.tag_to_snp.size());
+  sections[kContextChrnumvec] = make_section<int>(&offset, snapshot.chrnumvec.size());
+  for (int i = 0; i < float_data.size(); i++) sections[kContextZvec1 + i] = make_section<float>(&offset, float_data[i]->size());
+
+  ContextSnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  header.num_snp = snapshot.num_snp;
+  header.num_tag = snapshot.tag_to_snp.size();
+  header.segment_offset = make_section<char>(&offset, 0).offset;
+
+  std::ofstream os(filename, std::ofstream::binary);
+  if (!os) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename)));
+  size_t format_version = LD_MATRIX_CONTEXT_FORMAT_VERSION;
+  os.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
+  save_value(os, static_cast<uint64_t>(key.size()));
+  os.write(key.data(), key.size());
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char*>(&sections[0]), kNumContextSections * sizeof(LdMatrixSection));
+  save_section(os, sections[kContextTagToSnp], snapshot.tag_to_snp.data());
+  save_section(os, sections[kContextChrnumvec], snapshot.chrnumvec.data());
+  for (int i = 0; i < float_data.size(); i++) save_section(os, sections[kContextZvec1 + i], float_data[i]->data());
+  const std::vector<char> padding(header.segment_offset - static_cast<uint64_t>(os.tellp()), 0);
+  if (!padding.empty()) os.write(&padding[0], padding.size());
+  ld_matrix_csr->save_segment(os, key);
+
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename));
+  os.close();
+  LOG << "<save_context_snapshot(filename=" << filename << "), elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+bool load_context_snapshot(std::string filename, std::string key, ContextSnapshot* snapshot) {
+  MemoryMappedFile file(filename);
+  size_t format_version = 0;
+  if (file.size() >= sizeof(size_t)) memcpy(&format_version, file.data(), sizeof(size_t));
+  if (format_version != LD_MATRIX_CONTEXT_FORMAT_VERSION) {
+    LOG << " load_context_snapshot(filename=" << filename << "): not a context snapshot, or written by another version of bgmglib";
+    return false;
+  }
+
+  size_t available = file.size() - sizeof(size_t);
+  const char* ptr = file.data() + sizeof(size_t);
+  auto read = [&ptr, &available, &filename](void* dst, size_t bytes) {
+    if (bytes > available) BGMG_THROW_EXCEPTION(::std::runtime_error("context snapshot is corrupted: " + filename));
+    memcpy(dst, ptr, bytes); ptr += bytes; available -= bytes;
+  };
+
+  uint64_t key_size;
+  read(&key_size, sizeof(uint64_t));
+  if ((key_size != key.size()) || (key_size > available) || (memcmp(ptr, key.data(), key.size()) != 0)) {
+    LOG << " load_context_snapshot(filename=" << filename << "): the snapshot was built from other inputs";
+    return false;
+  }
+  ptr += key_size; available -= key_size;
+
+  ContextSnapshotHeader header;
+  std::vector<LdMatrixSection> sections(kNumContextSections);
+  read(&header, sizeof(ContextSnapshotHeader));
+  read(&sections[0], kNumContextSections * sizeof(LdMatrixSection));
+  if ((sections[kContextTagToSnp].numel != header.num_tag) || (sections[kContextChrnumvec].numel != header.num_snp) || (header.segment_offset > file.size()))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("context snapshot is corrupted: " + filename));
+
+  std::vector<std::vector<float>*> float_data = {
+    &snapshot->zvec1, &snapshot->nvec1, &snapshot->zvec2, &snapshot->nvec2, &snapshot->weights, &snapshot->causalbetavec1, &snapshot->causalbetavec2 };
+  snapshot->num_snp = header.num_snp;
+  snapshot->segment_offset = header.segment_offset;
+  copy_section(file, sections[kContextTagToSnp], &snapshot->tag_to_snp);
+  copy_section(file, sections[kContextChrnumvec], &snapshot->chrnumvec);
+  for (int i = 0; i < float_data.size(); i++) {
+    float_data[i]->clear();
+    if (sections[kContextZvec1 + i].numel > 0) copy_section(file, sections[kContextZvec1 + i], float_data[i]);
+  }
+  return true;
+}
+
+// Scratch file of spill_chunk() has no header: it is written and mapped by the same process, and unlinked straight away.
+enum LdMatrixSpillSectionId {
+  kSpillValIndexPacked, kSpillValIndexCodec, kSpillR, kSpillR8,
+  kNumSpillSections
+};
+
+void LdMatrixCsr::spill_chunk(int chr_label, const std::string& directory) {
+  check_not_shared("spill_chunk");
+  if (chr_label < 0) {
+    for (int i = 0; i < chunks_reverse_.size(); i++)
+      if (chunks_reverse_[i].is_finalized() && !chunks_reverse_[i].is_empty()) spill_chunk(i, directory);
+    return;
+  }
+  if ((chr_label >= chunks_reverse_.size()) || !chunks_reverse_[chr_label].is_finalized()) BGMG_THROW_EXCEPTION(::std::runtime_error("spill_chunk: LD matrix must be finalized"));
+  LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
+  if (chunk.csr_ld_val_index_packed_.is_mapped() || chunk.csr_ld_r_.is_mapped() || chunk.csr_ld_r8_.is_mapped()) return;  // already spilled, or mapped from LD segment
+
+  static std::atomic<int> spill_counter(0);
+  std::stringstream ss;
+#ifndef _WIN32
+  ss << directory << "/bgmg_ld_stream." << getpid() << "." << spill_counter++ << ".chr" << chr_label << ".bin";
+#else
+  BGMG_THROW_EXCEPTION(::std::runtime_error("out-of-core LD matrix is not supported on this platform"));
+#endif
+  const std::string filename = ss.str();
+
+  uint64_t offset = 0;
+  std::vector<LdMatrixSection> sections(kNumSpillSections);
+  sections[kSpillValIndexPacked] = make_section<unsigned char>(&offset, chunk.csr_ld_val_index_packed_.size());
+  sections[kSpillValIndexCodec] = make_section<uint8_t>(&offset, chunk.csr_ld_val_index_codec_.size());
+  sections[kSpillR] = make_section<packed_r_value>(&offset, chunk.csr_ld_r_.size());
+  sections[kSpillR8] = make_section<uint8_t>(&offset, chunk.csr_ld_r8_.size());
+  if (offset == 0) return;
+
+  std::ofstream os(filename, std::ofstream::binary);
+  if (!os) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename)));
+  save_section(os, sections[kSpillValIndexPacked], chunk.csr_ld_val_index_packed_.data());
+  save_section(os, sections[kSpillValIndexCodec], chunk.csr_ld_val_index_codec_.data());
+  save_section(os, sections[kSpillR], chunk.csr_ld_r_.data());
+  save_section(os, sections[kSpillR8], chunk.csr_ld_r8_.data());
+  os.close();
+  if (!os) { std::remove(filename.c_str()); BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename)); }
+
+  std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>(filename);
+  std::remove(filename.c_str());  // the mapping keeps the data until the chunk is released
+  // empty sections stay as they are (there is no padding after the last non-empty section, so their offsets may point past the end of file)
+  if (sections[kSpillValIndexPacked].numel > 0) map_section(file, sections[kSpillValIndexPacked], &chunk.csr_ld_val_index_packed_);
+  if (sections[kSpillValIndexCodec].numel > 0) map_section(file, sections[kSpillValIndexCodec], &chunk.csr_ld_val_index_codec_);
+  if (sections[kSpillR].numel > 0) map_section(file, sections[kSpillR], &chunk.csr_ld_r_);
+  if (sections[kSpillR8].numel > 0) map_section(file, sections[kSpillR8], &chunk.csr_ld_r8_);
+
+  stream_spilled_[chr_label] = 1;
+  stream_resident_[chr_label] = 0;
+  LOG << " LdMatrixCsr::spill_chunk(chr_label=" << chr_label << "), " << offset << " bytes moved to " << directory;
+}
+
+void LdMatrixCsr::advise_chunk(int chr_label, bool will_need) {
+#ifndef _WIN32
+  const LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  auto advise = [will_need, page_size](const void* data, size_t bytes) {
+    if (bytes == 0) return;
+    // MADV_DONTNEED is safe here, because the pages are read-only and never modified: they are read from the file again on the next access
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(page_size - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+    madvise(reinterpret_cast<void*>(begin), end - begin, will_need ? MADV_WILLNEED : MADV_DONTNEED);
+  };
+  if (chunk.csr_ld_val_index_packed_.is_mapped()) advise(chunk.csr_ld_val_index_packed_.data(), chunk.csr_ld_val_index_packed_.size() * sizeof(unsigned char));
+  if (chunk.csr_ld_val_index_codec_.is_mapped()) advise(chunk.csr_ld_val_index_codec_.data(), chunk.csr_ld_val_index_codec_.size() * sizeof(uint8_t));
+  if (chunk.csr_ld_r_.is_mapped()) advise(chunk.csr_ld_r_.data(), chunk.csr_ld_r_.size() * sizeof(packed_r_value));
+  if (chunk.csr_ld_r8_.is_mapped()) advise(chunk.csr_ld_r8_.data(), chunk.csr_ld_r8_.size() * sizeof(uint8_t));
+#endif
+}
+
+#ifndef _WIN32
+LdSegmentLock::LdSegmentLock(std::string filename) : filename_(filename), build_filename_(filename + ".build"), fd_(-1), build_fd_(-1), exclusive_(false) {
+  // the last user of the segment removes the lock file while it holds the exclusive lock, hence the lock taken on a removed file is retried
+  for (;;) {
+    fd_ = open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd_ < 0) BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to open ") + filename));
+    if (flock(fd_, LOCK_SH) != 0) { close(fd_); BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to lock ") + filename)); }
+    struct stat fd_stat, path_stat;
+    if ((fstat(fd_, &fd_stat) == 0) && (stat(filename.c_str(), &path_stat) == 0) && (fd_stat.st_dev == path_stat.st_dev) && (fd_stat.st_ino == path_stat.st_ino)) break;
+    close(fd_);
+  }
+}
+
+LdSegmentLock::~LdSegmentLock() {
+  unlock_build();
+  if (exclusive_) {
+    unlink(build_filename_.c_str());
+    unlink(filename_.c_str());
+  }
+  flock(fd_, LOCK_UN);
+  close(fd_);
+}
+
+// the build lock file is only removed by a process that holds the exclusive lock, i.e. not while this process holds the shared lock
+void LdSegmentLock::lock_build() {
+  if (build_fd_ >= 0) return;
+  build_fd_ = open(build_filename_.c_str(), O_RDWR | O_CREAT, 0666);
+  if (build_fd_ < 0) BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to open ") + build_filename_));
+  if (flock(build_fd_, LOCK_EX) != 0) { close(build_fd_); build_fd_ = -1; BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to lock ") + build_filename_)); }
+}
+
+void LdSegmentLock::unlock_build() {
+  if (build_fd_ < 0) return;
+  flock(build_fd_, LOCK_UN);
+  close(build_fd_);
+  build_fd_ = -1;
+}
+
+bool LdSegmentLock::try_exclusive() {
+  exclusive_ = (flock(fd_, LOCK_EX | LOCK_NB) == 0);
+  return exclusive_;
+}
+#else
+LdSegmentLock::LdSegmentLock(std::string filename) : filename_(filename), fd_(-1), build_fd_(-1), exclusive_(false) {
+  BGMG_THROW_EXCEPTION(::std::runtime_error("LD segments are not supported on this platform"));
+}
+LdSegmentLock::~LdSegmentLock() {}
+void LdSegmentLock::lock_build() {}
+void LdSegmentLock::unlock_build() {}
+bool LdSegmentLock::try_exclusive() { return false; }
+#endif
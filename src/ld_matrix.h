@@ -18,24 +18,152 @@
 
 #pragma once
 
+#include <fstream>
 #include <string>
 #include <valarray>
+#include <cstdint>
 
+#include "bgmg_parse.h"
 #include "ld_matrix_csr.h"
 
-void generate_ld_matrix_from_bed_file(std::string bfile, float r2min, float ldscore_r2min, int ld_window, float ld_window_kb, std::string out_file);
+// How generate_ld_matrix_from_bed_file computes allelic correlations; both engines give exactly the same r values.
+enum LdEngine {
+  kLdEnginePairwise = 0,  // PlinkLdBedFileChunk::calculate_ld_corr for each SNP pair
+  kLdEngineTiled = 1,     // PlinkLdBedFileChunk::calculate_ld_corr_tile over 64x64 tiles of SNP pairs, with bit-sliced genotypes
+};
+
+// SNPs are processed in blocks of block_size, and LD is computed for each pair of blocks within the window;
+// the block size bounds the memory, and doesn't change the result (up to the order of summation of LD scores).
+void generate_ld_matrix_from_bed_file(std::string bfile, float r2min, float ldscore_r2min, int ld_window, float ld_window_kb, std::string out_file,
+                                      LdEngine ld_engine = kLdEngineTiled, int block_size = 8*1024);
 
 void save_ld_matrix(const LdMatrixCsrChunk& chunk,
                     const std::vector<float>& freqvec,
                     const std::vector<float>& ld_r2_sum,
                     const std::vector<float>& ld_r2_sum_adjust_for_hvec,
-                    std::string filename);
+                    std::string filename,
+                    bool compress_r = false);  // compress r values (smaller file, but r values can't be memory-mapped on load)
+
+// Writes an LD file (the same format as save_ld_matrix, without compressed r values) as a sequence of finalized CSR rows,
+// so that the whole LD matrix is never held in memory. Each append_rows() call takes a chunk with consecutive keys, starting where the previous chunk ended;
+// r values are written straight into the output file, and packed indices into a temporary file (filename + ".tmp"),
+// which finish() copies into the output file, followed by the per-key sections and the section table.
+// Memory is O(num_keys), for the offsets of each row. If finish() is not called (e.g. an exception), the output file is removed.
+class LdMatrixFileWriter {
+public:
+  LdMatrixFileWriter(std::string filename, int key_index_from_inclusive, int key_index_to_exclusive);
+  ~LdMatrixFileWriter();
+  void append_rows(const LdMatrixCsrChunk& chunk);
+  void finish(const std::vector<float>& freqvec,
+              const std::vector<float>& ld_r2_sum,
+              const std::vector<float>& ld_r2_sum_adjust_for_hvec);
+  int64_t num_ld_r() const { return key_index_.back(); }
+private:
+  LdMatrixFileWriter(const LdMatrixFileWriter&);
+  LdMatrixFileWriter& operator=(const LdMatrixFileWriter&);
+  std::string filename_;
+  std::ofstream os_;
+  std::ofstream packed_os_;  // temporary file with csr_ld_val_index_packed_
+  int key_index_from_inclusive_;
+  int key_index_to_exclusive_;
+  uint64_t r_offset_;
+  std::vector<int64_t> key_index_;        // csr_ld_key_index_ of the rows appended so far
+  std::vector<uint64_t> val_index_offset_;  // csr_ld_val_index_offset_
+  std::vector<uint8_t> val_index_codec_;
+  bool finished_;
+};
 
+// chr_label selects a chromosome from genome LD file (see save_ld_matrix_genome);
+// it can be omitted for genome LD files with a single chromosome, and it is ignored for per-chromosome LD files.
 void load_ld_matrix(std::string filename,
                     LdMatrixCsrChunk* chunk,
                     std::vector<float>* freqvec,
                     std::vector<float>* ld_r2_sum,
-                    std::vector<float>* ld_r2_sum_adjust_for_hvec);
+                    std::vector<float>* ld_r2_sum_adjust_for_hvec,
+                    int chr_label = -1);
+
+// Genome LD file (format version 3) holds LD matrices of several chromosomes,
+// with a header and a table of per-chromosome sections, so that a subset of chromosomes can be loaded
+// without reading the rest of the file.
+struct LdMatrixGenomeHeader {
+  uint64_t reference_hash;  // combined from reference_hash of all chromosomes, in the order they are stored
+  uint64_t num_snp;         // total across all chromosomes
+  float r2min;              // as used to compute the LD matrices
+  float ldscore_r2min;
+  uint64_t num_chunks;      // one chunk per chromosome
+  uint64_t num_sections;    // per chunk
+};
+
+struct LdMatrixGenomeChunk {
+  int chr_label;
+  int key_index_from_inclusive;
+  int key_index_to_exclusive;
+  int reserved;
+  uint64_t reference_hash;  // BimFile::reference_hash(chr_label) of the reference used to compute the LD matrix
+  uint64_t checksum;        // crc32 of all sections of the chunk, validated whenever the chunk is loaded
+};
+
+// Merge per-chromosome LD files, produced by generate_ld_matrix_from_bed_file, into a single genome LD file.
+void save_ld_matrix_genome(const BimFile& reference,
+                           const std::vector<int>& chr_labels,
+                           const std::vector<std::string>& filenames,
+                           float r2min,
+                           float ldscore_r2min,
+                           std::string out_file,
+                           bool compress_r = false);
+
+// The same, with '@' in bim_file and ld_file_template replaced by each of chr_labels (see split_chr_labels).
+void merge_ld_matrix_files(std::string bim_file,
+                           std::string chr_labels,
+                           std::string ld_file_template,
+                           float r2min,
+                           float ldscore_r2min,
+                           std::string out_file,
+                           bool compress_r = false);
+
+// Returns false if filename is not a genome LD file.
+bool load_ld_matrix_genome_header(std::string filename,
+                                  LdMatrixGenomeHeader* header,
+                                  std::vector<LdMatrixGenomeChunk>* chunks);
+
+// Advisory locks (flock) coordinating processes that share an LD segment (see LdMatrixCsr::save_segment).
+// The constructor creates the lock file if needed, and takes a shared lock, kept for as long as the process uses the segment;
+// therefore any number of processes use the segment at the same time. A process that finds no valid segment calls lock_build(),
+// which takes an exclusive lock on a separate build lock file, so that only one process builds the segment while the others wait for it;
+// then it checks the segment again, builds it if it is still missing, and calls unlock_build().
+// A process that gets the exclusive lock via try_exclusive() is the last user of the segment, and may remove it; the lock files are then removed in destructor.
+// The locks are released in destructor (or by the OS, if the process terminates).
+class LdSegmentLock {
+public:
+  LdSegmentLock(std::string filename);
+  ~LdSegmentLock();
+  void lock_build();
+  void unlock_build();
+  bool try_exclusive();
+private:
+  LdSegmentLock(const LdSegmentLock&);
+  LdSegmentLock& operator=(const LdSegmentLock&);
+  std::string filename_;
+  std::string build_filename_;
+  int fd_;
+  int build_fd_;
+  bool exclusive_;
+};
+
+// Context snapshot (see BgmgCalculator::save_context): the vectors of a fully initialized calculator,
+// followed by an LD segment with its LD matrix (see LdMatrixCsr::save_segment), at segment_offset.
+// The key identifies the inputs used to initialize the calculator; load_context_snapshot() returns false if the snapshot has a different key.
+struct ContextSnapshot {
+  int num_snp;
+  std::vector<int> tag_to_snp;
+  std::vector<int> chrnumvec;
+  std::vector<float> zvec1, nvec1, zvec2, nvec2, weights;  // one element per tag, or empty
+  std::vector<float> causalbetavec1, causalbetavec2;       // one element per snp, or empty
+  uint64_t segment_offset;
+};
+
+void save_context_snapshot(std::string filename, std::string key, const ContextSnapshot& snapshot, LdMatrixCsr* ld_matrix_csr);
+bool load_context_snapshot(std::string filename, std::string key, ContextSnapshot* snapshot);
 
 void load_ld_matrix_version0(std::string filename,
                              std::vector<int>* snp_index,
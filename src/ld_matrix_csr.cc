@@ -19,20 +19,116 @@
 #include "ld_matrix_csr.h"
 
 #include <assert.h>
+#include <string.h>
+#include <cstdlib>
 #include <algorithm>
 #include <numeric>
 
 #include "TurboPFor/vsimple.h"
+#include "TurboPFor/vint.h"
 #include "FastDifferentialCoding/fastdelta.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "ld_matrix.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#define omp_get_num_threads() 1
+#endif
+
 // Very important to use correct sizes for output buffers.
 // There boundaries were suggested in https://github.com/powturbo/TurboPFor/issues/31
 #define VSENC_BOUND(n, size) ((n + 32) * ((size)+1) )
 #define VSDEC_BOUND(n, size) ((n + 32) * (size))
 #define VSDEC_NUMEL(n      ) (n + 32)
 
+// kIndexCodecBitPack: the first byte gives number of bits per value, followed by values packed in little-endian bit order
+unsigned char* bitpack_enc32(const uint32_t* in, int64_t num, unsigned char* out) {
+  uint32_t max_value = 0;
+  for (int64_t i = 0; i < num; i++) max_value |= in[i];
+  int bits_per_value = 0;
+  while ((bits_per_value < 32) && ((max_value >> bits_per_value) != 0)) bits_per_value++;
+  *out++ = static_cast<unsigned char>(bits_per_value);
+
+  uint64_t buffer = 0;
+  int buffer_bits = 0;
+  for (int64_t i = 0; i < num; i++) {
+    buffer |= static_cast<uint64_t>(in[i]) << buffer_bits;
+    buffer_bits += bits_per_value;
+    for (; buffer_bits >= 8; buffer_bits -= 8, buffer >>= 8) *out++ = static_cast<unsigned char>(buffer);
+  }
+  if (buffer_bits > 0) *out++ = static_cast<unsigned char>(buffer);
+  return out;
+}
+
+const unsigned char* bitpack_dec32(const unsigned char* in, int64_t num, uint32_t* out) {
+  const int bits_per_value = *in++;
+  const uint64_t mask = (1ULL << bits_per_value) - 1;
+  uint64_t buffer = 0;
+  int buffer_bits = 0;
+  for (int64_t i = 0; i < num; i++) {
+    for (; buffer_bits < bits_per_value; buffer_bits += 8) buffer |= static_cast<uint64_t>(*in++) << buffer_bits;
+    out[i] = static_cast<uint32_t>(buffer & mask);
+    buffer >>= bits_per_value;
+    buffer_bits -= bits_per_value;
+  }
+  return in;
+}
+
+// kIndexCodecBitmap: the first index (4 bytes), followed by one bit for each of the subsequent positions up to the last index in the row.
+// For dense rows (LD band around the diagonal) this takes less than one bit per LD r value. Decoder writes indices, not deltas.
+int64_t bitmap_size32(const uint32_t* deltas, int64_t num) {
+  uint64_t span = 0;
+  for (int64_t i = 1; i < num; i++) span += deltas[i];
+  return sizeof(uint32_t) + static_cast<int64_t>((span + 7) / 8);
+}
+
+unsigned char* bitmap_enc32(const uint32_t* deltas, int64_t num, unsigned char* out) {
+  memcpy(out, &deltas[0], sizeof(uint32_t));
+  out += sizeof(uint32_t);
+  const int64_t num_bytes = bitmap_size32(deltas, num) - sizeof(uint32_t);
+  memset(out, 0, num_bytes);
+  uint64_t position = 0;
+  for (int64_t i = 1; i < num; i++) {
+    position += deltas[i];
+    out[(position - 1) >> 3] |= static_cast<unsigned char>(1 << ((position - 1) & 7));
+  }
+  return out + num_bytes;
+}
+
+const unsigned char* bitmap_dec32(const unsigned char* in, int64_t num, uint32_t* out) {
+  uint32_t index;
+  memcpy(&index, in, sizeof(uint32_t));
+  in += sizeof(uint32_t);
+  out[0] = index++;
+  int64_t i = 1;
+  for (; i < num; index += 8) {
+    unsigned int byte = *in++;
+    for (; byte != 0; byte &= (byte - 1)) out[i++] = index + __builtin_ctz(byte);
+  }
+  return in;
+}
+
+// upper bound on the number of bytes produced by encode_ld_indices
+int64_t encode_ld_indices_bound(int codec, const uint32_t* deltas, int64_t num) {
+  if (codec == kIndexCodecBitmap) return bitmap_size32(deltas, num);
+  return VSENC_BOUND(num, sizeof(uint32_t));
+}
+
+// "out" buffer must have capacity for encode_ld_indices_bound(codec, deltas, num) bytes
+unsigned char* encode_ld_indices(int codec, uint32_t* deltas, int64_t num, unsigned char* out) {
+  if (codec == kIndexCodecBitmap) return bitmap_enc32(deltas, num, out);
+  if (codec == kIndexCodecBitPack) return bitpack_enc32(deltas, num, out);
+  if (codec == kIndexCodecVByte) return vbenc32(deltas, num, out);
+  return vsenc32(deltas, num, out);
+}
+
 void find_hvec_per_chunk(TagToSnpMapping& mapping, std::vector<float>* hvec, int index_from, int index_to) {
   if (mapping.mafvec().empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("set_mafvec() must be called first"));  
   const std::vector<float>& mafvec = mapping.mafvec();
@@ -42,11 +138,15 @@ void find_hvec_per_chunk(TagToSnpMapping& mapping, std::vector<float>* hvec, int
   }
 }
 
-void find_hvec(TagToSnpMapping& mapping, std::vector<float>* hvec) {
-  find_hvec_per_chunk(mapping, hvec, 0, mapping.num_snp());
+void find_hvec(TagToSnpMapping& mapping, HugePageVector<float>* hvec) {
+  if (mapping.mafvec().empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("set_mafvec() must be called first"));
+  const std::vector<float>& mafvec = mapping.mafvec();
+  hvec->resize(mafvec.size());
+  for (int snp_index = 0; snp_index < mafvec.size(); snp_index++) (*hvec)[snp_index] = 2.0f * mafvec[snp_index] * (1.0f - mafvec[snp_index]);
 }
 
 int64_t LdMatrixCsr::set_ld_r2_coo_version0(int chr_label_data, const std::string& filename, float r2_min) {
+  check_not_shared("set_ld_r2_coo_version0");
   std::vector<int> snp_index;
   std::vector<int> snp_other_index;
   std::vector<float> r;
@@ -69,11 +169,19 @@ int64_t LdMatrixCsr::set_ld_r2_coo_version0(int chr_label_data, const std::strin
 }
 
 int64_t LdMatrixCsr::set_ld_r2_coo_version1plus(int chr_label, const std::string& filename, float r2_min) {
+  check_not_shared("set_ld_r2_coo_version1plus");
+  if (!chunks_full_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't load LD matrix while r2min is raised at runtime; set r2min_runtime to zero first"));
   LdMatrixCsrChunk chunk;
   std::vector<float> freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec;  // these are ignored for now
-  load_ld_matrix(filename, &chunk, &freqvec, &ld_r2_sum, &ld_r2_sum_adjust_for_hvec);
+  load_ld_matrix(filename, &chunk, &freqvec, &ld_r2_sum, &ld_r2_sum_adjust_for_hvec, chr_label);
 
   int64_t numel = chunk.csr_ld_r_.size();
+
+  if (can_set_ld_r2_csr_direct(chr_label, chunk)) {
+    LOG << " set_ld_r2_csr_direct(filename=" << filename << ", numel=" << numel << ")...";
+    return set_ld_r2_csr_direct(chr_label, chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, r2_min);
+  }
+
   LOG << " set_ld_r2_coo(filename=" << filename << ", numel=" << numel << ")...";
 
   const int index0 = (chr_label < 0) ? 0 : chunks_forward_[chr_label].key_index_from_inclusive_;
@@ -106,6 +214,178 @@ int64_t LdMatrixCsr::set_ld_r2_coo_version1plus(int chr_label, const std::string
   return set_ld_r2_coo(chr_label, numel, &snp_index[0], &snp_other_index[0], &r[0], r2_min);
 }
 
+bool LdMatrixCsr::can_set_ld_r2_csr_direct(int chr_label, const LdMatrixCsrChunk& chunk) {
+  // direct ingest is possible for the first file loaded for a given chromosome, if the file covers exactly the same set of SNPs
+  if (chr_label < 0 || chr_label >= chunks_forward_.size()) return false;
+  const LdMatrixCsrChunk& chunk_reverse = chunks_reverse_[chr_label];
+  if (!chunk_reverse.coo_ld_.empty() || !chunk_reverse.csr_ld_key_index_.empty()) return false;
+  return (chunk.key_index_from_inclusive_ == 0) && (chunk.key_index_to_exclusive_ == chunks_forward_[chr_label].num_keys_in_chunk());
+}
+
+// Sort each row of CSR matrix by val index. This is only needed when the rows are not filled in the order of val indices
+// (e.g. tag indices do not follow the order of snp indices, or the rows are filled concurrently by several threads).
+template<typename T>
+void sort_csr_rows(const std::vector<int64_t>& csr_ld_key_index, std::vector<uint32_t>* csr_ld_val_index, HugePageVector<T>* csr_ld_r) {
+  const int num_keys = (int)csr_ld_key_index.size() - 1;
+  std::vector<uint32_t>& val_index = *csr_ld_val_index;
+  HugePageVector<T>& r = *csr_ld_r;
+
+#pragma omp parallel
+  {
+    std::vector<std::pair<uint32_t, T>> buffer;
+
+#pragma omp for schedule(dynamic, 256)
+    for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys; key_index_in_chunk++) {
+      const int64_t ld_index_from = csr_ld_key_index[key_index_in_chunk];
+      const int64_t ld_index_to = csr_ld_key_index[key_index_in_chunk + 1];
+      bool sorted = true;
+      for (int64_t ld_index = ld_index_from + 1; ld_index < ld_index_to; ld_index++)
+        if (val_index[ld_index - 1] > val_index[ld_index]) { sorted = false; break; }
+      if (sorted) continue;
+
+      buffer.clear();
+      for (int64_t ld_index = ld_index_from; ld_index < ld_index_to; ld_index++)
+        buffer.push_back(std::make_pair(val_index[ld_index], r[ld_index]));
+      std::sort(buffer.begin(), buffer.end(), [](const std::pair<uint32_t, T>& lhs, const std::pair<uint32_t, T>& rhs) { return lhs.first < rhs.first; });
+      for (int64_t ld_index = ld_index_from; ld_index < ld_index_to; ld_index++) {
+        val_index[ld_index] = buffer[ld_index - ld_index_from].first;
+        r[ld_index] = buffer[ld_index - ld_index_from].second;
+      }
+    }
+  }
+}
+
+// Build chunks_reverse_[chr_label] directly from the CSR chunk loaded from a file.
+// The result is the same as extracting all elements into coo_ld_ and calling set_ld_r2_coo() + set_ld_r2_csr(),
+// but without materializing COO tuples and sorting them. The file contains upper triangle of the LD matrix (without diagonal), 
+// and the rows are visited in ascending order, therefore the rows of the resulting matrix are filled in sorted order (unless tag indices are permuted).
+// Two passes are made over the file: first pass counts elements in each row (and accumulates LdSum), second pass fills CSR arrays.
+int64_t LdMatrixCsr::set_ld_r2_csr_direct(int chr_label, const LdMatrixCsrChunk& chunk,
+                                          const std::vector<float>& freqvec, const std::vector<float>& ld_r2_sum, const std::vector<float>& ld_r2_sum_adjust_for_hvec,
+                                          float r2_min) {
+  LOG << ">set_ld_r2_csr_direct(chr_label=" << chr_label << "); ";
+  SimpleTimer timer(-1);
+  invalidate_row_cache();
+  invalidate_compact_view();
+  invalidate_snp_to_tag_map();
+
+  LdMatrixCsrChunk& chunk_reverse = chunks_reverse_[chr_label];
+  const int snp_index_from = chunks_forward_[chr_label].key_index_from_inclusive_;
+  const int snp_index_to = chunks_forward_[chr_label].key_index_to_exclusive_;
+  if (!excluded_snp_.empty() && (excluded_snp_.size() != mapping_.num_snp())) BGMG_THROW_EXCEPTION(::std::runtime_error("excluded snps do not match the reference; call set_excluded_snps again"));
+  const int tag_index_from = chunk_reverse.key_index_from_inclusive_;
+  const int num_snp_in_chunk = snp_index_to - snp_index_from;
+  const std::vector<char>& is_tag = mapping_.is_tag();
+  const std::vector<int>& snp_to_tag = mapping_.snp_to_tag();
+  const std::vector<int>& chrnumvec = mapping_.chrnumvec();
+
+  // apply freqvec and ld_r2_sum/ld_r2_sum_adjust_for_hvec, then add the diagonal (same order of operations as in set_ld_r2_coo_version1plus)
+  for (int chunk_snp_index = 0; chunk_snp_index < num_snp_in_chunk; chunk_snp_index++) {
+    const int snp_index = snp_index_from + chunk_snp_index;
+    mapping_.mutable_mafvec()->at(snp_index) = freqvec[chunk_snp_index];
+    ld_sum_->store_below_r2min(snp_index, ld_r2_sum[chunk_snp_index], 0);
+    ld_sum_adjust_for_hvec_->store_below_r2min(snp_index, ld_r2_sum_adjust_for_hvec[chunk_snp_index], 0);
+  }
+
+  std::vector<float> hvec_per_chunk;
+  find_hvec_per_chunk(mapping_, &hvec_per_chunk, snp_index_from, snp_index_to);
+
+  std::vector<int64_t> reverse_key_index(chunk_reverse.num_keys_in_chunk() + 1, 0);
+
+  int added = 0;
+  for (int snp_index = snp_index_from; snp_index < snp_index_to; snp_index++) {
+    ld_sum_adjust_for_hvec_->store_above_r2min(snp_index, 1.0f * hvec_per_chunk[snp_index - snp_index_from], 0);
+    ld_sum_->store_above_r2min(snp_index, 1.0f, 0);
+    if (!is_tag[snp_index]) continue;
+    added++;
+    reverse_key_index[snp_to_tag[snp_index] - tag_index_from + 1]++;
+  }
+
+  auto is_excluded = [this](int snp_index) { return !excluded_snp_.empty() && excluded_snp_[snp_index]; };
+
+  // first pass: count elements in each row, and accumulate LdSum
+  int64_t new_elements = 0;
+  int64_t elements_on_different_chromosomes = 0;
+  int64_t elements_excluded = 0;
+  LdMatrixRow ld_matrix_row;
+  for (int chunk_snp_index = 0; chunk_snp_index < num_snp_in_chunk; chunk_snp_index++) {
+    const int snp_index = snp_index_from + chunk_snp_index;
+    chunk.extract_row(chunk_snp_index, &ld_matrix_row);
+    auto iter_end = ld_matrix_row.end();
+    for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
+      const int chunk_snp_other_index = iter.index();
+      if (chunk_snp_other_index == chunk_snp_index) BGMG_THROW_EXCEPTION(::std::runtime_error("snp_index[i] == snp_other_index[i] --- unexpected for ld files created via plink"));
+      if (chunk_snp_other_index < 0 || chunk_snp_other_index >= num_snp_in_chunk) BGMG_THROW_EXCEPTION(::std::runtime_error("LD file refers to snp index outside of the chromosome"));
+      const int snp_other_index = snp_index_from + chunk_snp_other_index;
+      if (chrnumvec[snp_other_index] != chrnumvec[snp_index]) { elements_on_different_chromosomes++;  continue; }
+
+      const float r = iter.r();
+      const float r2 = r * r;
+      const bool below_r2min_other = (r2 < r2_min) || is_excluded(snp_index);  // contribution of snp_index to the sums of snp_other_index
+      const bool below_r2min = (r2 < r2_min) || is_excluded(snp_other_index);
+      ld_sum_adjust_for_hvec_->store(below_r2min_other, snp_other_index, r2 * hvec_per_chunk[chunk_snp_index], 0);
+      ld_sum_adjust_for_hvec_->store(below_r2min, snp_index, r2 * hvec_per_chunk[chunk_snp_other_index], 0);
+      ld_sum_->store(below_r2min_other, snp_other_index, r2, 0);
+      ld_sum_->store(below_r2min, snp_index, r2, 0);
+      if ((r2 >= r2_min) && (below_r2min_other || below_r2min)) elements_excluded++;
+
+      if (!below_r2min_other && is_tag[snp_other_index]) {
+        reverse_key_index[snp_to_tag[snp_other_index] - tag_index_from + 1]++;
+        new_elements++;
+      }
+      if (!below_r2min && is_tag[snp_index]) {
+        reverse_key_index[snp_to_tag[snp_index] - tag_index_from + 1]++;
+        new_elements++;
+      }
+    }
+  }
+
+  std::partial_sum(reverse_key_index.begin(), reverse_key_index.end(), reverse_key_index.begin());
+
+  // second pass: fill CSR arrays
+  std::vector<uint32_t> reverse_val_index;
+  HugePageVector<packed_r_value>& reverse_r = chunk_reverse.csr_ld_r_.mutable_vector();
+  reverse_val_index.resize(reverse_key_index.back()); reverse_r.resize(reverse_key_index.back());
+  std::vector<int64_t> reverse_pos(reverse_key_index.begin(), reverse_key_index.end() - 1);
+
+  auto push_element = [&](int chunk_snp_index, int chunk_snp_other_index, packed_r_value r) {
+    // chunk_snp_other_index must be a tag
+    const int snp_index = snp_index_from + chunk_snp_index;
+    const int tag_other_index = snp_to_tag[snp_index_from + chunk_snp_other_index];
+    const int64_t pos = reverse_pos[tag_other_index - tag_index_from]++;
+    reverse_val_index[pos] = snp_index; reverse_r[pos] = r;
+  };
+
+  for (int chunk_snp_index = 0; chunk_snp_index < num_snp_in_chunk; chunk_snp_index++) {
+    const int snp_index = snp_index_from + chunk_snp_index;
+    if (is_tag[snp_index]) push_element(chunk_snp_index, chunk_snp_index, packed_r_value(1.0f));
+
+    chunk.extract_row(chunk_snp_index, &ld_matrix_row);
+    auto iter_end = ld_matrix_row.end();
+    for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
+      const int chunk_snp_other_index = iter.index();
+      const int snp_other_index = snp_index_from + chunk_snp_other_index;
+      if (chrnumvec[snp_other_index] != chrnumvec[snp_index]) continue;
+      const float r = iter.r();
+      if ((r * r) < r2_min) continue;
+      if (is_tag[snp_other_index] && !is_excluded(snp_index)) push_element(chunk_snp_index, chunk_snp_other_index, packed_r_value(r));
+      if (is_tag[snp_index] && !is_excluded(snp_other_index)) push_element(chunk_snp_other_index, chunk_snp_index, packed_r_value(r));
+    }
+  }
+
+  for (int i = 0; i < reverse_pos.size(); i++) if (reverse_pos[i] != reverse_key_index[i+1]) BGMG_THROW_EXCEPTION(::std::runtime_error("internal error, set_ld_r2_csr_direct: reverse_pos mismatch"));
+
+  sort_csr_rows(reverse_key_index, &reverse_val_index, &reverse_r);
+  chunk_reverse.csr_ld_key_index_.assign(reverse_key_index);
+  chunk_reverse.pack_ld_r2_csr(&reverse_val_index);
+
+  LOG << " set_ld_r2_csr_direct(chr_label=" << chr_label << ") added " << added << " tag (out of " << num_snp_in_chunk << " snps) elements with r2=1.0 to the diagonal of LD r2 matrix";
+  if (elements_on_different_chromosomes > 0) LOG << " ignore " << elements_on_different_chromosomes << " r2 elements on between snps located on different chromosomes";
+  if (elements_excluded > 0) LOG << " move " << elements_excluded << " r2 elements with excluded snps to the sums below r2min";
+  LOG << "<set_ld_r2_csr_direct(chr_label=" << chr_label << "); (new_elements: " << new_elements << "), elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
+
 void LdMatrixCsr::init_chunks() {
   if (mapping_.chrnumvec().empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call init_chunks() before set_chrnumvec"));
   if (!chunks_forward_.empty() || !chunks_reverse_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call init_chunks() twice"));
@@ -123,6 +403,8 @@ void LdMatrixCsr::init_chunks() {
   }
   chunks_forward_.resize(max_chr_label + 1);  // here we most likely create one useless LD structure for chr_label==0. But that's fine, it'll just stay empty.
   chunks_reverse_.resize(max_chr_label + 1);
+  stream_spilled_.assign(max_chr_label + 1, 0);
+  stream_resident_.assign(max_chr_label + 1, 0);
   LOG << " highest chr label: " << max_chr_label;
 
   // Find where each chunk starts and ends
@@ -167,16 +449,16 @@ void LdMatrixCsr::init_diagonal(int chr_label) {
     if (!mapping_.is_tag()[snp_index]) continue;
     added++;
     int tag_index = mapping_.snp_to_tag()[snp_index];
-    if (!mapping_.disable_snp_to_tag_map())
-      chunks_forward_[chr_label].coo_ld_.push_back(std::make_tuple(snp_index, tag_index, 1.0f));
     chunks_reverse_[chr_label].coo_ld_.push_back(std::make_tuple(tag_index, snp_index, 1.0f));
   }
   LOG << " LdMatrixCsr::init_diagonal(chr_label=" << chr_label << ") added " << added << " tag (out of " << (snp_index_to - snp_index_from)  << " snps) elements with r2=1.0 to the diagonal of LD r2 matrix";  
 }
 
 int64_t LdMatrixCsr::set_ld_r2_coo(int chr_label_data, int64_t length, int* snp_index_data, int* snp_other_index_data, float* r, float r2_min) {
+  check_not_shared("set_ld_r2_coo");
   if (mapping_.mafvec().empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_coo before set_mafvec"));
   if (mapping_.chrnumvec().empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_coo before set_chrnumvec"));
+  if (!chunks_full_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't load LD matrix while r2min is raised at runtime; set r2min_runtime to zero first"));
   LOG << ">set_ld_r2_coo(chr_label=" << chr_label_data << ", length=" << length << "); ";
 
   for (int64_t i = 0; i < length; i++)
@@ -198,6 +480,8 @@ int64_t LdMatrixCsr::set_ld_r2_coo(int chr_label_data, int64_t length, int* snp_
 
   int64_t new_elements = 0;
   int64_t elements_on_different_chromosomes = 0;
+  int64_t elements_excluded = 0;
+  if (!excluded_snp_.empty() && (excluded_snp_.size() != mapping_.num_snp())) BGMG_THROW_EXCEPTION(::std::runtime_error("excluded snps do not match the reference; call set_excluded_snps again"));
 
   if (chr_label_data >= (int)chunks_forward_.size()) BGMG_THROW_EXCEPTION(::std::runtime_error("invalid value for chr_label argument"));
   const int snp_index_from = (chr_label_data < 0) ? 0 : chunks_forward_[chr_label_data].key_index_from_inclusive_;
@@ -219,42 +503,45 @@ int64_t LdMatrixCsr::set_ld_r2_coo(int chr_label_data, int64_t length, int* snp_
     if (chr_label != mapping_.chrnumvec()[snp_index]) { elements_on_different_chromosomes++;  continue; }
 
     const float r2 = r[i] * r[i];
+    const bool below_r2min_other = (r2 < r2_min) || (!excluded_snp_.empty() && excluded_snp_[snp_index]);  // contribution of snp_index to the sums of snp_other_index
+    const bool below_r2min = (r2 < r2_min) || (!excluded_snp_.empty() && excluded_snp_[snp_other_index]);
 
-    ld_sum_adjust_for_hvec_->store(r2 < r2_min, snp_other_index, r2 * hvec_per_chunk[snp_index - snp_index_from], 0);
-    ld_sum_adjust_for_hvec_->store(r2 < r2_min, snp_index, r2 * hvec_per_chunk[snp_other_index - snp_index_from], 0);
-    ld_sum_->store(r2 < r2_min, snp_other_index, r2, 0);
-    ld_sum_->store(r2 < r2_min, snp_index, r2, 0);
+    ld_sum_adjust_for_hvec_->store(below_r2min_other, snp_other_index, r2 * hvec_per_chunk[snp_index - snp_index_from], 0);
+    ld_sum_adjust_for_hvec_->store(below_r2min, snp_index, r2 * hvec_per_chunk[snp_other_index - snp_index_from], 0);
+    ld_sum_->store(below_r2min_other, snp_other_index, r2, 0);
+    ld_sum_->store(below_r2min, snp_index, r2, 0);
+    if ((r2 >= r2_min) && (below_r2min_other || below_r2min)) elements_excluded++;
 
-    if (r2 < r2_min) continue;
-
-    if (mapping_.is_tag()[snp_other_index]) { 
+    if (!below_r2min_other && mapping_.is_tag()[snp_other_index]) { 
       const int tag_other_index = mapping_.snp_to_tag()[snp_other_index];
-      if (!mapping_.disable_snp_to_tag_map())
-        chunks_forward_[chr_label].coo_ld_.push_back(std::make_tuple(snp_index, tag_other_index, r[i]));
       chunks_reverse_[chr_label].coo_ld_.push_back(std::make_tuple(tag_other_index, snp_index, r[i]));
       new_elements++;
     }
 
-    if (mapping_.is_tag()[snp_index]) {
+    if (!below_r2min && mapping_.is_tag()[snp_index]) {
       const int tag_index = mapping_.snp_to_tag()[snp_index];
-      if (!mapping_.disable_snp_to_tag_map())
-        chunks_forward_[chr_label].coo_ld_.push_back(std::make_tuple(snp_other_index, tag_index, r[i]));
       chunks_reverse_[chr_label].coo_ld_.push_back(std::make_tuple(tag_index, snp_other_index, r[i]));
       new_elements++;
     }
   }
 
-  for (int i = 0; i < chunks_forward_.size(); i++) chunks_forward_[i].coo_ld_.shrink_to_fit();
-  for (int i = 0; i < chunks_reverse_.size(); i++) chunks_reverse_[i].coo_ld_.shrink_to_fit();
+  // only touch chunks of chr_label_data, as other chromosomes may be loaded concurrently (see BgmgCalculator::set_ld_r2_from_files)
+  for (int i = 0; i < chunks_reverse_.size(); i++) if ((chr_label_data < 0) || (i == chr_label_data)) chunks_reverse_[i].coo_ld_.shrink_to_fit();
   if (elements_on_different_chromosomes > 0) LOG << " ignore " << elements_on_different_chromosomes << " r2 elements on between snps located on different chromosomes";
+  if (elements_excluded > 0) LOG << " move " << elements_excluded << " r2 elements with excluded snps to the sums below r2min";
   LOG << "<set_ld_r2_coo: done; (new_elements: " << new_elements << "), elapsed time " << timer.elapsed_ms() << " ms";
   return 0;
 }
 
+// Convert coo_ld_ into CSR format. Keys are dense integers within [key_index_from_inclusive_, key_index_to_exclusive_),
+// therefore instead of sorting all elements we make a counting sort: count elements per key, prefix-sum the counts,
+// and scatter elements into their rows; then each (short) row is sorted by val index.
+// Both passes run in parallel across blocks of coo_ld_, and each block is released right after it is scattered.
 int64_t LdMatrixCsrChunk::set_ld_r2_csr() {
   if (!csr_ld_key_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_csr twice"));
-  csr_ld_key_index_.resize(num_keys_in_chunk() + 1, 0);
+  std::vector<int64_t> csr_ld_key_index(num_keys_in_chunk() + 1, 0);
   if (coo_ld_.empty()) {
+    csr_ld_key_index_.assign(csr_ld_key_index);
     return 0;
   }
 
@@ -262,104 +549,479 @@ int64_t LdMatrixCsrChunk::set_ld_r2_csr() {
 
   SimpleTimer timer(-1);
 
-  LOG << " sorting ld r2 elements... ";
-  // Use parallel sort? https://software.intel.com/en-us/articles/a-parallel-stable-sort-using-c11-for-tbb-cilk-plus-and-openmp
-#if _OPENMP >= 200805
-  {
-    SimpleTimer timer2(-1);
-    pss::parallel_stable_sort(coo_ld_.begin(), coo_ld_.end(), std::less<std::tuple<int, int, packed_r_value>>());
-    LOG << " pss::parallel_stable_sort took " << timer2.elapsed_ms() << "ms.";
+  const int num_blocks = coo_ld_.num_blocks();
+  const int key_from = key_index_from_inclusive_;
+  const int key_to = key_index_to_exclusive_;
+  int64_t keys_out_of_range = 0;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(+: keys_out_of_range)
+  for (int block_index = 0; block_index < num_blocks; block_index++) {
+    for (const auto& element : coo_ld_.block(block_index)) {
+      const int key_index = std::get<0>(element);
+      if (key_index < key_from || key_index >= key_to) { keys_out_of_range++; continue; }
+      int64_t& count = csr_ld_key_index[key_index - key_from + 1];
+#pragma omp atomic
+      count++;
+    }
   }
-#else
-  {
-    SimpleTimer timer2(-1);
-    std::sort(coo_ld_.begin(), coo_ld_.end());
-    LOG << " std::sort took " << timer2.elapsed_ms() << "ms.";
+
+  if (keys_out_of_range > 0)
+    BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: key_index < key_index_from_inclusive_ || key_index >= key_index_to_exclusive_"));
+
+  std::partial_sum(csr_ld_key_index.begin(), csr_ld_key_index.end(), csr_ld_key_index.begin());
+
+  std::vector<uint32_t> csr_ld_val_index(coo_ld_.size());
+  HugePageVector<packed_r_value>& csr_ld_r = csr_ld_r_.mutable_vector();
+  csr_ld_r.resize(coo_ld_.size());
+  std::vector<int64_t> pos(csr_ld_key_index.begin(), csr_ld_key_index.end() - 1);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int block_index = 0; block_index < num_blocks; block_index++) {
+    for (const auto& element : coo_ld_.block(block_index)) {
+      int64_t ld_index;
+      int64_t& next_pos = pos[std::get<0>(element) - key_from];
+#pragma omp atomic capture
+      ld_index = next_pos++;
+      csr_ld_val_index[ld_index] = std::get<1>(element);
+      csr_ld_r[ld_index] = std::get<2>(element);
+    }
+    coo_ld_.clear_block(block_index);
   }
-  static bool first_call = true;
-  if (first_call) { first_call = false; LOG << " To enable parallel sort within each chr label build bgmglib with compiler that supports OpenMP 3.0";}
-#endif
 
-  std::vector<uint32_t> csr_ld_val_index_;
-  csr_ld_val_index_.reserve(coo_ld_.size());
-  csr_ld_r_.reserve(coo_ld_.size());
+  coo_ld_.clear();
+
+  sort_csr_rows(csr_ld_key_index, &csr_ld_val_index, &csr_ld_r);
+  csr_ld_key_index_.assign(csr_ld_key_index);
+  pack_ld_r2_csr(&csr_ld_val_index);
+
+  LOG << "<set_ld_r2_csr(chr_label=" << chr_label_ << "); elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
+
+// Each row is delta-encoded, and then compressed with one of LdIndexCodec codecs.
+// With kIndexCodecAuto the codec is chosen per row, whichever gives the smallest output; in practice this depends on density of the row:
+// bitmap wins for dense rows (most of the snps in the band between the first and the last index are in LD with the key),
+// bit packing for rows where all deltas are small, vsenc32 for rows where a few large gaps are mixed with small deltas.
+int64_t LdMatrixCsrChunk::pack_ld_r2_csr(std::vector<uint32_t>* csr_ld_val_index, int index_codec) {
+  validate_ld_r2_csr(*csr_ld_val_index);
+  if ((index_codec < kIndexCodecAuto) || (index_codec >= kNumIndexCodecs)) BGMG_THROW_EXCEPTION(::std::runtime_error("invalid index_codec"));
+
+  LOG << ">pack_ld_r2_csr(); ";
+  SimpleTimer timer(-1);
+  // pack LD structure
+  std::vector<uint64_t> csr_ld_val_index_offset;
+  csr_ld_val_index_offset.reserve(csr_ld_key_index_.size()); csr_ld_val_index_offset.push_back(0);
+  HugePageVector<uint8_t>& codecs = csr_ld_val_index_codec_.mutable_vector();
+  codecs.assign(num_keys_in_chunk(), kIndexCodecVSimple);
+  std::vector<int64_t> rows_per_codec(kNumIndexCodecs, 0);
+  std::vector<unsigned char> scratch;
+  int64_t buffer_size = 0;
+  for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys_in_chunk(); key_index_in_chunk++) {
+    int64_t ld_index_from = csr_ld_key_index_[key_index_in_chunk];
+    int64_t ld_index_to = csr_ld_key_index_[key_index_in_chunk + 1];
+    int64_t num_ld_indices = ld_index_to - ld_index_from;
+
+    if (num_ld_indices > 0) {
+      uint32_t* deltas = &csr_ld_val_index->at(ld_index_from);
+      compute_deltas_inplace(deltas, num_ld_indices, 0);
+
+      int codec = index_codec;
+      if (codec == kIndexCodecAuto) {
+        scratch.resize(VSENC_BOUND(num_ld_indices, sizeof(uint32_t)));
+        int64_t best_size = 0;
+        for (int candidate = 0; candidate < kNumIndexCodecs; candidate++) {
+          const int64_t bound = encode_ld_indices_bound(candidate, deltas, num_ld_indices);
+          if ((codec != kIndexCodecAuto) && (candidate == kIndexCodecBitmap) && (bound >= best_size)) continue;  // bitmap size is known upfront
+          if (scratch.size() < bound) scratch.resize(bound);
+          const int64_t size = encode_ld_indices(candidate, deltas, num_ld_indices, &scratch[0]) - &scratch[0];
+          if ((codec == kIndexCodecAuto) || (size < best_size)) { codec = candidate; best_size = size; }
+        }
+      }
+
+      const int growth_factor = 2;
+      csr_ld_val_index_packed_.resize(growth_factor * buffer_size + encode_ld_indices_bound(codec, deltas, num_ld_indices));
+      unsigned char *inptr = &csr_ld_val_index_packed_.mutable_vector()[buffer_size];
+      unsigned char *outptr = encode_ld_indices(codec, deltas, num_ld_indices, inptr);
+      buffer_size += (outptr - inptr);
+      codecs[key_index_in_chunk] = codec;
+      rows_per_codec[codec]++;
+    }
 
-  for (int64_t i = 0; i < coo_ld_.size(); i++) {
-    csr_ld_val_index_.push_back(std::get<1>(coo_ld_[i]));
-    csr_ld_r_.push_back(std::get<2>(coo_ld_[i]));
+    csr_ld_val_index_offset.push_back(buffer_size);
   }
+  csr_ld_val_index_offset_.assign(csr_ld_val_index_offset);
+  csr_ld_val_index_packed_.resize(buffer_size);
+  csr_ld_val_index_packed_.shrink_to_fit();
+  if (std::all_of(codecs.begin(), codecs.end(), [](uint8_t codec) { return codec == kIndexCodecVSimple; })) csr_ld_val_index_codec_.clear();
+  csr_ld_val_index_codec_.shrink_to_fit();
+  LOG << "<pack_ld_r2_csr(); " << buffer_size << " bytes, rows per codec (vsimple, vbyte, bitpack, bitmap): "
+      << rows_per_codec[kIndexCodecVSimple] << ", " << rows_per_codec[kIndexCodecVByte] << ", " << rows_per_codec[kIndexCodecBitPack] << ", " << rows_per_codec[kIndexCodecBitmap]
+      << "; elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
 
-  // find starting position for each key
-  std::fill(csr_ld_key_index_.begin(), csr_ld_key_index_.end(), coo_ld_.size());
-  for (int64_t ld_index = coo_ld_.size() - 1; ld_index >= 0; ld_index--) {
-    int key_index = std::get<0>(coo_ld_[ld_index]);
-    if (key_index < key_index_from_inclusive_ || key_index >= key_index_to_exclusive_)
-      BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: key_index < key_index_from_inclusive_ || key_index >= key_index_to_exclusive_"));
-    csr_ld_key_index_[key_index - key_index_from_inclusive_] = ld_index;
+int64_t LdMatrixCsrChunk::repack_ld_r2_csr(int index_codec) {
+  if (csr_ld_key_index_.empty()) return 0;
+  std::vector<uint32_t> csr_ld_val_index(csr_ld_key_index_.back());
+  LdMatrixRow row;
+  for (int key_index = key_index_from_inclusive_; key_index < key_index_to_exclusive_; key_index++) {
+    extract_row(key_index, &row);
+    std::copy(row.index_, row.index_ + row.num_, csr_ld_val_index.begin() + ld_index_begin(key_index));
   }
 
-  for (int i = (csr_ld_key_index_.size() - 2); i >= 0; i--)
-    if (csr_ld_key_index_[i] > csr_ld_key_index_[i + 1])
-      csr_ld_key_index_[i] = csr_ld_key_index_[i + 1];
+  csr_ld_val_index_offset_.clear();
+  csr_ld_val_index_packed_.clear();
+  csr_ld_val_index_codec_.clear();
+  return pack_ld_r2_csr(&csr_ld_val_index, index_codec);
+}
 
-  coo_ld_.clear();
+int64_t LdMatrixCsr::set_ld_r2_csr(float r2_min, int chr_label) {
+  check_not_shared("set_ld_r2_csr");
+  invalidate_row_cache();
+  invalidate_compact_view();
+  invalidate_snp_to_tag_map();
+  if (chr_label < 0) {
+    for (int i = 0; i < chunks_reverse_.size(); i++) set_ld_r2_csr(r2_min, i);
+  } else {  
+    // skip chunks already finalized by set_ld_r2_csr_direct()
+    LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
+    if (!chunk.is_finalized()) chunk.set_ld_r2_csr();
+    if ((r_bits_ == 8) && !chunk.is_quantized()) chunk.quantize_ld_r8();
+  }
+  return 0;
+}
+
+void LdMatrixCsr::set_r_bits(int r_bits) {
+  if ((r_bits != 8) && (r_bits != 16)) BGMG_THROW_EXCEPTION(::std::runtime_error("r_bits must be 8 or 16"));
+  if (r_bits == r_bits_) return;
+  check_not_shared("set_r_bits");
+  for (int i = 0; i < chunks_reverse_.size(); i++) {
+    if ((r_bits == 16) && chunks_reverse_[i].is_quantized()) BGMG_THROW_EXCEPTION(::std::runtime_error("LD matrix is already stored with 8-bit r values; load it again to use 16-bit r values"));
+  }
+
+  r_bits_ = r_bits;
+  if (r_bits_ != 8) return;
+  invalidate_row_cache();
+  invalidate_compact_view();
+  invalidate_snp_to_tag_map();
+  for (int i = 0; i < chunks_reverse_.size(); i++) {
+    if (chunks_reverse_[i].is_finalized() && !chunks_reverse_[i].is_empty()) chunks_reverse_[i].quantize_ld_r8();
+  }
+  for (int i = 0; i < chunks_full_.size(); i++) {
+    if (chunks_full_[i].is_finalized() && !chunks_full_[i].is_empty()) chunks_full_[i].quantize_ld_r8();
+  }
+  if (!thread_tag_from_.empty()) place_rows_per_thread();  // quantized r values are written by one thread
+}
+
+void LdMatrixCsr::set_r2_min_runtime(float r2_min, bool keep_full) {
+  if ((r2_min == r2_min_runtime_) && (keep_full == !chunks_full_.empty())) return;
+  check_not_shared("set_r2_min_runtime");
+  LOG << ">LdMatrixCsr::set_r2_min_runtime(r2_min=" << r2_min << ", keep_full=" << keep_full << "); ";
+  SimpleTimer timer(-1);
+  invalidate_row_cache();
+  invalidate_compact_view();
+  invalidate_snp_to_tag_map();
+
+  if (!chunks_full_.empty()) {
+    chunks_reverse_.swap(chunks_full_);
+    chunks_full_.clear();
+    ld_sum_.swap(ld_sum_full_); ld_sum_full_.reset();
+    ld_sum_adjust_for_hvec_.swap(ld_sum_adjust_for_hvec_full_); ld_sum_adjust_for_hvec_full_.reset();
+  }
+  r2_min_runtime_ = r2_min_in_place_;
+
+  if (r2_min <= r2_min_runtime_) {
+    if (r2_min < r2_min_in_place_) LOG << " LD matrix was already filtered in place with r2_min=" << r2_min_in_place_ << "; load it again to restore LD r2 values below this threshold";
+    LOG << "<LdMatrixCsr::set_r2_min_runtime(r2_min=" << r2_min << "); elapsed time " << timer.elapsed_ms() << " ms";
+    return;
+  }
+
+  HugePageVector<float> hvec; find_hvec(mapping_, &hvec);
+  std::shared_ptr<LdSum> ld_sum = std::make_shared<LdSum>(*ld_sum_);
+  std::shared_ptr<LdSum> ld_sum_adjust_for_hvec = std::make_shared<LdSum>(*ld_sum_adjust_for_hvec_);
+  std::vector<LdMatrixCsrChunk> chunks_filtered(chunks_reverse_.size());
+  int64_t num_ld_r = 0, num_ld_r_filtered = 0;
+  for (int chr_label = 0; chr_label < chunks_reverse_.size(); chr_label++) {
+    const LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
+    LdMatrixCsrChunk& chunk_filtered = chunks_filtered[chr_label];
+    chunk_filtered.key_index_from_inclusive_ = chunk.key_index_from_inclusive_;
+    chunk_filtered.key_index_to_exclusive_ = chunk.key_index_to_exclusive_;
+    chunk_filtered.chr_label_ = chunk.chr_label_;
+    if (!chunk.is_finalized()) continue;
+    chunk_filtered.set_ld_r2_csr_filtered(chunk, r2_min);
+    num_ld_r += chunk.num_ld_r(); num_ld_r_filtered += chunk_filtered.num_ld_r();
+
+    // each row updates LdSum only for its own tag, therefore rows can be processed in parallel
+#pragma omp parallel
+    {
+      LdMatrixRow ld_matrix_row;
+#pragma omp for schedule(dynamic, 256)
+      for (int tag_index = chunk.key_index_from_inclusive_; tag_index < chunk.key_index_to_exclusive_; tag_index++) {
+        const int snp_index = mapping_.tag_to_snp()[tag_index];
+        chunk.extract_row(tag_index, &ld_matrix_row);
+        auto iter_end = ld_matrix_row.end();
+        for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
+          const float r2 = iter.r2();
+          if (r2 >= r2_min) continue;
+          ld_sum->move_above_to_below_r2min(snp_index, r2);
+          ld_sum_adjust_for_hvec->move_above_to_below_r2min(snp_index, r2 * hvec[iter.index()]);
+        }
+      }
+    }
+  }
+
+  if (keep_full) {
+    chunks_full_.swap(chunks_reverse_);
+    ld_sum_full_ = ld_sum_;
+    ld_sum_adjust_for_hvec_full_ = ld_sum_adjust_for_hvec_;
+  } else {
+    r2_min_in_place_ = r2_min;
+  }
+  chunks_reverse_.swap(chunks_filtered);
+  ld_sum_ = ld_sum;
+  ld_sum_adjust_for_hvec_ = ld_sum_adjust_for_hvec;
+  r2_min_runtime_ = r2_min;
+  LOG << "<LdMatrixCsr::set_r2_min_runtime(r2_min=" << r2_min << "); " << num_ld_r_filtered << " LD r values out of " << num_ld_r << " are kept, elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+int64_t LdMatrixCsrChunk::quantize_ld_r8() {
+  if (is_quantized() || csr_ld_r_.empty()) return 0;
+  LOG << ">quantize_ld_r8(chr_label=" << chr_label_ << "); ";
+  SimpleTimer timer(-1);
+
+  const int64_t num_ld_r = csr_ld_r_.size();
+  float r2_min = 1.0f;
+  for (int64_t ld_index = 0; ld_index < num_ld_r; ld_index++) {
+    const float r = csr_ld_r_[ld_index].get();
+    r2_min = std::min(r2_min, r * r);
+  }
+
+  const int num_levels = 128;
+  const float r2_step = (1.0f - r2_min) / (num_levels - 1);
+  csr_ld_r8_codebook_.resize(2 * num_levels);
+  for (int level = 0; level < num_levels; level++) {
+    const float r = (level == (num_levels - 1)) ? 1.0f : sqrt(r2_min + r2_step * level);
+    csr_ld_r8_codebook_[level] = r;
+    csr_ld_r8_codebook_[num_levels + level] = -r;
+  }
+
+  HugePageVector<uint8_t>& csr_ld_r8 = csr_ld_r8_.mutable_vector();
+  csr_ld_r8.resize(num_ld_r);
+  double sum_abs_error_r2 = 0, max_abs_error_r2 = 0;
+  for (int64_t ld_index = 0; ld_index < num_ld_r; ld_index++) {
+    const float r = csr_ld_r_[ld_index].get();
+    const int level = (r2_step > 0) ? std::min(num_levels - 1, std::max(0, (int)roundf((r * r - r2_min) / r2_step))) : (num_levels - 1);
+    csr_ld_r8[ld_index] = static_cast<uint8_t>((r < 0) ? (num_levels + level) : level);
+    const float r_quantized = csr_ld_r8_codebook_[csr_ld_r8[ld_index]];
+    const double abs_error_r2 = fabs(r_quantized * r_quantized - r * r);
+    sum_abs_error_r2 += abs_error_r2; max_abs_error_r2 = std::max(max_abs_error_r2, abs_error_r2);
+  }
+
+  csr_ld_r_.clear(); csr_ld_r_.shrink_to_fit();
+  LOG << "<quantize_ld_r8(chr_label=" << chr_label_ << "); r2 in [" << r2_min << ", 1.0], mean abs error in r2 " << (sum_abs_error_r2 / num_ld_r) << ", max abs error in r2 " << max_abs_error_r2 << "; elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
 
-  validate_ld_r2_csr(csr_ld_val_index_);
+// Transpose is done in two passes over the rows of the source chunk: first pass counts elements for each key, 
+// second pass scatters elements to their rows. Both passes are parallel across rows of the source chunk,
+// therefore the rows of the result are sorted at the end. Values (r) are copied as is, i.e. there is no loss of precision;
+// for quantized source the result is also quantized, and shares the codebook of the source.
+int64_t LdMatrixCsrChunk::set_ld_r2_csr_transpose(const LdMatrixCsrChunk& source) {
+  if (!csr_ld_key_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_csr_transpose twice"));
+  const int num_keys = num_keys_in_chunk();
+  std::vector<int64_t> key_index(num_keys + 1, 0);
+  if (source.is_empty()) { csr_ld_key_index_.assign(key_index); return 0; }
+
+  LOG << ">set_ld_r2_csr_transpose(chr_label=" << chr_label_ << "); ";
+  SimpleTimer timer(-1);
 
+  const int source_key_from = source.key_index_from_inclusive_;
+  const int source_key_to = source.key_index_to_exclusive_;
+  const int key_from = key_index_from_inclusive_;
+
+#pragma omp parallel
   {
-    LOG << ">pack_ld_r2_csr(); ";
-    SimpleTimer timer3(-1);
-    // pack LD structure
-    csr_ld_val_index_offset_.reserve(csr_ld_key_index_.size()); csr_ld_val_index_offset_.push_back(0);
-    int64_t buffer_size = 0;
-    for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys_in_chunk(); key_index_in_chunk++) {
-      int64_t ld_index_from = csr_ld_key_index_[key_index_in_chunk];
-      int64_t ld_index_to = csr_ld_key_index_[key_index_in_chunk + 1];
-      int64_t num_ld_indices = ld_index_to - ld_index_from;
-
-      if (num_ld_indices > 0) {
-        compute_deltas_inplace(&csr_ld_val_index_[ld_index_from], num_ld_indices, 0);
-
-        const int growth_factor = 2;
-        csr_ld_val_index_packed_.resize(growth_factor * buffer_size + VSENC_BOUND(num_ld_indices, sizeof(uint32_t)));
-        unsigned char *inptr = &csr_ld_val_index_packed_[buffer_size];
-        unsigned char *outptr = vsenc32(&csr_ld_val_index_[ld_index_from], num_ld_indices, inptr);
-        buffer_size += (outptr - inptr);
+    LdMatrixRow ld_matrix_row;
+#pragma omp for schedule(dynamic, 256)
+    for (int source_key = source_key_from; source_key < source_key_to; source_key++) {
+      source.extract_row(source_key, &ld_matrix_row);
+      for (int k = 0; k < ld_matrix_row.num_; k++) {
+        int64_t& count = key_index[ld_matrix_row.index_[k] - key_from + 1];
+#pragma omp atomic
+        count++;
       }
+    }
+  }
+
+  std::partial_sum(key_index.begin(), key_index.end(), key_index.begin());
+  if (key_index.back() != source.num_ld_r()) BGMG_THROW_EXCEPTION(::std::runtime_error("internal error, set_ld_r2_csr_transpose: source chunk refers to keys outside of this chunk"));
 
-      csr_ld_val_index_offset_.push_back(buffer_size);
+  std::vector<uint32_t> val_index(key_index.back());
+  HugePageVector<packed_r_value> r;
+  HugePageVector<uint8_t> r8;
+  if (source.is_quantized()) r8.resize(key_index.back()); else r.resize(key_index.back());
+  std::vector<int64_t> pos(key_index.begin(), key_index.end() - 1);
+
+#pragma omp parallel
+  {
+    LdMatrixRow ld_matrix_row;
+#pragma omp for schedule(dynamic, 256)
+    for (int source_key = source_key_from; source_key < source_key_to; source_key++) {
+      source.extract_row(source_key, &ld_matrix_row);
+      for (int k = 0; k < ld_matrix_row.num_; k++) {
+        int64_t ld_index;
+        int64_t& next_pos = pos[ld_matrix_row.index_[k] - key_from];
+#pragma omp atomic capture
+        ld_index = next_pos++;
+        val_index[ld_index] = source_key;
+        if (ld_matrix_row.r8_ != nullptr) r8[ld_index] = ld_matrix_row.r8_[k];
+        else r[ld_index] = ld_matrix_row.r_[k];
+      }
     }
-    csr_ld_val_index_packed_.resize(buffer_size);
-    csr_ld_val_index_packed_.shrink_to_fit();
-    LOG << "<pack_ld_r2_csr(); elapsed time " << timer3.elapsed_ms() << " ms";
   }
 
-  LOG << "<set_ld_r2_csr(chr_label=" << chr_label_ << "); elapsed time " << timer.elapsed_ms() << " ms";
+  if (source.is_quantized()) {
+    sort_csr_rows(key_index, &val_index, &r8);
+    csr_ld_r8_.mutable_vector().swap(r8);
+    csr_ld_r8_codebook_ = source.csr_ld_r8_codebook_;
+  } else {
+    sort_csr_rows(key_index, &val_index, &r);
+    csr_ld_r_.mutable_vector().swap(r);
+  }
+  csr_ld_key_index_.assign(key_index);
+  pack_ld_r2_csr(&val_index);
+  LOG << "<set_ld_r2_csr_transpose(chr_label=" << chr_label_ << "); elapsed time " << timer.elapsed_ms() << " ms";
   return 0;
 }
 
-int64_t LdMatrixCsr::set_ld_r2_csr(float r2_min, int chr_label) {
-  if (chr_label < 0) {
-    for (int i = 0; i < chunks_forward_.size(); i++) set_ld_r2_csr(r2_min, i);
-  } else {  
-    chunks_forward_[chr_label].set_ld_r2_csr();
-    chunks_reverse_[chr_label].set_ld_r2_csr();
+// Rows are copied in their packed form (no decoding), therefore each row keeps its index codec.
+int64_t LdMatrixCsrChunk::set_ld_r2_csr_subset(const LdMatrixCsrChunk& source, const std::vector<char>& keep_key) {
+  if (!csr_ld_key_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_csr_subset twice"));
+  if ((key_index_from_inclusive_ != source.key_index_from_inclusive_) || (key_index_to_exclusive_ != source.key_index_to_exclusive_))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("internal error, set_ld_r2_csr_subset: source chunk has different range of keys"));
+
+  const int num_keys = num_keys_in_chunk();
+  std::vector<int64_t> key_index(num_keys + 1, 0);
+  std::vector<uint64_t> val_index_offset(num_keys + 1, 0);
+  for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys; key_index_in_chunk++) {
+    const int key = key_index_from_inclusive_ + key_index_in_chunk;
+    const bool keep = keep_key[key] && !source.is_empty();
+    key_index[key_index_in_chunk + 1] = key_index[key_index_in_chunk] + (keep ? source.num_ld_r2(key) : 0);
+    val_index_offset[key_index_in_chunk + 1] = val_index_offset[key_index_in_chunk] + 
+      (keep ? (source.csr_ld_val_index_offset_[key_index_in_chunk + 1] - source.csr_ld_val_index_offset_[key_index_in_chunk]) : 0);
+  }
+
+  HugePageVector<unsigned char>& packed = csr_ld_val_index_packed_.mutable_vector();
+  HugePageVector<uint8_t>& codecs = csr_ld_val_index_codec_.mutable_vector();
+  HugePageVector<packed_r_value>& r = csr_ld_r_.mutable_vector();
+  HugePageVector<uint8_t>& r8 = csr_ld_r8_.mutable_vector();
+  packed.resize(val_index_offset.back());
+  if (!source.csr_ld_val_index_codec_.empty()) codecs.assign(num_keys, kIndexCodecVSimple);
+  if (source.is_quantized()) r8.resize(key_index.back()); else r.resize(key_index.back());
+  csr_ld_r8_codebook_ = source.csr_ld_r8_codebook_;
+
+#pragma omp parallel for schedule(dynamic, 256)
+  for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys; key_index_in_chunk++) {
+    const int key = key_index_from_inclusive_ + key_index_in_chunk;
+    if (key_index[key_index_in_chunk + 1] == key_index[key_index_in_chunk]) continue;
+    std::copy(source.csr_ld_val_index_packed(key), source.csr_ld_val_index_packed(key) + (val_index_offset[key_index_in_chunk + 1] - val_index_offset[key_index_in_chunk]),
+              packed.begin() + val_index_offset[key_index_in_chunk]);
+    if (!codecs.empty()) codecs[key_index_in_chunk] = source.csr_ld_val_index_codec(key);
+    if (source.is_quantized()) std::copy(source.csr_ld_r8_.begin() + source.ld_index_begin(key), source.csr_ld_r8_.begin() + source.ld_index_end(key), r8.begin() + key_index[key_index_in_chunk]);
+    else std::copy(source.csr_ld_r_.begin() + source.ld_index_begin(key), source.csr_ld_r_.begin() + source.ld_index_end(key), r.begin() + key_index[key_index_in_chunk]);
   }
+
+  csr_ld_key_index_.assign(key_index);
+  csr_ld_val_index_offset_.assign(val_index_offset);
+  return 0;
+}
+
+// Rows are visited in parallel; each row is first counted, then copied, and finally packed again.
+int64_t LdMatrixCsrChunk::set_ld_r2_csr_filtered(const LdMatrixCsrChunk& source, float r2_min) {
+  if (!csr_ld_key_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_csr_filtered twice"));
+  if ((key_index_from_inclusive_ != source.key_index_from_inclusive_) || (key_index_to_exclusive_ != source.key_index_to_exclusive_))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("internal error, set_ld_r2_csr_filtered: source chunk has different range of keys"));
+
+  const int num_keys = num_keys_in_chunk();
+  std::vector<int64_t> key_index(num_keys + 1, 0);
+  if (source.is_empty()) { csr_ld_key_index_.assign(key_index); return 0; }
+
+#pragma omp parallel
+  {
+    LdMatrixRow ld_matrix_row;
+#pragma omp for schedule(dynamic, 256)
+    for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys; key_index_in_chunk++) {
+      source.extract_row(key_index_from_inclusive_ + key_index_in_chunk, &ld_matrix_row);
+      int64_t count = 0;
+      for (auto iter = ld_matrix_row.begin(); iter < ld_matrix_row.end(); iter++) if (iter.r2() >= r2_min) count++;
+      key_index[key_index_in_chunk + 1] = count;
+    }
+  }
+
+  std::partial_sum(key_index.begin(), key_index.end(), key_index.begin());
+  std::vector<uint32_t> val_index(key_index.back());
+  HugePageVector<packed_r_value>& r = csr_ld_r_.mutable_vector();
+  HugePageVector<uint8_t>& r8 = csr_ld_r8_.mutable_vector();
+  if (source.is_quantized()) r8.resize(key_index.back()); else r.resize(key_index.back());
+  csr_ld_r8_codebook_ = source.csr_ld_r8_codebook_;
+
+#pragma omp parallel
+  {
+    LdMatrixRow ld_matrix_row;
+#pragma omp for schedule(dynamic, 256)
+    for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys; key_index_in_chunk++) {
+      source.extract_row(key_index_from_inclusive_ + key_index_in_chunk, &ld_matrix_row);
+      int64_t ld_index = key_index[key_index_in_chunk];
+      auto iter = ld_matrix_row.begin();
+      for (int k = 0; k < ld_matrix_row.num_; k++, iter++) {
+        if (iter.r2() < r2_min) continue;
+        val_index[ld_index] = ld_matrix_row.index_[k];
+        if (ld_matrix_row.r8_ != nullptr) r8[ld_index] = ld_matrix_row.r8_[k];
+        else r[ld_index] = ld_matrix_row.r_[k];
+        ld_index++;
+      }
+    }
+  }
+
+  csr_ld_key_index_.assign(key_index);
+  pack_ld_r2_csr(&val_index);
   return 0;
 }
 
+void LdMatrixCsr::invalidate_snp_to_tag_map() {
+  std::lock_guard<std::mutex> guard(snp_to_tag_map_mutex_);
+  snp_to_tag_map_valid_ = false;
+  for (int i = 0; i < chunks_forward_.size(); i++) chunks_forward_[i].clear_csr();
+}
+
+// When the first call comes from within a parallel region the remaining threads wait on snp_to_tag_map_mutex_ until the transpose is ready.
+void LdMatrixCsr::init_snp_to_tag_map() {
+  if (shared_ != nullptr) { shared_->init_snp_to_tag_map(); return; }
+  if (snp_to_tag_map_valid_) return;
+  std::lock_guard<std::mutex> guard(snp_to_tag_map_mutex_);
+  if (snp_to_tag_map_valid_) return;
+
+  for (int chr_label = 0; chr_label < chunks_reverse_.size(); chr_label++) {
+    if (!chunks_reverse_[chr_label].is_finalized() || chunks_forward_[chr_label].is_finalized()) continue;
+    chunks_forward_[chr_label].set_ld_r2_csr_transpose(chunks_reverse_[chr_label]);
+  }
+
+  snp_to_tag_map_valid_ = true;
+}
+
 int64_t LdMatrixCsrChunk::validate_ld_r2_csr(const std::vector<uint32_t>& csr_ld_val_index_) {
   LOG << ">validate_ld_r2_csr(); ";
   SimpleTimer timer(-1);
 
-  if (csr_ld_r_.empty()) return 0;  // allow empty chunks
+  if (is_empty()) return 0;  // allow empty chunks
+  const int64_t num_ld_r = this->num_ld_r();
   
   // Test correctness of sparse representation
   if (csr_ld_key_index_.size() != (num_keys_in_chunk() + 1)) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_key_index_.size() != (num_keys_in_chunk() + 1))"));
-  for (int i = 0; i < csr_ld_key_index_.size(); i++) if (csr_ld_key_index_[i] < 0 || csr_ld_key_index_[i] > csr_ld_r_.size()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_key_index_[i] < 0 || csr_ld_key_index_[i] > csr_ld_r_.size()"));
+  for (int i = 0; i < csr_ld_key_index_.size(); i++) if (csr_ld_key_index_[i] < 0 || csr_ld_key_index_[i] > num_ld_r) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_key_index_[i] < 0 || csr_ld_key_index_[i] > num_ld_r()"));
   for (int i = 1; i < csr_ld_key_index_.size(); i++) if (csr_ld_key_index_[i - 1] > csr_ld_key_index_[i]) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_key_index_[i-1] > csr_ld_key_index_[i]"));
-  if (csr_ld_key_index_.back() != csr_ld_r_.size()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_key_index_.back() != csr_ld_r_.size()"));
-  if (csr_ld_val_index_.size() != csr_ld_r_.size()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_val_index_.size() != csr_ld_r_.size()"));
+  if (csr_ld_key_index_.back() != num_ld_r) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_key_index_.back() != num_ld_r()"));
+  if (csr_ld_val_index_.size() != num_ld_r) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_val_index_.size() != num_ld_r()"));
 
   // Test that LDr2 does not have duplicates
   for (int key_index_in_chunk = 0; key_index_in_chunk < num_keys_in_chunk(); key_index_in_chunk++) {
@@ -379,11 +1041,23 @@ float LdMatrixCsrChunk::find_and_retrieve_ld_r2(int key_index, int val_index, co
   auto r2_iter_from = csr_ld_val_index_.begin() + csr_ld_key_index_[key_index - key_index_from_inclusive_];
   auto r2_iter_to = csr_ld_val_index_.begin() + csr_ld_key_index_[key_index - key_index_from_inclusive_ + 1];
   auto iter = std::lower_bound(r2_iter_from, r2_iter_to, val_index);
-  return (iter != r2_iter_to) ? csr_ld_r_[iter - csr_ld_val_index_.begin()].get() : NAN;
+  return (iter != r2_iter_to) ? get_r(iter - csr_ld_val_index_.begin()) : NAN;
 }
 
 size_t LdMatrixCsr::log_diagnostics() {
   size_t mem_bytes = 0, mem_bytes_total = 0;
+  if (shared_ != nullptr) {
+    LOG << " diag: LdMatrixCsr is shared by " << shared_.use_count() << " contexts" << (shared_tag_index_.empty() ? "" : " (with translation of tag indices)") << "; logging info for the shared matrix";
+    mem_bytes = (shared_tag_index_.size() + shared_tag_to_local_.size()) * sizeof(int); mem_bytes_total += mem_bytes;
+    return mem_bytes_total + shared_->log_diagnostics();
+  }
+  mem_bytes = row_cache_index_.size() * (sizeof(int) + sizeof(float)); mem_bytes_total += mem_bytes;
+  LOG << " diag: LdMatrixCsr row cache budget " << row_cache_budget_bytes_ << " bytes, " << row_cache_index_.size() << " elements cached (mem usage = " << mem_bytes << " bytes)";
+  for (auto ld_sum : { ld_sum_.get(), ld_sum_adjust_for_hvec_.get() }) {
+    if (ld_sum == nullptr) continue;
+    mem_bytes = ld_sum->num_bytes(); mem_bytes_total += mem_bytes;
+    LOG << " diag: LdMatrixCsr " << ((ld_sum == ld_sum_.get()) ? "ld_sum" : "ld_sum_adjust_for_hvec") << " (mem usage = " << mem_bytes << " bytes, " << ld_sum->pages_str() << ")";
+  }
   LOG << " diag: LdMatrixCsr " << chunks_forward_.size() <<  " chunks in total. Logging futher info for non-empty chunks only.";
   for (int i = 0; i < chunks_forward_.size(); i++) {
     if (chunks_forward_[i].is_empty()) continue;
@@ -395,6 +1069,11 @@ size_t LdMatrixCsr::log_diagnostics() {
     LOG << " diag: LdMatrixCsr reverse chunk " << i << ", key_index in ["<< chunks_reverse_[i].key_index_from_inclusive_ << ", " << chunks_reverse_[i].key_index_to_exclusive_ << ")";
     mem_bytes_total += chunks_reverse_[i].log_diagnostics();
   }
+  for (int i = 0; i < chunks_compact_.size(); i++) {
+    if (chunks_compact_[i].is_empty()) continue;
+    LOG << " diag: LdMatrixCsr compact chunk " << i << ", key_index in ["<< chunks_compact_[i].key_index_from_inclusive_ << ", " << chunks_compact_[i].key_index_to_exclusive_ << ")";
+    mem_bytes_total += chunks_compact_[i].log_diagnostics();
+  }
 
   return mem_bytes_total;
 }
@@ -403,18 +1082,45 @@ size_t LdMatrixCsrChunk::log_diagnostics() {
   size_t mem_bytes = 0, mem_bytes_total = 0;
   mem_bytes = coo_ld_.size() * (sizeof(packed_r_value) + sizeof(int) + sizeof(int)); mem_bytes_total += mem_bytes;
   LOG << " diag: coo_ld_.size()=" << coo_ld_.size() << " (mem usage = " << mem_bytes << " bytes)";
-  LOG << " diag: csr_ld_key_index_.size()=" << csr_ld_key_index_.size();
-  LOG << " diag: csr_ld_val_index_offset_.size()=" << csr_ld_val_index_offset_.size();
+  mem_bytes = csr_ld_key_index_.num_bytes(); mem_bytes_total += mem_bytes;
+  LOG << " diag: csr_ld_key_index_.size()=" << csr_ld_key_index_.size() << " (mem usage = " << mem_bytes << " bytes)";
+  mem_bytes = csr_ld_val_index_offset_.num_bytes(); mem_bytes_total += mem_bytes;
+  LOG << " diag: csr_ld_val_index_offset_.size()=" << csr_ld_val_index_offset_.size() << " (mem usage = " << mem_bytes << " bytes)";
   mem_bytes = csr_ld_val_index_packed_.size() * sizeof(unsigned char); mem_bytes_total += mem_bytes;
-  LOG << " diag: csr_ld_val_index_packed_.size()=" << csr_ld_val_index_packed_.size() << " (mem usage = " << mem_bytes << " bytes)";
+  LOG << " diag: csr_ld_val_index_packed_.size()=" << csr_ld_val_index_packed_.size() << " (mem usage = " << mem_bytes << " bytes, " << csr_ld_val_index_packed_.pages_str() << ")";
+  mem_bytes = csr_ld_val_index_codec_.size() * sizeof(uint8_t); mem_bytes_total += mem_bytes;
+  LOG << " diag: csr_ld_val_index_codec_.size()=" << csr_ld_val_index_codec_.size() << " (mem usage = " << mem_bytes << " bytes)";
   mem_bytes = csr_ld_r_.size() * sizeof(packed_r_value); mem_bytes_total += mem_bytes;
-  LOG << " diag: csr_ld_r_.size()=" << csr_ld_r_.size() << " (mem usage = " << mem_bytes << " bytes)";
+  LOG << " diag: csr_ld_r_.size()=" << csr_ld_r_.size() << " (mem usage = " << mem_bytes << " bytes, " << csr_ld_r_.pages_str() << ")";
+  mem_bytes = csr_ld_r8_.size() * sizeof(uint8_t) + csr_ld_r8_codebook_.size() * sizeof(float); mem_bytes_total += mem_bytes;
+  LOG << " diag: csr_ld_r8_.size()=" << csr_ld_r8_.size() << " (mem usage = " << mem_bytes << " bytes, " << csr_ld_r8_.pages_str() << ")";
   return mem_bytes_total;
 }
 
 void LdMatrixCsr::clear() {
+  if (shared_ != nullptr) {  // detach, leaving the shared matrix and its LdSum untouched
+    shared_.reset();
+    std::vector<int>().swap(shared_tag_index_);
+    std::vector<int>().swap(shared_tag_to_local_);
+    ld_sum_adjust_for_hvec_ = std::make_shared<LdSum>(mapping_);
+    ld_sum_ = std::make_shared<LdSum>(mapping_);
+  }
+  invalidate_row_cache();
+  invalidate_compact_view();
+  invalidate_snp_to_tag_map();
   chunks_forward_.clear();
   chunks_reverse_.clear();
+  stream_spilled_.clear();
+  stream_resident_.clear();
+  stream_chunk_ = -1;
+  thread_tag_from_.clear();
+  compact_tag_.clear();
+  compact_freed_rest_ = false;
+  chunks_full_.clear();
+  ld_sum_full_.reset();
+  ld_sum_adjust_for_hvec_full_.reset();
+  r2_min_runtime_ = 0.0f;
+  r2_min_in_place_ = 0.0f;
   if (ld_sum_adjust_for_hvec_ != nullptr) ld_sum_adjust_for_hvec_->clear();
   if (ld_sum_ != nullptr) ld_sum_->clear();
 }
@@ -423,32 +1129,94 @@ void LdMatrixCsrChunk::clear() {
   coo_ld_.clear();
 }
 
-void LdMatrixCsrChunk::extract_row(int key_index, LdMatrixRow* row) {
+void LdMatrixCsrChunk::clear_csr() {
+  csr_ld_key_index_.clear(); csr_ld_key_index_.shrink_to_fit();
+  csr_ld_val_index_offset_.clear(); csr_ld_val_index_offset_.shrink_to_fit();
+  csr_ld_val_index_packed_.clear(); csr_ld_val_index_packed_.shrink_to_fit();
+  csr_ld_val_index_codec_.clear(); csr_ld_val_index_codec_.shrink_to_fit();
+  csr_ld_r_.clear(); csr_ld_r_.shrink_to_fit();
+  csr_ld_r8_.clear(); csr_ld_r8_.shrink_to_fit();
+  std::vector<float>().swap(csr_ld_r8_codebook_);
+}
+
+// Decode a row of indices, packed by pack_ld_r2_csr (delta-encoded, then compressed with one of LdIndexCodec codecs).
+// The codec restores the deltas, and the prefix sum runs straight away on the same buffer while it is still in L1 cache
+// (except for kIndexCodecBitmap, which restores the indices directly).
+// With AVX2 the prefix sum handles 8 elements per step; otherwise we fall back to SSE version from FastDifferentialCoding.
+void decode_ld_indices(int codec, const unsigned char* packed, int64_t num, uint32_t* out) {
+  if (codec == kIndexCodecBitmap) { bitmap_dec32(packed, num, out); return; }
+  if (codec == kIndexCodecBitPack) bitpack_dec32(packed, num, out);
+  else if (codec == kIndexCodecVByte) vbdec32(const_cast<unsigned char*>(packed), num, out);
+  else vsdec32(const_cast<unsigned char*>(packed), num, out);
+
+#ifdef __AVX2__
+  __m256i carry = _mm256_setzero_si256();
+  const __m256i last_element = _mm256_set1_epi32(7);
+  int64_t i = 0;
+  for (; i + 8 <= num; i += 8) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + i));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));         // prefix sum within each 128-bit lane
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i low_lane_total = _mm256_shuffle_epi32(x, 0xFF);
+    low_lane_total = _mm256_permute2x128_si256(low_lane_total, low_lane_total, 0x08);  // move to the high lane, zero the low lane
+    x = _mm256_add_epi32(_mm256_add_epi32(x, low_lane_total), carry);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), x);
+    carry = _mm256_permutevar8x32_epi32(x, last_element);
+  }
+  uint32_t running_sum = (i > 0) ? out[i - 1] : 0;
+  for (; i < num; i++) out[i] = (running_sum += out[i]);
+#else
+  compute_prefix_sum_inplace(out, num, 0);
+#endif
+}
+
+void LdMatrixCsrChunk::extract_row(int key_index, LdMatrixRow* row) const {
   const int64_t num_ld_r2 = this->num_ld_r2(key_index);
-  row->index_vector_.reserve(VSDEC_NUMEL(num_ld_r2));
-  row->index_vector_.resize(num_ld_r2);  // std::vector.resize() never reduce capacity
-  row->r_.resize(num_ld_r2);
+  if (row->index_buffer_.size() < VSDEC_NUMEL(num_ld_r2)) row->index_buffer_.resize(VSDEC_NUMEL(num_ld_r2));
+  row->num_ = num_ld_r2;
+  row->index_ = &row->index_buffer_[0];
+  row->r_ = csr_ld_r_.data() + this->ld_index_begin(key_index);
+  row->r_float_ = nullptr;
+  row->r8_ = is_quantized() ? (csr_ld_r8_.data() + this->ld_index_begin(key_index)) : nullptr;
+  row->r8_codebook_ = csr_ld_r8_codebook_.data();
 
   // empty LD entry
   if (num_ld_r2 == 0) return;
 
-  vsdec32(this->csr_ld_val_index_packed(key_index), num_ld_r2, reinterpret_cast<unsigned int*>(&row->index_vector_[0]));
-
-  compute_prefix_sum_inplace(reinterpret_cast<uint32_t*>(&row->index_vector_[0]), num_ld_r2, 0);
-
-  const int64_t ld_index_begin = this->ld_index_begin(key_index);
-  const int64_t ld_index_end = this->ld_index_end(key_index);
-  for (int64_t ld_index = ld_index_begin; ld_index < ld_index_end; ld_index++) {
-    row->r_.at(ld_index - ld_index_begin) = this->csr_ld_r_[ld_index];
-  }
+  decode_ld_indices(this->csr_ld_val_index_codec(key_index), this->csr_ld_val_index_packed(key_index), num_ld_r2, reinterpret_cast<uint32_t*>(&row->index_buffer_[0]));
 }
 
 void LdMatrixCsr::extract_snp_row(SnpIndex snp_index, LdMatrixRow* row) {
+  if (shared_ != nullptr) {
+    shared_->extract_snp_row(snp_index, row);
+    if (shared_tag_to_local_.empty()) return;
+
+    // translate tag indices of the shared matrix, and drop tags which are not present in this matrix
+    if (row->index_ != row->index_buffer_.data()) row->index_buffer_.resize(std::max<size_t>(row->index_buffer_.size(), row->num_));
+    if (row->r_buffer_.size() < row->num_) row->r_buffer_.resize(row->num_);
+    int num = 0;
+    auto iter = row->begin();
+    for (int k = 0; k < row->num_; k++, iter++) {
+      const int tag_index = shared_tag_to_local_[row->index_[k]];
+      if (tag_index < 0) continue;
+      row->r_buffer_[num] = iter.r();
+      row->index_buffer_[num] = tag_index;
+      num++;
+    }
+    row->num_ = num;
+    row->index_ = row->index_buffer_.data();
+    row->r_ = nullptr;
+    row->r8_ = nullptr;
+    row->r_float_ = row->r_buffer_.data();
+    return;
+  }
+
   if (mapping_.num_tag() == mapping_.num_snp()) {
     extract_tag_row(TagIndex(snp_index.index()), row);
     return;
   }
 
+  init_snp_to_tag_map();
   const int chr_label = mapping_.chrnumvec()[snp_index.index()];
   LdMatrixCsrChunk& chunk = chunks_forward_[chr_label];
   if (chunk.is_empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("chunks_forward_ is empty()"));  
@@ -456,19 +1224,349 @@ void LdMatrixCsr::extract_snp_row(SnpIndex snp_index, LdMatrixRow* row) {
 }
 
 void LdMatrixCsr::extract_tag_row(TagIndex tag_index, LdMatrixRow* row) {
+  if (shared_ != nullptr) {
+    shared_->extract_tag_row(shared_tag_index_.empty() ? tag_index : TagIndex(shared_tag_index_[tag_index.index()]), row);
+    return;
+  }
+
   const int chr_label = mapping_.chrnumvec()[mapping_.tag_to_snp()[tag_index.index()]];
   LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
   if (chunk.is_empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("chunks_reverse_ is empty()"));  
+
+  init_row_cache();
+  if (!row_cache_offset_.empty()) {
+    const int64_t offset = row_cache_offset_[tag_index.index()];
+    if (offset >= 0) {
+      row->num_ = chunk.num_ld_r2(tag_index.index());
+      row->index_ = &row_cache_index_[offset];
+      row->r_ = nullptr;
+      row->r8_ = nullptr;
+      row->r_float_ = &row_cache_r_[offset];
+      return;
+    }
+  }
+
+  if (!compact_tag_.empty()) {
+    if (compact_tag_[tag_index.index()] && !chunks_compact_.empty()) {
+      chunks_compact_[chr_label].extract_row(tag_index.index(), row);
+      return;
+    }
+    if (!compact_tag_[tag_index.index()] && compact_freed_rest_) BGMG_THROW_EXCEPTION(::std::runtime_error("LD row of a tag was released by compact_ld_to_deftags"));
+  }
+
+  if (stream_spilled_[chr_label]) stream_to_chunk(chr_label);
   chunk.extract_row(tag_index.index(), row);
 }
 
+// Keep in memory the spilled chunk of chr_label, the previous one (other threads may still be finishing its rows), and the next one (prefetched);
+// release the others. Releasing pages that are still in use is safe: they are read-only, and are read again from the file on access.
+void LdMatrixCsr::stream_to_chunk(int chr_label) {
+  if (stream_chunk_.load() == chr_label) return;
+  std::lock_guard<std::mutex> guard(stream_mutex_);
+  if (stream_chunk_.load() == chr_label) return;
+  stream_chunk_.store(chr_label);
+
+  int prev_chr_label = -1, next_chr_label = -1;
+  for (int i = 0; i < chr_label; i++) if (stream_spilled_[i]) prev_chr_label = i;
+  for (int i = (int)stream_spilled_.size() - 1; i > chr_label; i--) if (stream_spilled_[i]) next_chr_label = i;
+
+  for (int i = 0; i < stream_spilled_.size(); i++) {
+    const bool keep = (i == prev_chr_label) || (i == chr_label) || (i == next_chr_label);
+    if (!stream_spilled_[i] || (keep == (stream_resident_[i] != 0))) continue;
+    advise_chunk(i, keep);
+    stream_resident_[i] = keep ? 1 : 0;
+  }
+}
+
+void LdMatrixCsr::set_excluded_snps(const std::vector<char>& excluded_snp) {
+  check_not_shared("set_excluded_snps");
+  if (!excluded_snp.empty() && (excluded_snp.size() != mapping_.num_snp())) BGMG_THROW_EXCEPTION(::std::runtime_error("set_excluded_snps: wrong number of snps"));
+  for (auto& chunk : chunks_reverse_)
+    if (!chunk.coo_ld_.empty() || !chunk.csr_ld_key_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("set_excluded_snps must be called before LD matrix is loaded"));
+  const int num_excluded = std::count(excluded_snp.begin(), excluded_snp.end(), 1);
+  LOG << " LdMatrixCsr::set_excluded_snps(), " << num_excluded << " snps are excluded from the reference";
+  if (num_excluded == 0) std::vector<char>().swap(excluded_snp_);
+  else excluded_snp_ = excluded_snp;
+}
+
+void LdMatrixCsr::check_not_shared(const char* what) {
+  if (shared_ == nullptr) return;
+  BGMG_THROW_EXCEPTION(::std::runtime_error(std::string(what) + ": LD matrix is shared with other contexts and can't be modified; clear it, or load it again without sharing"));
+}
+
+void LdMatrixCsr::place_rows_per_thread() {
+  check_not_shared("place_rows_per_thread");
+  LOG << ">LdMatrixCsr::place_rows_per_thread(); ";
+  SimpleTimer timer(-1);
+  const int num_threads = omp_get_max_threads();
+  const int num_tag = mapping_.num_tag();
+
+  // split tags between threads, balancing the number of LD r values
+  std::vector<int64_t> num_ld_r_cumsum(num_tag + 1, 0);
+  for (int tag_index = 0; tag_index < num_tag; tag_index++) {
+    const LdMatrixCsrChunk& chunk = chunks_reverse_[mapping_.chrnumvec()[mapping_.tag_to_snp()[tag_index]]];
+    num_ld_r_cumsum[tag_index + 1] = num_ld_r_cumsum[tag_index] + (chunk.is_finalized() ? chunk.num_ld_r2(tag_index) : 0);
+  }
+  thread_tag_from_.assign(num_threads + 1, num_tag);
+  for (int thread_num = 0; thread_num < num_threads; thread_num++) {
+    const int64_t num_ld_r_before = (num_ld_r_cumsum.back() * thread_num) / num_threads;
+    thread_tag_from_[thread_num] = std::lower_bound(num_ld_r_cumsum.begin(), num_ld_r_cumsum.end() - 1, num_ld_r_before) - num_ld_r_cumsum.begin();
+  }
+
+  // uninitialized buffers (fresh pages from huge_pages_allocate, not touched until the copy)
+  struct PlacedChunk { int chr_label; std::shared_ptr<void> packed, r, r8; };
+  auto allocate = [](size_t bytes) { return std::shared_ptr<void>(huge_pages_allocate(bytes), [bytes](void* ptr) { huge_pages_deallocate(ptr, bytes); }); };
+  std::vector<PlacedChunk> placed;
+  for (int chr_label = 0; chr_label < chunks_reverse_.size(); chr_label++) {
+    const LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
+    if (!chunk.is_finalized() || chunk.is_empty()) continue;
+    if (chunk.csr_ld_val_index_packed_.is_mapped() || chunk.csr_ld_r_.is_mapped() || chunk.csr_ld_r8_.is_mapped()) continue;
+    PlacedChunk entry; entry.chr_label = chr_label;
+    entry.packed = allocate(chunk.csr_ld_val_index_packed_.size() + 1);
+    entry.r = allocate(chunk.csr_ld_r_.size() * sizeof(packed_r_value) + 1);
+    entry.r8 = allocate(chunk.csr_ld_r8_.size() + 1);
+    placed.push_back(entry);
+  }
+
+#pragma omp parallel num_threads(num_threads)
+  {
+    // each part is copied by the thread with the same number; the loop only matters if the team is smaller than requested
+    for (int part = omp_get_thread_num(); part < num_threads; part += omp_get_num_threads()) {
+      for (auto& entry : placed) {
+        const LdMatrixCsrChunk& chunk = chunks_reverse_[entry.chr_label];
+        const int tag_from = std::max(thread_tag_from_[part], chunk.key_index_from_inclusive_);
+        const int tag_to = std::min(thread_tag_from_[part + 1], chunk.key_index_to_exclusive_);
+        if (tag_from >= tag_to) continue;
+
+        const uint64_t packed_from = chunk.csr_ld_val_index_offset_[tag_from - chunk.key_index_from_inclusive_];
+        const uint64_t packed_to = (tag_to == chunk.key_index_to_exclusive_) ? chunk.csr_ld_val_index_packed_.size() : chunk.csr_ld_val_index_offset_[tag_to - chunk.key_index_from_inclusive_];
+        memcpy(static_cast<unsigned char*>(entry.packed.get()) + packed_from, chunk.csr_ld_val_index_packed_.data() + packed_from, packed_to - packed_from);
+
+        const int64_t ld_index_from = chunk.ld_index_begin(tag_from), ld_index_to = chunk.ld_index_end(tag_to - 1);
+        if (chunk.is_quantized()) memcpy(static_cast<uint8_t*>(entry.r8.get()) + ld_index_from, chunk.csr_ld_r8_.data() + ld_index_from, ld_index_to - ld_index_from);
+        else memcpy(static_cast<packed_r_value*>(entry.r.get()) + ld_index_from, chunk.csr_ld_r_.data() + ld_index_from, (ld_index_to - ld_index_from) * sizeof(packed_r_value));
+      }
+    }
+  }
+
+  for (auto& entry : placed) {
+    LdMatrixCsrChunk& chunk = chunks_reverse_[entry.chr_label];
+    chunk.csr_ld_val_index_packed_.assign_placed(static_cast<const unsigned char*>(entry.packed.get()), chunk.csr_ld_val_index_packed_.size(), entry.packed);
+    if (chunk.is_quantized()) chunk.csr_ld_r8_.assign_placed(static_cast<const uint8_t*>(entry.r8.get()), chunk.csr_ld_r8_.size(), entry.r8);
+    else chunk.csr_ld_r_.assign_placed(static_cast<const packed_r_value*>(entry.r.get()), chunk.csr_ld_r_.size(), entry.r);
+  }
+
+  LOG << "<LdMatrixCsr::place_rows_per_thread(), " << placed.size() << " chunks placed by " << num_threads << " threads, elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+const std::vector<int>& LdMatrixCsr::thread_tag_from() const {
+  static const std::vector<int> empty;
+  if (shared_ != nullptr) return shared_tag_index_.empty() ? shared_->thread_tag_from() : empty;
+  // streamed chromosomes are read back one by one (see stream_to_chunk), so all threads must walk the tags in the same order
+  if (std::find(stream_spilled_.begin(), stream_spilled_.end(), 1) != stream_spilled_.end()) return empty;
+  return thread_tag_from_;
+}
+
+LdTagScheduler::LdTagScheduler(const std::vector<int>& deftag_indices, const std::vector<int>& thread_tag_from, int num_threads, int chunk_size)
+  : num_ranges_((thread_tag_from.size() == std::max(1, num_threads) + 1) ? std::max(1, num_threads) : 1), chunk_size_(std::max(1, chunk_size)), ranges_(num_ranges_) {
+  const int64_t num_deftag = deftag_indices.size();
+  for (int i = 0; i <= num_ranges_; i++) {
+    const int64_t deftag_from = (i == 0) ? 0 : (i == num_ranges_) ? num_deftag :
+                                (std::lower_bound(deftag_indices.begin(), deftag_indices.end(), thread_tag_from[i]) - deftag_indices.begin());
+    if (i < num_ranges_) ranges_[i].next = deftag_from;
+    if (i > 0) ranges_[i - 1].end = deftag_from;
+  }
+}
+
+bool LdTagScheduler::next(int thread_num, int* deftag_from, int* deftag_to) {
+  for (int k = 0; k < num_ranges_; k++) {
+    Range& range = ranges_[(thread_num + k) % num_ranges_];
+    if (range.next.load(std::memory_order_relaxed) >= range.end) continue;
+    const int64_t pos = range.next.fetch_add(chunk_size_);
+    if (pos >= range.end) continue;
+    *deftag_from = pos;
+    *deftag_to = std::min(range.end, pos + chunk_size_);
+    return true;
+  }
+  return false;
+}
+
+bool LdMatrixCsr::can_attach_shared(LdMatrixCsr& shared) {
+  if ((&shared == this) || (shared.mapping_.num_snp() != mapping_.num_snp()) || (shared.mapping_.chrnumvec() != mapping_.chrnumvec())) return false;
+  if (shared.excluded_snp_ != excluded_snp_) return false;
+  const std::vector<char>& is_tag = mapping_.is_tag();
+  const std::vector<char>& shared_is_tag = shared.mapping_.is_tag();
+  for (int snp_index = 0; snp_index < mapping_.num_snp(); snp_index++)
+    if (is_tag[snp_index] && !shared_is_tag[snp_index]) return false;
+  return true;
+}
+
+void LdMatrixCsr::attach_shared(std::shared_ptr<LdMatrixCsr> shared) {
+  if ((shared == nullptr) || !can_attach_shared(*shared)) BGMG_THROW_EXCEPTION(::std::runtime_error("attach_shared: shared LD matrix must cover the same snps and a superset of tags"));
+  for (auto& chunk : chunks_reverse_)
+    if (!chunk.coo_ld_.empty() || chunk.is_finalized()) BGMG_THROW_EXCEPTION(::std::runtime_error("attach_shared: LD matrix is already loaded"));
+  shared->init_snp_to_tag_map();  // build the transpose up front, rather than on first use from a parallel loop
+
+  if (shared->mapping_.tag_to_snp() == mapping_.tag_to_snp()) {
+    ld_sum_ = shared->ld_sum_;
+    ld_sum_adjust_for_hvec_ = shared->ld_sum_adjust_for_hvec_;
+  } else {
+    const std::vector<int>& tag_to_snp = mapping_.tag_to_snp();
+    const std::vector<int>& shared_snp_to_tag = shared->mapping_.snp_to_tag();
+    shared_tag_index_.resize(mapping_.num_tag());
+    shared_tag_to_local_.assign(shared->mapping_.num_tag(), -1);
+    for (int tag_index = 0; tag_index < mapping_.num_tag(); tag_index++) {
+      shared_tag_index_[tag_index] = shared_snp_to_tag[tag_to_snp[tag_index]];
+      shared_tag_to_local_[shared_tag_index_[tag_index]] = tag_index;
+    }
+    ld_sum_ = std::make_shared<LdSum>(mapping_, *shared->ld_sum_);
+    ld_sum_adjust_for_hvec_ = std::make_shared<LdSum>(mapping_, *shared->ld_sum_adjust_for_hvec_);
+  }
+
+  r_bits_ = shared->r_bits_;
+  r2_min_runtime_ = shared->r2_min_runtime_;
+  shared_ = shared;
+  LOG << " LdMatrixCsr::attach_shared(), " << (shared_tag_index_.empty() ? "same tags" : "translate tag indices");
+}
+
+void LdMatrixCsr::invalidate_compact_view() {
+  std::lock_guard<std::mutex> guard(compact_mutex_);
+  chunks_compact_.clear();
+  if (!compact_freed_rest_) compact_tag_.clear();  // otherwise keep the mask, so that released rows are not mistaken for empty rows
+}
+
+void LdMatrixCsr::compact_to_tags(const std::vector<char>& keep_tag, bool free_rest) {
+  if (keep_tag.size() != mapping_.num_tag()) BGMG_THROW_EXCEPTION(::std::runtime_error("compact_to_tags: keep_tag.size() != num_tag"));
+  check_not_shared("compact_to_tags");
+  if (compact_freed_rest_ && !compact_tag_.empty()) {
+    for (int tag_index = 0; tag_index < keep_tag.size(); tag_index++)
+      if (keep_tag[tag_index] && !compact_tag_[tag_index]) BGMG_THROW_EXCEPTION(::std::runtime_error("compact_to_tags: LD rows of some of the tags were already released"));
+  }
+  LOG << ">LdMatrixCsr::compact_to_tags(free_rest=" << free_rest << "); ";
+  SimpleTimer timer(-1);
+  invalidate_row_cache();
+
+  std::vector<LdMatrixCsrChunk> chunks_compact(chunks_reverse_.size());
+  int64_t num_ld_r = 0, num_ld_r_compact = 0;
+  for (int chr_label = 0; chr_label < chunks_reverse_.size(); chr_label++) {
+    const LdMatrixCsrChunk& chunk = chunks_reverse_[chr_label];
+    LdMatrixCsrChunk& chunk_compact = chunks_compact[chr_label];
+    chunk_compact.key_index_from_inclusive_ = chunk.key_index_from_inclusive_;
+    chunk_compact.key_index_to_exclusive_ = chunk.key_index_to_exclusive_;
+    chunk_compact.chr_label_ = chunk.chr_label_;
+    if (!chunk.is_finalized()) continue;
+    chunk_compact.set_ld_r2_csr_subset(chunk, keep_tag);
+    num_ld_r += chunk.num_ld_r(); num_ld_r_compact += chunk_compact.num_ld_r();
+  }
+
+  if (free_rest) {
+    invalidate_snp_to_tag_map();
+    chunks_reverse_.swap(chunks_compact);
+    for (int chr_label = 0; chr_label < chunks_full_.size(); chr_label++) {  // matrix kept aside by set_r2_min_runtime
+      if (!chunks_full_[chr_label].is_finalized()) continue;
+      LdMatrixCsrChunk chunk_compact;
+      chunk_compact.key_index_from_inclusive_ = chunks_full_[chr_label].key_index_from_inclusive_;
+      chunk_compact.key_index_to_exclusive_ = chunks_full_[chr_label].key_index_to_exclusive_;
+      chunk_compact.chr_label_ = chunks_full_[chr_label].chr_label_;
+      chunk_compact.set_ld_r2_csr_subset(chunks_full_[chr_label], keep_tag);
+      std::swap(chunks_full_[chr_label], chunk_compact);
+    }
+  } else {
+    chunks_compact_.swap(chunks_compact);
+  }
+  compact_tag_ = keep_tag;
+  compact_freed_rest_ = free_rest;
+  LOG << "<LdMatrixCsr::compact_to_tags(free_rest=" << free_rest << "); " << std::count(keep_tag.begin(), keep_tag.end(), 1) << " tags, "
+      << num_ld_r_compact << " LD r values out of " << num_ld_r << ", elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+void LdMatrixCsr::set_row_cache_budget(size_t budget_bytes) {
+  check_not_shared("set_row_cache_budget");
+  invalidate_row_cache();
+  row_cache_budget_bytes_ = budget_bytes;
+}
+
+void LdMatrixCsr::invalidate_row_cache() {
+  std::lock_guard<std::mutex> guard(row_cache_mutex_);
+  row_cache_valid_ = false;
+  std::vector<int64_t>().swap(row_cache_offset_);
+  std::vector<int>().swap(row_cache_index_);
+  std::vector<float>().swap(row_cache_r_);
+}
+
+// The cache is built lazily, so that it doesn't matter whether ld_row_cache_mb option is set before or after loading LD matrix.
+// When the first call comes from within a parallel region the remaining threads wait on row_cache_mutex_ until the cache is ready.
+void LdMatrixCsr::init_row_cache() {
+  if (shared_ != nullptr) { shared_->init_row_cache(); return; }
+  if ((row_cache_budget_bytes_ == 0) || row_cache_valid_) return;
+  std::lock_guard<std::mutex> guard(row_cache_mutex_);
+  if (row_cache_valid_) return;
+
+  SimpleTimer timer(-1);
+  const int num_tag = mapping_.num_tag();
+  std::vector<int64_t> num_ld_r2(num_tag, 0);
+  for (int tag_index = 0; tag_index < num_tag; tag_index++) {
+    const int chr_label = mapping_.chrnumvec()[mapping_.tag_to_snp()[tag_index]];
+    if (!compact_tag_.empty() && !compact_tag_[tag_index]) continue;  // rows not needed by cost functions, see compact_to_tags
+    if ((chr_label < (int)chunks_reverse_.size()) && chunks_reverse_[chr_label].is_finalized())
+      num_ld_r2[tag_index] = chunks_reverse_[chr_label].num_ld_r2(tag_index);
+  }
+
+  std::vector<int> tag_order(num_tag);
+  std::iota(tag_order.begin(), tag_order.end(), 0);
+  std::stable_sort(tag_order.begin(), tag_order.end(), [&num_ld_r2](int lhs, int rhs) { return num_ld_r2[lhs] > num_ld_r2[rhs]; });
+
+  const size_t bytes_per_element = sizeof(int) + sizeof(float);
+  std::vector<int64_t> row_cache_offset(num_tag, -1);
+  int64_t total_elements = 0;
+  int num_cached_rows = 0;
+  for (int i = 0; i < num_tag; i++) {
+    const int tag_index = tag_order[i];
+    if (num_ld_r2[tag_index] == 0) break;
+    if ((total_elements + num_ld_r2[tag_index]) * bytes_per_element > row_cache_budget_bytes_) continue;
+    row_cache_offset[tag_index] = total_elements;
+    total_elements += num_ld_r2[tag_index];
+    num_cached_rows++;
+  }
+
+  row_cache_index_.resize(total_elements);
+  row_cache_r_.resize(total_elements);
+
+#pragma omp parallel
+  {
+    LdMatrixRow ld_matrix_row;
+#pragma omp for schedule(dynamic, 256)
+    for (int tag_index = 0; tag_index < num_tag; tag_index++) {
+      const int64_t offset = row_cache_offset[tag_index];
+      if (offset < 0) continue;
+      const int chr_label = mapping_.chrnumvec()[mapping_.tag_to_snp()[tag_index]];
+      chunks_reverse_[chr_label].extract_row(tag_index, &ld_matrix_row);
+      auto iter = ld_matrix_row.begin();
+      for (int k = 0; k < ld_matrix_row.num_; k++, iter++) {
+        row_cache_index_[offset + k] = ld_matrix_row.index_[k];
+        row_cache_r_[offset + k] = iter.r();
+      }
+    }
+  }
+
+  row_cache_offset_.swap(row_cache_offset);
+  row_cache_valid_ = true;
+  LOG << " LdMatrixCsr::init_row_cache() cached " << num_cached_rows << " tag rows out of " << num_tag << " (" << (total_elements * bytes_per_element) << " bytes), elapsed time " << timer.elapsed_ms() << " ms";
+}
+
 int LdMatrixCsr::num_ld_r2_snp(int snp_index) {
+  if (shared_ != nullptr) {
+    if (shared_tag_to_local_.empty()) return shared_->num_ld_r2_snp(snp_index);
+    LdMatrixRow row;
+    extract_snp_row(SnpIndex(snp_index), &row);
+    return row.size();
+  }
+
   const int chr_label = mapping_.chrnumvec()[snp_index];
+  if (mapping_.num_tag() == mapping_.num_snp()) return chunks_reverse_[chr_label].num_ld_r2(snp_index);
+
+  init_snp_to_tag_map();
   const LdMatrixCsrChunk& chunk = chunks_forward_[chr_label];
+  if (!chunk.is_finalized()) return 0;
   return chunk.num_ld_r2(snp_index);
 }
-
-int LdMatrixIterator::index() const { return parent_->index_vector_[ld_index_]; }
-float LdMatrixIterator::r() const { return parent_->r_[ld_index_].get(); }
-float LdMatrixIterator::r2() const { float r = parent_->r_[ld_index_].get(); return r*r; }
-
@@ -20,16 +20,16 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <tuple>
 #include <numeric>
 
 #include "bgmg_log.h"
-
-#if _OPENMP >= 200805
-#include "parallel_stable_sort.h"
-#endif
+#include "huge_page_allocator.h"
 
 // TagIndex and SnpIndex classes wrap an integer that represents either a tag or a snp,
 // to enable compile-time checks (protection agains typos in the code).
@@ -91,7 +91,6 @@ public:
   virtual ~TagToSnpMapping() {}
   virtual int num_snp() = 0;
   virtual int num_tag() = 0;
-  virtual bool disable_snp_to_tag_map() = 0;
   virtual const std::vector<int>& tag_to_snp() = 0;
   virtual const std::vector<int>& snp_to_tag() = 0;
   virtual const std::vector<char>& is_tag() = 0;
@@ -100,11 +99,54 @@ public:
   virtual std::vector<float>* mutable_mafvec() = 0;
 };
 
+// TagToSnpMapping that keeps its own copy of the mapping, e.g. for LD matrix that outlives the context it was loaded for (see LdMatrixCsr::attach_shared).
+// With all_snps_as_tags the copy treats every snp as a tag, so that LD matrix loaded with it can be shared with contexts that have any set of tags.
+class TagToSnpMappingCopy : public TagToSnpMapping {
+public:
+  TagToSnpMappingCopy(TagToSnpMapping& mapping, bool all_snps_as_tags = false) : num_snp_(mapping.num_snp()), num_tag_(mapping.num_tag()),
+    tag_to_snp_(mapping.tag_to_snp()), snp_to_tag_(mapping.snp_to_tag()), is_tag_(mapping.is_tag()), chrnumvec_(mapping.chrnumvec()), mafvec_(mapping.mafvec()) {
+    if (!all_snps_as_tags) return;
+    num_tag_ = num_snp_;
+    tag_to_snp_.resize(num_snp_); std::iota(tag_to_snp_.begin(), tag_to_snp_.end(), 0);
+    snp_to_tag_ = tag_to_snp_;
+    is_tag_.assign(num_snp_, 1);
+  }
+  virtual int num_snp() { return num_snp_; }
+  virtual int num_tag() { return num_tag_; }
+  virtual const std::vector<int>& tag_to_snp() { return tag_to_snp_; }
+  virtual const std::vector<int>& snp_to_tag() { return snp_to_tag_; }
+  virtual const std::vector<char>& is_tag() { return is_tag_; }
+  virtual const std::vector<int>& chrnumvec() { return chrnumvec_; }
+  virtual const std::vector<float>& mafvec() { return mafvec_; }
+  virtual std::vector<float>* mutable_mafvec() { return &mafvec_; }
+private:
+  int num_snp_;
+  int num_tag_;
+  std::vector<int> tag_to_snp_;
+  std::vector<int> snp_to_tag_;
+  std::vector<char> is_tag_;
+  std::vector<int> chrnumvec_;
+  std::vector<float> mafvec_;
+};
+
 #define CHECK_SNP_INDEX(mapping, i) if (i < 0 || i >= mapping.num_snp()) BGMG_THROW_EXCEPTION(::std::runtime_error("CHECK_SNP_INDEX failed"));
 #define CHECK_TAG_INDEX(mapping, i) if (i < 0 || i >= mapping.num_tag()) BGMG_THROW_EXCEPTION(::std::runtime_error("CHECK_TAG_INDEX failed"));
 
 void find_hvec_per_chunk(TagToSnpMapping& mapping, std::vector<float>* hvec, int index_from, int index_to);
-void find_hvec(TagToSnpMapping& mapping, std::vector<float>* hvec);
+void find_hvec(TagToSnpMapping& mapping, HugePageVector<float>* hvec);
+
+// Codecs for rows of LdMatrixCsrChunk::csr_ld_val_index_packed_; all of them, except kIndexCodecBitmap, compress deltas between consecutive indices.
+enum LdIndexCodec {
+  kIndexCodecVSimple = 0,  // TurboPFor vsenc32 (the only codec used by LD files before format version 4)
+  kIndexCodecVByte = 1,    // TurboPFor vbenc32, i.e. variable byte encoding
+  kIndexCodecBitPack = 2,  // fixed number of bits per delta (stored in the first byte of the row)
+  kIndexCodecBitmap = 3,   // first index of the row, followed by a bitmap of the band between the first and the last index
+  kNumIndexCodecs,
+  kIndexCodecAuto = -1,    // choose per row, whichever codec gives the smallest output
+};
+
+// decode a row of indices packed by LdMatrixCsrChunk::pack_ld_r2_csr; "out" buffer must have capacity for (num + 32) elements
+void decode_ld_indices(int codec, const unsigned char* packed, int64_t num, uint32_t* out);
 
 // pre-calculated sum of LD r2 and r4 for each snp
 // This takes hvec into account, e.i. we store sum of r2*hvec and r4*hvec^2.
@@ -121,6 +163,24 @@ public:
     ld_tag_sum_r4_above_r2min_.resize(num_tag, 0.0f);
   }
 
+  // copy of LdSum computed for another set of tags (on the same set of snps); tag sums are the sums of the corresponding snps
+  LdSum(TagToSnpMapping& mapping, const LdSum& source)
+    : LdSum(mapping, source.ld_sum_r2_below_r2min_, source.ld_sum_r2_above_r2min_, source.ld_sum_r4_above_r2min_) {}
+
+  template<typename V>
+  LdSum(TagToSnpMapping& mapping, const V& ld_sum_r2_below_r2min, const V& ld_sum_r2_above_r2min, const V& ld_sum_r4_above_r2min)
+    : mapping_(mapping), ld_sum_r2_below_r2min_(ld_sum_r2_below_r2min.begin(), ld_sum_r2_below_r2min.end()),
+      ld_sum_r2_above_r2min_(ld_sum_r2_above_r2min.begin(), ld_sum_r2_above_r2min.end()), ld_sum_r4_above_r2min_(ld_sum_r4_above_r2min.begin(), ld_sum_r4_above_r2min.end()) {
+    if ((ld_sum_r2_below_r2min_.size() != mapping.num_snp()) || (ld_sum_r2_above_r2min_.size() != mapping.num_snp()) || (ld_sum_r4_above_r2min_.size() != mapping.num_snp()))
+      BGMG_THROW_EXCEPTION(::std::runtime_error("LdSum: sums must have one element per snp"));
+    const std::vector<int>& tag_to_snp = mapping.tag_to_snp();
+    for (int tag_index = 0; tag_index < mapping.num_tag(); tag_index++) {
+      ld_tag_sum_r2_below_r2min_.push_back(ld_sum_r2_below_r2min_[tag_to_snp[tag_index]]);
+      ld_tag_sum_r2_above_r2min_.push_back(ld_sum_r2_above_r2min_[tag_to_snp[tag_index]]);
+      ld_tag_sum_r4_above_r2min_.push_back(ld_sum_r4_above_r2min_[tag_to_snp[tag_index]]);
+    }
+  }
+
   void store_below_r2min(int snp_index, float r2_times_hval, int to_be_removed) {
     ld_sum_r2_below_r2min_[snp_index] += r2_times_hval;
     if (mapping_.is_tag()[snp_index]) {
@@ -143,13 +203,31 @@ public:
     else store_above_r2min(index, r2_times_hval, 0);
   }
 
-  const std::vector<float>& ld_sum_r2_below_r2min() const { return ld_sum_r2_below_r2min_; }
-  const std::vector<float>& ld_sum_r2_above_r2min() const { return ld_sum_r2_above_r2min_; }
-  const std::vector<float>& ld_sum_r4_above_r2min() const { return ld_sum_r4_above_r2min_; }
+  // undo store_above_r2min, and store the same value below r2min (used when r2min is raised after LD matrix is loaded)
+  void move_above_to_below_r2min(int snp_index, float r2_times_hval) {
+    ld_sum_r2_above_r2min_[snp_index] -= r2_times_hval;
+    ld_sum_r4_above_r2min_[snp_index] -= (r2_times_hval * r2_times_hval);
+    ld_sum_r2_below_r2min_[snp_index] += r2_times_hval;
+    if (mapping_.is_tag()[snp_index]) {
+      const int tag_index = mapping_.snp_to_tag()[snp_index];
+      ld_tag_sum_r2_above_r2min_[tag_index] -= r2_times_hval;
+      ld_tag_sum_r4_above_r2min_[tag_index] -= (r2_times_hval * r2_times_hval);
+      ld_tag_sum_r2_below_r2min_[tag_index] += r2_times_hval;
+    }
+  }
 
-  const std::vector<float>& ld_tag_sum_r2_below_r2min() const { return ld_tag_sum_r2_below_r2min_; }
-  const std::vector<float>& ld_tag_sum_r2_above_r2min() const { return ld_tag_sum_r2_above_r2min_; }
-  const std::vector<float>& ld_tag_sum_r4_above_r2min() const { return ld_tag_sum_r4_above_r2min_; }
+  size_t num_bytes() const { return (ld_sum_r2_below_r2min_.size() + ld_tag_sum_r2_below_r2min_.size()) * 3 * sizeof(float); }
+  std::string pages_str() const {
+    return std::string("snp sums in ") + huge_pages_kind_str(ld_sum_r2_below_r2min_) + ", tag sums in " + huge_pages_kind_str(ld_tag_sum_r2_below_r2min_);
+  }
+
+  const HugePageVector<float>& ld_sum_r2_below_r2min() const { return ld_sum_r2_below_r2min_; }
+  const HugePageVector<float>& ld_sum_r2_above_r2min() const { return ld_sum_r2_above_r2min_; }
+  const HugePageVector<float>& ld_sum_r4_above_r2min() const { return ld_sum_r4_above_r2min_; }
+
+  const HugePageVector<float>& ld_tag_sum_r2_below_r2min() const { return ld_tag_sum_r2_below_r2min_; }
+  const HugePageVector<float>& ld_tag_sum_r2_above_r2min() const { return ld_tag_sum_r2_above_r2min_; }
+  const HugePageVector<float>& ld_tag_sum_r4_above_r2min() const { return ld_tag_sum_r4_above_r2min_; }
 
   void clear() {
     std::fill(ld_sum_r2_below_r2min_.begin(), ld_sum_r2_below_r2min_.end(), 0.0f);
@@ -162,13 +240,164 @@ public:
  private:
   TagToSnpMapping& mapping_;
 
-  std::vector<float> ld_sum_r2_below_r2min_;  // master data
-  std::vector<float> ld_sum_r2_above_r2min_;
-  std::vector<float> ld_sum_r4_above_r2min_;
+  HugePageVector<float> ld_sum_r2_below_r2min_;  // master data
+  HugePageVector<float> ld_sum_r2_above_r2min_;
+  HugePageVector<float> ld_sum_r4_above_r2min_;
+
+  HugePageVector<float> ld_tag_sum_r2_below_r2min_;  // derived data
+  HugePageVector<float> ld_tag_sum_r2_above_r2min_;
+  HugePageVector<float> ld_tag_sum_r4_above_r2min_;
+};
+
+// Vector-like storage for LD matrix arrays.
+// The buffer either owns its elements (HugePageVector<T>), or refers to a read-only memory region
+// (for example a memory-mapped LD file), which stays alive as long as the holder_ shared_ptr is referenced.
+// A third state is an owned buffer allocated outside of HugePageVector (see assign_placed), e.g. rows placed on a NUMA node.
+// Read access is identical in all cases; mutable access goes through mutable_vector() (or push_back/resize/etc),
+// which first copies mapped or placed data into owned storage.
+template<typename T>
+class MappableVector {
+ public:
+  MappableVector() : external_data_(nullptr), external_size_(0), placed_(false) {}
+
+  size_t size() const { return is_external() ? external_size_ : owned_.size(); }
+  bool empty() const { return size() == 0; }
+  bool is_mapped() const { return is_external() && !placed_; }
+  bool is_placed() const { return is_external() && placed_; }
+  const T* data() const { return is_external() ? external_data_ : owned_.data(); }
+  const T* begin() const { return data(); }
+  const T* end() const { return data() + size(); }
+  const T& operator[](size_t index) const { return data()[index]; }
+  const T& back() const { return data()[size() - 1]; }
+
+  void push_back(const T& value) { mutable_vector().push_back(value); }
+  void reserve(size_t numel) { mutable_vector().reserve(numel); }
+  void resize(size_t numel) { mutable_vector().resize(numel); }
+  void resize(size_t numel, const T& value) { mutable_vector().resize(numel, value); }
+  void shrink_to_fit() { mutable_vector().shrink_to_fit(); }
+  void clear() { reset_external(); owned_.clear(); }
+  const char* pages_str() const {
+    if (is_mapped()) return "mapped";
+    if (is_placed()) return huge_pages_kind_str(empty() ? kHugePagesKindNone : huge_pages_kind(external_data_));
+    return huge_pages_kind_str(owned_);
+  }
+
+  HugePageVector<T>& mutable_vector() {
+    if (is_external()) {
+      owned_.assign(external_data_, external_data_ + external_size_);
+      reset_external();
+    }
+    return owned_;
+  }
+
+  // refer to an external read-only memory region instead of owning the data
+  void assign_mapped(const T* data, size_t numel, std::shared_ptr<const void> holder) { assign_external(data, numel, holder, false); }
+
+  // take over a buffer from huge_pages_allocate, released together with the holder
+  void assign_placed(const T* data, size_t numel, std::shared_ptr<const void> holder) { assign_external(data, numel, holder, true); }
+
+ private:
+  bool is_external() const { return external_data_ != nullptr; }
+  void assign_external(const T* data, size_t numel, std::shared_ptr<const void> holder, bool placed) {
+    HugePageVector<T>().swap(owned_);
+    external_data_ = data;
+    external_size_ = numel;
+    holder_ = holder;
+    placed_ = placed;
+  }
+  void reset_external() { external_data_ = nullptr; external_size_ = 0; holder_.reset(); placed_ = false; }
+
+  HugePageVector<T> owned_;
+  const T* external_data_;
+  size_t external_size_;
+  std::shared_ptr<const void> holder_;
+  bool placed_;  // external_data_ is an owned buffer (assign_placed), not a mapped region (assign_mapped)
+};
+
+// Block-banded storage of a non-decreasing sequence of offsets (csr_ld_key_index_ and csr_ld_val_index_offset_ of LdMatrixCsrChunk).
+// The sequence is split into blocks of kBlockSize consecutive elements; each block keeps a 64-bit base (its first offset),
+// and each element keeps a 32-bit offset relative to the base of its block. LD is concentrated in a narrow band around the diagonal,
+// so the rows within one block are short, and 4 bytes per element are enough (instead of 8 bytes with plain int64_t offsets).
+template<typename T>
+class LdBlockOffsets {
+ public:
+  static const int kBlockShift = 8;
+  static const int kBlockSize = 1 << kBlockShift;
+
+  size_t size() const { return local_.size(); }
+  bool empty() const { return local_.empty(); }
+  T operator[](size_t index) const { return block_base_[index >> kBlockShift] + local_[index]; }
+  T back() const { return (*this)[size() - 1]; }
+  size_t num_bytes() const { return block_base_.size() * sizeof(T) + local_.size() * sizeof(uint32_t); }
+
+  void assign(const T* offsets, size_t numel) {
+    std::vector<T> block_base((numel + kBlockSize - 1) >> kBlockShift);
+    std::vector<uint32_t> local(numel);
+    for (size_t index = 0; index < numel; index++) {
+      if ((index & (kBlockSize - 1)) == 0) block_base[index >> kBlockShift] = offsets[index];
+      const T base = block_base[index >> kBlockShift];
+      if (((index > 0) && (offsets[index] < offsets[index - 1])) || ((offsets[index] - base) > std::numeric_limits<uint32_t>::max()))
+        BGMG_THROW_EXCEPTION(::std::runtime_error("LdBlockOffsets: offsets must be non-decreasing, and increase by less than 2^32 within each block"));
+      local[index] = static_cast<uint32_t>(offsets[index] - base);
+    }
+    block_base_.swap(block_base);
+    local_.swap(local);
+  }
+  void assign(const std::vector<T>& offsets) { assign(offsets.data(), offsets.size()); }
 
-  std::vector<float> ld_tag_sum_r2_below_r2min_;  // derived data
-  std::vector<float> ld_tag_sum_r2_above_r2min_;
-  std::vector<float> ld_tag_sum_r4_above_r2min_;
+  std::vector<T> to_vector() const {
+    std::vector<T> offsets(size());
+    for (size_t index = 0; index < offsets.size(); index++) offsets[index] = (*this)[index];
+    return offsets;
+  }
+
+  void clear() { block_base_.clear(); local_.clear(); }
+  void shrink_to_fit() { block_base_.shrink_to_fit(); local_.shrink_to_fit(); }
+
+ private:
+  std::vector<T> block_base_;
+  std::vector<uint32_t> local_;
+};
+
+// Staging area for LD r values in COO format (key, val, r), before they are converted to CSR format by set_ld_r2_csr().
+// Elements are stored in blocks of up to kBlockSize elements, rather than in one contiguous vector:
+// a thread can collect elements into its own LdMatrixCoo, and then hand its blocks over with append() without copying elements;
+// set_ld_r2_csr() processes blocks in parallel and releases each block as soon as its elements are moved into CSR arrays.
+class LdMatrixCoo {
+ public:
+  typedef std::tuple<int, int, packed_r_value> Element;  // key, val, r
+  static const size_t kBlockSize = 1 << 18;
+
+  LdMatrixCoo() : size_(0) {}
+
+  void push_back(const Element& element) {
+    if (blocks_.empty() || (blocks_.back().size() == kBlockSize)) {
+      blocks_.push_back(std::vector<Element>());
+      blocks_.back().reserve(kBlockSize);
+    }
+    blocks_.back().push_back(element);
+    size_++;
+  }
+
+  // move all elements from other into this; other becomes empty
+  void append(LdMatrixCoo&& other) {
+    other.shrink_to_fit();
+    for (auto& block : other.blocks_) blocks_.push_back(std::move(block));
+    size_ += other.size_;
+    other.clear();
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t num_blocks() const { return blocks_.size(); }
+  const std::vector<Element>& block(size_t block_index) const { return blocks_[block_index]; }
+  void clear_block(size_t block_index) { std::vector<Element>().swap(blocks_[block_index]); }  // release memory, but keep size() unchanged
+  void clear() { std::vector<std::vector<Element>>().swap(blocks_); size_ = 0; }
+  void shrink_to_fit() { if (!blocks_.empty()) blocks_.back().shrink_to_fit(); }
+
+ private:
+  std::vector<std::vector<Element>> blocks_;
+  size_t size_;
 };
 
 class LdMatrixRow; 
@@ -177,22 +406,35 @@ class LdMatrixRow;
 // Iterpret this class as a mapping from key to val, where "key" is a snp, and "val" is a tag.
 class LdMatrixCsrChunk {
  public:
-  std::vector<std::tuple<int, int, packed_r_value>> coo_ld_; // key, val, r
+  LdMatrixCoo coo_ld_; // key, val, r
 
   // csr_ld_key_index_.size() == num_keys_in_chunk() + 1; 
   // csr_ld_key_index_[j]..csr_ld_key_index_[j+1] is a range of values in CSR matrix corresponding to j-th variant
   // csr_ld_val_index_.size() == csr_ld_r_.size() == number of non-zero LD r values
   // csr_ld_val_index_ contains values from 0 to num_val_-1
   // csr_ld_r_ contains values from -1 to 1, indicating LD allelic correlation (r) between snp and tag variants
-  std::vector<int64_t> csr_ld_key_index_;
-  std::vector<uint64_t> csr_ld_val_index_offset_;      // pointers to csr_ld_val_index_packed_ (location where to decompress)
-                                                       // number of elements to decompress can be deduced from csr_ld_key_index_
-  std::vector<unsigned char> csr_ld_val_index_packed_;  // packed csr_ld_val_index (delta-encoded, then compressed with TurboPFor vsenc32 algorithm).
-                                                        // The buffer has some extra capacity (as required by TurboPFor vsenc32/vdec32 algorithms).
-  std::vector<packed_r_value> csr_ld_r_;
+  // The arrays with one element per LD r value can be memory-mapped directly from an LD file (see load_ld_matrix), hence MappableVector;
+  // the two arrays with one element per key are block-banded (LdBlockOffsets), and are expanded to plain 64-bit offsets in LD files.
+  LdBlockOffsets<int64_t> csr_ld_key_index_;
+  LdBlockOffsets<uint64_t> csr_ld_val_index_offset_;      // pointers to csr_ld_val_index_packed_ (location where to decompress)
+                                                          // number of elements to decompress can be deduced from csr_ld_key_index_
+  MappableVector<unsigned char> csr_ld_val_index_packed_;  // packed csr_ld_val_index (delta-encoded, then compressed with one of LdIndexCodec codecs).
+                                                           // The buffer has some extra capacity (as required by TurboPFor vsenc32/vdec32 algorithms).
+  MappableVector<uint8_t> csr_ld_val_index_codec_;         // LdIndexCodec of each row; empty if all rows use kIndexCodecVSimple
+  MappableVector<packed_r_value> csr_ld_r_;
+
+  // Optional 8-bit storage of r values, replacing csr_ld_r_ after quantize_ld_r8() (see "ld_r_bits" option).
+  // Bit 7 of each code is the sign of r, bits 0..6 select one of 128 levels of r2, uniformly spaced between the smallest r2 stored in the chunk and 1.0.
+  // Therefore the 8 bits are spent only on the range of r2 values which is actually present in the chunk (above r2_min).
+  MappableVector<uint8_t> csr_ld_r8_;
+  std::vector<float> csr_ld_r8_codebook_;  // 256 values of r, indexed by code
   
-  unsigned char* csr_ld_val_index_packed(int key_index) {
-    return &csr_ld_val_index_packed_[csr_ld_val_index_offset_[key_index - key_index_from_inclusive_]];
+  const unsigned char* csr_ld_val_index_packed(int key_index) const {
+    return csr_ld_val_index_packed_.data() + csr_ld_val_index_offset_[key_index - key_index_from_inclusive_];
+  }
+
+  int csr_ld_val_index_codec(int key_index) const {
+    return csr_ld_val_index_codec_.empty() ? kIndexCodecVSimple : csr_ld_val_index_codec_[key_index - key_index_from_inclusive_];
   }
 
   int64_t num_ld_r2(int key_index) const {
@@ -213,24 +455,36 @@ class LdMatrixCsrChunk {
   int key_index_to_exclusive_;
   int chr_label_;
   int num_keys_in_chunk() const { return key_index_to_exclusive_ - key_index_from_inclusive_; }
-  bool is_empty() const { return csr_ld_r_.empty(); }
+  bool is_empty() const { return csr_ld_r_.empty() && csr_ld_r8_.empty(); }
+  bool is_quantized() const { return !csr_ld_r8_.empty(); }
+  int64_t num_ld_r() const { return is_quantized() ? csr_ld_r8_.size() : csr_ld_r_.size(); }
+  float get_r(int64_t ld_index) const { return is_quantized() ? csr_ld_r8_codebook_[csr_ld_r8_[ld_index]] : csr_ld_r_[ld_index].get(); }
+
+  bool is_finalized() const { return !csr_ld_key_index_.empty() && coo_ld_.empty(); }
 
   int64_t set_ld_r2_csr();
+  int64_t set_ld_r2_csr_transpose(const LdMatrixCsrChunk& source);  // build this chunk as a transpose of the source chunk (vals of the source become keys)
+  int64_t set_ld_r2_csr_subset(const LdMatrixCsrChunk& source, const std::vector<char>& keep_key);  // copy rows of the source chunk with non-zero keep_key[key_index]; other rows are empty
+  int64_t set_ld_r2_csr_filtered(const LdMatrixCsrChunk& source, float r2_min);  // copy elements of the source chunk with r2 >= r2_min
+  int64_t pack_ld_r2_csr(std::vector<uint32_t>* csr_ld_val_index, int index_codec = kIndexCodecAuto);  // requires csr_ld_key_index_ and csr_ld_r_; csr_ld_val_index is modified in-place
+  int64_t repack_ld_r2_csr(int index_codec);  // decode all rows, and pack them again with a given LdIndexCodec
+  int64_t quantize_ld_r8();  // replace csr_ld_r_ with csr_ld_r8_
   int64_t validate_ld_r2_csr(const std::vector<uint32_t>& csr_ld_val_index);
   float find_and_retrieve_ld_r2(int key_index, int val_index, const std::vector<uint32_t>& csr_ld_val_index);  // nan if doesn't exist.
-  void extract_row(int key_index, LdMatrixRow* row);
+  void extract_row(int key_index, LdMatrixRow* row) const;
 
   size_t log_diagnostics();
   void clear();
+  void clear_csr();
 };
 
 class LdMatrixIterator {
 public:
   LdMatrixIterator(int64_t ld_index, const LdMatrixRow* parent) : ld_index_(ld_index), parent_(parent) {}
 
-  int index() const;  // this can be tag_index or snp_index, depending on how LdMatrix is stored (as snp->tag mapping or as tag->snp mapping)
-  float r() const;
-  float r2() const;
+  inline int index() const;  // this can be tag_index or snp_index, depending on how LdMatrix is stored (as snp->tag mapping or as tag->snp mapping)
+  inline float r() const;
+  inline float r2() const;
 
   LdMatrixIterator& operator++ () {
     ld_index_++;
@@ -259,22 +513,66 @@ inline int operator -(const LdMatrixIterator& lhs, const LdMatrixIterator& rhs)
   return lhs.ld_index_ - rhs.ld_index_;
 }
 
+// A view of one row of LD matrix.
+// Indices are decoded into index_buffer_, which is reused across extract_row calls (typically LdMatrixRow is thread-local),
+// while r values are read in place from the chunk - therefore the view is valid only while the underlying chunk is not modified.
+// Rows served from LdMatrixCsr row cache point index_ and r_float_ to the (already decoded) cache instead.
+// Rows of quantized chunks point r8_ to 8-bit codes, which are decoded via r8_codebook_.
 class LdMatrixRow {
 public:
-  LdMatrixIterator begin() { return LdMatrixIterator(0, this); }
-  LdMatrixIterator end() { return LdMatrixIterator(index_vector_.size(), this); }
+  LdMatrixRow() : num_(0), index_(nullptr), r_(nullptr), r_float_(nullptr), r8_(nullptr), r8_codebook_(nullptr) {}
+  LdMatrixIterator begin() const { return LdMatrixIterator(0, this); }
+  LdMatrixIterator end() const { return LdMatrixIterator(num_, this); }
+  int size() const { return num_; }
 private:
-  std::vector<int> index_vector_;
-  std::vector<packed_r_value> r_;
+  std::vector<int> index_buffer_;  // has extra capacity, as required by vsdec32
+  std::vector<float> r_buffer_;    // r values of a snp row filtered to the tags of an attached context (see LdMatrixCsr::attach_shared)
+  int num_;
+  const int* index_;               // either index_buffer_.data(), or a row in LdMatrixCsr row cache
+  const packed_r_value* r_;        // r values, unless r_float_ or r8_ is set
+  const float* r_float_;
+  const uint8_t* r8_;
+  const float* r8_codebook_;
   friend class LdMatrixIterator;
   friend class LdMatrixCsr;
   friend class LdMatrixCsrChunk;
 };
 
+inline int LdMatrixIterator::index() const { return parent_->index_[ld_index_]; }
+inline float LdMatrixIterator::r() const {
+  if (parent_->r_float_ != nullptr) return parent_->r_float_[ld_index_];
+  if (parent_->r8_ != nullptr) return parent_->r8_codebook_[parent_->r8_[ld_index_]];
+  return parent_->r_[ld_index_].get();
+}
+inline float LdMatrixIterator::r2() const { float r = this->r(); return r*r; }
+
+// Schedule of a parallel loop over deftag indices (i.e. over sorted tag indices), following the placement of tag rows (see LdMatrixCsr::place_rows_per_thread).
+// Each thread first takes chunks of its own range of tags, whose rows are in the memory of its NUMA node, and then steals chunks from the ranges
+// of other threads, starting with its neighbours. Without placement (thread_tag_from is empty) all threads take chunks from one shared range,
+// in the order of deftag indices, as with schedule(dynamic); a streamed LD matrix relies on this order (see LdMatrixCsr::stream_to_chunk). Usage:
+//   LdTagScheduler scheduler(deftag_indices, ld_matrix_csr_.thread_tag_from(), omp_get_max_threads(), kOmpDynamicChunk);
+//   #pragma omp parallel
+//   for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+//     for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) { ... }
+class LdTagScheduler {
+ public:
+  LdTagScheduler(const std::vector<int>& deftag_indices, const std::vector<int>& thread_tag_from, int num_threads, int chunk_size);
+  bool next(int thread_num, int* deftag_from, int* deftag_to);
+
+ private:
+  struct alignas(64) Range {  // each range on its own cache line
+    std::atomic<int64_t> next;
+    int64_t end;
+  };
+  int num_ranges_;                // one per thread with placement, otherwise one shared range
+  int chunk_size_;
+  HugePageVector<Range> ranges_;  // aligned by huge_pages_allocate, unlike new[] before C++17
+};
+
 // Class for sparse LD matrix stored in CSR format (Compressed Sparse Row Format)
 class LdMatrixCsr {
  public:
-   LdMatrixCsr(TagToSnpMapping& mapping) : mapping_(mapping) {}
+   LdMatrixCsr(TagToSnpMapping& mapping) : mapping_(mapping), snp_to_tag_map_valid_(false), compact_freed_rest_(false), r2_min_runtime_(0.0f), r2_min_in_place_(0.0f), r_bits_(16), stream_chunk_(-1), row_cache_budget_bytes_(0), row_cache_valid_(false) {}
 
    int64_t set_ld_r2_coo(int chr_label, int64_t length, int* snp_index, int* snp_other_index, float* r, float r2_min);
    int64_t set_ld_r2_coo_version1plus(int chr_label, const std::string& filename, float r2_min);
@@ -293,12 +591,128 @@ class LdMatrixCsr {
    void clear();
    void init_chunks();
    void init_diagonal(int chr_label);
+
+   // Optional cache of decoded tag rows (indices and float r values), served by extract_tag_row.
+   // Rows are selected longest first, until the total size reaches the budget; zero budget disables the cache.
+   // The cache is shared by all threads; it is built on first use after LD matrix has changed, see init_row_cache().
+   void set_row_cache_budget(size_t budget_bytes);
+   void init_row_cache();
+
+   // LD matrix is stored only as tag->snp map (chunks_reverse_). The snp->tag map (chunks_forward_) is its transpose,
+   // built on first call to extract_snp_row or num_ld_r2_snp. Call init_snp_to_tag_map() before parallel loops over snps,
+   // so that the transpose is built using all threads.
+   void init_snp_to_tag_map();
+
+   // Number of bits to store each r value: 16 (packed_r_value, default) or 8 (see LdMatrixCsrChunk::quantize_ld_r8).
+   // Chunks are quantized when they are finalized by set_ld_r2_csr, or straight away if they are already finalized.
+   // Quantization can't be undone, i.e. switching back to 16 bits requires to load LD matrix again.
+   // Note that r values are decoded with 16 bits, and quantized only once the whole chunk is loaded; therefore the peak memory usage
+   // while loading includes 16-bit r values of the chromosomes loaded at the same time (see "ld_load_jobs" option).
+   void set_r_bits(int r_bits);
+   int r_bits() const { return r_bits_; }
+
+   // Compacted copy of LD matrix, holding only the rows of selected tags (see BgmgCalculator::compact_ld_to_deftags).
+   // Rows are copied as they are (packed indices and r values) and in the order of tag indices, so that a loop over selected tags
+   // streams through contiguous memory instead of jumping across the full matrix. Rows of other tags are still served from the full matrix,
+   // unless free_rest is set: then the full matrix is replaced by the compacted copy, extract_tag_row throws for tags that were not selected,
+   // and snp->tag map only includes selected tags. The copy is discarded when LD matrix changes; call this after LD matrix is fully loaded.
+   void compact_to_tags(const std::vector<char>& keep_tag, bool free_rest);
+
+   // Raise r2_min after LD matrix is loaded, without reading LD files again: elements with r2 below r2_min are removed from tag rows,
+   // and their contribution moves from "above r2min" to "below r2min" sums of LdSum (i.e. to the infinitesimal part of the model).
+   // With keep_full the original matrix and LdSum are kept aside, so that a later call with a lower r2_min (e.g. zero) restores them;
+   // otherwise the matrix is filtered in place, and r2_min can only be raised further (until LD matrix is loaded again).
+   // Only tag-related entries of LdSum are adjusted; sums of non-tag snps keep their original values.
+   void set_r2_min_runtime(float r2_min, bool keep_full);
+   float r2_min_runtime() const { return r2_min_runtime_; }
+
+   // Serve LD matrix and LdSum from another LdMatrixCsr (typically loaded once, and shared by several contexts), instead of own chunks.
+   // The shared matrix must be fully loaded, must not be modified afterwards, and must cover the same snps and a superset of the tags of this matrix.
+   // With the same set of tags rows and LdSum are served as they are; otherwise tag indices are translated (tag rows are looked up by snp,
+   // snp rows are filtered to the tags of this matrix), and LdSum is copied with tag sums taken from the corresponding snps.
+   // Functions that modify LD matrix throw while it is attached; clear() detaches it.
+   bool can_attach_shared(LdMatrixCsr& shared);
+   void attach_shared(std::shared_ptr<LdMatrixCsr> shared);
+   bool is_shared() const { return shared_ != nullptr; }
+   size_t row_cache_budget() const { return row_cache_budget_bytes_; }
+
+   // Save finalized LD matrix (tag rows and LdSum, as they are in memory) to a segment file, that other processes can map read-only with load_segment().
+   // The key identifies the data used to build the matrix (reference, LD files, r2min, etc); load_segment() returns false if the segment has a different key.
+   // After load_segment() the rows refer to the mapped file, and are shared with all other processes that mapped the same segment.
+   // Both functions are implemented in ld_matrix.cc, next to the other LD file formats.
+   // A segment may also be embedded into another file (e.g. a context snapshot), starting at the given offset.
+   void save_segment(const std::string& filename, const std::string& key);
+   void save_segment(std::ofstream& os, const std::string& key);
+   bool load_segment(const std::string& filename, const std::string& key, uint64_t offset = 0);
+
+   // Out-of-core mode for nodes that can't keep the whole LD matrix in memory. spill_chunk() moves packed indices and r values of a finalized
+   // chromosome to a scratch file in the directory, and maps them back read-only; the file is unlinked straight away, so it disappears with the mapping.
+   // extract_tag_row then streams through chromosomes: on the first row of a chromosome the next one is prefetched (asynchronously, by the kernel),
+   // and the chromosomes left behind are dropped from memory, to be read again from the file on the next pass. Rows and results are the same as in memory.
+   // chr_label=-1 spills all finalized chromosomes. Implemented in ld_matrix.cc, next to the other LD file formats.
+   void spill_chunk(int chr_label, const std::string& directory);
+
+   // Variants excluded from the reference (e.g. by --extract/--exclude), indexed by snp; empty if all variants are kept.
+   // LD files are still read in full, but LD r2 with excluded variants is not stored in the rows of other variants:
+   // it goes into "below r2min" part of LdSum, i.e. to the infinitesimal part of the model, as if it were below r2min.
+   // Rows of excluded variants in the snp->tag map stay empty. Call before LD matrix is loaded; the setting persists across clear().
+   void set_excluded_snps(const std::vector<char>& excluded_snp);
+   const std::vector<char>& excluded_snps() const { return excluded_snp_; }
+
+   // NUMA-aware placement of tag rows. Tags are split into omp_get_max_threads() contiguous ranges with about the same number of LD r values,
+   // and packed indices and r values of each range are copied to fresh memory by the thread that owns the range. The pages are allocated
+   // on the first touch, i.e. on the NUMA node of that thread (given that threads are pinned, e.g. OMP_PROC_BIND=close). Loops over tags
+   // follow the same split via LdTagScheduler. Chunks mapped from files (LD segment, or spilled by spill_chunk) keep their pages as they are.
+   // Placed arrays are reported by log_diagnostics with their page kind; set_r_bits places the rows again after quantization.
+   void place_rows_per_thread();
+   const std::vector<int>& thread_tag_from() const;  // first tag of each thread's range, and num_tag at the end; empty if rows were not placed, or if LD matrix is streamed
 private:
+  void check_not_shared(const char* what);
+  void invalidate_row_cache();
+  void invalidate_compact_view();
+  void invalidate_snp_to_tag_map();
+  void stream_to_chunk(int chr_label);
+  void advise_chunk(int chr_label, bool will_need);
+
+  bool can_set_ld_r2_csr_direct(int chr_label, const LdMatrixCsrChunk& chunk);
+  int64_t set_ld_r2_csr_direct(int chr_label, const LdMatrixCsrChunk& chunk,
+                               const std::vector<float>& freqvec, const std::vector<float>& ld_r2_sum, const std::vector<float>& ld_r2_sum_adjust_for_hvec,
+                               float r2_min);
 
   TagToSnpMapping& mapping_;
-  std::vector<LdMatrixCsrChunk> chunks_forward_;   // split per chromosomes, mapping from snp to tag
+  std::vector<LdMatrixCsrChunk> chunks_forward_;   // split per chromosomes, mapping from snp to tag (transpose of chunks_reverse_, see init_snp_to_tag_map)
   std::vector<LdMatrixCsrChunk> chunks_reverse_;   // mapping from tag to snp
+  std::atomic<bool> snp_to_tag_map_valid_;
+  std::mutex snp_to_tag_map_mutex_;
+  std::vector<LdMatrixCsrChunk> chunks_compact_;   // rows of chunks_reverse_ for selected tags only (see compact_to_tags); empty if not built, or if free_rest was set
+  std::vector<char> compact_tag_;                  // tags selected by compact_to_tags; empty if there was no call to compact_to_tags
+  bool compact_freed_rest_;
+  std::mutex compact_mutex_;                       // invalidate_compact_view() is called by set_ld_r2_csr for several chromosomes at the same time
+  std::vector<LdMatrixCsrChunk> chunks_full_;      // chunks_reverse_ before set_r2_min_runtime(keep_full=true); empty otherwise
+  std::shared_ptr<LdSum> ld_sum_adjust_for_hvec_full_;
+  std::shared_ptr<LdSum> ld_sum_full_;
+  float r2_min_runtime_;                           // r2_min of set_r2_min_runtime (zero if it wasn't called)
+  float r2_min_in_place_;                          // the largest r2_min applied with keep_full=false
+  int r_bits_;
+  std::vector<char> excluded_snp_;     // see set_excluded_snps()
+  std::vector<int> thread_tag_from_;   // see place_rows_per_thread()
+
+  std::vector<char> stream_spilled_;   // per chromosome: 1 if chunks_reverse_ was moved to a scratch file by spill_chunk()
+  std::vector<char> stream_resident_;  // per chromosome: 1 if pages of the spilled chunk are kept in memory (guarded by stream_mutex_)
+  std::atomic<int> stream_chunk_;      // chromosome of the last streamed row
+  std::mutex stream_mutex_;
   
   std::shared_ptr<LdSum> ld_sum_adjust_for_hvec_;
   std::shared_ptr<LdSum> ld_sum_;
+
+  std::shared_ptr<LdMatrixCsr> shared_;    // see attach_shared(); chunks of this matrix stay empty while it is set
+  std::vector<int> shared_tag_index_;      // tag index in shared_ of each tag of this matrix; empty if the sets of tags are the same
+  std::vector<int> shared_tag_to_local_;   // tag index in this matrix of each tag of shared_, or -1
+
+  size_t row_cache_budget_bytes_;
+  std::atomic<bool> row_cache_valid_;
+  std::mutex row_cache_mutex_;
+  std::vector<int64_t> row_cache_offset_;  // offset of each tag row in row_cache_index_ and row_cache_r_; -1 if the row is not cached
+  std::vector<int> row_cache_index_;
+  std::vector<float> row_cache_r_;
 };
@@ -19,6 +19,15 @@
 #include "plink_ld.h"
 #include "snp_lookup.h"
 
+#include <algorithm>
+#include <atomic>
+
+// AVX2 / AVX-512 kernels are compiled with target attributes regardless of -march, and chosen at runtime
+#if defined(__LP64__) && defined(__x86_64__) && defined(__GNUC__)
+#define PLINK_LD_RUNTIME_DISPATCH
+#include <immintrin.h>
+#endif
+
 
 #define MULTIPLEX_LD 1920
 
@@ -573,6 +582,406 @@ uint32_t ld_missing_ct_intersect(uintptr_t* lptr1, uintptr_t* lptr2, uintptr_t w
   return tot;
 }
 
+// AVX2 and AVX-512 kernels for the three routines above, selected at runtime by ld_kernel() (see plink_ld.h).
+// Unlike the SSE2 code they take a plain word count instead of MULTIPLEX_LD batches; any word count is supported,
+// and the result is exactly the same integer counts as from ld_dot_prod(), ld_dot_prod_nm() and ld_missing_ct_intersect().
+//   AVX2:     256-bit vectors; the single-stream loops (no-missing dot product, missing intersect) use the Harley-Seal
+//             carry-save adder and popcount only one vector out of eight, the masked dot product (five counts per
+//             window) uses the pshufb nibble lookup with byte accumulators.
+//   AVX-512:  512-bit vectors with the VPOPCNTDQ hardware popcount; the tail is handled with masked loads.
+// Throughout, "t" is the biased x_iy_i term of ld_dot_prod_batch(), and popcount2(x) = popcount(x) + popcount(x & 0xaaaa...)
+// for vectors whose 2-bit fields never equal 11.
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+#define LD_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define LD_TARGET_AVX512 __attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+
+LD_TARGET_AVX2 static inline __m256i popcount256_bytes(__m256i vv) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i lo = _mm256_and_si256(vv, low_mask);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(vv, 4), low_mask);
+  return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+}
+
+LD_TARGET_AVX2 static inline __m256i popcount256(__m256i vv) {
+  return _mm256_sad_epu8(popcount256_bytes(vv), _mm256_setzero_si256());  // four 64-bit counts
+}
+
+LD_TARGET_AVX2 static inline uint64_t hsum256_epi64(__m256i vv) {
+  const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(vv), _mm256_extracti128_si256(vv, 1));
+  return (uint64_t)_mm_cvtsi128_si64(sum) + (uint64_t)_mm_extract_epi64(sum, 1);
+}
+
+// Loads the last word_ct % 4 words, zero-filling the remaining lanes
+LD_TARGET_AVX2 static inline __m256i load_tail256(const uintptr_t* ptr, uintptr_t word_ct) {
+  const __m256i lane_mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(word_ct), _mm256_setr_epi64x(0, 1, 2, 3));
+  return _mm256_maskload_epi64((const long long*)ptr, lane_mask);
+}
+
+// carry-save adder: (*hi, *lo) := aa + bb + cc, bitwise
+LD_TARGET_AVX2 static inline void csa256(__m256i* hi, __m256i* lo, __m256i aa, __m256i bb, __m256i cc) {
+  const __m256i uu = _mm256_xor_si256(aa, bb);
+  *hi = _mm256_or_si256(_mm256_and_si256(aa, bb), _mm256_and_si256(uu, cc));
+  *lo = _mm256_xor_si256(uu, cc);
+}
+
+// Harley-Seal step: adds eight vectors to the carry-save counters; only the carries out of *fours are popcounted
+LD_TARGET_AVX2 static inline void harley_seal_add8(const __m256i* ss, __m256i* ones, __m256i* twos, __m256i* fours, __m256i* eights_total) {
+  __m256i twos_a, twos_b, fours_a, fours_b, eights;
+  csa256(&twos_a, ones, *ones, ss[0], ss[1]);
+  csa256(&twos_b, ones, *ones, ss[2], ss[3]);
+  csa256(&fours_a, twos, *twos, twos_a, twos_b);
+  csa256(&twos_a, ones, *ones, ss[4], ss[5]);
+  csa256(&twos_b, ones, *ones, ss[6], ss[7]);
+  csa256(&fours_b, twos, *twos, twos_a, twos_b);
+  csa256(&eights, fours, *fours, fours_a, fours_b);
+  *eights_total = _mm256_add_epi64(*eights_total, popcount256(eights));
+}
+
+LD_TARGET_AVX2 static inline uint64_t harley_seal_sum(__m256i ones, __m256i twos, __m256i fours, __m256i eights_total) {
+  __m256i total = _mm256_slli_epi64(eights_total, 3);
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+  total = _mm256_add_epi64(total, popcount256(ones));
+  return hsum256_epi64(total);
+}
+
+LD_TARGET_AVX2 static inline __m256i ld_dot_term256(__m256i loader1, __m256i loader2, __m256i m1) {
+  const __m256i sum12 = _mm256_and_si256(_mm256_or_si256(loader1, loader2), m1);
+  return _mm256_or_si256(sum12, _mm256_andnot_si256(_mm256_add_epi64(m1, sum12), _mm256_xor_si256(loader1, loader2)));
+}
+
+LD_TARGET_AVX2 static void ld_dot_prod_avx2(const uintptr_t* vec1, const uintptr_t* vec2, const uintptr_t* mask1, const uintptr_t* mask2, int32_t* return_vals, uintptr_t word_ct) {
+  const __m256i m1 = _mm256_set1_epi64x(FIVEMASK);
+  const __m256i a1 = _mm256_set1_epi64x(FIVEMASK << 1);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero, acc1 = zero, acc2 = zero, acc11 = zero, acc22 = zero;
+  uintptr_t widx = 0;
+  while (widx < word_ct) {
+    // byte counters take at most 16 per window, so they are flushed to the 64-bit accumulators every 15 windows
+    __m256i bacc = zero, bacc1 = zero, bacc2 = zero, bacc11 = zero, bacc22 = zero;
+    for (int window = 0; (window < 15) && (widx < word_ct); window++, widx += 4) {
+      __m256i loader1, loader2, sum1, sum2;
+      if (word_ct - widx >= 4) {
+        loader1 = _mm256_loadu_si256((const __m256i*)&vec1[widx]);
+        loader2 = _mm256_loadu_si256((const __m256i*)&vec2[widx]);
+        sum1 = _mm256_loadu_si256((const __m256i*)&mask2[widx]);
+        sum2 = _mm256_loadu_si256((const __m256i*)&mask1[widx]);
+      } else {
+        loader1 = load_tail256(&vec1[widx], word_ct - widx);
+        loader2 = load_tail256(&vec2[widx], word_ct - widx);
+        sum1 = load_tail256(&mask2[widx], word_ct - widx);
+        sum2 = load_tail256(&mask1[widx], word_ct - widx);
+      }
+      const __m256i sum12 = ld_dot_term256(loader1, loader2, m1);
+      sum1 = _mm256_and_si256(sum1, loader1);
+      sum2 = _mm256_and_si256(sum2, loader2);
+      bacc = _mm256_add_epi8(bacc, _mm256_add_epi8(popcount256_bytes(sum12), popcount256_bytes(_mm256_and_si256(sum12, a1))));
+      bacc1 = _mm256_add_epi8(bacc1, _mm256_add_epi8(popcount256_bytes(sum1), popcount256_bytes(_mm256_and_si256(sum1, a1))));
+      bacc2 = _mm256_add_epi8(bacc2, _mm256_add_epi8(popcount256_bytes(sum2), popcount256_bytes(_mm256_and_si256(sum2, a1))));
+      bacc11 = _mm256_add_epi8(bacc11, popcount256_bytes(_mm256_and_si256(sum1, m1)));
+      bacc22 = _mm256_add_epi8(bacc22, popcount256_bytes(_mm256_and_si256(sum2, m1)));
+    }
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bacc, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(bacc1, zero));
+    acc2 = _mm256_add_epi64(acc2, _mm256_sad_epu8(bacc2, zero));
+    acc11 = _mm256_add_epi64(acc11, _mm256_sad_epu8(bacc11, zero));
+    acc22 = _mm256_add_epi64(acc22, _mm256_sad_epu8(bacc22, zero));
+  }
+  return_vals[0] -= (int32_t)hsum256_epi64(acc);
+  return_vals[1] += (int32_t)hsum256_epi64(acc1);
+  return_vals[2] += (int32_t)hsum256_epi64(acc2);
+  return_vals[3] += (int32_t)hsum256_epi64(acc11);
+  return_vals[4] += (int32_t)hsum256_epi64(acc22);
+}
+
+LD_TARGET_AVX2 static uint32_t ld_dot_prod_nm_avx2(const uintptr_t* vec1, const uintptr_t* vec2, uintptr_t word_ct) {
+  // returns \sum_i popcount2(t_i), i.e. N - \sum_i x_iy_i
+  const __m256i m1 = _mm256_set1_epi64x(FIVEMASK);
+  const __m256i a1 = _mm256_set1_epi64x(FIVEMASK << 1);
+  __m256i ones = _mm256_setzero_si256(), twos = ones, fours = ones, eights_total = ones, tail_total = ones;
+  __m256i ss[8];
+  uintptr_t widx = 0;
+  for (; widx + 16 <= word_ct; widx += 16) {
+    for (int vidx = 0; vidx < 4; vidx++) {
+      ss[2 * vidx] = ld_dot_term256(_mm256_loadu_si256((const __m256i*)&vec1[widx + 4 * vidx]),
+                                    _mm256_loadu_si256((const __m256i*)&vec2[widx + 4 * vidx]), m1);
+      ss[2 * vidx + 1] = _mm256_and_si256(ss[2 * vidx], a1);
+    }
+    harley_seal_add8(ss, &ones, &twos, &fours, &eights_total);
+  }
+  for (; widx < word_ct; widx += 4) {
+    const __m256i loader1 = (word_ct - widx >= 4) ? _mm256_loadu_si256((const __m256i*)&vec1[widx]) : load_tail256(&vec1[widx], word_ct - widx);
+    const __m256i loader2 = (word_ct - widx >= 4) ? _mm256_loadu_si256((const __m256i*)&vec2[widx]) : load_tail256(&vec2[widx], word_ct - widx);
+    const __m256i sum12 = ld_dot_term256(loader1, loader2, m1);
+    tail_total = _mm256_add_epi64(tail_total, _mm256_add_epi64(popcount256(sum12), popcount256(_mm256_and_si256(sum12, a1))));
+  }
+  return (uint32_t)(harley_seal_sum(ones, twos, fours, eights_total) + hsum256_epi64(tail_total));
+}
+
+LD_TARGET_AVX2 static uint32_t ld_missing_ct_intersect_avx2(const uintptr_t* lptr1, const uintptr_t* lptr2, uintptr_t word_ct) {
+  // number of samples missing in both masks, over word_ct full words
+  const __m256i m1 = _mm256_set1_epi64x(FIVEMASK);
+  __m256i ones = _mm256_setzero_si256(), twos = ones, fours = ones, eights_total = ones;
+  __m256i ss[8];
+  uintptr_t widx = 0;
+  for (; widx + 32 <= word_ct; widx += 32) {
+    for (int vidx = 0; vidx < 8; vidx++) {
+      ss[vidx] = _mm256_andnot_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)&lptr1[widx + 4 * vidx]),
+                                                     _mm256_loadu_si256((const __m256i*)&lptr2[widx + 4 * vidx])), m1);
+    }
+    harley_seal_add8(ss, &ones, &twos, &fours, &eights_total);
+  }
+  uint64_t tot = harley_seal_sum(ones, twos, fours, eights_total);
+  for (; widx < word_ct; widx++) {
+    tot += popcount2_long((~(lptr1[widx] | lptr2[widx])) & FIVEMASK);
+  }
+  return (uint32_t)tot;
+}
+
+LD_TARGET_AVX512 static inline __mmask8 tail_mask512(uintptr_t words_left) {
+  return (words_left >= 8) ? (__mmask8)0xff : (__mmask8)((1u << words_left) - 1);
+}
+
+LD_TARGET_AVX512 static inline __m512i ld_dot_term512(__m512i loader1, __m512i loader2, __m512i m1) {
+  const __m512i sum12 = _mm512_and_si512(_mm512_or_si512(loader1, loader2), m1);
+  return _mm512_or_si512(sum12, _mm512_andnot_si512(_mm512_add_epi64(m1, sum12), _mm512_xor_si512(loader1, loader2)));
+}
+
+LD_TARGET_AVX512 static inline __m512i popcount2_512(__m512i vv, __m512i a1) {
+  return _mm512_add_epi64(_mm512_popcnt_epi64(vv), _mm512_popcnt_epi64(_mm512_and_si512(vv, a1)));
+}
+
+LD_TARGET_AVX512 static void ld_dot_prod_avx512(const uintptr_t* vec1, const uintptr_t* vec2, const uintptr_t* mask1, const uintptr_t* mask2, int32_t* return_vals, uintptr_t word_ct) {
+  const __m512i m1 = _mm512_set1_epi64(FIVEMASK);
+  const __m512i a1 = _mm512_set1_epi64(FIVEMASK << 1);
+  __m512i acc = _mm512_setzero_si512(), acc1 = acc, acc2 = acc, acc11 = acc, acc22 = acc;
+  for (uintptr_t widx = 0; widx < word_ct; widx += 8) {
+    const __mmask8 kk = tail_mask512(word_ct - widx);
+    const __m512i loader1 = _mm512_maskz_loadu_epi64(kk, &vec1[widx]);
+    const __m512i loader2 = _mm512_maskz_loadu_epi64(kk, &vec2[widx]);
+    const __m512i sum1 = _mm512_and_si512(_mm512_maskz_loadu_epi64(kk, &mask2[widx]), loader1);
+    const __m512i sum2 = _mm512_and_si512(_mm512_maskz_loadu_epi64(kk, &mask1[widx]), loader2);
+    acc = _mm512_add_epi64(acc, popcount2_512(ld_dot_term512(loader1, loader2, m1), a1));
+    acc1 = _mm512_add_epi64(acc1, popcount2_512(sum1, a1));
+    acc2 = _mm512_add_epi64(acc2, popcount2_512(sum2, a1));
+    acc11 = _mm512_add_epi64(acc11, _mm512_popcnt_epi64(_mm512_and_si512(sum1, m1)));
+    acc22 = _mm512_add_epi64(acc22, _mm512_popcnt_epi64(_mm512_and_si512(sum2, m1)));
+  }
+  return_vals[0] -= (int32_t)_mm512_reduce_add_epi64(acc);
+  return_vals[1] += (int32_t)_mm512_reduce_add_epi64(acc1);
+  return_vals[2] += (int32_t)_mm512_reduce_add_epi64(acc2);
+  return_vals[3] += (int32_t)_mm512_reduce_add_epi64(acc11);
+  return_vals[4] += (int32_t)_mm512_reduce_add_epi64(acc22);
+}
+
+LD_TARGET_AVX512 static uint32_t ld_dot_prod_nm_avx512(const uintptr_t* vec1, const uintptr_t* vec2, uintptr_t word_ct) {
+  const __m512i m1 = _mm512_set1_epi64(FIVEMASK);
+  const __m512i a1 = _mm512_set1_epi64(FIVEMASK << 1);
+  __m512i acc = _mm512_setzero_si512();
+  for (uintptr_t widx = 0; widx < word_ct; widx += 8) {
+    const __mmask8 kk = tail_mask512(word_ct - widx);
+    const __m512i sum12 = ld_dot_term512(_mm512_maskz_loadu_epi64(kk, &vec1[widx]), _mm512_maskz_loadu_epi64(kk, &vec2[widx]), m1);
+    acc = _mm512_add_epi64(acc, popcount2_512(sum12, a1));
+  }
+  return (uint32_t)_mm512_reduce_add_epi64(acc);
+}
+
+LD_TARGET_AVX512 static uint32_t ld_missing_ct_intersect_avx512(const uintptr_t* lptr1, const uintptr_t* lptr2, uintptr_t word_ct) {
+  const __m512i m1 = _mm512_set1_epi64(FIVEMASK);
+  __m512i acc = _mm512_setzero_si512();
+  for (uintptr_t widx = 0; widx < word_ct; widx += 8) {
+    const __mmask8 kk = tail_mask512(word_ct - widx);
+    const __m512i both = _mm512_or_si512(_mm512_maskz_loadu_epi64(kk, &lptr1[widx]), _mm512_maskz_loadu_epi64(kk, &lptr2[widx]));
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_maskz_andnot_epi64(kk, both, m1)));
+  }
+  return (uint32_t)_mm512_reduce_add_epi64(acc);
+}
+#endif  // PLINK_LD_RUNTIME_DISPATCH
+
+LdKernel ld_kernel_supported() {
+  static const LdKernel supported = []() {
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) return kLdKernelAvx512;
+    if (__builtin_cpu_supports("avx2")) return kLdKernelAvx2;
+#endif
+    return kLdKernelSse2;
+  }();
+  return supported;
+}
+
+static std::atomic<int> g_ld_kernel(-1);  // -1 means ld_kernel_supported()
+
+LdKernel ld_kernel() {
+  const int kernel = g_ld_kernel.load(std::memory_order_relaxed);
+  return (kernel < 0) ? ld_kernel_supported() : static_cast<LdKernel>(kernel);
+}
+
+void set_ld_kernel(LdKernel kernel) {
+  g_ld_kernel = std::min(kernel, ld_kernel_supported());
+}
+
+const char* ld_kernel_str(LdKernel kernel) {
+  switch (kernel) {
+    case kLdKernelAvx2: return "avx2";
+    case kLdKernelAvx512: return "avx512-vpopcntdq";
+#ifdef __LP64__
+    default: return "sse2";
+#else
+    default: return "generic";
+#endif
+  }
+}
+
+// Dispatch by kernel; word_ct (or the SampleCountInfo) describes one geno / mask vector, see PlinkLdBedFileChunk
+static void ld_dot_prod(LdKernel kernel, uintptr_t* vec1, uintptr_t* vec2, uintptr_t* mask1, uintptr_t* mask2, int32_t* return_vals, const SampleCountInfo& sc) {
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+  if (kernel == kLdKernelAvx512) return ld_dot_prod_avx512(vec1, vec2, mask1, mask2, return_vals, sc.founder_ct_192_long);
+  if (kernel == kLdKernelAvx2) return ld_dot_prod_avx2(vec1, vec2, mask1, mask2, return_vals, sc.founder_ct_192_long);
+#endif
+  ld_dot_prod(vec1, vec2, mask1, mask2, return_vals, sc.founder_ct_mld_m1, sc.founder_ct_mld_rem);
+}
+
+static int32_t ld_dot_prod_nm(LdKernel kernel, uintptr_t* vec1, uintptr_t* vec2, const SampleCountInfo& sc) {
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+  if (kernel == kLdKernelAvx512) return (int32_t)sc.founder_ct - (int32_t)ld_dot_prod_nm_avx512(vec1, vec2, sc.founder_ct_192_long);
+  if (kernel == kLdKernelAvx2) return (int32_t)sc.founder_ct - (int32_t)ld_dot_prod_nm_avx2(vec1, vec2, sc.founder_ct_192_long);
+#endif
+  return ld_dot_prod_nm(vec1, vec2, sc.founder_ct, sc.founder_ct_mld_m1, sc.founder_ct_mld_rem);
+}
+
+static uint32_t ld_missing_ct_intersect(LdKernel kernel, uintptr_t* lptr1, uintptr_t* lptr2, const SampleCountInfo& sc) {
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+  if (kernel != kLdKernelSse2) {
+    uint32_t tot = (kernel == kLdKernelAvx512) ? ld_missing_ct_intersect_avx512(lptr1, lptr2, sc.founder_ctwd)
+                                               : ld_missing_ct_intersect_avx2(lptr1, lptr2, sc.founder_ctwd);
+    if (sc.lshift_last) {
+      tot += popcount2_long(((~(lptr1[sc.founder_ctwd] | lptr2[sc.founder_ctwd])) & FIVEMASK) << sc.lshift_last);
+    }
+    return tot;
+  }
+#endif
+  return ld_missing_ct_intersect(lptr1, lptr2, sc.founder_ctwd12, sc.founder_ctwd12_rem, sc.lshift_last);
+}
+
+// Kernels of PlinkLdBedFileChunk::calculate_ld_corr_tile: one fixed SNP against kLdTileCols var SNPs, over bit planes
+// (see init_bit_planes). With x, y the genotypes of the fixed and var SNP, and Z, N, M the nonzero, minus and nonmissing planes,
+//   both_nonzero  = popcount(Zx & Zy),  opposite_sign = popcount(Zx & Zy & (Nx ^ Ny)),  i.e. \sum_i x_iy_i = both_nonzero - 2 * opposite_sign
+// and, only when one of the SNPs has missing genotypes, the other terms of ld_dot_prod() restricted to the samples nonmissing in both.
+#define kLdTileCols 4
+
+struct LdTileCounts {
+  uint64_t both_nonzero;
+  uint64_t opposite_sign;
+  uint64_t var_nonzero;    // popcount(Zy & Mx)
+  uint64_t var_minus;      // popcount(Ny & Mx)
+  uint64_t fixed_nonzero;  // popcount(Zx & My)
+  uint64_t fixed_minus;    // popcount(Nx & My)
+  uint64_t non_missing;    // popcount(Mx & My)
+};
+
+template<bool kMissing>
+static inline __attribute__((always_inline)) void ld_tile_row_generic(const uint64_t* fixed, const uint64_t* const* var, uintptr_t plane_words, LdTileCounts* counts) {
+  uint64_t acc[kLdTileCols][7] = {{0}};
+  for (uintptr_t widx = 0; widx < plane_words; widx++) {
+    const uint64_t zx = fixed[widx], nx = fixed[plane_words + widx], mx = fixed[2 * plane_words + widx];
+    for (int col = 0; col < kLdTileCols; col++) {
+      const uint64_t zy = var[col][widx], ny = var[col][plane_words + widx];
+      const uint64_t both = zx & zy;
+      acc[col][0] += __builtin_popcountll(both);
+      acc[col][1] += __builtin_popcountll(both & (nx ^ ny));
+      if (kMissing) {
+        const uint64_t my = var[col][2 * plane_words + widx];
+        acc[col][2] += __builtin_popcountll(zy & mx);
+        acc[col][3] += __builtin_popcountll(ny & mx);
+        acc[col][4] += __builtin_popcountll(zx & my);
+        acc[col][5] += __builtin_popcountll(nx & my);
+        acc[col][6] += __builtin_popcountll(mx & my);
+      }
+    }
+  }
+  for (int col = 0; col < kLdTileCols; col++) {
+    counts[col] = LdTileCounts{acc[col][0], acc[col][1], acc[col][2], acc[col][3], acc[col][4], acc[col][5], acc[col][6]};
+  }
+}
+
+template<bool kMissing>
+static void ld_tile_row_default(const uint64_t* fixed, const uint64_t* const* var, uintptr_t plane_words, LdTileCounts* counts) {
+  ld_tile_row_generic<kMissing>(fixed, var, plane_words, counts);
+}
+
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+// the same code with the hardware popcount instruction
+template<bool kMissing>
+LD_TARGET_AVX2 static void ld_tile_row_avx2(const uint64_t* fixed, const uint64_t* const* var, uintptr_t plane_words, LdTileCounts* counts) {
+  ld_tile_row_generic<kMissing>(fixed, var, plane_words, counts);
+}
+
+// plane_words is a multiple of 8, so there is no tail
+template<bool kMissing>
+LD_TARGET_AVX512 static void ld_tile_row_avx512(const uint64_t* fixed, const uint64_t* const* var, uintptr_t plane_words, LdTileCounts* counts) {
+  __m512i acc[kLdTileCols][7];
+  for (int col = 0; col < kLdTileCols; col++) for (int k = 0; k < 7; k++) acc[col][k] = _mm512_setzero_si512();
+  for (uintptr_t widx = 0; widx < plane_words; widx += 8) {
+    const __m512i zx = _mm512_loadu_si512(&fixed[widx]);
+    const __m512i nx = _mm512_loadu_si512(&fixed[plane_words + widx]);
+    const __m512i mx = kMissing ? _mm512_loadu_si512(&fixed[2 * plane_words + widx]) : _mm512_setzero_si512();
+    for (int col = 0; col < kLdTileCols; col++) {
+      const __m512i zy = _mm512_loadu_si512(&var[col][widx]);
+      const __m512i ny = _mm512_loadu_si512(&var[col][plane_words + widx]);
+      const __m512i both = _mm512_and_si512(zx, zy);
+      acc[col][0] = _mm512_add_epi64(acc[col][0], _mm512_popcnt_epi64(both));
+      acc[col][1] = _mm512_add_epi64(acc[col][1], _mm512_popcnt_epi64(_mm512_and_si512(both, _mm512_xor_si512(nx, ny))));
+      if (kMissing) {
+        const __m512i my = _mm512_loadu_si512(&var[col][2 * plane_words + widx]);
+        acc[col][2] = _mm512_add_epi64(acc[col][2], _mm512_popcnt_epi64(_mm512_and_si512(zy, mx)));
+        acc[col][3] = _mm512_add_epi64(acc[col][3], _mm512_popcnt_epi64(_mm512_and_si512(ny, mx)));
+        acc[col][4] = _mm512_add_epi64(acc[col][4], _mm512_popcnt_epi64(_mm512_and_si512(zx, my)));
+        acc[col][5] = _mm512_add_epi64(acc[col][5], _mm512_popcnt_epi64(_mm512_and_si512(nx, my)));
+        acc[col][6] = _mm512_add_epi64(acc[col][6], _mm512_popcnt_epi64(_mm512_and_si512(mx, my)));
+      }
+    }
+  }
+  for (int col = 0; col < kLdTileCols; col++) {
+    uint64_t sums[7];
+    for (int k = 0; k < 7; k++) sums[k] = _mm512_reduce_add_epi64(acc[col][k]);
+    counts[col] = LdTileCounts{sums[0], sums[1], sums[2], sums[3], sums[4], sums[5], sums[6]};
+  }
+}
+#endif  // PLINK_LD_RUNTIME_DISPATCH
+
+template<bool kMissing>
+static void ld_tile_row(LdKernel kernel, const uint64_t* fixed, const uint64_t* const* var, uintptr_t plane_words, LdTileCounts* counts) {
+#ifdef PLINK_LD_RUNTIME_DISPATCH
+  if (kernel == kLdKernelAvx512) return ld_tile_row_avx512<kMissing>(fixed, var, plane_words, counts);
+  if (kernel == kLdKernelAvx2) return ld_tile_row_avx2<kMissing>(fixed, var, plane_words, counts);
+#endif
+  ld_tile_row_default<kMissing>(fixed, var, plane_words, counts);
+}
+
+// The final step of plink's ld_block_thread() / ld_report_regular(): allelic correlation from the ld_dot_prod() terms
+static inline double ld_corr_from_dot_prod(const int32_t* dp_result, uint32_t non_missing_ct) {
+  const bool is_r2 = false;
+  const bool keep_sign = false;
+
+  double non_missing_ctd = (double)((int32_t)non_missing_ct);
+  double dxx = dp_result[1];
+  double dyy = dp_result[2];
+  double cov12 = dp_result[0] * non_missing_ctd - dxx * dyy;
+  dxx = (dp_result[3] * non_missing_ctd + dxx * dxx) * (dp_result[4] * non_missing_ctd + dyy * dyy);
+  if (!is_r2) {
+    dxx = cov12 / sqrt(dxx);
+  } else if (!keep_sign) {
+    dxx = (cov12 * cov12) / dxx;
+  } else {
+    dxx = (fabs(cov12) * cov12) / dxx;
+  }
+
+  return dxx;
+}
+
 SampleCountInfo::SampleCountInfo(int num_subjects) {
   unfiltered_sample_ct = num_subjects;
   unfiltered_sample_ctl = BITCT_TO_WORDCT(unfiltered_sample_ct);
@@ -686,6 +1095,8 @@ uint32_t PlinkLdBedFileChunk::init(int num_subjects, int snp_start_index, int nu
   geno_vec.resize(num_snps_in_chunk * sc.founder_ct_192_long, 0);
   geno_masks_vec.resize(num_snps_in_chunk * sc.founder_ct_192_long, 0);
   ld_missing_cts_vec.resize(num_snps_in_chunk, 0);
+  ld_geno_sums_vec.assign(num_snps_in_chunk, 0);  // accumulated below, hence must be reset when the chunk is re-initialized
+  ld_het_cts_vec.assign(num_snps_in_chunk, 0);
   freq_.resize(num_snps_in_chunk_, 0);
 
   if (fseeko(bedfile, bed_offset + (snp_start_index * ((uint64_t)sc.unfiltered_sample_ct4)), SEEK_SET)) {
@@ -710,6 +1121,13 @@ uint32_t PlinkLdBedFileChunk::init(int num_subjects, int snp_start_index, int nu
                      &(geno_masks_vec[snp_index * sc.founder_ct_192_long]),
                      &(ld_missing_cts_vec[snp_index]), 
                      sc.founder_ct, is_x, founder_male_include2);
+
+    // per-SNP terms of ld_dot_prod(), used by calculate_ld_corr for pairs without missing genotypes
+    const uintptr_t* geno_ptr = &(geno_vec[snp_index * sc.founder_ct_192_long]);
+    for (uintptr_t word_index = 0; word_index < sc.unfiltered_sample_ctl2; word_index++) {
+      ld_geno_sums_vec[snp_index] += popcount2_long(geno_ptr[word_index]);
+      ld_het_cts_vec[snp_index] += popcount2_long(geno_ptr[word_index] & FIVEMASK);
+    }
   }
 
   return 0;
@@ -719,9 +1137,6 @@ double PlinkLdBedFileChunk::calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk,
   // The following routine is combined from plink's ld_block_thread() and ld_report_regular() in plink_ld.c
   const SampleCountInfo sc(fixed_chunk.num_subj());
 
-  const bool is_r2 = false;
-  const bool keep_sign = false;
-
   uintptr_t* mask_fixed_vec_ptr = &(fixed_chunk.geno_masks()[snp_fixed_index * sc.founder_ct_192_long]);
   uintptr_t* mask_var_vec_ptr = &(var_chunk.geno_masks()[snp_var_index * sc.founder_ct_192_long]);
   uintptr_t* geno_fixed_vec_ptr = &(fixed_chunk.geno()[snp_fixed_index * sc.founder_ct_192_long]);
@@ -732,30 +1147,112 @@ double PlinkLdBedFileChunk::calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk,
   uint32_t fixed_non_missing_ct = sc.founder_ct - fixed_missing_ct;
   uint32_t var_non_missing_ct = sc.founder_ct - var_missing_ct;
   uint32_t non_missing_ct = fixed_non_missing_ct - var_missing_ct;
+  const LdKernel kernel = ld_kernel();
   if (fixed_missing_ct && var_missing_ct) {
-    non_missing_ct += ld_missing_ct_intersect(mask_var_vec_ptr, mask_fixed_vec_ptr, sc.founder_ctwd12, sc.founder_ctwd12_rem, sc.lshift_last);
+    non_missing_ct += ld_missing_ct_intersect(kernel, mask_var_vec_ptr, mask_fixed_vec_ptr, sc);
   }
 
   int32_t dp_result[5];
-  dp_result[0] = sc.founder_ct;
-  dp_result[1] = -fixed_non_missing_ct;
-  dp_result[2] = -var_non_missing_ct;
-  dp_result[3] = dp_result[1];
-  dp_result[4] = dp_result[2];
-  ld_dot_prod(geno_var_vec_ptr, geno_fixed_vec_ptr, mask_var_vec_ptr, mask_fixed_vec_ptr, dp_result, sc.founder_ct_mld_m1, sc.founder_ct_mld_rem);
-
-  double non_missing_ctd = (double)((int32_t)non_missing_ct);
-  double dxx = dp_result[1];
-  double dyy = dp_result[2];
-  double cov12 = dp_result[0] * non_missing_ctd - dxx * dyy;
-  dxx = (dp_result[3] * non_missing_ctd + dxx * dxx) * (dp_result[4] * non_missing_ctd + dyy * dyy);
-  if (!is_r2) {
-    dxx = cov12 / sqrt(dxx);
-  } else if (!keep_sign) {
-    dxx = (cov12 * cov12) / dxx;
+  if (!fixed_missing_ct && !var_missing_ct) {
+    // no missing genotypes: the masks are all ones, and only the x_iy_i term depends on the pair
+    dp_result[0] = ld_dot_prod_nm(kernel, geno_var_vec_ptr, geno_fixed_vec_ptr, sc);
+    dp_result[1] = (int32_t)var_chunk.ld_geno_sums()[snp_var_index] - (int32_t)sc.founder_ct;
+    dp_result[2] = (int32_t)fixed_chunk.ld_geno_sums()[snp_fixed_index] - (int32_t)sc.founder_ct;
+    dp_result[3] = (int32_t)var_chunk.ld_het_cts()[snp_var_index] - (int32_t)sc.founder_ct;
+    dp_result[4] = (int32_t)fixed_chunk.ld_het_cts()[snp_fixed_index] - (int32_t)sc.founder_ct;
   } else {
-    dxx = (fabs(cov12) * cov12) / dxx;
+    dp_result[0] = sc.founder_ct;
+    dp_result[1] = -fixed_non_missing_ct;
+    dp_result[2] = -var_non_missing_ct;
+    dp_result[3] = dp_result[1];
+    dp_result[4] = dp_result[2];
+    ld_dot_prod(kernel, geno_var_vec_ptr, geno_fixed_vec_ptr, mask_var_vec_ptr, mask_fixed_vec_ptr, dp_result, sc);
   }
 
-  return dxx;
+  return ld_corr_from_dot_prod(dp_result, non_missing_ct);
+}
+
+static inline uint64_t pack_even_bits(uint64_t val) {
+  // bits 0, 2, 4, ... of val become bits 0, 1, 2, ...
+  val &= 0x5555555555555555LLU;
+  val = (val | (val >> 1)) & 0x3333333333333333LLU;
+  val = (val | (val >> 2)) & 0x0f0f0f0f0f0f0f0fLLU;
+  val = (val | (val >> 4)) & 0x00ff00ff00ff00ffLLU;
+  val = (val | (val >> 8)) & 0x0000ffff0000ffffLLU;
+  val = (val | (val >> 16)) & 0x00000000ffffffffLLU;
+  return val;
+}
+
+void PlinkLdBedFileChunk::init_bit_planes() {
+  const SampleCountInfo sc(num_subj_);
+  plane_words_ = (((sc.founder_ct + 63) / 64) + 7) / 8 * 8;  // a multiple of 8 words, so that AVX-512 loads need no tail
+  bit_planes_vec.assign(num_snps_in_chunk_ * 3 * plane_words_, 0);
+
+  const uintptr_t geno_words_per_plane_word = 64 / BITCT2;
+  for (int snp_index = 0; snp_index < num_snps_in_chunk_; snp_index++) {
+    const uintptr_t* geno_ptr = &(geno_vec[snp_index * sc.founder_ct_192_long]);
+    const uintptr_t* mask_ptr = &(geno_masks_vec[snp_index * sc.founder_ct_192_long]);
+    uint64_t* planes = &(bit_planes_vec[snp_index * 3 * plane_words_]);
+    for (uintptr_t geno_word = 0; geno_word < sc.unfiltered_sample_ctl2; geno_word++) {
+      // geno: -1 -> 00, 0/missing -> 01, 1 -> 10; mask: missing -> 00, otherwise 11 (also 00 beyond founder_ct)
+      const uintptr_t geno_lo = geno_ptr[geno_word];
+      const uintptr_t geno_hi = geno_lo >> 1;
+      const uintptr_t mask = mask_ptr[geno_word];
+      const uintptr_t plane_word = geno_word / geno_words_per_plane_word;
+      const uintptr_t shift = BITCT2 * (geno_word % geno_words_per_plane_word);
+      planes[plane_word] |= pack_even_bits(mask & ~geno_lo) << shift;                              // x_i != 0
+      planes[plane_words_ + plane_word] |= pack_even_bits(mask & ~geno_lo & ~geno_hi) << shift;    // x_i == -1
+      planes[2 * plane_words_ + plane_word] |= pack_even_bits(mask) << shift;                       // nonmissing
+    }
+  }
+}
+
+void PlinkLdBedFileChunk::calculate_ld_corr_tile(PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk, int fixed_begin, int fixed_count, int var_begin, int var_count, double* corr) {
+  const int32_t founder_ct = fixed_chunk.num_subj();
+  const uintptr_t plane_words = fixed_chunk.plane_words_;
+  const LdKernel kernel = ld_kernel();
+
+  const uint64_t* var[kLdTileCols];
+  LdTileCounts counts[kLdTileCols];
+  for (int var_tile = 0; var_tile < var_count; var_tile += kLdTileCols) {
+    // a partial group of columns repeats its last SNP, and ignores the extra results
+    const int cols = std::min(kLdTileCols, var_count - var_tile);
+    bool var_missing = false;
+    for (int col = 0; col < kLdTileCols; col++) {
+      const int snp_var_index = var_begin + var_tile + std::min(col, cols - 1);
+      var[col] = &(var_chunk.bit_planes_vec[snp_var_index * 3 * plane_words]);
+      var_missing |= (var_chunk.ld_missing_cts()[snp_var_index] != 0);
+    }
+
+    for (int fixed_offset = 0; fixed_offset < fixed_count; fixed_offset++) {
+      const int snp_fixed_index = fixed_begin + fixed_offset;
+      const uint64_t* fixed = &(fixed_chunk.bit_planes_vec[snp_fixed_index * 3 * plane_words]);
+      const bool fixed_missing = (fixed_chunk.ld_missing_cts()[snp_fixed_index] != 0);
+      if (fixed_missing || var_missing) ld_tile_row<true>(kernel, fixed, var, plane_words, counts);
+      else ld_tile_row<false>(kernel, fixed, var, plane_words, counts);
+
+      for (int col = 0; col < cols; col++) {
+        const int snp_var_index = var_begin + var_tile + col;
+        const LdTileCounts& cc = counts[col];
+        int32_t dp_result[5];
+        uint32_t non_missing_ct;
+        dp_result[0] = (int32_t)cc.both_nonzero - 2 * (int32_t)cc.opposite_sign;
+        if (!fixed_missing && !var_chunk.ld_missing_cts()[snp_var_index]) {
+          // no missing genotypes, the same per-SNP terms as in calculate_ld_corr
+          dp_result[1] = (int32_t)var_chunk.ld_geno_sums()[snp_var_index] - founder_ct;
+          dp_result[2] = (int32_t)fixed_chunk.ld_geno_sums()[snp_fixed_index] - founder_ct;
+          dp_result[3] = (int32_t)var_chunk.ld_het_cts()[snp_var_index] - founder_ct;
+          dp_result[4] = (int32_t)fixed_chunk.ld_het_cts()[snp_fixed_index] - founder_ct;
+          non_missing_ct = founder_ct;
+        } else {
+          dp_result[1] = (int32_t)cc.var_nonzero - 2 * (int32_t)cc.var_minus;
+          dp_result[2] = (int32_t)cc.fixed_nonzero - 2 * (int32_t)cc.fixed_minus;
+          dp_result[3] = -(int32_t)cc.var_nonzero;
+          dp_result[4] = -(int32_t)cc.fixed_nonzero;
+          non_missing_ct = (uint32_t)cc.non_missing;
+        }
+        corr[fixed_offset * var_count + var_tile + col] = ld_corr_from_dot_prod(dp_result, non_missing_ct);
+      }
+    }
+  }
 }
@@ -25,6 +25,19 @@
 
 #include <vector>
 
+// Kernels for the bit-counting loops of PlinkLdBedFileChunk::calculate_ld_corr. All kernels give exactly the same result.
+// By default the best kernel supported by the CPU is used (ld_kernel_supported); set_ld_kernel may select a slower one.
+enum LdKernel {
+  kLdKernelSse2 = 0,    // the original plink code (128-bit SSE2, or 32-bit words in 32-bit builds)
+  kLdKernelAvx2 = 1,    // 256-bit AVX2
+  kLdKernelAvx512 = 2,  // 512-bit AVX-512 with the VPOPCNTDQ popcount instruction
+};
+
+LdKernel ld_kernel_supported();
+LdKernel ld_kernel();
+void set_ld_kernel(LdKernel kernel);  // capped to ld_kernel_supported()
+const char* ld_kernel_str(LdKernel kernel);
+
 // Calculates several derived measures from the number of subjects.
 // Has several simplifications compared to what is typically handled in plink:
 // * Assumes that all individuals are founders.
@@ -63,17 +76,31 @@ class PlinkLdBedFileChunk {
   uintptr_t* geno() {return &geno_vec[0];}
   uintptr_t* geno_masks() {return &geno_masks_vec[0];}
   uint32_t* ld_missing_cts() {return &ld_missing_cts_vec[0];}
+  uint32_t* ld_geno_sums() {return &ld_geno_sums_vec[0];}
+  uint32_t* ld_het_cts() {return &ld_het_cts_vec[0];}
   float* freq() {return &freq_[0];}
   float hetval(int snp_index) { return 2.0f * freq_[snp_index] * (1.0f - freq_[snp_index]);} // heterozygosity
   int num_subj() { return num_subj_; }
 
   static double calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk, int snp_fixed_index, int snp_var_index);
 
+  // Bit-sliced copy of the genotypes for calculate_ld_corr_tile, to be called after init().
+  void init_bit_planes();
+
+  // Allelic correlation of all pairs (fixed_begin + i, var_begin + j), i < fixed_count, j < var_count, written to corr[i * var_count + j].
+  // Gives exactly the same values as calculate_ld_corr, but loads each genotype word once per group of var SNPs instead of once per pair.
+  // Both chunks must have bit planes.
+  static void calculate_ld_corr_tile(PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk, int fixed_begin, int fixed_count, int var_begin, int var_count, double* corr);
+
  private:
   int num_subj_;
   int num_snps_in_chunk_;
   std::vector<uintptr_t> geno_vec;        // geno_vec and geno_masks_vec has special encoding for LD structure, see ld_process_load2()
   std::vector<uintptr_t> geno_masks_vec;
   std::vector<uint32_t> ld_missing_cts_vec;
+  std::vector<uint32_t> ld_geno_sums_vec;  // popcount2(geno), i.e. N + \sum_i x_i for a SNP without missing genotypes
+  std::vector<uint32_t> ld_het_cts_vec;    // popcount(geno & 0x5555...), i.e. N - \sum_i x_i^2 for a SNP without missing genotypes
   std::vector<float> freq_;
+  uintptr_t plane_words_;
+  std::vector<uint64_t> bit_planes_vec;  // per SNP: x_i != 0, x_i == -1, and nonmissing planes of plane_words_ 64-sample words each
 };
@@ -161,6 +161,48 @@ int64_t bgmg_set_ld_r2_csr(int context_id, int chr_label) {
   } CATCH_EXCEPTIONS;
 }
 
+int64_t bgmg_set_ld_r2_from_files(int context_id, const char* chr_labels, const char* filename_template) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(chr_labels); check_is_not_null(filename_template);
+    return BgmgCalculatorManager::singleton().Get(context_id)->set_ld_r2_from_files(chr_labels, filename_template);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_set_ld_shm_dir(int context_id, const char* directory) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(directory);
+    return BgmgCalculatorManager::singleton().Get(context_id)->set_ld_shm_dir(directory);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_set_ld_stream_dir(int context_id, const char* directory) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(directory);
+    return BgmgCalculatorManager::singleton().Get(context_id)->set_ld_stream_dir(directory);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_save_context(int context_id, const char* filename, const char* key) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(filename);
+    check_is_not_null(key);
+    return BgmgCalculatorManager::singleton().Get(context_id)->save_context(filename, key);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_load_context(int context_id, const char* filename, const char* key) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(filename);
+    check_is_not_null(key);
+    return BgmgCalculatorManager::singleton().Get(context_id)->load_context(filename, key);
+  } CATCH_EXCEPTIONS;
+}
+
 int64_t bgmg_num_ld_r2_snp(int context_id, int snp_index) {
   try {
     set_last_error(std::string());
@@ -300,6 +342,13 @@ int64_t bgmg_set_weights_randprune(int context_id, int n, float r2, const char*
   } CATCH_EXCEPTIONS;
 }
 
+int64_t bgmg_compact_ld_to_deftags(int context_id, int free_rest) {
+  try {
+    set_last_error(std::string());
+    return BgmgCalculatorManager::singleton().Get(context_id)->compact_ld_to_deftags(free_rest);
+  } CATCH_EXCEPTIONS;
+}
+
 int64_t bgmg_dispose(int context_id) {
   try {
     set_last_error(std::string());
@@ -364,12 +413,24 @@ int64_t bgmg_convert_plink_ld(int context_id, const char* plink_ld_gz, const cha
   } CATCH_EXCEPTIONS;
 }
 
-int64_t bgmg_calc_ld_matrix(const char* bfile, const char* outfile, double r2min, double ldscore_r2min, int ld_window, float ld_window_kb) {
+int64_t bgmg_calc_ld_matrix(const char* bfile, const char* outfile, double r2min, double ldscore_r2min, int ld_window, float ld_window_kb, int ld_engine) {
   try {
     if (!LoggerImpl::singleton().is_initialized()) LoggerImpl::singleton().init("bgmg.log");
     set_last_error(std::string());
     check_is_not_null(bfile); check_is_not_null(outfile);
-    generate_ld_matrix_from_bed_file(bfile, r2min, ldscore_r2min, ld_window, ld_window_kb, outfile);
+    if ((ld_engine != kLdEnginePairwise) && (ld_engine != kLdEngineTiled)) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_engine must be 0 (pairwise) or 1 (tiled)"));
+    generate_ld_matrix_from_bed_file(bfile, r2min, ldscore_r2min, ld_window, ld_window_kb, outfile, static_cast<LdEngine>(ld_engine));
+    return 0;
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_merge_ld_matrix(const char* bim_file, const char* chr_labels, const char* ld_file_template, double r2min, double ldscore_r2min, int compress_r, const char* outfile) {
+  try {
+    if (!LoggerImpl::singleton().is_initialized()) LoggerImpl::singleton().init("bgmg.log");
+    set_last_error(std::string());
+    check_is_not_null(bim_file); check_is_not_null(chr_labels); check_is_not_null(ld_file_template); check_is_not_null(outfile);
+
+    merge_ld_matrix_files(bim_file, chr_labels, ld_file_template, r2min, ldscore_r2min, outfile, compress_r != 0);
     return 0;
   } CATCH_EXCEPTIONS;
 }
@@ -7,11 +7,21 @@
 #include <random>
 #include <algorithm>
 #include <string>
+#include <fstream>
+#include <numeric>
+#include <memory>
+#include <functional>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <boost/filesystem.hpp>
 
 #include "bgmg_parse.h"
 #include "plink_ld.h"
 #include "snp_lookup.h"
 #include "ld_matrix.h"
+#include "bgmg_calculator.h"
 
 const std::string DataFolder = "/home/oleksanf/github/mixer/src/testdata";
 
@@ -136,6 +146,72 @@ TEST(TestLd, AllMissingGenotypes) {
   for (int num_subj = 10001; num_subj < 10100; num_subj++) test_ld(num_subj, 10, 1.001);
 }
 
+// --gtest_filter=TestLd.LdKernels
+TEST(TestLd, LdKernels) {
+  // every kernel supported by this CPU must give exactly the same correlations as the original SSE2 code;
+  // sample sizes cover partial words, partial 256- and 512-bit vectors, and several MULTIPLEX_LD batches
+  for (int num_subj : {1, 31, 33, 100, 191, 193, 385, 1921, 3877}) {
+    for (double missing_rate : {0.0, 0.002, 0.3}) {
+      std::vector<std::string> unpacked_snps;
+      std::string buffer;
+      const int num_snps = 12;
+      generate_genotypes(num_subj, num_snps, missing_rate, &unpacked_snps, &buffer);
+      FILE* bedfile = fmemopen(&buffer[0], buffer.size(), "rb");
+      PlinkLdBedFileChunk plink_ld(num_subj, 0, num_snps, bedfile);
+      fclose(bedfile);
+
+      std::vector<double> expected;
+      set_ld_kernel(kLdKernelSse2);
+      for (int i = 0; i < num_snps; i++) for (int j = 0; j < num_snps; j++)
+        expected.push_back(PlinkLdBedFileChunk::calculate_ld_corr(plink_ld, plink_ld, i, j));
+
+      for (int kernel = kLdKernelSse2; kernel <= ld_kernel_supported(); kernel++) {
+        set_ld_kernel(static_cast<LdKernel>(kernel));
+        ASSERT_EQ(ld_kernel(), kernel);
+        for (int i = 0, k = 0; i < num_snps; i++) for (int j = 0; j < num_snps; j++, k++) {
+          const double rIJ = PlinkLdBedFileChunk::calculate_ld_corr(plink_ld, plink_ld, i, j);
+          if (std::isfinite(expected[k]) || std::isfinite(rIJ)) ASSERT_EQ(rIJ, expected[k]) << ld_kernel_str(ld_kernel());
+        }
+      }
+      set_ld_kernel(ld_kernel_supported());
+    }
+  }
+}
+
+// --gtest_filter=TestLd.CorrTile
+TEST(TestLd, CorrTile) {
+  // calculate_ld_corr_tile must give exactly the same correlations as calculate_ld_corr, including partial groups of columns
+  for (int num_subj : {1, 63, 65, 513, 1100}) {
+    for (double missing_rate : {0.0, 0.002, 0.3}) {
+      std::vector<std::string> unpacked_snps;
+      std::string buffer;
+      const int num_snps = 22;
+      generate_genotypes(num_subj, num_snps, missing_rate, &unpacked_snps, &buffer);
+      FILE* bedfile = fmemopen(&buffer[0], buffer.size(), "rb");
+      PlinkLdBedFileChunk left_chunk(num_subj, 0, num_snps / 2, bedfile);
+      PlinkLdBedFileChunk right_chunk(num_subj, num_snps / 2, num_snps / 2, bedfile);
+      fclose(bedfile);
+      left_chunk.init_bit_planes();
+      right_chunk.init_bit_planes();
+
+      for (int kernel = kLdKernelSse2; kernel <= ld_kernel_supported(); kernel++) {
+        set_ld_kernel(static_cast<LdKernel>(kernel));
+        for (PlinkLdBedFileChunk* var_chunk : {&left_chunk, &right_chunk}) {
+          const int fixed_begin = 1, fixed_count = 9, var_begin = 2, var_count = 7;
+          std::vector<double> tile(fixed_count * var_count);
+          PlinkLdBedFileChunk::calculate_ld_corr_tile(left_chunk, *var_chunk, fixed_begin, fixed_count, var_begin, var_count, &tile[0]);
+          for (int i = 0; i < fixed_count; i++) for (int j = 0; j < var_count; j++) {
+            const double rIJ = PlinkLdBedFileChunk::calculate_ld_corr(left_chunk, *var_chunk, fixed_begin + i, var_begin + j);
+            const double rIJ_tile = tile[i * var_count + j];
+            if (std::isfinite(rIJ) || std::isfinite(rIJ_tile)) ASSERT_EQ(rIJ, rIJ_tile) << ld_kernel_str(ld_kernel());
+          }
+        }
+      }
+      set_ld_kernel(ld_kernel_supported());
+    }
+  }
+}
+
 TEST(TestLd, DifferentChunks) {
   std::vector<std::string> unpacked_snps;
   std::string buffer;
@@ -159,6 +235,32 @@ TEST(TestLd, DifferentChunks) {
   fclose(bedfile);
 }
 
+// a chunk re-initialized with other SNPs (as chunk_var in generate_ld_matrix_from_bed_file) must give the same correlations as a new chunk;
+// without missing genotypes calculate_ld_corr uses per-SNP sums, computed in PlinkLdBedFileChunk::init
+TEST(TestLd, ReusedChunk) {
+  std::vector<std::string> unpacked_snps;
+  std::string buffer;
+  int num_subj = 789, num_snps=20;
+  generate_genotypes(num_subj, num_snps, 0.0, &unpacked_snps, &buffer);
+  FILE* bedfile = fmemopen(&buffer[0], buffer.size(), "rb");
+
+  PlinkLdBedFileChunk left_chunk(num_subj, 0, num_snps/2, bedfile);
+  PlinkLdBedFileChunk right_chunk(num_subj, num_snps/2, num_snps/2, bedfile);
+  PlinkLdBedFileChunk reused_chunk(num_subj, 0, num_snps/2, bedfile);
+  reused_chunk.init(num_subj, num_snps/2, num_snps/2, bedfile);
+
+  for (int i = 0; i < num_snps/2; i++) {
+    for (int j = 0; j < num_snps/2; j++) {
+      double rIJ = PlinkLdBedFileChunk::calculate_ld_corr(left_chunk, right_chunk, i, j);
+      double rIJ_reused = PlinkLdBedFileChunk::calculate_ld_corr(left_chunk, reused_chunk, i, j);
+      ASSERT_TRUE(std::isfinite(rIJ));
+      ASSERT_EQ(rIJ, rIJ_reused);
+    }
+  }
+
+  fclose(bedfile);
+}
+
 // --gtest_filter=TestLd.GatherLdMatrix
 TEST(TestLd, GatherLdMatrix) {
   std::string fname = DataFolder + "/test.ld.bin2";
@@ -169,7 +271,7 @@ TEST(TestLd, GatherLdMatrix) {
   ASSERT_EQ(chunk.key_index_to_exclusive_, 2011);
   ASSERT_EQ(chunk.csr_ld_key_index_.size(), 2012);
   ASSERT_EQ(chunk.csr_ld_val_index_offset_.size(), 2012);
-  ASSERT_EQ(chunk.csr_ld_val_index_packed_.size(), 84585);
+  ASSERT_EQ(chunk.csr_ld_val_index_packed_.size(), 69200);  // 84585 with vsenc32 for all rows
   ASSERT_EQ(chunk.csr_ld_r_.size(), 129834);
   ASSERT_EQ(chunk.csr_ld_r_[0].raw_value(), 63653);
   ASSERT_EQ(chunk.csr_ld_r_[129833].raw_value(), 20092);
@@ -183,4 +285,1298 @@ TEST(TestLd, GatherLdMatrix) {
 
   ASSERT_FLOAT_EQ(ld_tag_r2_sum[2010], 8.81037998);
   ASSERT_FLOAT_EQ(ld_tag_r2_sum_adjust_for_hvec[2010], 1.8912569);
-}
\ No newline at end of file
+}
+void make_test_chunk(int num_keys, LdMatrixCsrChunk* chunk) {
+  chunk->key_index_from_inclusive_ = 0;
+  chunk->key_index_to_exclusive_ = num_keys;
+  chunk->chr_label_ = 0;
+  for (int i = 0; i < num_keys; i++) {
+    for (int j = i + 1; j < std::min(num_keys, i + 1 + (i % 37)); j++) {
+      chunk->coo_ld_.push_back(std::make_tuple(i, j, packed_r_value(((float)rand() / (float)RAND_MAX) * 2.0f - 1.0f)));
+    }
+  }
+  chunk->set_ld_r2_csr();
+}
+
+void assert_same_chunk(const LdMatrixCsrChunk& chunk1, const LdMatrixCsrChunk& chunk2) {
+  ASSERT_EQ(chunk1.key_index_from_inclusive_, chunk2.key_index_from_inclusive_);
+  ASSERT_EQ(chunk1.key_index_to_exclusive_, chunk2.key_index_to_exclusive_);
+  ASSERT_EQ(chunk1.csr_ld_r_.size(), chunk2.csr_ld_r_.size());
+  LdMatrixRow row1, row2;
+  for (int key_index = chunk1.key_index_from_inclusive_; key_index < chunk1.key_index_to_exclusive_; key_index++) {
+    chunk1.extract_row(key_index, &row1);
+    chunk2.extract_row(key_index, &row2);
+    ASSERT_EQ(row1.end() - row1.begin(), row2.end() - row2.begin());
+    for (auto iter1 = row1.begin(), iter2 = row2.begin(); iter1 < row1.end(); iter1++, iter2++) {
+      ASSERT_EQ(iter1.index(), iter2.index());
+      ASSERT_EQ(iter1.r(), iter2.r());
+    }
+  }
+}
+
+// --gtest_filter=TestLd.LdEngines
+TEST(TestLd, LdEngines) {
+  // the tiled engine must find the same r values as the pairwise engine, also when the window cuts the tiles (in SNPs or in kb)
+  for (std::pair<int, float> window : {std::make_pair(0, 0.0f), std::make_pair(150, 0.0f), std::make_pair(0, 50.0f)}) {
+    std::string fname_pairwise = DataFolder + "/test_ld_engine_pairwise.ld.bin", fname_tiled = DataFolder + "/test_ld_engine_tiled.ld.bin";
+    generate_ld_matrix_from_bed_file(DataFolder + "/test", 0.05, 0.001, window.first, window.second, fname_pairwise, kLdEnginePairwise);
+    generate_ld_matrix_from_bed_file(DataFolder + "/test", 0.05, 0.001, window.first, window.second, fname_tiled, kLdEngineTiled);
+
+    LdMatrixCsrChunk chunk_pairwise, chunk_tiled;
+    std::vector<float> freqvec_pairwise, ld_r2_sum_pairwise, ld_r2_sum_adjust_for_hvec_pairwise;
+    std::vector<float> freqvec_tiled, ld_r2_sum_tiled, ld_r2_sum_adjust_for_hvec_tiled;
+    load_ld_matrix(fname_pairwise, &chunk_pairwise, &freqvec_pairwise, &ld_r2_sum_pairwise, &ld_r2_sum_adjust_for_hvec_pairwise);
+    load_ld_matrix(fname_tiled, &chunk_tiled, &freqvec_tiled, &ld_r2_sum_tiled, &ld_r2_sum_adjust_for_hvec_tiled);
+    assert_same_chunk(chunk_pairwise, chunk_tiled);
+    ASSERT_EQ(freqvec_pairwise, freqvec_tiled);
+    for (int i = 0; i < ld_r2_sum_pairwise.size(); i++) {
+      ASSERT_NEAR(ld_r2_sum_pairwise[i], ld_r2_sum_tiled[i], 1e-4);  // the summation order depends on the threads
+      ASSERT_NEAR(ld_r2_sum_adjust_for_hvec_pairwise[i], ld_r2_sum_adjust_for_hvec_tiled[i], 1e-4);
+    }
+    remove(fname_pairwise.c_str());
+    remove(fname_tiled.c_str());
+  }
+}
+
+// --gtest_filter=TestLd.LdEnginesMultiBlock
+TEST(TestLd, LdEnginesMultiBlock) {
+  // with blocks of 256 SNPs testdata/test (2011 SNPs) spans 8 blocks, i.e. block pairs are off-diagonal, reuse chunk_var, and are skipped by the window;
+  // rows must match the single-block run exactly, and LD scores up to the order of summation
+  const int block_size = 256;
+  for (std::pair<int, float> window : {std::make_pair(0, 0.0f), std::make_pair(150, 0.0f), std::make_pair(0, 50.0f)}) {
+    std::string fname_single = DataFolder + "/test_ld_engine_single.ld.bin";
+    std::string fname_pairwise = DataFolder + "/test_ld_engine_pairwise.ld.bin", fname_tiled = DataFolder + "/test_ld_engine_tiled.ld.bin";
+    generate_ld_matrix_from_bed_file(DataFolder + "/test", 0.05, 0.001, window.first, window.second, fname_single, kLdEngineTiled);
+    generate_ld_matrix_from_bed_file(DataFolder + "/test", 0.05, 0.001, window.first, window.second, fname_pairwise, kLdEnginePairwise, block_size);
+    generate_ld_matrix_from_bed_file(DataFolder + "/test", 0.05, 0.001, window.first, window.second, fname_tiled, kLdEngineTiled, block_size);
+
+    LdMatrixCsrChunk chunk_single, chunk_pairwise, chunk_tiled;
+    std::vector<float> freqvec_single, ld_r2_sum_single, ld_r2_sum_adjust_for_hvec_single;
+    std::vector<float> freqvec_pairwise, ld_r2_sum_pairwise, ld_r2_sum_adjust_for_hvec_pairwise;
+    std::vector<float> freqvec_tiled, ld_r2_sum_tiled, ld_r2_sum_adjust_for_hvec_tiled;
+    load_ld_matrix(fname_single, &chunk_single, &freqvec_single, &ld_r2_sum_single, &ld_r2_sum_adjust_for_hvec_single);
+    load_ld_matrix(fname_pairwise, &chunk_pairwise, &freqvec_pairwise, &ld_r2_sum_pairwise, &ld_r2_sum_adjust_for_hvec_pairwise);
+    load_ld_matrix(fname_tiled, &chunk_tiled, &freqvec_tiled, &ld_r2_sum_tiled, &ld_r2_sum_adjust_for_hvec_tiled);
+    ASSERT_GT(freqvec_single.size(), 4 * block_size);
+    assert_same_chunk(chunk_pairwise, chunk_tiled);
+    assert_same_chunk(chunk_single, chunk_tiled);
+    ASSERT_EQ(freqvec_single, freqvec_pairwise);
+    ASSERT_EQ(freqvec_single, freqvec_tiled);
+    for (int i = 0; i < ld_r2_sum_single.size(); i++) {
+      ASSERT_NEAR(ld_r2_sum_single[i], ld_r2_sum_pairwise[i], 1e-4);
+      ASSERT_NEAR(ld_r2_sum_single[i], ld_r2_sum_tiled[i], 1e-4);
+      ASSERT_NEAR(ld_r2_sum_adjust_for_hvec_single[i], ld_r2_sum_adjust_for_hvec_pairwise[i], 1e-4);
+      ASSERT_NEAR(ld_r2_sum_adjust_for_hvec_single[i], ld_r2_sum_adjust_for_hvec_tiled[i], 1e-4);
+    }
+    remove(fname_single.c_str());
+    remove(fname_pairwise.c_str());
+    remove(fname_tiled.c_str());
+  }
+}
+
+// --gtest_filter=TestLd.SaveLoadMappedLdMatrix
+TEST(TestLd, SaveLoadMappedLdMatrix) {
+  const int num_keys = 1000;
+  LdMatrixCsrChunk chunk;
+  make_test_chunk(num_keys, &chunk);
+  std::vector<float> freqvec(num_keys, 0.25f), ld_r2_sum(num_keys, 1.5f), ld_r2_sum_adjust_for_hvec(num_keys, 0.5f);
+
+  // version 2 files are memory-mapped
+  std::string fname = DataFolder + "/test_mapped.ld.bin";
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+  LdMatrixCsrChunk chunk2;
+  std::vector<float> freqvec2, ld_r2_sum2, ld_r2_sum_adjust_for_hvec2;
+  load_ld_matrix(fname, &chunk2, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2);
+  ASSERT_TRUE(chunk2.csr_ld_r_.is_mapped());
+  ASSERT_TRUE(chunk2.csr_ld_val_index_packed_.is_mapped());
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(chunk2.csr_ld_r_.data()) % 64, 0);
+  assert_same_chunk(chunk, chunk2);
+  ASSERT_EQ(freqvec, freqvec2);
+  ASSERT_EQ(ld_r2_sum, ld_r2_sum2);
+  ASSERT_EQ(ld_r2_sum_adjust_for_hvec, ld_r2_sum_adjust_for_hvec2);
+
+  // version 1 files are still supported (they were written before per-row index codecs, i.e. all rows use vsenc32)
+  std::string fname_v1 = DataFolder + "/test_mapped_v1.ld.bin";
+  chunk.repack_ld_r2_csr(kIndexCodecVSimple);
+  ASSERT_TRUE(chunk.csr_ld_val_index_codec_.empty());
+  {
+    std::ofstream os(fname_v1, std::ofstream::binary);
+    size_t format_version = 1, numel;
+    os.write(reinterpret_cast<const char*>(&format_version), sizeof(size_t));
+    os.write(reinterpret_cast<const char*>(&chunk.key_index_from_inclusive_), sizeof(int));
+    os.write(reinterpret_cast<const char*>(&chunk.key_index_to_exclusive_), sizeof(int));
+    numel = chunk.csr_ld_key_index_.size(); os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
+    os.write(reinterpret_cast<const char*>(chunk.csr_ld_key_index_.to_vector().data()), numel * sizeof(int64_t));
+    numel = chunk.csr_ld_val_index_offset_.size(); os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
+    os.write(reinterpret_cast<const char*>(chunk.csr_ld_val_index_offset_.to_vector().data()), numel * sizeof(uint64_t));
+    numel = chunk.csr_ld_val_index_packed_.size(); os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
+    os.write(reinterpret_cast<const char*>(chunk.csr_ld_val_index_packed_.data()), numel);
+    numel = chunk.csr_ld_r_.size(); os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
+    os.write(reinterpret_cast<const char*>(chunk.csr_ld_r_.data()), numel * sizeof(packed_r_value));
+    for (auto vec : { &freqvec, &ld_r2_sum, &ld_r2_sum_adjust_for_hvec }) {
+      numel = vec->size(); os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
+      os.write(reinterpret_cast<const char*>(vec->data()), numel * sizeof(float));
+    }
+  }
+  LdMatrixCsrChunk chunk3;
+  load_ld_matrix(fname_v1, &chunk3, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2);
+  ASSERT_FALSE(chunk3.csr_ld_r_.is_mapped());
+  assert_same_chunk(chunk, chunk3);
+  ASSERT_EQ(freqvec, freqvec2);
+}
+
+// --gtest_filter=TestLd.LdMatrixFileWriter
+TEST(TestLd, LdMatrixFileWriter) {
+  const int num_keys = 1000;
+  LdMatrixCsrChunk chunk;
+  make_test_chunk(num_keys, &chunk);
+  std::vector<float> freqvec(num_keys, 0.25f), ld_r2_sum(num_keys, 1.5f), ld_r2_sum_adjust_for_hvec(num_keys, 0.5f);
+
+  // write the rows in several pieces (one of them empty), as generate_ld_matrix_from_bed_file does for each block of SNPs
+  std::string fname = DataFolder + "/test_writer.ld.bin";
+  {
+    LdMatrixFileWriter writer(fname, 0, num_keys);
+    for (std::pair<int, int> range : {std::make_pair(0, 300), std::make_pair(300, 300), std::make_pair(300, 700), std::make_pair(700, num_keys)}) {
+      LdMatrixCsrChunk piece;
+      piece.key_index_from_inclusive_ = range.first;
+      piece.key_index_to_exclusive_ = range.second;
+      piece.chr_label_ = 0;
+      LdMatrixRow row;
+      for (int key_index = range.first; key_index < range.second; key_index++) {
+        chunk.extract_row(key_index, &row);
+        for (auto iter = row.begin(); iter < row.end(); iter++) piece.coo_ld_.push_back(std::make_tuple(key_index, iter.index(), packed_r_value(iter.r())));
+      }
+      piece.set_ld_r2_csr();
+      writer.append_rows(piece);
+    }
+    ASSERT_EQ(writer.num_ld_r(), chunk.csr_ld_r_.size());
+    writer.finish(freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+  }
+  ASSERT_FALSE(boost::filesystem::exists(fname + ".tmp"));
+
+  LdMatrixCsrChunk chunk2;
+  std::vector<float> freqvec2, ld_r2_sum2, ld_r2_sum_adjust_for_hvec2;
+  load_ld_matrix(fname, &chunk2, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2);
+  ASSERT_TRUE(chunk2.csr_ld_r_.is_mapped());
+  assert_same_chunk(chunk, chunk2);
+  ASSERT_EQ(freqvec, freqvec2);
+  ASSERT_EQ(ld_r2_sum, ld_r2_sum2);
+  ASSERT_EQ(ld_r2_sum_adjust_for_hvec, ld_r2_sum_adjust_for_hvec2);
+  remove(fname.c_str());
+
+  // with all rows in kIndexCodecVSimple the codec section is empty, and it is the last one in the file
+  chunk.repack_ld_r2_csr(kIndexCodecVSimple);
+  {
+    LdMatrixFileWriter writer(fname, 0, num_keys);
+    writer.append_rows(chunk);
+    writer.finish(freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec);
+  }
+  LdMatrixCsrChunk chunk3;
+  load_ld_matrix(fname, &chunk3, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2);
+  ASSERT_TRUE(chunk3.csr_ld_val_index_codec_.empty());
+  assert_same_chunk(chunk, chunk3);
+  remove(fname.c_str());
+
+  // an unfinished file is removed
+  {
+    LdMatrixFileWriter writer(fname, 0, num_keys);
+  }
+  ASSERT_FALSE(boost::filesystem::exists(fname));
+}
+
+// --gtest_filter=TestLd.SaveLoadGenomeLdMatrix
+TEST(TestLd, SaveLoadGenomeLdMatrix) {
+  const std::vector<int> num_snp_per_chr = { 300, 200 };
+  std::string bim_file = DataFolder + "/test_genome.bim";
+  {
+    std::ofstream os(bim_file);
+    for (int chr_label = 1; chr_label <= 2; chr_label++)
+      for (int i = 0; i < num_snp_per_chr[chr_label - 1]; i++)
+        os << chr_label << "\trs" << chr_label << "_" << i << "\t0\t" << (1000 + i) << "\tA\tG\n";
+  }
+
+  std::vector<LdMatrixCsrChunk> chunks(2);
+  std::vector<std::vector<float>> freqvec(2);
+  for (int chr_label = 1; chr_label <= 2; chr_label++) {
+    const int num_keys = num_snp_per_chr[chr_label - 1];
+    make_test_chunk(num_keys, &chunks[chr_label - 1]);
+    freqvec[chr_label - 1].assign(num_keys, 0.1f * chr_label);
+    std::vector<float> ld_r2_sum(num_keys, 1.5f), ld_r2_sum_adjust_for_hvec(num_keys, 0.5f);
+    save_ld_matrix(chunks[chr_label - 1], freqvec[chr_label - 1], ld_r2_sum, ld_r2_sum_adjust_for_hvec, DataFolder + "/test_genome_chr" + std::to_string(chr_label) + ".ld.bin");
+  }
+
+  std::string fname = DataFolder + "/test_genome.ld.bin";
+  merge_ld_matrix_files(bim_file, "1 2", DataFolder + "/test_genome_chr@.ld.bin", 0.05f, 0.001f, fname);
+
+  LdMatrixGenomeHeader header;
+  std::vector<LdMatrixGenomeChunk> entries;
+  ASSERT_TRUE(load_ld_matrix_genome_header(fname, &header, &entries));
+  ASSERT_EQ(header.num_snp, 500);
+  ASSERT_EQ(header.num_chunks, 2);
+  ASSERT_FLOAT_EQ(header.r2min, 0.05f);
+  ASSERT_FLOAT_EQ(header.ldscore_r2min, 0.001f);
+  BimFile bim(bim_file);
+  ASSERT_EQ(entries[1].chr_label, 2);
+  ASSERT_EQ(entries[1].reference_hash, bim.reference_hash(2));
+  ASSERT_NE(entries[0].reference_hash, entries[1].reference_hash);
+  ASSERT_FALSE(load_ld_matrix_genome_header(DataFolder + "/test_genome_chr1.ld.bin", &header, &entries));
+
+  // each chromosome is mapped separately
+  for (int chr_label = 1; chr_label <= 2; chr_label++) {
+    LdMatrixCsrChunk chunk;
+    std::vector<float> freqvec2, ld_r2_sum2, ld_r2_sum_adjust_for_hvec2;
+    load_ld_matrix(fname, &chunk, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2, chr_label);
+    ASSERT_TRUE(chunk.csr_ld_r_.is_mapped());
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(chunk.csr_ld_r_.data()) % 64, 0);
+    assert_same_chunk(chunks[chr_label - 1], chunk);
+    ASSERT_EQ(freqvec[chr_label - 1], freqvec2);
+  }
+
+  LdMatrixCsrChunk chunk;
+  std::vector<float> freqvec2, ld_r2_sum2, ld_r2_sum_adjust_for_hvec2;
+  ASSERT_THROW(load_ld_matrix(fname, &chunk, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2, 3), std::runtime_error);
+  ASSERT_THROW(load_ld_matrix(fname, &chunk, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2), std::runtime_error);
+
+  // corrupt the last byte of the file (it belongs to chromosome 2), chromosome 1 is still readable
+  {
+    std::fstream fs(fname, std::ios::in | std::ios::out | std::ios::binary);
+    fs.seekg(-1, std::ios::end); char c; fs.get(c);
+    fs.seekp(-1, std::ios::end); fs.put(c ^ 0x55);
+  }
+  load_ld_matrix(fname, &chunk, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2, 1);
+  ASSERT_THROW(load_ld_matrix(fname, &chunk, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2, 2), std::runtime_error);
+}
+
+void extract_all_rows(const LdMatrixCsrChunk& chunk, std::vector<std::vector<int>>* rows) {
+  LdMatrixRow row;
+  rows->clear();
+  for (int key_index = chunk.key_index_from_inclusive_; key_index < chunk.key_index_to_exclusive_; key_index++) {
+    chunk.extract_row(key_index, &row);
+    rows->push_back(std::vector<int>());
+    for (auto iter = row.begin(); iter < row.end(); iter++) rows->back().push_back(iter.index());
+  }
+}
+
+// --gtest_filter=TestLd.BlockOffsets
+TEST(TestLd, BlockOffsets) {
+  std::vector<int64_t> offsets(1000);
+  offsets[0] = 5;
+  for (int i = 1; i < offsets.size(); i++) offsets[i] = offsets[i - 1] + (i % 7) * 1000 + ((i == 512) ? 0x100000000LL : 0);  // large increment at the start of a block
+  LdBlockOffsets<int64_t> block_offsets;
+  block_offsets.assign(offsets);
+  ASSERT_EQ(block_offsets.size(), offsets.size());
+  ASSERT_EQ(block_offsets.back(), offsets.back());
+  ASSERT_EQ(block_offsets.to_vector(), offsets);
+  ASSERT_LT(block_offsets.num_bytes(), offsets.size() * sizeof(int64_t));
+
+  offsets[300] = offsets[299] - 1;  // decreasing
+  ASSERT_THROW(block_offsets.assign(offsets), std::runtime_error);
+  offsets[300] = offsets[299]; offsets[301] = offsets[300] + 0x100000000LL;  // too large increment within a block
+  for (int i = 302; i < offsets.size(); i++) offsets[i] += 0x100000000LL;
+  ASSERT_THROW(block_offsets.assign(offsets), std::runtime_error);
+}
+
+// every codec must restore the same indices; automatic choice must be at least as compact as any of them
+// --gtest_filter=TestLd.IndexCodecs
+TEST(TestLd, IndexCodecs) {
+  const int num_keys = 1000;
+  LdMatrixCsrChunk chunk;
+  make_test_chunk(num_keys, &chunk);
+  std::vector<std::vector<int>> expected, actual;
+  extract_all_rows(chunk, &expected);
+  const size_t auto_size = chunk.csr_ld_val_index_packed_.size();
+
+  for (int codec = 0; codec < kNumIndexCodecs; codec++) {
+    chunk.repack_ld_r2_csr(codec);
+    extract_all_rows(chunk, &actual);
+    ASSERT_EQ(expected, actual);
+    ASSERT_LE(auto_size, chunk.csr_ld_val_index_packed_.size());
+    for (int key_index = 0; key_index < num_keys; key_index++)
+      if (chunk.num_ld_r2(key_index) > 0) ASSERT_EQ(chunk.csr_ld_val_index_codec(key_index), codec);
+  }
+
+  chunk.repack_ld_r2_csr(kIndexCodecAuto);
+  ASSERT_EQ(auto_size, chunk.csr_ld_val_index_packed_.size());
+
+  // codecs are saved with the file, and r values can be compressed
+  std::vector<float> freqvec(num_keys, 0.25f), ld_r2_sum(num_keys, 1.5f), ld_r2_sum_adjust_for_hvec(num_keys, 0.5f);
+  std::string fname = DataFolder + "/test_codecs.ld.bin", fname_compressed = DataFolder + "/test_codecs_compressed.ld.bin";
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname_compressed, true);
+  for (auto filename : { fname, fname_compressed }) {
+    LdMatrixCsrChunk chunk2;
+    std::vector<float> freqvec2, ld_r2_sum2, ld_r2_sum_adjust_for_hvec2;
+    load_ld_matrix(filename, &chunk2, &freqvec2, &ld_r2_sum2, &ld_r2_sum_adjust_for_hvec2);
+    ASSERT_EQ(chunk2.csr_ld_r_.is_mapped(), filename == fname);
+    assert_same_chunk(chunk, chunk2);
+    ASSERT_EQ(ld_r2_sum_adjust_for_hvec, ld_r2_sum_adjust_for_hvec2);
+  }
+}
+
+// Compare index codecs and compression of r values on LD matrix computed from real genotypes (testdata/test.bed)
+// --gtest_filter=TestLd.CodecBenchmark
+TEST(TestLd, CodecBenchmark) {
+  std::string fname = DataFolder + "/test_codec_benchmark.ld.bin";
+  generate_ld_matrix_from_bed_file(DataFolder + "/test", 0.05, 0.0, 0, 0, fname);
+  LdMatrixCsrChunk chunk;
+  std::vector<float> freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec;
+  load_ld_matrix(fname, &chunk, &freqvec, &ld_r2_sum, &ld_r2_sum_adjust_for_hvec);
+  std::vector<std::vector<int>> expected, actual;
+  extract_all_rows(chunk, &expected);
+
+  const char* codec_names[] = { "vsimple", "vbyte", "bitpack", "bitmap", "auto" };
+  const int num_repeats = 20;
+  size_t auto_size = 0, min_size = 0;
+  for (int codec : { kIndexCodecVSimple, kIndexCodecVByte, kIndexCodecBitPack, kIndexCodecBitmap, kIndexCodecAuto }) {
+    chunk.repack_ld_r2_csr(codec);
+    extract_all_rows(chunk, &actual);
+    ASSERT_EQ(expected, actual);
+
+    SimpleTimer timer(-1);
+    LdMatrixRow row;
+    int64_t num_decoded = 0;
+    for (int repeat = 0; repeat < num_repeats; repeat++) {
+      for (int key_index = chunk.key_index_from_inclusive_; key_index < chunk.key_index_to_exclusive_; key_index++) {
+        chunk.extract_row(key_index, &row);
+        num_decoded += row.size();
+      }
+    }
+
+    const size_t size = chunk.csr_ld_val_index_packed_.size();
+    std::cout << codec_names[(codec == kIndexCodecAuto) ? kNumIndexCodecs : codec] << ": " << size << " bytes (" << (8.0 * size / chunk.csr_ld_r_.size()) << " bits per index), "
+              << num_decoded << " indices decoded in " << timer.elapsed_ms() << " ms" << std::endl;
+    if (codec == kIndexCodecAuto) auto_size = size;
+    else min_size = (min_size == 0) ? size : std::min(min_size, size);
+  }
+  ASSERT_LE(auto_size, min_size);
+  const size_t offsets_size = chunk.csr_ld_key_index_.num_bytes() + chunk.csr_ld_val_index_offset_.num_bytes();
+  std::cout << "offset tables: " << offsets_size << " bytes (" << (16 * chunk.csr_ld_key_index_.size()) << " bytes as plain 64-bit offsets)" << std::endl;
+
+  fname = DataFolder + "/test_codec_benchmark_auto.ld.bin";  // the original file is still mapped by the chunk
+  std::string fname_compressed = DataFolder + "/test_codec_benchmark_compressed.ld.bin";
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname_compressed, true);
+  const int64_t size = std::ifstream(fname, std::ifstream::ate | std::ifstream::binary).tellg();
+  const int64_t size_compressed = std::ifstream(fname_compressed, std::ifstream::ate | std::ifstream::binary).tellg();
+  std::cout << "r values: " << (2 * chunk.csr_ld_r_.size()) << " bytes; file size " << size << " bytes, or " << size_compressed << " bytes with compressed r values" << std::endl;
+  ASSERT_LT(size_compressed, size);
+}
+
+class TestTagToSnpMapping : public TagToSnpMapping {
+public:
+  TestTagToSnpMapping(const std::vector<int>& chrnumvec, const std::vector<int>& tag_to_snp)
+      : chrnumvec_(chrnumvec), tag_to_snp_(tag_to_snp) {
+    is_tag_.resize(chrnumvec.size(), 0);
+    snp_to_tag_.resize(chrnumvec.size(), -1);
+    for (int i = 0; i < tag_to_snp_.size(); i++) { is_tag_[tag_to_snp_[i]] = 1; snp_to_tag_[tag_to_snp_[i]] = i; }
+  }
+  virtual int num_snp() { return chrnumvec_.size(); }
+  virtual int num_tag() { return tag_to_snp_.size(); }
+  virtual const std::vector<int>& tag_to_snp() { return tag_to_snp_; }
+  virtual const std::vector<int>& snp_to_tag() { return snp_to_tag_; }
+  virtual const std::vector<char>& is_tag() { return is_tag_; }
+  virtual const std::vector<int>& chrnumvec() { return chrnumvec_; }
+  virtual const std::vector<float>& mafvec() { return mafvec_; }
+  virtual std::vector<float>* mutable_mafvec() { return &mafvec_; }
+private:
+  std::vector<int> chrnumvec_;
+  std::vector<int> tag_to_snp_;
+  std::vector<int> snp_to_tag_;
+  std::vector<char> is_tag_;
+  std::vector<float> mafvec_;
+};
+
+void assert_same_ld_sum(const LdSum* ld_sum1, const LdSum* ld_sum2) {
+  ASSERT_EQ(ld_sum1->ld_sum_r2_below_r2min(), ld_sum2->ld_sum_r2_below_r2min());
+  ASSERT_EQ(ld_sum1->ld_sum_r2_above_r2min(), ld_sum2->ld_sum_r2_above_r2min());
+  ASSERT_EQ(ld_sum1->ld_sum_r4_above_r2min(), ld_sum2->ld_sum_r4_above_r2min());
+  ASSERT_EQ(ld_sum1->ld_tag_sum_r2_below_r2min(), ld_sum2->ld_tag_sum_r2_below_r2min());
+  ASSERT_EQ(ld_sum1->ld_tag_sum_r2_above_r2min(), ld_sum2->ld_tag_sum_r2_above_r2min());
+  ASSERT_EQ(ld_sum1->ld_tag_sum_r4_above_r2min(), ld_sum2->ld_tag_sum_r4_above_r2min());
+}
+
+void assert_same_ld_row(LdMatrixRow* row1, LdMatrixRow* row2) {
+  ASSERT_EQ(row1->end() - row1->begin(), row2->end() - row2->begin());
+  for (auto iter1 = row1->begin(), iter2 = row2->begin(); iter1 < row1->end(); iter1++, iter2++) {
+    ASSERT_EQ(iter1.index(), iter2.index());
+    ASSERT_EQ(iter1.r(), iter2.r());
+  }
+}
+
+// Loading LD matrix from a file builds CSR structure directly (set_ld_r2_csr_direct);
+// here we validate that it gives the same result as passing the same elements through set_ld_r2_coo.
+// With exclude_snps some variants are removed from the reference (see LdMatrixCsr::set_excluded_snps);
+// then both paths are also validated against the full matrix.
+void test_ld_csr_direct(bool exclude_snps) {
+  const int num_snp_per_chr = 500, num_chr = 2;
+  const float r2_min = 0.05f;
+  std::vector<int> chrnumvec, tag_to_snp;
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    std::vector<int> tags;
+    for (int i = 0; i < num_snp_per_chr; i++) {
+      const int snp_index = chrnumvec.size();
+      chrnumvec.push_back(chr_label);
+      if (i % 3 != 1) tags.push_back(snp_index);
+    }
+    std::reverse(tags.begin(), tags.end());  // tag indices in reverse order of snp indices
+    tag_to_snp.insert(tag_to_snp.end(), tags.begin(), tags.end());
+  }
+
+  TestTagToSnpMapping mapping_direct(chrnumvec, tag_to_snp), mapping_coo(chrnumvec, tag_to_snp), mapping_full(chrnumvec, tag_to_snp);
+  mapping_direct.mutable_mafvec()->assign(chrnumvec.size(), NAN);
+  mapping_coo.mutable_mafvec()->assign(chrnumvec.size(), NAN);
+  mapping_full.mutable_mafvec()->assign(chrnumvec.size(), NAN);
+  LdMatrixCsr csr_direct(mapping_direct), csr_coo(mapping_coo), csr_full(mapping_full);
+  csr_direct.init_chunks();
+  csr_coo.init_chunks();
+  csr_full.init_chunks();
+
+  std::vector<char> excluded_snp(chrnumvec.size(), 0);
+  for (int snp_index = 0; snp_index < chrnumvec.size(); snp_index++) excluded_snp[snp_index] = (exclude_snps && (snp_index % 5 == 0)) ? 1 : 0;
+  csr_direct.set_excluded_snps(excluded_snp);
+  csr_coo.set_excluded_snps(excluded_snp);
+
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    LdMatrixCsrChunk chunk;
+    make_test_chunk(num_snp_per_chr, &chunk);
+    std::vector<float> freqvec, ld_r2_sum(num_snp_per_chr, 0.0f), ld_r2_sum_adjust_for_hvec(num_snp_per_chr, 0.0f);
+    for (int i = 0; i < num_snp_per_chr; i++) freqvec.push_back(0.05f + 0.4f * (float)rand() / (float)RAND_MAX);
+
+    std::string fname = DataFolder + "/test_direct.ld.bin";
+    save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+    csr_direct.set_ld_r2_coo_version1plus(chr_label, fname, r2_min);
+    csr_full.set_ld_r2_coo_version1plus(chr_label, fname, r2_min);
+
+    std::vector<int> snp_index, snp_other_index;
+    std::vector<float> r;
+    LdMatrixRow row;
+    for (int i = 0; i < num_snp_per_chr; i++) {
+      mapping_coo.mutable_mafvec()->at((chr_label - 1) * num_snp_per_chr + i) = freqvec[i];
+      chunk.extract_row(i, &row);
+      for (auto iter = row.begin(); iter < row.end(); iter++) {
+        snp_index.push_back(i); snp_other_index.push_back(iter.index()); r.push_back(iter.r());
+      }
+    }
+    csr_coo.set_ld_r2_coo(chr_label, r.size(), &snp_index[0], &snp_other_index[0], &r[0], r2_min);
+  }
+
+  csr_direct.set_ld_r2_csr(r2_min, -1);
+  csr_coo.set_ld_r2_csr(r2_min, -1);
+  csr_full.set_ld_r2_csr(r2_min, -1);
+  ASSERT_THROW(csr_direct.set_excluded_snps(excluded_snp), std::runtime_error);
+
+  assert_same_ld_sum(csr_direct.ld_sum(), csr_coo.ld_sum());
+  assert_same_ld_sum(csr_direct.ld_sum_adjust_for_hvec(), csr_coo.ld_sum_adjust_for_hvec());
+
+  LdMatrixRow row_direct, row_coo;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr_direct.extract_tag_row(TagIndex(tag_index), &row_direct);
+    csr_coo.extract_tag_row(TagIndex(tag_index), &row_coo);
+    assert_same_ld_row(&row_direct, &row_coo);
+  }
+
+  for (int snp_index = 0; snp_index < chrnumvec.size(); snp_index++) {
+    csr_direct.extract_snp_row(SnpIndex(snp_index), &row_direct);
+    csr_coo.extract_snp_row(SnpIndex(snp_index), &row_coo);
+    assert_same_ld_row(&row_direct, &row_coo);
+    if (excluded_snp[snp_index] && !mapping_direct.is_tag()[snp_index]) ASSERT_EQ(row_direct.size(), 0);
+  }
+
+  // excluded variants are dropped from the rows of other variants, and their r2 moves below r2min
+  LdMatrixRow row_full;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr_full.extract_tag_row(TagIndex(tag_index), &row_full);
+    csr_direct.extract_tag_row(TagIndex(tag_index), &row_direct);
+    auto iter = row_direct.begin();
+    for (auto iter_full = row_full.begin(); iter_full < row_full.end(); iter_full++) {
+      if (excluded_snp[iter_full.index()] && (iter_full.index() != tag_to_snp[tag_index])) continue;
+      ASSERT_TRUE(iter < row_direct.end());
+      ASSERT_EQ(iter.index(), iter_full.index());
+      ASSERT_EQ(iter.r(), iter_full.r());
+      iter++;
+    }
+    ASSERT_FALSE(iter < row_direct.end());
+  }
+  for (int snp_index = 0; snp_index < chrnumvec.size(); snp_index++) {
+    const LdSum* ld_sum = csr_direct.ld_sum(); const LdSum* ld_sum_full = csr_full.ld_sum();
+    ASSERT_NEAR(ld_sum->ld_sum_r2_below_r2min()[snp_index] + ld_sum->ld_sum_r2_above_r2min()[snp_index],
+                ld_sum_full->ld_sum_r2_below_r2min()[snp_index] + ld_sum_full->ld_sum_r2_above_r2min()[snp_index], 1e-4);
+    if (!exclude_snps) ASSERT_EQ(ld_sum->ld_sum_r2_above_r2min()[snp_index], ld_sum_full->ld_sum_r2_above_r2min()[snp_index]);
+  }
+}
+
+// --gtest_filter=TestLd.SetLdR2CsrDirect
+TEST(TestLd, SetLdR2CsrDirect) {
+  test_ld_csr_direct(false);
+}
+
+// --gtest_filter=TestLd.SetLdR2CsrDirectExcludedSnps
+TEST(TestLd, SetLdR2CsrDirectExcludedSnps) {
+  test_ld_csr_direct(true);
+}
+
+// Several LD matrices loaded from the same LD files (random, see make_test_chunk), for the tests that compare them to each other.
+// There are num_chr chromosomes with num_snp_per_chr variants each, and every third variant is not a tag;
+// each LD matrix has its own mapping, with mafvec taken from the LD files.
+struct TestLdCsr {
+  TestLdCsr(int num_snp_per_chr, int num_chr, int num_csr) : num_snp_per_chr(num_snp_per_chr), num_chr(num_chr) {
+    for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+      for (int i = 0; i < num_snp_per_chr; i++) {
+        if (i % 3 != 1) tag_to_snp.push_back(chrnumvec.size());
+        chrnumvec.push_back(chr_label);
+      }
+    }
+    for (int csr_index = 0; csr_index < num_csr; csr_index++) {
+      mapping.emplace_back(new TestTagToSnpMapping(chrnumvec, tag_to_snp));
+      mapping.back()->mutable_mafvec()->assign(chrnumvec.size(), NAN);
+      csr.emplace_back(new LdMatrixCsr(*mapping.back()));
+      csr.back()->init_chunks();
+    }
+  }
+
+  // r2_min is given per LD matrix; on_chunk_loaded(chr_label) is called once a chromosome is finalized in all LD matrices
+  void load(std::string fname, const std::vector<float>& r2_min, std::function<void(int)> on_chunk_loaded = nullptr) {
+    for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+      LdMatrixCsrChunk chunk;
+      make_test_chunk(num_snp_per_chr, &chunk);
+      std::vector<float> freqvec(num_snp_per_chr, 0.3f), ld_r2_sum(num_snp_per_chr, 0.0f), ld_r2_sum_adjust_for_hvec(num_snp_per_chr, 0.0f);
+      save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+      for (int csr_index = 0; csr_index < csr.size(); csr_index++) {
+        csr[csr_index]->set_ld_r2_coo_version1plus(chr_label, fname, r2_min[csr_index]);
+        csr[csr_index]->set_ld_r2_csr(r2_min[csr_index], chr_label);
+      }
+      if (on_chunk_loaded) on_chunk_loaded(chr_label);
+    }
+  }
+
+  LdMatrixCsr& operator[](int csr_index) { return *csr[csr_index]; }
+
+  const int num_snp_per_chr, num_chr;
+  std::vector<int> chrnumvec, tag_to_snp;
+  std::vector<std::unique_ptr<TestTagToSnpMapping>> mapping;
+  std::vector<std::unique_ptr<LdMatrixCsr>> csr;
+};
+
+// --gtest_filter=TestLd.ExtractRow
+TEST(TestLd, ExtractRow) {
+  LdMatrixCsrChunk chunk;
+  chunk.key_index_from_inclusive_ = 0;
+  chunk.key_index_to_exclusive_ = 100;
+  std::vector<std::vector<std::tuple<int, packed_r_value>>> expected(100);
+  for (int i = 0; i < 100; i++) {
+    int val = rand() % 5;
+    for (int j = 0; j < i * 7; j++) {
+      packed_r_value r(((float)rand() / (float)RAND_MAX) * 2.0f - 1.0f);
+      chunk.coo_ld_.push_back(std::make_tuple(i, val, r));
+      expected[i].push_back(std::make_tuple(val, r));
+      val += 1 + (rand() % ((j % 3 == 0) ? 100000 : 10));
+    }
+  }
+  chunk.set_ld_r2_csr();
+
+  LdMatrixRow row;
+  for (int i = 99; i >= 0; i--) {  // start from the longest row
+    chunk.extract_row(i, &row);
+    ASSERT_EQ(row.size(), expected[i].size());
+    int ld_index = 0;
+    for (auto iter = row.begin(); iter < row.end(); iter++, ld_index++) {
+      ASSERT_EQ(iter.index(), std::get<0>(expected[i][ld_index]));
+      ASSERT_EQ(iter.r(), std::get<1>(expected[i][ld_index]).get());
+    }
+  }
+}
+
+// set_ld_r2_csr builds CSR arrays by counting sort; validate against sorted COO tuples,
+// with elements collected by several LdMatrixCoo buffers (spanning more than one block) in random order of keys
+// --gtest_filter=TestLd.SetLdR2CsrCountingSort
+TEST(TestLd, SetLdR2CsrCountingSort) {
+  const int num_keys = 2000;
+  LdMatrixCsrChunk chunk;
+  chunk.key_index_from_inclusive_ = 0;
+  chunk.key_index_to_exclusive_ = num_keys;
+  chunk.chr_label_ = 0;
+
+  std::vector<LdMatrixCoo::Element> expected;
+  for (int buffer_index = 0; buffer_index < 3; buffer_index++) {
+    LdMatrixCoo coo;
+    for (int i = 0; i < 300000; i++) {
+      const int key = rand() % num_keys;
+      const int val = 3 * i + buffer_index;
+      LdMatrixCoo::Element element = std::make_tuple(key, val, packed_r_value(((float)rand() / (float)RAND_MAX) * 2.0f - 1.0f));
+      coo.push_back(element);
+      expected.push_back(element);
+    }
+    chunk.coo_ld_.append(std::move(coo));
+    ASSERT_TRUE(coo.empty());
+  }
+  ASSERT_EQ(chunk.coo_ld_.size(), expected.size());
+  ASSERT_GT(chunk.coo_ld_.num_blocks(), 3);
+  chunk.set_ld_r2_csr();
+  ASSERT_TRUE(chunk.is_finalized());
+  std::sort(expected.begin(), expected.end());
+
+  ASSERT_EQ(chunk.csr_ld_r_.size(), expected.size());
+  LdMatrixRow row;
+  int64_t ld_index = 0;
+  for (int key_index = 0; key_index < num_keys; key_index++) {
+    chunk.extract_row(key_index, &row);
+    for (auto iter = row.begin(); iter < row.end(); iter++, ld_index++) {
+      ASSERT_EQ(key_index, std::get<0>(expected[ld_index]));
+      ASSERT_EQ(iter.index(), std::get<1>(expected[ld_index]));
+      ASSERT_EQ(iter.r(), std::get<2>(expected[ld_index]).get());
+    }
+  }
+  ASSERT_EQ(ld_index, expected.size());
+}
+
+// --gtest_filter=TestLd.RowCache
+TEST(TestLd, RowCache) {
+  const float r2_min = 0.05f;
+  TestLdCsr ld(500, 1, 2);
+  LdMatrixCsr& csr = ld[0], &csr_cached = ld[1];
+  const std::vector<int>& tag_to_snp = ld.tag_to_snp;
+  csr_cached.set_row_cache_budget(1024 * 1024);  // the budget can be set before LD matrix is loaded
+  ld.load(DataFolder + "/test_row_cache.ld.bin", { r2_min, r2_min });
+
+  int64_t total_elements = 0;
+  LdMatrixRow row, row_cached;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr.extract_tag_row(TagIndex(tag_index), &row);
+    total_elements += row.size();
+  }
+
+  // all rows cached, then only some of them, then cache disabled
+  for (size_t budget_bytes : { (size_t)(1024 * 1024), (size_t)(total_elements * 4), (size_t)0 }) {
+    csr_cached.set_row_cache_budget(budget_bytes);
+    for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+      csr.extract_tag_row(TagIndex(tag_index), &row);
+      csr_cached.extract_tag_row(TagIndex(tag_index), &row_cached);
+      assert_same_ld_row(&row, &row_cached);
+      for (auto iter = row.begin(), iter_cached = row_cached.begin(); iter < row.end(); iter++, iter_cached++)
+        ASSERT_EQ(iter.r2(), iter_cached.r2());
+    }
+  }
+}
+
+// compacted copy of LD matrix serves the same rows as the full matrix, for the selected tags
+// --gtest_filter=TestLd.CompactToTags
+TEST(TestLd, CompactToTags) {
+  const float r2_min = 0.05f;
+  TestLdCsr ld(500, 1, 2);
+  LdMatrixCsr& csr = ld[0], &csr_compact = ld[1];
+  ld.load(DataFolder + "/test_compact_to_tags.ld.bin", { r2_min, r2_min });
+  const int num_tag = ld.tag_to_snp.size();
+  std::vector<char> keep_tag(num_tag, 0);
+  for (int tag_index = 0; tag_index < num_tag; tag_index++) keep_tag[tag_index] = (tag_index % 5 == 0);
+
+  LdMatrixRow row, row_compact;
+  for (bool free_rest : { false, true }) {
+    csr_compact.compact_to_tags(keep_tag, free_rest);
+    for (int tag_index = 0; tag_index < num_tag; tag_index++) {
+      csr.extract_tag_row(TagIndex(tag_index), &row);
+      if (!keep_tag[tag_index] && free_rest) {
+        ASSERT_THROW(csr_compact.extract_tag_row(TagIndex(tag_index), &row_compact), std::runtime_error);
+        continue;
+      }
+      csr_compact.extract_tag_row(TagIndex(tag_index), &row_compact);
+      assert_same_ld_row(&row, &row_compact);
+    }
+  }
+
+  // after the rest is released, it is still possible to compact to a subset of the same tags
+  keep_tag[0] = 0;
+  csr_compact.compact_to_tags(keep_tag, true);
+  ASSERT_THROW(csr_compact.extract_tag_row(TagIndex(0), &row_compact), std::runtime_error);
+  keep_tag[0] = 1;
+  ASSERT_THROW(csr_compact.compact_to_tags(keep_tag, false), std::runtime_error);
+}
+
+void assert_same_tag_ld_sum(const LdSum& lhs, const LdSum& rhs) {
+  for (int tag_index = 0; tag_index < lhs.ld_tag_sum_r2_above_r2min().size(); tag_index++) {
+    ASSERT_NEAR(lhs.ld_tag_sum_r2_above_r2min()[tag_index], rhs.ld_tag_sum_r2_above_r2min()[tag_index], 1e-4);
+    ASSERT_NEAR(lhs.ld_tag_sum_r4_above_r2min()[tag_index], rhs.ld_tag_sum_r4_above_r2min()[tag_index], 1e-4);
+    ASSERT_NEAR(lhs.ld_tag_sum_r2_below_r2min()[tag_index], rhs.ld_tag_sum_r2_below_r2min()[tag_index], 1e-4);
+  }
+}
+
+// raising r2min at runtime must give the same LD matrix and LdSum as loading LD matrix with a higher r2min
+// --gtest_filter=TestLd.R2MinRuntime
+TEST(TestLd, R2MinRuntime) {
+  const float r2_min = 0.05f, r2_min_high = 0.3f;
+  TestLdCsr ld(500, 1, 2);
+  LdMatrixCsr& csr = ld[0], &csr_high = ld[1];
+  const std::string fname = DataFolder + "/test_r2min_runtime.ld.bin";
+  ld.load(fname, { r2_min, r2_min_high });
+  const int num_tag = ld.tag_to_snp.size();
+  const LdSum ld_sum_full(*csr.ld_sum_adjust_for_hvec());
+
+  auto assert_same_rows = [num_tag](LdMatrixCsr* lhs, LdMatrixCsr* rhs) {
+    LdMatrixRow row_lhs, row_rhs;
+    for (int tag_index = 0; tag_index < num_tag; tag_index++) {
+      lhs->extract_tag_row(TagIndex(tag_index), &row_lhs);
+      rhs->extract_tag_row(TagIndex(tag_index), &row_rhs);
+      assert_same_ld_row(&row_lhs, &row_rhs);
+    }
+  };
+
+  csr.set_r2_min_runtime(r2_min_high, true);
+  assert_same_rows(&csr, &csr_high);
+  assert_same_tag_ld_sum(*csr.ld_sum_adjust_for_hvec(), *csr_high.ld_sum_adjust_for_hvec());
+  assert_same_tag_ld_sum(*csr.ld_sum(), *csr_high.ld_sum());
+  ASSERT_THROW(csr.set_ld_r2_coo_version1plus(1, fname, r2_min), std::runtime_error);
+
+  // restore the full matrix
+  csr.set_r2_min_runtime(0.0f, true);
+  ASSERT_EQ(csr.r2_min_runtime(), 0.0f);
+  assert_same_tag_ld_sum(*csr.ld_sum_adjust_for_hvec(), ld_sum_full);
+  csr.set_r2_min_runtime(r2_min_high, false);
+  assert_same_rows(&csr, &csr_high);
+  assert_same_tag_ld_sum(*csr.ld_sum_adjust_for_hvec(), *csr_high.ld_sum_adjust_for_hvec());
+
+  // once filtered in place, the matrix can't be restored
+  csr.set_r2_min_runtime(0.0f, true);
+  ASSERT_EQ(csr.r2_min_runtime(), r2_min_high);
+  assert_same_rows(&csr, &csr_high);
+}
+
+// contexts attached to a shared LD matrix must see the same rows and LdSum as if they loaded LD matrix on their own
+// --gtest_filter=TestLd.SharedLdMatrix
+TEST(TestLd, SharedLdMatrix) {
+  const int num_snp = 500;
+  const float r2_min = 0.05f;
+  std::vector<int> chrnumvec(num_snp, 1), all_tags, some_tags;
+  for (int i = 0; i < num_snp; i++) { all_tags.push_back(i); if (i % 3 != 1) some_tags.push_back(i); }
+
+  LdMatrixCsrChunk chunk;
+  make_test_chunk(num_snp, &chunk);
+  std::vector<float> freqvec(num_snp, 0.3f), ld_r2_sum(num_snp, 0.0f), ld_r2_sum_adjust_for_hvec(num_snp, 0.0f);
+  std::string fname = DataFolder + "/test_shared.ld.bin";
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+
+  TestTagToSnpMapping mapping_shared(chrnumvec, all_tags), mapping_same(chrnumvec, all_tags), mapping_subset(chrnumvec, some_tags), mapping_loaded(chrnumvec, some_tags);
+  for (auto mapping : { &mapping_shared, &mapping_same, &mapping_subset, &mapping_loaded }) mapping->mutable_mafvec()->assign(num_snp, 0.3f);
+  auto shared = std::make_shared<LdMatrixCsr>(mapping_shared);
+  LdMatrixCsr csr_same(mapping_same), csr_subset(mapping_subset), csr_loaded(mapping_loaded);
+  for (auto csr : { shared.get(), &csr_same, &csr_subset, &csr_loaded }) csr->init_chunks();
+  shared->set_ld_r2_coo_version1plus(1, fname, r2_min); shared->set_ld_r2_csr(r2_min, -1);
+  csr_loaded.set_ld_r2_coo_version1plus(1, fname, r2_min); csr_loaded.set_ld_r2_csr(r2_min, -1);
+
+  ASSERT_TRUE(csr_subset.can_attach_shared(*shared));
+  ASSERT_FALSE(shared->can_attach_shared(csr_loaded));  // tags of csr_loaded don't cover all snps
+  csr_same.attach_shared(shared);
+  csr_subset.attach_shared(shared);
+  ASSERT_TRUE(csr_subset.is_shared());
+  ASSERT_EQ(csr_same.ld_sum(), shared->ld_sum());  // same tags: LdSum is not copied
+  ASSERT_THROW(csr_subset.set_ld_r2_coo_version1plus(1, fname, r2_min), std::runtime_error);
+  ASSERT_THROW(csr_subset.set_r2_min_runtime(0.2f, true), std::runtime_error);
+
+  LdMatrixRow row, row_loaded;
+  for (int tag_index = 0; tag_index < some_tags.size(); tag_index++) {
+    csr_subset.extract_tag_row(TagIndex(tag_index), &row);
+    csr_loaded.extract_tag_row(TagIndex(tag_index), &row_loaded);
+    assert_same_ld_row(&row, &row_loaded);
+  }
+  for (int snp_index = 0; snp_index < num_snp; snp_index++) {
+    csr_subset.extract_snp_row(SnpIndex(snp_index), &row);
+    csr_loaded.extract_snp_row(SnpIndex(snp_index), &row_loaded);
+    assert_same_ld_row(&row, &row_loaded);
+    ASSERT_EQ(csr_subset.num_ld_r2_snp(snp_index), csr_loaded.num_ld_r2_snp(snp_index));
+    csr_same.extract_snp_row(SnpIndex(snp_index), &row);
+    shared->extract_snp_row(SnpIndex(snp_index), &row_loaded);
+    assert_same_ld_row(&row, &row_loaded);
+  }
+  assert_same_ld_sum(csr_subset.ld_sum(), csr_loaded.ld_sum());
+  assert_same_ld_sum(csr_subset.ld_sum_adjust_for_hvec(), csr_loaded.ld_sum_adjust_for_hvec());
+
+  // detaching one context leaves the shared matrix intact
+  const HugePageVector<float> ld_sum_shared = shared->ld_sum()->ld_sum_r2_above_r2min();
+  csr_same.clear();
+  ASSERT_FALSE(csr_same.is_shared());
+  ASSERT_EQ(shared->ld_sum()->ld_sum_r2_above_r2min(), ld_sum_shared);
+  csr_subset.extract_tag_row(TagIndex(0), &row);
+  csr_loaded.extract_tag_row(TagIndex(0), &row_loaded);
+  assert_same_ld_row(&row, &row_loaded);
+}
+
+// LD segment must reproduce the rows and LD sums of the matrix it was saved from, and must not load under a different key
+// --gtest_filter=TestLd.SaveLoadSegment
+TEST(TestLd, SaveLoadSegment) {
+  const int num_snp = 400;
+  const float r2_min = 0.05f;
+  std::vector<int> chrnumvec(num_snp, 1), all_tags(num_snp);
+  std::iota(all_tags.begin(), all_tags.end(), 0);
+
+  LdMatrixCsrChunk chunk;
+  make_test_chunk(num_snp, &chunk);
+  std::vector<float> freqvec(num_snp, 0.3f), ld_r2_sum(num_snp, 0.0f), ld_r2_sum_adjust_for_hvec(num_snp, 0.0f);
+  std::string fname = DataFolder + "/test_segment.ld.bin", segment = DataFolder + "/test_segment.segment.bin";
+  save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+
+  for (int r_bits : { 16, 8 }) {
+    TestTagToSnpMapping mapping_saved(chrnumvec, all_tags), mapping_loaded(chrnumvec, all_tags);
+    for (auto mapping : { &mapping_saved, &mapping_loaded }) mapping->mutable_mafvec()->assign(num_snp, NAN);
+    LdMatrixCsr csr_saved(mapping_saved), csr_loaded(mapping_loaded);
+    csr_saved.set_r_bits(r_bits);
+    for (auto csr : { &csr_saved, &csr_loaded }) csr->init_chunks();
+    csr_saved.set_ld_r2_coo_version1plus(1, fname, r2_min); csr_saved.set_ld_r2_csr(r2_min, -1);
+    csr_saved.save_segment(segment, "key");
+
+    ASSERT_FALSE(csr_loaded.load_segment(segment, "other key"));
+    ASSERT_TRUE(csr_loaded.load_segment(segment, "key"));
+    ASSERT_EQ(csr_loaded.r_bits(), r_bits);
+    ASSERT_EQ(mapping_loaded.mafvec(), mapping_saved.mafvec());
+
+    LdMatrixRow row_saved, row_loaded;
+    for (int snp_index = 0; snp_index < num_snp; snp_index++) {
+      csr_saved.extract_tag_row(TagIndex(snp_index), &row_saved);
+      csr_loaded.extract_tag_row(TagIndex(snp_index), &row_loaded);
+      assert_same_ld_row(&row_saved, &row_loaded);
+      csr_saved.extract_snp_row(SnpIndex(snp_index), &row_saved);
+      csr_loaded.extract_snp_row(SnpIndex(snp_index), &row_loaded);
+      assert_same_ld_row(&row_saved, &row_loaded);
+    }
+    assert_same_ld_sum(csr_saved.ld_sum(), csr_loaded.ld_sum());
+    assert_same_ld_sum(csr_saved.ld_sum_adjust_for_hvec(), csr_loaded.ld_sum_adjust_for_hvec());
+  }
+}
+
+// processes attached to the same LD segment hold the lock at the same time, and only the build lock makes them wait for each other;
+// the child process exits with a non-zero status on failure, and is killed by alarm() if it is blocked
+// --gtest_filter=TestLd.LdSegmentLock
+TEST(TestLd, LdSegmentLock) {
+  const std::string lock_path = DataFolder + "/test_segment_lock.lock", segment_path = DataFolder + "/test_segment_lock.bin";
+  auto wait_child = [](pid_t pid) { int status = 0; return (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0); };
+  boost::filesystem::remove(segment_path);
+  {
+    LdSegmentLock lock(lock_path);
+
+    // attach while this process holds the shared lock
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+      alarm(10);
+      bool ok = true;
+      {
+        LdSegmentLock child_lock(lock_path);
+        child_lock.lock_build();
+        child_lock.unlock_build();
+        ok = !child_lock.try_exclusive();  // the parent still uses the segment
+      }
+      _exit(ok && boost::filesystem::exists(lock_path) ? 0 : 1);
+    }
+    ASSERT_TRUE(wait_child(pid));
+
+    // the child waits for the build lock, and finds the segment built by this process
+    lock.lock_build();
+    pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+      alarm(10);
+      LdSegmentLock child_lock(lock_path);
+      child_lock.lock_build();
+      _exit(boost::filesystem::exists(segment_path) ? 0 : 1);
+    }
+    usleep(200000);
+    std::ofstream(segment_path.c_str()) << "segment";
+    lock.unlock_build();
+    ASSERT_TRUE(wait_child(pid));
+
+    // the last user removes the lock files
+    ASSERT_TRUE(lock.try_exclusive());
+  }
+  ASSERT_FALSE(boost::filesystem::exists(lock_path));
+  ASSERT_FALSE(boost::filesystem::exists(lock_path + ".build"));
+  boost::filesystem::remove(segment_path);
+}
+
+// snp->tag map is built as a transpose of tag->snp map; validate it against tag rows
+// --gtest_filter=TestLd.SnpToTagTranspose
+TEST(TestLd, SnpToTagTranspose) {
+  const int num_snp_per_chr = 300, num_chr = 2;
+  const float r2_min = 0.05f;
+  std::vector<int> chrnumvec, tag_to_snp;
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    const int num_tag_on_previous_chromosomes = tag_to_snp.size();
+    for (int i = 0; i < num_snp_per_chr; i++) {
+      if (i % 4 != 2) tag_to_snp.push_back(chrnumvec.size());
+      chrnumvec.push_back(chr_label);
+    }
+    std::random_shuffle(tag_to_snp.begin() + num_tag_on_previous_chromosomes, tag_to_snp.end());  // tag indices in random order within each chromosome
+  }
+
+  TestTagToSnpMapping mapping(chrnumvec, tag_to_snp);
+  mapping.mutable_mafvec()->assign(chrnumvec.size(), NAN);
+  LdMatrixCsr csr(mapping);
+  csr.init_chunks();
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    LdMatrixCsrChunk chunk;
+    make_test_chunk(num_snp_per_chr, &chunk);
+    std::vector<float> freqvec(num_snp_per_chr, 0.3f), ld_r2_sum(num_snp_per_chr, 0.0f), ld_r2_sum_adjust_for_hvec(num_snp_per_chr, 0.0f);
+    std::string fname = DataFolder + "/test_transpose.ld.bin";
+    save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, fname);
+    csr.set_ld_r2_coo_version1plus(chr_label, fname, r2_min);
+  }
+  csr.set_ld_r2_csr(r2_min, -1);
+
+  std::vector<std::vector<std::pair<int, float>>> expected(chrnumvec.size());
+  LdMatrixRow row;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr.extract_tag_row(TagIndex(tag_index), &row);
+    for (auto iter = row.begin(); iter < row.end(); iter++)
+      expected[iter.index()].push_back(std::make_pair(tag_index, iter.r()));
+  }
+
+  for (int snp_index = 0; snp_index < chrnumvec.size(); snp_index++) {
+    std::sort(expected[snp_index].begin(), expected[snp_index].end());
+    ASSERT_EQ(csr.num_ld_r2_snp(snp_index), expected[snp_index].size());
+    csr.extract_snp_row(SnpIndex(snp_index), &row);
+    ASSERT_EQ(row.size(), expected[snp_index].size());
+    int ld_index = 0;
+    for (auto iter = row.begin(); iter < row.end(); iter++, ld_index++) {
+      ASSERT_EQ(iter.index(), expected[snp_index][ld_index].first);
+      ASSERT_EQ(iter.r(), expected[snp_index][ld_index].second);
+    }
+  }
+}
+
+// out-of-core LD matrix must give the same rows as in-memory LD matrix, for any order of tags, and must not leave scratch files behind
+// --gtest_filter=TestLd.StreamLdMatrix
+TEST(TestLd, StreamLdMatrix) {
+  const float r2_min = 0.05f;
+  TestLdCsr ld(300, 3, 2);
+  LdMatrixCsr& csr_memory = ld[0], &csr_stream = ld[1];
+  const std::vector<int>& chrnumvec = ld.chrnumvec, &tag_to_snp = ld.tag_to_snp;
+  ld.load(DataFolder + "/test_stream.ld.bin", { r2_min, r2_min }, [&csr_stream](int chr_label) { csr_stream.spill_chunk(chr_label, DataFolder); });
+
+  for (auto& entry : boost::filesystem::directory_iterator(DataFolder))
+    ASSERT_NE(entry.path().filename().string().find("bgmg_ld_stream"), 0);
+
+  std::vector<int> tag_order(tag_to_snp.size());
+  std::iota(tag_order.begin(), tag_order.end(), 0);
+  LdMatrixRow row_memory, row_stream;
+  for (int pass = 0; pass < 3; pass++) {
+    if (pass == 2) std::random_shuffle(tag_order.begin(), tag_order.end());
+    for (int tag_index : tag_order) {
+      csr_memory.extract_tag_row(TagIndex(tag_index), &row_memory);
+      csr_stream.extract_tag_row(TagIndex(tag_index), &row_stream);
+      assert_same_ld_row(&row_memory, &row_stream);
+    }
+  }
+  for (int snp_index = 0; snp_index < chrnumvec.size(); snp_index++) {
+    csr_memory.extract_snp_row(SnpIndex(snp_index), &row_memory);
+    csr_stream.extract_snp_row(SnpIndex(snp_index), &row_stream);
+    assert_same_ld_row(&row_memory, &row_stream);
+  }
+  assert_same_ld_sum(csr_memory.ld_sum(), csr_stream.ld_sum());
+
+  // spilled chunks are not placed, and threads must not split the tags of a streamed LD matrix between them
+  csr_stream.place_rows_per_thread();
+  ASSERT_TRUE(csr_stream.thread_tag_from().empty());
+}
+
+// place_rows_per_thread must keep rows as they are; LdTagScheduler must visit each deftag index exactly once
+// --gtest_filter=TestLd.PlaceRowsPerThread
+TEST(TestLd, PlaceRowsPerThread) {
+  const float r2_min = 0.05f;
+  TestLdCsr ld(300, 3, 2);
+  LdMatrixCsr& csr_default = ld[0], &csr_placed = ld[1];
+  const std::vector<int>& tag_to_snp = ld.tag_to_snp;
+  ld.load(DataFolder + "/test_placement.ld.bin", { r2_min, r2_min });
+
+  ASSERT_TRUE(csr_default.thread_tag_from().empty());
+  csr_placed.place_rows_per_thread();
+  const std::vector<int>& thread_tag_from = csr_placed.thread_tag_from();
+  ASSERT_EQ(thread_tag_from.size(), omp_get_max_threads() + 1);
+  ASSERT_EQ(thread_tag_from.front(), 0);
+  ASSERT_EQ(thread_tag_from.back(), tag_to_snp.size());
+  for (int thread_num = 0; thread_num < omp_get_max_threads(); thread_num++)
+    ASSERT_LE(thread_tag_from[thread_num], thread_tag_from[thread_num + 1]);
+
+  LdMatrixRow row_default, row_placed;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr_default.extract_tag_row(TagIndex(tag_index), &row_default);
+    csr_placed.extract_tag_row(TagIndex(tag_index), &row_placed);
+    assert_same_ld_row(&row_default, &row_placed);
+  }
+  assert_same_ld_sum(csr_default.ld_sum(), csr_placed.ld_sum());
+
+  std::vector<int> deftag_indices;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index += 2) deftag_indices.push_back(tag_index);
+  for (auto csr : { &csr_default, &csr_placed }) {
+    for (int chunk_size : { 1, 7, 1000 }) {
+      std::vector<int> visited(deftag_indices.size(), 0);
+      LdTagScheduler scheduler(deftag_indices, csr->thread_tag_from(), omp_get_max_threads(), chunk_size);
+#pragma omp parallel
+      for (int deftag_from, deftag_to; scheduler.next(omp_get_thread_num(), &deftag_from, &deftag_to); )
+        for (int deftag_index = deftag_from; deftag_index < deftag_to; deftag_index++) {
+#pragma omp atomic
+          visited[deftag_index]++;
+        }
+      for (int count : visited) ASSERT_EQ(count, 1);
+    }
+  }
+
+  // without placement all threads share one range, walking the deftag indices in order (see LdMatrixCsr::stream_to_chunk)
+  LdTagScheduler in_order(deftag_indices, csr_default.thread_tag_from(), 4, 7);
+  int deftag_expected = 0;
+  for (int deftag_from, deftag_to, call = 0; in_order.next(call % 4, &deftag_from, &deftag_to); call++) {
+    ASSERT_EQ(deftag_from, deftag_expected);
+    deftag_expected = deftag_to;
+  }
+  ASSERT_EQ(deftag_expected, deftag_indices.size());
+
+  // placed buffers are owned (not mapped), and report the kind of their pages
+  const size_t bytes = 1000 * sizeof(float);
+  std::shared_ptr<void> buffer(huge_pages_allocate(bytes), [bytes](void* ptr) { huge_pages_deallocate(ptr, bytes); });
+  std::fill(static_cast<float*>(buffer.get()), static_cast<float*>(buffer.get()) + 1000, 1.0f);
+  MappableVector<float> placed;
+  placed.assign_placed(static_cast<const float*>(buffer.get()), 1000, buffer);
+  ASSERT_TRUE(placed.is_placed());
+  ASSERT_FALSE(placed.is_mapped());
+  ASSERT_STREQ(placed.pages_str(), huge_pages_kind_str(huge_pages_kind(buffer.get())));
+  placed.mutable_vector()[0] = 2.0f;
+  ASSERT_FALSE(placed.is_placed());
+  ASSERT_EQ(placed.size(), 1000);
+  ASSERT_EQ(placed[0], 2.0f);
+  ASSERT_EQ(placed[999], 1.0f);
+
+  // quantization rewrites r values of placed rows, which are then placed again
+  csr_default.set_r_bits(8);
+  csr_placed.set_r_bits(8);
+  ASSERT_EQ(csr_placed.thread_tag_from().size(), omp_get_max_threads() + 1);
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr_default.extract_tag_row(TagIndex(tag_index), &row_default);
+    csr_placed.extract_tag_row(TagIndex(tag_index), &row_placed);
+    assert_same_ld_row(&row_default, &row_placed);
+  }
+}
+
+// --gtest_filter=TestLd.HugePageAllocator
+TEST(TestLd, HugePageAllocator) {
+  const HugePagesMode mode = huge_pages_mode();
+  for (HugePagesMode test_mode : { kHugePagesOff, kHugePagesAdvise, kHugePagesExplicit }) {
+    set_huge_pages_mode(test_mode);
+    size_t bytes_before[3], bytes_after[3];
+    huge_pages_usage(&bytes_before[0], &bytes_before[1], &bytes_before[2]);
+    {
+      HugePageVector<float> small(1000, 1.0f), large(kHugePageSize, 2.0f);
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(small.data()) % kHugePageAlignment, 0);
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(large.data()) % kHugePageSize, 0);
+      ASSERT_EQ(huge_pages_kind(small.data()), kHugePagesKindNone);
+      const HugePagesKind kind = huge_pages_kind(large.data());
+      if (test_mode == kHugePagesOff) ASSERT_EQ(kind, kHugePagesKindFallback);
+      if (test_mode == kHugePagesExplicit) ASSERT_NE(kind, kHugePagesKindNone);
+      ASSERT_EQ(std::accumulate(large.begin(), large.end(), 0.0), 2.0 * kHugePageSize);
+
+      huge_pages_usage(&bytes_after[0], &bytes_after[1], &bytes_after[2]);
+      ASSERT_EQ(bytes_after[0] + bytes_after[1] + bytes_after[2], bytes_before[0] + bytes_before[1] + bytes_before[2] + 4 * kHugePageSize);
+    }
+    huge_pages_usage(&bytes_after[0], &bytes_after[1], &bytes_after[2]);
+    for (int i = 0; i < 3; i++) ASSERT_EQ(bytes_after[i], bytes_before[i]);
+  }
+  set_huge_pages_mode(mode);
+}
+
+// set_ld_r2_from_files loads chromosomes concurrently; validate against loading them one by one
+// --gtest_filter=TestLd.SetLdR2FromFiles
+TEST(TestLd, SetLdR2FromFiles) {
+  const int num_chr = 4;
+  std::vector<int> chrnumvec, tag_indices;
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    const int num_snp_per_chr = 100 * chr_label;
+    LdMatrixCsrChunk chunk;
+    make_test_chunk(num_snp_per_chr, &chunk);
+    std::vector<float> freqvec(num_snp_per_chr, 0.1f * chr_label), ld_r2_sum(num_snp_per_chr, 0.0f), ld_r2_sum_adjust_for_hvec(num_snp_per_chr, 0.0f);
+    save_ld_matrix(chunk, freqvec, ld_r2_sum, ld_r2_sum_adjust_for_hvec, DataFolder + "/test_from_files.chr" + std::to_string(chr_label) + ".ld.bin");
+    for (int i = 0; i < num_snp_per_chr; i++) {
+      if (i % 3 != 1) tag_indices.push_back(chrnumvec.size());
+      chrnumvec.push_back(chr_label);
+    }
+  }
+  const int num_snp = chrnumvec.size(), num_tag = tag_indices.size();
+
+  BgmgCalculator calc_serial, calc_concurrent;
+  for (auto calc : { &calc_serial, &calc_concurrent }) {
+    calc->set_tag_indices(num_snp, num_tag, &tag_indices[0]);
+    calc->set_chrnumvec(num_snp, &chrnumvec[0]);
+    calc->set_option("r2min", 0.05);
+  }
+
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    calc_serial.set_ld_r2_coo(chr_label, DataFolder + "/test_from_files.chr" + std::to_string(chr_label) + ".ld.bin");
+    calc_serial.set_ld_r2_csr(chr_label);
+  }
+  calc_concurrent.set_option("ld_load_jobs", 2);
+  calc_concurrent.set_ld_r2_from_files("1,2,3,4", DataFolder + "/test_from_files.chr@.ld.bin");
+  ASSERT_EQ(calc_concurrent.ld_load_peak_chunks(), num_chr);  // in-memory LD matrix keeps all chromosomes
+
+  std::vector<float> buffer_serial(num_snp), buffer_concurrent(num_snp);
+  calc_serial.retrieve_mafvec(num_snp, &buffer_serial[0]);
+  calc_concurrent.retrieve_mafvec(num_snp, &buffer_concurrent[0]);
+  ASSERT_EQ(buffer_serial, buffer_concurrent);
+  calc_serial.retrieve_ld_sum_r2(num_snp, &buffer_serial[0]);
+  calc_concurrent.retrieve_ld_sum_r2(num_snp, &buffer_concurrent[0]);
+  ASSERT_EQ(buffer_serial, buffer_concurrent);
+
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    const int64_t num_ld_r2 = calc_serial.num_ld_r2_chr(chr_label);
+    ASSERT_EQ(num_ld_r2, calc_concurrent.num_ld_r2_chr(chr_label));
+    std::vector<int> snp_serial(num_ld_r2), tag_serial(num_ld_r2), snp_concurrent(num_ld_r2), tag_concurrent(num_ld_r2);
+    std::vector<float> r_serial(num_ld_r2), r_concurrent(num_ld_r2);
+    calc_serial.retrieve_ld_r2_chr(chr_label, num_ld_r2, &snp_serial[0], &tag_serial[0], &r_serial[0]);
+    calc_concurrent.retrieve_ld_r2_chr(chr_label, num_ld_r2, &snp_concurrent[0], &tag_concurrent[0], &r_concurrent[0]);
+    ASSERT_EQ(snp_serial, snp_concurrent);
+    ASSERT_EQ(tag_serial, tag_concurrent);
+    ASSERT_EQ(r_serial, r_concurrent);
+  }
+
+  ASSERT_ANY_THROW(calc_concurrent.set_ld_r2_from_files("1,1", DataFolder + "/test_from_files.chr@.ld.bin"));
+  ASSERT_ANY_THROW(calc_concurrent.set_ld_r2_from_files("5", DataFolder + "/test_from_files.chr@.ld.bin"));
+
+  // with share_ld option the second context attaches to LD matrix loaded by the first one
+  BgmgCalculator calc_shared1, calc_shared2;
+  for (auto calc : { &calc_shared1, &calc_shared2 }) {
+    calc->set_tag_indices(num_snp, num_tag, &tag_indices[0]);
+    calc->set_chrnumvec(num_snp, &chrnumvec[0]);
+    calc->set_option("r2min", 0.05);
+    calc->set_option("share_ld", 1);
+    calc->set_ld_r2_from_files("1,2,3,4", DataFolder + "/test_from_files.chr@.ld.bin");
+    calc->retrieve_mafvec(num_snp, &buffer_concurrent[0]);
+    calc_serial.retrieve_mafvec(num_snp, &buffer_serial[0]);
+    ASSERT_EQ(buffer_serial, buffer_concurrent);
+    calc->retrieve_ld_sum_r2(num_snp, &buffer_concurrent[0]);
+    calc_serial.retrieve_ld_sum_r2(num_snp, &buffer_serial[0]);
+    ASSERT_EQ(buffer_serial, buffer_concurrent);
+    for (int chr_label = 1; chr_label <= num_chr; chr_label++) ASSERT_EQ(calc_serial.num_ld_r2_chr(chr_label), calc->num_ld_r2_chr(chr_label));
+  }
+  ASSERT_ANY_THROW(calc_shared2.set_option("r2min_runtime", 0.2));
+
+  // with ld_shm_dir the LD matrix is kept in a segment file, removed after the last context releases it
+  std::string segment_path;
+  {
+    BgmgCalculator calc_shm1, calc_shm2;
+    for (auto calc : { &calc_shm1, &calc_shm2 }) {
+      calc->set_tag_indices(num_snp, num_tag, &tag_indices[0]);
+      calc->set_chrnumvec(num_snp, &chrnumvec[0]);
+      calc->set_option("r2min", 0.05);
+      calc->set_ld_shm_dir(DataFolder);
+      calc->set_ld_r2_from_files("1,2,3,4", DataFolder + "/test_from_files.chr@.ld.bin");
+      calc->retrieve_ld_sum_r2(num_snp, &buffer_concurrent[0]);
+      calc_serial.retrieve_ld_sum_r2(num_snp, &buffer_serial[0]);
+      ASSERT_EQ(buffer_serial, buffer_concurrent);
+      for (int chr_label = 1; chr_label <= num_chr; chr_label++) ASSERT_EQ(calc_serial.num_ld_r2_chr(chr_label), calc->num_ld_r2_chr(chr_label));
+    }
+    for (auto& entry : boost::filesystem::directory_iterator(DataFolder)) {
+      const std::string name = entry.path().filename().string();
+      if ((name.find("bgmg_ld_") == 0) && (entry.path().extension() == ".bin")) segment_path = entry.path().string();
+    }
+    ASSERT_FALSE(segment_path.empty());
+  }
+  ASSERT_FALSE(boost::filesystem::exists(segment_path));
+  ASSERT_FALSE(boost::filesystem::exists(boost::filesystem::path(segment_path).replace_extension(".lock")));
+
+  // with ld_stream_dir the LD matrix is kept out of core, with the same results
+  BgmgCalculator calc_stream;
+  calc_stream.set_tag_indices(num_snp, num_tag, &tag_indices[0]);
+  calc_stream.set_chrnumvec(num_snp, &chrnumvec[0]);
+  calc_stream.set_option("r2min", 0.05);
+  calc_stream.set_ld_stream_dir(DataFolder);
+  calc_stream.set_option("ld_load_jobs", num_chr);
+  const int max_threads = omp_get_max_threads();
+  omp_set_num_threads(num_chr);  // enough threads to load all chromosomes at once, unless streaming prevents it
+  calc_stream.set_ld_r2_from_files("1,2,3,4", DataFolder + "/test_from_files.chr@.ld.bin");
+  omp_set_num_threads(max_threads);
+  ASSERT_EQ(calc_stream.ld_load_peak_chunks(), 1);  // each chromosome is spilled before the next one is loaded
+  calc_stream.retrieve_ld_sum_r2(num_snp, &buffer_concurrent[0]);
+  calc_serial.retrieve_ld_sum_r2(num_snp, &buffer_serial[0]);
+  ASSERT_EQ(buffer_serial, buffer_concurrent);
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) ASSERT_EQ(calc_serial.num_ld_r2_chr(chr_label), calc_stream.num_ld_r2_chr(chr_label));
+  ASSERT_ANY_THROW(calc_stream.set_ld_stream_dir(DataFolder + "/no_such_directory"));
+
+  // context snapshot restores tag indices, summary statistics, weights and LD matrix in a fresh context
+  std::vector<float> zvec(num_tag), nvec(num_tag), weights(num_tag);
+  for (int tag_index = 0; tag_index < num_tag; tag_index++) { zvec[tag_index] = 0.01f * tag_index; nvec[tag_index] = 1000.0f + tag_index; weights[tag_index] = (tag_index % 2) ? 1.0f : 0.0f; }
+  calc_serial.set_zvec(1, num_tag, &zvec[0]);
+  calc_serial.set_nvec(1, num_tag, &nvec[0]);
+  calc_serial.set_weights(num_tag, &weights[0]);
+  const std::string snapshot_path = DataFolder + "/test_context.snapshot";
+  calc_serial.save_context(snapshot_path, "inputs-hash");
+  ASSERT_ANY_THROW(calc_shared1.save_context(snapshot_path, "inputs-hash"));
+
+  BgmgCalculator calc_snapshot;
+  ASSERT_EQ(calc_snapshot.load_context(snapshot_path, "other-inputs-hash"), 0);
+  ASSERT_EQ(calc_snapshot.load_context(DataFolder + "/no_such_snapshot", "inputs-hash"), 0);
+  ASSERT_EQ(calc_snapshot.load_context(snapshot_path, "inputs-hash"), 1);
+  ASSERT_ANY_THROW(calc_snapshot.load_context(snapshot_path, "inputs-hash"));
+  ASSERT_EQ(calc_snapshot.num_snp(), num_snp);
+  ASSERT_EQ(calc_snapshot.tag_to_snp(), tag_indices);
+  ASSERT_EQ(calc_snapshot.chrnumvec(), chrnumvec);
+  std::vector<float> tag_buffer(num_tag);
+  calc_snapshot.retrieve_zvec(1, num_tag, &tag_buffer[0]); ASSERT_EQ(tag_buffer, zvec);
+  calc_snapshot.retrieve_nvec(1, num_tag, &tag_buffer[0]); ASSERT_EQ(tag_buffer, nvec);
+  calc_snapshot.retrieve_weights(num_tag, &tag_buffer[0]); ASSERT_EQ(tag_buffer, weights);
+  calc_snapshot.retrieve_mafvec(num_snp, &buffer_concurrent[0]);
+  calc_serial.retrieve_mafvec(num_snp, &buffer_serial[0]);
+  ASSERT_EQ(buffer_serial, buffer_concurrent);
+  calc_snapshot.retrieve_ld_sum_r2(num_snp, &buffer_concurrent[0]);
+  calc_serial.retrieve_ld_sum_r2(num_snp, &buffer_serial[0]);
+  ASSERT_EQ(buffer_serial, buffer_concurrent);
+  for (int chr_label = 1; chr_label <= num_chr; chr_label++) {
+    const int64_t num_ld_r2 = calc_serial.num_ld_r2_chr(chr_label);
+    ASSERT_EQ(num_ld_r2, calc_snapshot.num_ld_r2_chr(chr_label));
+    std::vector<int> snp_serial(num_ld_r2), tag_serial(num_ld_r2), snp_snapshot(num_ld_r2), tag_snapshot(num_ld_r2);
+    std::vector<float> r_serial(num_ld_r2), r_snapshot(num_ld_r2);
+    calc_serial.retrieve_ld_r2_chr(chr_label, num_ld_r2, &snp_serial[0], &tag_serial[0], &r_serial[0]);
+    calc_snapshot.retrieve_ld_r2_chr(chr_label, num_ld_r2, &snp_snapshot[0], &tag_snapshot[0], &r_snapshot[0]);
+    ASSERT_EQ(snp_serial, snp_snapshot);
+    ASSERT_EQ(tag_serial, tag_snapshot);
+    ASSERT_EQ(r_serial, r_snapshot);
+  }
+}
+
+// 8-bit r values must give the same LD structure as 16-bit r values, with small error in r2
+// --gtest_filter=TestLd.QuantizedR8
+TEST(TestLd, QuantizedR8) {
+  const int num_snp = 400;
+  const float r2_min = 0.05f;
+  TestLdCsr ld(num_snp, 1, 3);
+  LdMatrixCsr& csr = ld[0], &csr_r8 = ld[1], &csr_r8_late = ld[2];
+  const std::vector<int>& tag_to_snp = ld.tag_to_snp;
+  csr_r8.set_r_bits(8);  // quantize chunks as they are finalized...
+  ld.load(DataFolder + "/test_quantized_r8.ld.bin", { r2_min, r2_min, r2_min });
+  csr_r8_late.set_r_bits(8);  // ... or after they are finalized
+  ASSERT_THROW(csr_r8_late.set_r_bits(16), std::runtime_error);
+
+  float min_r2 = 1.0f;
+  LdMatrixRow row;
+  for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+    csr.extract_tag_row(TagIndex(tag_index), &row);
+    for (auto iter = row.begin(); iter < row.end(); iter++) min_r2 = std::min(min_r2, iter.r2());
+  }
+  const float max_error_r2 = (1.0f - min_r2) / 254.0f + 1e-5f;
+
+  for (auto c : { &csr_r8, &csr_r8_late }) {
+    LdMatrixRow row_r8;
+    for (int tag_index = 0; tag_index < tag_to_snp.size(); tag_index++) {
+      csr.extract_tag_row(TagIndex(tag_index), &row);
+      c->extract_tag_row(TagIndex(tag_index), &row_r8);
+      ASSERT_EQ(row.size(), row_r8.size());
+      for (auto iter = row.begin(), iter_r8 = row_r8.begin(); iter < row.end(); iter++, iter_r8++) {
+        ASSERT_EQ(iter.index(), iter_r8.index());
+        ASSERT_EQ(std::signbit(iter.r()), std::signbit(iter_r8.r()));
+        ASSERT_NEAR(iter.r2(), iter_r8.r2(), max_error_r2);
+        if (iter.r2() == 1.0f) ASSERT_EQ(iter_r8.r2(), 1.0f);
+      }
+    }
+
+    for (int snp_index = 0; snp_index < num_snp; snp_index++) {
+      csr.extract_snp_row(SnpIndex(snp_index), &row);
+      c->extract_snp_row(SnpIndex(snp_index), &row_r8);
+      ASSERT_EQ(row.size(), row_r8.size());
+      for (auto iter = row.begin(), iter_r8 = row_r8.begin(); iter < row.end(); iter++, iter_r8++) {
+        ASSERT_EQ(iter.index(), iter_r8.index());
+        ASSERT_NEAR(iter.r2(), iter_r8.r2(), max_error_r2);
+      }
+    }
+  }
+}